@@ -0,0 +1,183 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "actuation_latency.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <vector>
+
+#include "step_detection_transform.h"
+#include "util/time.h"
+
+namespace pwrusbctl {
+
+//! The time spent sampling before each switch so that the current level is
+//! known and any transient from the previous switch has passed.
+constexpr uint64_t kSettleTimeUs(1000000);
+
+//! The time after a switch within which the change must be observed.
+constexpr uint64_t kObserveTimeoutUs(2000000);
+
+//! The upper bounds of the buckets used to record latencies in microseconds.
+const std::vector<int64_t> kActuationBucketsUs = {
+  100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000,
+  500000, 1000000, 2000000,
+};
+
+/**
+ * Retains the first step emitted by a StepDetectionTransform in a given
+ * direction.
+ */
+class StepObserver : public SampleConsumer {
+ public:
+  /**
+   * Constructs a StepObserver.
+   *
+   * @param rising Whether to observe rising or falling steps.
+   */
+  explicit StepObserver(bool rising)
+      : rising_(rising), observed_(false), step_us_(0) {}
+
+  void Consume(const Sample& sample) override {
+    if (!observed_ && sample.type == SampleType::Step
+        && (sample.level_after_ma > sample.level_before_ma) == rising_) {
+      observed_ = true;
+      step_us_ = sample.timestamp_us;
+    }
+  }
+
+  /**
+   * Discards any step observed so far.
+   */
+  void Reset() {
+    observed_ = false;
+  }
+
+  /**
+   * @return Returns true if a step has been observed.
+   */
+  bool IsObserved() const {
+    return observed_;
+  }
+
+  /**
+   * @return Returns the estimated start of the observed step.
+   */
+  uint64_t GetStepUs() const {
+    return step_us_;
+  }
+
+ private:
+  //! Whether to observe rising or falling steps.
+  const bool rising_;
+
+  //! Whether or not a step has been observed.
+  bool observed_;
+
+  //! The estimated start of the observed step.
+  uint64_t step_us_;
+};
+
+constexpr size_t ActuationLatencyMeter::kDefaultTrialCount;
+constexpr float ActuationLatencyMeter::kDefaultMinStepMa;
+
+ActuationLatencyMeter::ActuationLatencyMeter(const PowerUsbDevice& device,
+                                             size_t outlet, float min_step_ma)
+    : device_(device),
+      outlet_(outlet),
+      min_step_ma_(min_step_ma),
+      write_histogram_(kActuationBucketsUs),
+      on_histogram_(kActuationBucketsUs),
+      off_histogram_(kActuationBucketsUs),
+      missed_count_(0) {}
+
+bool ActuationLatencyMeter::Measure(size_t trial_count) {
+  // Start from a known state so that the first trial observes a step.
+  if (!device_.SetSocketState(outlet_, SocketState::Off)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < trial_count; i++) {
+    if (!MeasureTransition(SocketState::On, &on_histogram_)
+        || !MeasureTransition(SocketState::Off, &off_histogram_)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void ActuationLatencyMeter::PrintResults(FILE *file) const {
+  write_histogram_.Print(file, "Command write", "us");
+  on_histogram_.Print(file, "Switch on observed", "us");
+  off_histogram_.Print(file, "Switch off observed", "us");
+  fprintf(file, "Unobserved transitions: %" PRIu64 "\n", missed_count_);
+}
+
+bool ActuationLatencyMeter::MeasureTransition(SocketState state,
+                                              Histogram *observe_histogram) {
+  StepDetectionTransform detector(min_step_ma_, false);
+  StepObserver observer(state == SocketState::On);
+  Sample sample = {};
+  sample.has_current = true;
+
+  // Each sample is timestamped when the reading returns, so the reported
+  // times are an upper bound on when the change occurred.
+  auto take_sample = [&]() {
+    int16_t current_ma;
+    if (!device_.GetInstantaneousCurrent(&current_ma)) {
+      return false;
+    }
+
+    sample.current_ma = current_ma;
+    sample.timestamp_us = GetMonotonicTimeUs();
+    detector.Process(sample, &observer);
+    return true;
+  };
+
+  uint64_t settle_start_us = GetMonotonicTimeUs();
+  while (GetMonotonicTimeUs() - settle_start_us < kSettleTimeUs) {
+    if (!take_sample()) {
+      return false;
+    }
+  }
+
+  observer.Reset();
+  uint64_t start_us = GetMonotonicTimeUs();
+  if (!device_.SetSocketState(outlet_, state)) {
+    return false;
+  }
+
+  write_histogram_.Record(GetMonotonicTimeUs() - start_us);
+  while (GetMonotonicTimeUs() - start_us < kObserveTimeoutUs) {
+    if (!take_sample()) {
+      return false;
+    }
+
+    if (observer.IsObserved()) {
+      // A run of deviating samples may have begun just before the switch.
+      uint64_t step_us = std::max(observer.GetStepUs(), start_us);
+      observe_histogram->Record(step_us - start_us);
+      return true;
+    }
+  }
+
+  missed_count_++;
+  return true;
+}
+
+}  // namespace pwrusbctl
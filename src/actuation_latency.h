@@ -0,0 +1,110 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_ACTUATION_LATENCY_H_
+#define PWRUSBCTL_ACTUATION_LATENCY_H_
+
+#include <cstdint>
+#include <cstdio>
+
+#include "power_usb_device.h"
+#include "util/histogram.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * Measures the end-to-end latency of switching an outlet. Each trial switches
+ * the outlet while sampling current as fast as the device allows and records
+ * both the time taken to write the command and the time until the resulting
+ * step in current is observed. The outlet must have a load attached that
+ * draws at least the minimum step when switched on.
+ *
+ * Every trial switches the outlet on and then off again, so the outlet is
+ * left switched off.
+ */
+class ActuationLatencyMeter : public NonCopyable {
+ public:
+  //! The default number of trials.
+  static constexpr size_t kDefaultTrialCount = 20;
+
+  //! The default smallest change in current treated as the load switching.
+  static constexpr float kDefaultMinStepMa = 20.0f;
+
+  /**
+   * Constructs an ActuationLatencyMeter.
+   *
+   * @param device The device to switch.
+   * @param outlet The index of the outlet to switch.
+   * @param min_step_ma The smallest change in current in milliamps that is
+   *        treated as the load switching.
+   */
+  ActuationLatencyMeter(const PowerUsbDevice& device, size_t outlet,
+                        float min_step_ma);
+
+  /**
+   * Runs trials, accumulating into the results of any previous trials. Each
+   * trial takes a few seconds.
+   *
+   * @param trial_count The number of trials to run.
+   * @return Returns false if the device fails to respond to a command.
+   */
+  bool Measure(size_t trial_count);
+
+  /**
+   * Prints the distributions of command write time and time to observe the
+   * change in each direction.
+   *
+   * @param file The file to print to.
+   */
+  void PrintResults(FILE *file) const;
+
+ private:
+  //! The device to switch.
+  const PowerUsbDevice& device_;
+
+  //! The index of the outlet to switch.
+  const size_t outlet_;
+
+  //! The smallest change in current that is treated as the load switching.
+  const float min_step_ma_;
+
+  //! The time taken to write each switching command.
+  Histogram write_histogram_;
+
+  //! The time from starting to write an on or off command until the change
+  //! was observed.
+  Histogram on_histogram_;
+  Histogram off_histogram_;
+
+  //! The number of transitions for which no change was observed.
+  uint64_t missed_count_;
+
+  /**
+   * Switches the outlet once the current has settled and waits for the
+   * resulting step.
+   *
+   * @param state The state to switch the outlet to.
+   * @param observe_histogram The histogram to record the time to observe the
+   *        change into.
+   * @return Returns false if the device fails to respond to a command.
+   */
+  bool MeasureTransition(SocketState state, Histogram *observe_histogram);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_ACTUATION_LATENCY_H_
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+
+namespace pwrusbctl {
+
+//! The version of the result file format.
+constexpr int kResultVersion(1);
+
+//! The two-sided 95% critical values of Student's t-distribution for one to
+//! thirty degrees of freedom.
+constexpr double kTCritical95[] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+/**
+ * Obtains the two-sided 95% critical value of Student's t-distribution.
+ * Fractional degrees of freedom are rounded down, which widens the interval.
+ *
+ * @param degrees_of_freedom The degrees of freedom, at least one.
+ * @return The critical value.
+ */
+static double GetTCritical95(double degrees_of_freedom) {
+  size_t df = static_cast<size_t>(std::max(1.0, degrees_of_freedom));
+  size_t table_size = sizeof(kTCritical95) / sizeof(kTCritical95[0]);
+  if (df <= table_size) {
+    return kTCritical95[df - 1];
+  } else if (df <= 40) {
+    return 2.021;
+  } else if (df <= 60) {
+    return 2.000;
+  } else if (df <= 120) {
+    return 1.980;
+  }
+
+  return 1.960;
+}
+
+/**
+ * Computes the half-width of the 95% confidence interval of a mean.
+ *
+ * @param run_count The number of runs.
+ * @param stddev The sample standard deviation.
+ * @return The half-width, or zero with fewer than two runs.
+ */
+static double GetConfidenceInterval(uint64_t run_count, double stddev) {
+  if (run_count < 2) {
+    return 0.0;
+  }
+
+  return GetTCritical95(run_count - 1) * stddev / std::sqrt(run_count);
+}
+
+/**
+ * Obtains a quantile of sorted values by linear interpolation.
+ *
+ * @param sorted The values in ascending order. Must not be empty.
+ * @param quantile The quantile between 0 and 1.
+ * @return The quantile.
+ */
+static double GetQuantile(const std::vector<double>& sorted, double quantile) {
+  double position = quantile * (sorted.size() - 1);
+  size_t index = static_cast<size_t>(position);
+  if (index + 1 >= sorted.size()) {
+    return sorted.back();
+  }
+
+  double fraction = position - index;
+  return sorted[index] + fraction * (sorted[index + 1] - sorted[index]);
+}
+
+EnergyStats ComputeEnergyStats(const std::vector<double>& energies_j) {
+  EnergyStats stats = {};
+  stats.run_count = energies_j.size();
+  for (double energy_j : energies_j) {
+    stats.mean_j += energy_j;
+  }
+
+  stats.mean_j /= energies_j.size();
+  if (energies_j.size() > 1) {
+    double sum_squares = 0.0;
+    for (double energy_j : energies_j) {
+      sum_squares += (energy_j - stats.mean_j) * (energy_j - stats.mean_j);
+    }
+
+    stats.stddev_j = std::sqrt(sum_squares / (energies_j.size() - 1));
+  }
+
+  stats.ci95_j = GetConfidenceInterval(stats.run_count, stats.stddev_j);
+  return stats;
+}
+
+std::vector<bool> FindOutliers(const std::vector<double>& energies_j) {
+  std::vector<bool> outliers(energies_j.size(), false);
+  if (energies_j.size() < 4) {
+    return outliers;
+  }
+
+  std::vector<double> sorted(energies_j);
+  std::sort(sorted.begin(), sorted.end());
+  double lower_quartile = GetQuantile(sorted, 0.25);
+  double upper_quartile = GetQuantile(sorted, 0.75);
+  double fence = 1.5 * (upper_quartile - lower_quartile);
+  for (size_t i = 0; i < energies_j.size(); i++) {
+    outliers[i] = energies_j[i] < lower_quartile - fence
+        || energies_j[i] > upper_quartile + fence;
+  }
+
+  return outliers;
+}
+
+EnergyComparison CompareEnergyStats(const EnergyStats& baseline,
+                                    const EnergyStats& current,
+                                    double max_increase_percent) {
+  EnergyComparison comparison = {};
+  comparison.difference_j = current.mean_j - baseline.mean_j;
+  comparison.difference_percent = (baseline.mean_j == 0.0) ? 0.0
+      : 100.0 * comparison.difference_j / std::fabs(baseline.mean_j);
+
+  // The variance of each mean, combined with the Welch-Satterthwaite
+  // approximation of the degrees of freedom.
+  double baseline_variance = (baseline.run_count < 2) ? 0.0
+      : baseline.stddev_j * baseline.stddev_j / baseline.run_count;
+  double current_variance = (current.run_count < 2) ? 0.0
+      : current.stddev_j * current.stddev_j / current.run_count;
+  double variance = baseline_variance + current_variance;
+  if (variance > 0.0) {
+    double df_denominator = 0.0;
+    if (baseline.run_count > 1) {
+      df_denominator += baseline_variance * baseline_variance
+          / (baseline.run_count - 1);
+    }
+
+    if (current.run_count > 1) {
+      df_denominator += current_variance * current_variance
+          / (current.run_count - 1);
+    }
+
+    comparison.ci95_j = GetTCritical95(variance * variance / df_denominator)
+        * std::sqrt(variance);
+  }
+
+  comparison.regression =
+      comparison.difference_percent > max_increase_percent
+      && comparison.difference_j - comparison.ci95_j > 0.0;
+  return comparison;
+}
+
+bool LoadEnergyStats(const std::string& path, EnergyStats *stats) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr) {
+    return false;
+  }
+
+  int version;
+  bool success = fscanf(file, "version %d\n", &version) == 1
+      && version == kResultVersion
+      && fscanf(file, "runs %" SCNu64 "\n", &stats->run_count) == 1
+      && fscanf(file, "mean_j %lf\n", &stats->mean_j) == 1
+      && fscanf(file, "stddev_j %lf\n", &stats->stddev_j) == 1
+      && stats->run_count > 0;
+  fclose(file);
+  if (success) {
+    stats->ci95_j = GetConfidenceInterval(stats->run_count, stats->stddev_j);
+  }
+
+  return success;
+}
+
+bool SaveEnergyStats(const std::string& path, const EnergyStats& stats) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  fprintf(file, "version %d\n", kResultVersion);
+  fprintf(file, "runs %" PRIu64 "\n", stats.run_count);
+  fprintf(file, "mean_j %.17g\n", stats.mean_j);
+  fprintf(file, "stddev_j %.17g\n", stats.stddev_j);
+  return fclose(file) == 0;
+}
+
+void PrintEnergyStats(FILE *file, const EnergyStats& stats) {
+  fprintf(file, "Energy over %" PRIu64 " runs: mean %.3fJ, stddev %.3fJ, "
+          "95%% CI +/- %.3fJ\n", stats.run_count, stats.mean_j,
+          stats.stddev_j, stats.ci95_j);
+}
+
+void PrintEnergyComparison(FILE *file, const EnergyComparison& comparison) {
+  fprintf(file, "Change from baseline: %+.3fJ (%+.1f%%), 95%% CI +/- %.3fJ"
+          "%s\n", comparison.difference_j, comparison.difference_percent,
+          comparison.ci95_j, comparison.regression ? ", REGRESSION" : "");
+}
+
+}  // namespace pwrusbctl
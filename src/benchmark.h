@@ -0,0 +1,132 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_BENCHMARK_H_
+#define PWRUSBCTL_BENCHMARK_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace pwrusbctl {
+
+/**
+ * Summary statistics of the energy drawn over repeated runs of a workload.
+ */
+struct EnergyStats {
+  //! The number of runs.
+  uint64_t run_count;
+
+  //! The mean energy per run in joules.
+  double mean_j;
+
+  //! The sample standard deviation of the energy per run in joules.
+  double stddev_j;
+
+  //! The half-width of the 95% confidence interval of the mean in joules.
+  double ci95_j;
+};
+
+/**
+ * The outcome of comparing a benchmark against a saved baseline result.
+ */
+struct EnergyComparison {
+  //! The difference between the current and baseline means in joules.
+  double difference_j;
+
+  //! The difference as a percentage of the baseline mean.
+  double difference_percent;
+
+  //! The half-width of the 95% confidence interval of the difference.
+  double ci95_j;
+
+  //! Whether or not the current mean is higher than the baseline by more
+  //! than the allowed percentage and the increase is statistically
+  //! significant.
+  bool regression;
+};
+
+/**
+ * Computes summary statistics of the energy per run. The confidence interval
+ * uses Student's t-distribution, which suits the handful of runs that a
+ * benchmark typically makes.
+ *
+ * @param energies_j The energy of each run in joules. Must not be empty.
+ * @return The statistics of the runs.
+ */
+EnergyStats ComputeEnergyStats(const std::vector<double>& energies_j);
+
+/**
+ * Finds runs outside Tukey's fences, 1.5 interquartile ranges beyond the
+ * quartiles. Fewer than four runs are never considered outliers.
+ *
+ * @param energies_j The energy of each run in joules.
+ * @return Whether or not each run is an outlier.
+ */
+std::vector<bool> FindOutliers(const std::vector<double>& energies_j);
+
+/**
+ * Compares the energy of a benchmark against a baseline result using Welch's
+ * t-test, which does not assume that the runs of each have equal variance.
+ *
+ * @param baseline The saved baseline statistics.
+ * @param current The statistics of the current benchmark.
+ * @param max_increase_percent The increase in mean energy that is tolerated
+ *        before a significant increase is considered a regression.
+ * @return The outcome of the comparison.
+ */
+EnergyComparison CompareEnergyStats(const EnergyStats& baseline,
+                                    const EnergyStats& current,
+                                    double max_increase_percent);
+
+/**
+ * Loads benchmark statistics from a result file.
+ *
+ * @param path The path of the result file.
+ * @param stats The statistics to populate.
+ * @return Returns false if the file does not exist or is malformed.
+ */
+bool LoadEnergyStats(const std::string& path, EnergyStats *stats);
+
+/**
+ * Saves benchmark statistics to a result file for later comparison.
+ *
+ * @param path The path of the result file.
+ * @param stats The statistics to save.
+ * @return Returns false if an error occurs.
+ */
+bool SaveEnergyStats(const std::string& path, const EnergyStats& stats);
+
+/**
+ * Prints benchmark statistics in a human-readable form.
+ *
+ * @param file The file to print to.
+ * @param stats The statistics to print.
+ */
+void PrintEnergyStats(FILE *file, const EnergyStats& stats);
+
+/**
+ * Prints the comparison against a baseline in a human-readable form.
+ *
+ * @param file The file to print to.
+ * @param comparison The comparison to print.
+ */
+void PrintEnergyComparison(FILE *file, const EnergyComparison& comparison);
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_BENCHMARK_H_
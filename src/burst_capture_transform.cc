@@ -0,0 +1,214 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "burst_capture_transform.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace pwrusbctl {
+
+constexpr size_t BurstCaptureTransform::kDefaultPreTriggerCount;
+constexpr size_t BurstCaptureTransform::kDefaultPostTriggerCount;
+
+BurstCaptureTransform::BurstCaptureTransform(const std::string& directory,
+                                             size_t pre_trigger_count,
+                                             size_t post_trigger_count,
+                                             float threshold_ma,
+                                             const Clock& clock)
+    : directory_(directory),
+      threshold_ma_(threshold_ma),
+      wall_clock_offset_us_(clock.GetWallClockOffsetUs()),
+      post_trigger_count_(std::max<size_t>(1, post_trigger_count)),
+      ring_(pre_trigger_count),
+      ring_head_(0),
+      ring_size_(0),
+      capture_(pre_trigger_count + post_trigger_count_),
+      capture_size_(0),
+      capture_end_(0),
+      trigger_index_(0),
+      trigger_requested_(false),
+      capturing_(false),
+      has_last_current_(false),
+      last_current_ma_(0.0f),
+      capture_count_(0),
+      missed_count_(0),
+      writer_busy_(false),
+      stop_(false) {
+  mkdir(directory_.c_str(), 0755);
+  writer_thread_ = std::thread(&BurstCaptureTransform::WriterLoop, this);
+}
+
+BurstCaptureTransform::~BurstCaptureTransform() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+
+  condition_.notify_all();
+  writer_thread_.join();
+}
+
+void BurstCaptureTransform::Process(const Sample& sample,
+                                    SampleConsumer *output) {
+  output->Consume(sample);
+  if (sample.type != SampleType::Measurement || !sample.has_current) {
+    return;
+  }
+
+  if (capturing_) {
+    capture_[capture_size_++] = sample;
+    if (capture_size_ == capture_end_) {
+      SubmitCapture();
+    }
+  } else if (IsTriggered(sample)) {
+    bool writer_busy;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writer_busy = writer_busy_;
+    }
+
+    if (writer_busy) {
+      missed_count_++;
+    } else {
+      // Unroll the ring so that the capture is in chronological order.
+      capture_size_ = 0;
+      size_t ring_size = ring_size_;
+      for (size_t i = 0; i < ring_size; i++) {
+        capture_[capture_size_++] = ring_[(ring_head_ + i) % ring_.size()];
+      }
+
+      trigger_index_ = capture_size_;
+      capture_end_ = capture_size_ + post_trigger_count_;
+      capture_[capture_size_++] = sample;
+      capturing_ = true;
+      if (capture_size_ == capture_end_) {
+        SubmitCapture();
+      }
+    }
+  }
+
+  // The ring keeps filling during a capture so that the next capture has a
+  // full pre-trigger window as soon as possible.
+  if (!ring_.empty()) {
+    if (ring_size_ < ring_.size()) {
+      ring_[(ring_head_ + ring_size_) % ring_.size()] = sample;
+      ring_size_++;
+    } else {
+      ring_[ring_head_] = sample;
+      ring_head_ = (ring_head_ + 1) % ring_.size();
+    }
+  }
+}
+
+void BurstCaptureTransform::Finish(SampleConsumer *output) {
+  // Write a capture that was cut short by the end of logging.
+  if (capturing_) {
+    SubmitCapture();
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_.wait(lock, [this]() { return !writer_busy_; });
+}
+
+void BurstCaptureTransform::Trigger() {
+  trigger_requested_ = true;
+}
+
+bool BurstCaptureTransform::IsArmed() const {
+  return ring_size_ == ring_.size();
+}
+
+void BurstCaptureTransform::PrintStats(FILE *file) const {
+  fprintf(file, "Captures: written %" PRIu64 ", missed %" PRIu64 "\n",
+          capture_count_.load(), missed_count_.load());
+}
+
+bool BurstCaptureTransform::IsTriggered(const Sample& sample) {
+  float current_ma = sample.current_ma;
+  bool crossed = threshold_ma_ > 0.0f && has_last_current_
+      && ((last_current_ma_ < threshold_ma_) != (current_ma < threshold_ma_));
+  has_last_current_ = true;
+  last_current_ma_ = current_ma;
+
+  // Consume a requested trigger even when the threshold also fired so that
+  // it does not fire a second capture later.
+  bool requested = trigger_requested_.exchange(false);
+  return crossed || requested;
+}
+
+void BurstCaptureTransform::SubmitCapture() {
+  capturing_ = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writer_busy_ = true;
+  }
+
+  condition_.notify_all();
+}
+
+void BurstCaptureTransform::WriterLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    condition_.wait(lock, [this]() { return stop_ || writer_busy_; });
+    if (!writer_busy_) {
+      return;
+    }
+
+    lock.unlock();
+    if (WriteCapture()) {
+      capture_count_++;
+    } else {
+      fprintf(stderr, "Error writing capture to %s\n", directory_.c_str());
+    }
+
+    lock.lock();
+    writer_busy_ = false;
+    condition_.notify_all();
+  }
+}
+
+bool BurstCaptureTransform::WriteCapture() {
+  const Sample& trigger = capture_[trigger_index_];
+  int64_t trigger_time_us = static_cast<int64_t>(trigger.timestamp_us)
+      + wall_clock_offset_us_;
+
+  char name[128];
+  snprintf(name, sizeof(name), "/capture-%s-%" PRId64 ".csv",
+           trigger.device_id, trigger_time_us);
+  FILE *file = fopen((directory_ + name).c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  // Offsets are relative to the sample that fired the trigger.
+  fprintf(file, "# device %s, trigger at %" PRId64 "us since the epoch\n",
+          trigger.device_id, trigger_time_us);
+  fprintf(file, "offset_us,current_ma,power_w\n");
+  for (size_t i = 0; i < capture_size_; i++) {
+    const Sample& sample = capture_[i];
+    fprintf(file, "%" PRId64 ",%" PRId32 ",%f\n",
+            static_cast<int64_t>(sample.timestamp_us)
+                - static_cast<int64_t>(trigger.timestamp_us),
+            sample.current_ma, sample.power_w);
+  }
+
+  return fclose(file) == 0;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_BURST_CAPTURE_TRANSFORM_H_
+#define PWRUSBCTL_BURST_CAPTURE_TRANSFORM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pipeline.h"
+#include "util/clock.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that captures bursts of samples around trigger events, like the
+ * single-shot mode of an oscilloscope. The most recent samples are retained
+ * in a pre-trigger ring buffer. When a trigger fires, those samples and the
+ * samples that follow are copied into a capture buffer and written to a CSV
+ * file in the capture directory.
+ *
+ * A trigger fires when current crosses a threshold in either direction, or
+ * when Trigger() is invoked, for example after switching an outlet. All
+ * buffers are allocated up front and files are written on a separate thread,
+ * so capturing does not disturb the sampling schedule. Triggers that fire
+ * while a capture is still being written are counted as missed.
+ *
+ * Samples pass through unchanged. Placed ahead of a DecimatingTransform, the
+ * capture sees the full sampling rate while other outputs see the decimated
+ * stream.
+ */
+class BurstCaptureTransform : public Transform {
+ public:
+  //! The default number of samples retained before a trigger.
+  static constexpr size_t kDefaultPreTriggerCount = 1000;
+
+  //! The default number of samples captured after a trigger.
+  static constexpr size_t kDefaultPostTriggerCount = 4000;
+
+  /**
+   * Constructs a BurstCaptureTransform.
+   *
+   * @param directory The directory that capture files are written to.
+   * @param pre_trigger_count The number of samples retained before a trigger.
+   * @param post_trigger_count The number of samples captured after a trigger,
+   *        including the sample that fired it.
+   * @param threshold_ma The current that fires a trigger when crossed, or
+   *        zero to only trigger on request.
+   * @param clock The clock whose wall-clock offset names capture files.
+   */
+  BurstCaptureTransform(const std::string& directory,
+                        size_t pre_trigger_count, size_t post_trigger_count,
+                        float threshold_ma, const Clock& clock);
+
+  /**
+   * Waits for any capture being written to complete.
+   */
+  ~BurstCaptureTransform();
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+  void Finish(SampleConsumer *output) override;
+
+  /**
+   * Requests a trigger at the next sample. This may be invoked from any
+   * thread.
+   */
+  void Trigger();
+
+  /**
+   * @return Returns true once the pre-trigger buffer has filled, so that a
+   *         trigger would capture the full pre-trigger window.
+   */
+  bool IsArmed() const;
+
+  /**
+   * Prints the number of captures written and missed.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  //! The directory that capture files are written to.
+  const std::string directory_;
+
+  //! The current that fires a trigger when crossed, zero if disabled.
+  const float threshold_ma_;
+
+  //! The offset added to monotonic timestamps to obtain wall-clock time.
+  const int64_t wall_clock_offset_us_;
+
+  //! The number of samples captured after a trigger.
+  const size_t post_trigger_count_;
+
+  //! The pre-trigger ring buffer and the position of its oldest sample.
+  std::vector<Sample> ring_;
+  size_t ring_head_;
+  std::atomic<size_t> ring_size_;
+
+  //! The capture being filled or written. Owned by the writer thread while
+  //! writer_busy_ is set.
+  std::vector<Sample> capture_;
+  size_t capture_size_;
+
+  //! The size that capture_ is complete at.
+  size_t capture_end_;
+
+  //! The index in capture_ of the sample that fired the trigger.
+  size_t trigger_index_;
+
+  //! Whether or not a trigger has been requested by Trigger().
+  std::atomic<bool> trigger_requested_;
+
+  //! Whether or not samples are being collected after a trigger.
+  bool capturing_;
+
+  //! The current of the previous sample, used to detect crossings.
+  bool has_last_current_;
+  float last_current_ma_;
+
+  //! The number of captures written and triggers missed.
+  std::atomic<uint64_t> capture_count_;
+  std::atomic<uint64_t> missed_count_;
+
+  //! Guards writer_busy_ and stop_.
+  std::mutex mutex_;
+  std::condition_variable condition_;
+
+  //! Whether or not capture_ is waiting for or being written by the writer.
+  bool writer_busy_;
+
+  //! Whether or not the writer thread should exit.
+  bool stop_;
+
+  //! The thread that writes captures to files.
+  std::thread writer_thread_;
+
+  /**
+   * Determines whether or not a sample fires a trigger.
+   *
+   * @param sample The sample to check.
+   * @return Returns true if a trigger fires.
+   */
+  bool IsTriggered(const Sample& sample);
+
+  /**
+   * Passes the filled capture buffer to the writer thread.
+   */
+  void SubmitCapture();
+
+  /**
+   * The entry point of the writer thread.
+   */
+  void WriterLoop();
+
+  /**
+   * Writes capture_ to a new file in the capture directory.
+   *
+   * @return Returns false if an error occurs.
+   */
+  bool WriteCapture();
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_BURST_CAPTURE_TRANSFORM_H_
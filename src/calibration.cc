@@ -0,0 +1,252 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "calibration.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+#include "util/time.h"
+
+namespace pwrusbctl {
+
+//! The version of the cache file format. Bump this when calibration changes
+//! so that stale results are probed again.
+constexpr int kCalibrationVersion(1);
+
+//! The number of round trips timed for each command.
+constexpr size_t kRoundTripCount(100);
+
+//! The sampling interval that the rate probe starts at.
+constexpr uint64_t kProbeStartIntervalUs(100000);
+
+//! The shortest sampling interval that the rate probe attempts.
+constexpr uint64_t kProbeMinIntervalUs(500);
+
+//! The factor by which the interval shrinks at each step of the rate probe.
+constexpr double kProbeIntervalStep(0.7);
+
+//! The time spent sampling at each step of the rate probe.
+constexpr uint64_t kProbeStepDurationUs(250000);
+
+//! The minimum number of samples taken at each step of the rate probe.
+constexpr size_t kProbeStepMinSamples(5);
+
+//! The fraction of the scheduled time that a probe step may overrun by and
+//! still be considered sustained.
+constexpr double kProbeMaxOverrun(0.05);
+
+//! The factor applied to the shortest sustained interval to obtain the
+//! recommended minimum interval.
+constexpr double kIntervalHeadroom(1.25);
+
+/**
+ * Times repeated invocations of a command.
+ *
+ * @param command The command to invoke, returning false on error.
+ * @param latency The latency distribution to populate.
+ * @return Returns false if any invocation fails.
+ */
+static bool MeasureCommand(const std::function<bool()>& command,
+                           CommandLatency *latency) {
+  std::vector<uint64_t> round_trips;
+  round_trips.reserve(kRoundTripCount);
+  for (size_t i = 0; i < kRoundTripCount; i++) {
+    uint64_t start_us = GetMonotonicTimeUs();
+    if (!command()) {
+      return false;
+    }
+
+    round_trips.push_back(GetMonotonicTimeUs() - start_us);
+  }
+
+  std::sort(round_trips.begin(), round_trips.end());
+  latency->p50_us = round_trips[round_trips.size() / 2];
+  latency->p99_us = round_trips[round_trips.size() * 99 / 100];
+  latency->max_us = round_trips.back();
+  return true;
+}
+
+/**
+ * Samples current and charge at a fixed interval for one probe step.
+ *
+ * @param device The device to sample.
+ * @param interval_us The interval to sample at.
+ * @return Returns true if every sample succeeded and sampling kept up with
+ *         the schedule.
+ */
+static bool ProbeInterval(const PowerUsbDevice& device, uint64_t interval_us) {
+  size_t sample_count = std::max<size_t>(kProbeStepMinSamples,
+                                         kProbeStepDurationUs / interval_us);
+  uint64_t start_us = GetMonotonicTimeUs();
+  uint64_t scheduled_us = start_us;
+  for (size_t i = 0; i < sample_count; i++) {
+    int16_t current;
+    int32_t charge;
+    if (!device.GetInstantaneousCurrent(&current)
+        || !device.GetAccumulatedCharge(&charge)) {
+      return false;
+    }
+
+    scheduled_us += interval_us;
+    uint64_t now_us = GetMonotonicTimeUs();
+    if (now_us < scheduled_us) {
+      usleep(scheduled_us - now_us);
+    }
+  }
+
+  uint64_t elapsed_us = GetMonotonicTimeUs() - start_us;
+  return elapsed_us <= sample_count * interval_us * (1.0 + kProbeMaxOverrun);
+}
+
+bool CalibrateDevice(const PowerUsbDevice& device, Calibration *calibration) {
+  bool success = MeasureCommand([&device]() {
+        return device.GetDeviceType() != nullptr;
+      }, &calibration->device_type)
+      && MeasureCommand([&device]() {
+        int16_t current;
+        return device.GetInstantaneousCurrent(&current);
+      }, &calibration->current)
+      && MeasureCommand([&device]() {
+        int32_t charge;
+        return device.GetAccumulatedCharge(&charge);
+      }, &calibration->charge);
+  if (!success) {
+    return false;
+  }
+
+  // Shrink the interval until a step fails. The probe starts slow enough
+  // that a working device always sustains the first step; if it does not,
+  // the recommendation falls back to the start interval.
+  uint64_t sustained_interval_us = kProbeStartIntervalUs;
+  for (uint64_t interval_us = kProbeStartIntervalUs;
+       interval_us >= kProbeMinIntervalUs;
+       interval_us = static_cast<uint64_t>(interval_us * kProbeIntervalStep)) {
+    if (!ProbeInterval(device, interval_us)) {
+      break;
+    }
+
+    sustained_interval_us = interval_us;
+  }
+
+  calibration->max_rate_hz = 1e6 / sustained_interval_us;
+  calibration->min_interval_us = static_cast<uint64_t>(
+      sustained_interval_us * kIntervalHeadroom);
+  return true;
+}
+
+std::string GetCalibrationCachePath(const std::string& serial) {
+  std::string directory;
+  const char *cache_home = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache_home != nullptr && cache_home[0] != '\0') {
+    directory = cache_home;
+  } else if (home != nullptr && home[0] != '\0') {
+    directory = std::string(home) + "/.cache";
+  } else {
+    return std::string();
+  }
+
+  // Serial numbers are reported by the device so keep them from escaping the
+  // cache directory.
+  std::string name = serial;
+  std::replace(name.begin(), name.end(), '/', '_');
+  return directory + "/pwrusbctl/calibration-" + name;
+}
+
+bool LoadCalibration(const std::string& path, Calibration *calibration) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr) {
+    return false;
+  }
+
+  int version;
+  bool success = fscanf(file, "version %d\n", &version) == 1
+      && version == kCalibrationVersion;
+  CommandLatency *latencies[] = {
+    &calibration->device_type,
+    &calibration->current,
+    &calibration->charge,
+  };
+  for (CommandLatency *latency : latencies) {
+    success = success && fscanf(file, "%*s %" SCNu64 " %" SCNu64 " %" SCNu64
+                                "\n", &latency->p50_us, &latency->p99_us,
+                                &latency->max_us) == 3;
+  }
+
+  success = success
+      && fscanf(file, "max_rate_hz %lf\n", &calibration->max_rate_hz) == 1
+      && fscanf(file, "min_interval_us %" SCNu64 "\n",
+                &calibration->min_interval_us) == 1;
+  fclose(file);
+  return success;
+}
+
+bool SaveCalibration(const std::string& path, const Calibration& calibration) {
+  // Create each missing directory leading up to the file.
+  for (size_t slash = path.find('/', 1); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    mkdir(path.substr(0, slash).c_str(), 0755);
+  }
+
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+
+  fprintf(file, "version %d\n", kCalibrationVersion);
+  const CommandLatency& device_type = calibration.device_type;
+  const CommandLatency& current = calibration.current;
+  const CommandLatency& charge = calibration.charge;
+  fprintf(file, "device_type %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+          device_type.p50_us, device_type.p99_us, device_type.max_us);
+  fprintf(file, "current %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+          current.p50_us, current.p99_us, current.max_us);
+  fprintf(file, "charge %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+          charge.p50_us, charge.p99_us, charge.max_us);
+  fprintf(file, "max_rate_hz %f\n", calibration.max_rate_hz);
+  fprintf(file, "min_interval_us %" PRIu64 "\n", calibration.min_interval_us);
+  return fclose(file) == 0;
+}
+
+void PrintCalibration(FILE *file, const Calibration& calibration) {
+  struct {
+    const char *name;
+    const CommandLatency& latency;
+  } commands[] = {
+    { "device type", calibration.device_type },
+    { "current", calibration.current },
+    { "charge", calibration.charge },
+  };
+
+  for (const auto& command : commands) {
+    fprintf(file, "Round trip %s: p50 %" PRIu64 "us, p99 %" PRIu64
+            "us, max %" PRIu64 "us\n", command.name, command.latency.p50_us,
+            command.latency.p99_us, command.latency.max_us);
+  }
+
+  fprintf(file, "Maximum sustained rate: %.1fHz\n", calibration.max_rate_hz);
+  fprintf(file, "Recommended minimum interval: %" PRIu64 "us\n",
+          calibration.min_interval_us);
+}
+
+}  // namespace pwrusbctl
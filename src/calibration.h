@@ -0,0 +1,114 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_CALIBRATION_H_
+#define PWRUSBCTL_CALIBRATION_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "power_usb_device.h"
+
+namespace pwrusbctl {
+
+/**
+ * The distribution of round-trip times of a device command.
+ */
+struct CommandLatency {
+  //! The median round-trip time in microseconds.
+  uint64_t p50_us;
+
+  //! The 99th percentile round-trip time in microseconds.
+  uint64_t p99_us;
+
+  //! The largest round-trip time observed in microseconds.
+  uint64_t max_us;
+};
+
+/**
+ * The results of calibrating a device. Only commands that read state are
+ * probed so that calibration never changes the state of the outlets.
+ */
+struct Calibration {
+  //! The round-trip time of the device type query.
+  CommandLatency device_type;
+
+  //! The round-trip time of the instantaneous current query.
+  CommandLatency current;
+
+  //! The round-trip time of the accumulated charge query.
+  CommandLatency charge;
+
+  //! The highest sampling rate, reading both current and charge, that was
+  //! sustained without errors or falling behind schedule.
+  double max_rate_hz;
+
+  //! The recommended minimum sampling interval in microseconds. This leaves
+  //! headroom below the maximum rate for other users of the device.
+  uint64_t min_interval_us;
+};
+
+/**
+ * Measures the round-trip time of each command and probes for the highest
+ * sustainable sampling rate. This takes a few seconds.
+ *
+ * @param device The device to calibrate.
+ * @param calibration The calibration to populate.
+ * @return Returns false if the device fails to respond to a command while
+ *         measuring round-trip times.
+ */
+bool CalibrateDevice(const PowerUsbDevice& device, Calibration *calibration);
+
+/**
+ * Obtains the path that the calibration of a device is cached at. This is
+ * within $XDG_CACHE_HOME, or ~/.cache if that is not set.
+ *
+ * @param serial The serial number of the device.
+ * @return The path of the cache file, or empty if no cache directory exists.
+ */
+std::string GetCalibrationCachePath(const std::string& serial);
+
+/**
+ * Loads a calibration from a cache file.
+ *
+ * @param path The path of the cache file.
+ * @param calibration The calibration to populate.
+ * @return Returns false if the file does not exist or was written by an
+ *         incompatible version.
+ */
+bool LoadCalibration(const std::string& path, Calibration *calibration);
+
+/**
+ * Saves a calibration to a cache file, creating its directory if required.
+ *
+ * @param path The path of the cache file.
+ * @param calibration The calibration to save.
+ * @return Returns false if an error occurs.
+ */
+bool SaveCalibration(const std::string& path, const Calibration& calibration);
+
+/**
+ * Prints a calibration in a human-readable form.
+ *
+ * @param file The file to print to.
+ * @param calibration The calibration to print.
+ */
+void PrintCalibration(FILE *file, const Calibration& calibration);
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_CALIBRATION_H_
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "collector_protocol.h"
+
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The flags that record which optional fields of an encoded sample are
+//! populated.
+constexpr uint8_t kHasCurrentFlag(1 << 0);
+constexpr uint8_t kHasEnergyFlag(1 << 1);
+
+/**
+ * Writes a float in little-endian order.
+ *
+ * @param value The value to write.
+ * @param buffer The buffer of four bytes to write to.
+ */
+static void WriteFloat(float value, uint8_t *buffer) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  WriteLittleEndian(bits, sizeof(bits), buffer);
+}
+
+/**
+ * Reads a float in little-endian order.
+ *
+ * @param buffer The buffer of four bytes to read from.
+ * @return The value read.
+ */
+static float ReadFloat(const uint8_t *buffer) {
+  uint32_t bits = ReadLittleEndian(buffer, sizeof(bits));
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+void WriteLittleEndian(uint64_t value, size_t size, uint8_t *buffer) {
+  for (size_t i = 0; i < size; i++) {
+    buffer[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+uint64_t ReadLittleEndian(const uint8_t *buffer, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value |= static_cast<uint64_t>(buffer[i]) << (8 * i);
+  }
+
+  return value;
+}
+
+void EncodeFrameHeader(FrameType type, uint32_t payload_size,
+                       uint8_t *buffer) {
+  WriteLittleEndian(kCollectorMagic, 4, buffer);
+  buffer[4] = kCollectorVersion;
+  buffer[5] = static_cast<uint8_t>(type);
+  WriteLittleEndian(0, 2, buffer + 6);
+  WriteLittleEndian(payload_size, 4, buffer + 8);
+}
+
+bool DecodeFrameHeader(const uint8_t *buffer, FrameHeader *header) {
+  uint8_t type = buffer[5];
+  header->type = static_cast<FrameType>(type);
+  header->payload_size = ReadLittleEndian(buffer + 8, 4);
+  return ReadLittleEndian(buffer, 4) == kCollectorMagic
+      && buffer[4] == kCollectorVersion
+      && type >= static_cast<uint8_t>(FrameType::Hello)
+      && type <= static_cast<uint8_t>(FrameType::Result)
+      && header->payload_size <= kMaxFramePayloadSize;
+}
+
+void EncodeSample(const Sample& sample, int64_t wall_clock_offset_us,
+                  uint8_t *buffer) {
+  memset(buffer, 0, kEncodedSampleSize);
+  strncpy(reinterpret_cast<char *>(buffer), sample.device_id,
+          kMaxDeviceIdLength - 1);
+  WriteLittleEndian(static_cast<int64_t>(sample.timestamp_us)
+                    + wall_clock_offset_us, 8, buffer + 32);
+  WriteLittleEndian(sample.lateness_us, 8, buffer + 40);
+  WriteLittleEndian(sample.sample_count, 4, buffer + 48);
+  buffer[52] = static_cast<uint8_t>(sample.type);
+  buffer[53] = (sample.has_current ? kHasCurrentFlag : 0)
+      | (sample.has_energy ? kHasEnergyFlag : 0);
+  WriteLittleEndian(static_cast<uint32_t>(sample.current_ma), 4, buffer + 54);
+  WriteLittleEndian(static_cast<uint32_t>(sample.current_min_ma), 4,
+                    buffer + 58);
+  WriteLittleEndian(static_cast<uint32_t>(sample.current_max_ma), 4,
+                    buffer + 62);
+  WriteFloat(sample.power_w, buffer + 66);
+  WriteFloat(sample.power_min_w, buffer + 70);
+  WriteFloat(sample.power_max_w, buffer + 74);
+  WriteFloat(sample.energy_kwh, buffer + 78);
+  WriteFloat(sample.level_before_ma, buffer + 82);
+  WriteFloat(sample.level_after_ma, buffer + 86);
+  strncpy(reinterpret_cast<char *>(buffer + 90), sample.region,
+          kMaxRegionNameLength - 1);
+  WriteLittleEndian(sample.region_duration_us, 8, buffer + 122);
+  WriteFloat(sample.region_energy_j, buffer + 130);
+  WriteFloat(sample.region_peak_w, buffer + 134);
+}
+
+bool DecodeSample(const uint8_t *buffer, int64_t wall_clock_offset_us,
+                  Sample *sample) {
+  if (buffer[52] > static_cast<uint8_t>(SampleType::Region)) {
+    return false;
+  }
+
+  // Both strings are null-terminated by the encoder, but a corrupt frame
+  // must not leave them unterminated.
+  *sample = Sample();
+  memcpy(sample->device_id, buffer, kMaxDeviceIdLength);
+  sample->device_id[kMaxDeviceIdLength - 1] = '\0';
+  int64_t timestamp_us = static_cast<int64_t>(ReadLittleEndian(buffer + 32, 8))
+      - wall_clock_offset_us;
+  sample->timestamp_us = (timestamp_us < 0) ? 0 : timestamp_us;
+  sample->lateness_us = ReadLittleEndian(buffer + 40, 8);
+  sample->sample_count = ReadLittleEndian(buffer + 48, 4);
+  sample->type = static_cast<SampleType>(buffer[52]);
+  sample->has_current = (buffer[53] & kHasCurrentFlag) != 0;
+  sample->has_energy = (buffer[53] & kHasEnergyFlag) != 0;
+  sample->current_ma = static_cast<int32_t>(ReadLittleEndian(buffer + 54, 4));
+  sample->current_min_ma = static_cast<int32_t>(
+      ReadLittleEndian(buffer + 58, 4));
+  sample->current_max_ma = static_cast<int32_t>(
+      ReadLittleEndian(buffer + 62, 4));
+  sample->power_w = ReadFloat(buffer + 66);
+  sample->power_min_w = ReadFloat(buffer + 70);
+  sample->power_max_w = ReadFloat(buffer + 74);
+  sample->energy_kwh = ReadFloat(buffer + 78);
+  sample->level_before_ma = ReadFloat(buffer + 82);
+  sample->level_after_ma = ReadFloat(buffer + 86);
+  memcpy(sample->region, buffer + 90, kMaxRegionNameLength);
+  sample->region[kMaxRegionNameLength - 1] = '\0';
+  sample->region_duration_us = ReadLittleEndian(buffer + 122, 8);
+  sample->region_energy_j = ReadFloat(buffer + 130);
+  sample->region_peak_w = ReadFloat(buffer + 134);
+  return true;
+}
+
+void EncodeResultEntry(const TopEntry& entry, uint8_t *buffer) {
+  memset(buffer, 0, kMaxDeviceIdLength);
+  strncpy(reinterpret_cast<char *>(buffer), entry.device_id.c_str(),
+          kMaxDeviceIdLength - 1);
+  WriteFloat(entry.power_w, buffer + kMaxDeviceIdLength);
+}
+
+void DecodeResultEntry(const uint8_t *buffer, TopEntry *entry) {
+  const char *device_id = reinterpret_cast<const char *>(buffer);
+  entry->device_id.assign(device_id,
+      strnlen(device_id, kMaxDeviceIdLength - 1));
+  entry->power_w = ReadFloat(buffer + kMaxDeviceIdLength);
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_COLLECTOR_PROTOCOL_H_
+#define PWRUSBCTL_COLLECTOR_PROTOCOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "sample.h"
+#include "top_index.h"
+
+namespace pwrusbctl {
+
+/*
+ * The protocol between agents and a collector. Every message is a frame of a
+ * fixed header followed by a payload. All integers are little-endian.
+ *
+ *   header:  magic u32, version u8, type u8, reserved u16, length u32
+ *   hello:   resume sequence u64, stream id length u8, stream id
+ *            (agent to collector)
+ *   welcome: next sequence u64 (collector to agent)
+ *   batch:   first sequence u64, sample count u32, zstd-compressed samples
+ *   ack:     next sequence u64 (collector to agent)
+ *   query:   window u8, count u16, label length u8, label (client to
+ *            collector)
+ *   result:  entry count u16, entries of device id char[32] and power f32
+ *            (collector to client)
+ *
+ * Each stream numbers its samples consecutively. An agent opens a connection
+ * with a hello carrying the sequence number of its oldest unacknowledged
+ * sample. The collector replies with the sequence number that it expects next
+ * for the stream, so that the agent resends only what the collector has not
+ * seen. Samples before the resume sequence were acknowledged by a collector,
+ * possibly another one that the stream was sharded to, and are not lost.
+ * Acknowledgements are cumulative and acknowledge every sample before the
+ * given sequence number.
+ *
+ * A client may instead send queries for the devices that draw the most power,
+ * each answered by a result.
+ */
+
+//! The magic number that starts every frame, "PWRC".
+constexpr uint32_t kCollectorMagic(0x43525750);
+
+//! The version of the protocol.
+constexpr uint8_t kCollectorVersion(3);
+
+//! The size of a frame header.
+constexpr size_t kFrameHeaderSize(12);
+
+//! The maximum size of a frame payload.
+constexpr size_t kMaxFramePayloadSize(1024 * 1024);
+
+//! The maximum length of a stream identifier.
+constexpr size_t kMaxStreamIdLength(64);
+
+//! The size of the fixed fields that precede the stream identifier of a
+//! hello.
+constexpr size_t kHelloHeaderSize(9);
+
+//! The size of the fixed fields that precede the label of a query.
+constexpr size_t kQueryHeaderSize(4);
+
+//! The maximum length of the label of a query.
+constexpr size_t kMaxQueryLabelLength(64);
+
+//! The maximum number of entries in a result. A full result is small enough
+//! to be sent without blocking.
+constexpr size_t kMaxResultEntries(100);
+
+//! The size of each entry of a result.
+constexpr size_t kResultEntrySize(kMaxDeviceIdLength + 4);
+
+//! The size of the fixed fields that precede the samples of a batch.
+constexpr size_t kBatchHeaderSize(12);
+
+//! The size of a sample encoded for transmission.
+constexpr size_t kEncodedSampleSize(138);
+
+//! The maximum number of samples in a batch. The samples of a full batch fit
+//! the maximum payload even if they do not compress.
+constexpr size_t kMaxBatchSamples(
+    (kMaxFramePayloadSize - kBatchHeaderSize) / kEncodedSampleSize / 2);
+
+/**
+ * The kinds of frame.
+ */
+enum class FrameType : uint8_t {
+  Hello = 1,
+  Welcome = 2,
+  Batch = 3,
+  Ack = 4,
+  Query = 5,
+  Result = 6,
+};
+
+/**
+ * The decoded fields of a frame header.
+ */
+struct FrameHeader {
+  //! The kind of frame.
+  FrameType type;
+
+  //! The size of the payload that follows the header.
+  uint32_t payload_size;
+};
+
+/**
+ * Writes an unsigned integer in little-endian order.
+ *
+ * @param value The value to write.
+ * @param size The number of bytes to write.
+ * @param buffer The buffer to write to.
+ */
+void WriteLittleEndian(uint64_t value, size_t size, uint8_t *buffer);
+
+/**
+ * Reads an unsigned integer in little-endian order.
+ *
+ * @param buffer The buffer to read from.
+ * @param size The number of bytes to read.
+ * @return The value read.
+ */
+uint64_t ReadLittleEndian(const uint8_t *buffer, size_t size);
+
+/**
+ * Encodes a frame header.
+ *
+ * @param type The kind of frame.
+ * @param payload_size The size of the payload that follows.
+ * @param buffer The buffer of kFrameHeaderSize to encode into.
+ */
+void EncodeFrameHeader(FrameType type, uint32_t payload_size,
+                       uint8_t *buffer);
+
+/**
+ * Decodes a frame header.
+ *
+ * @param buffer The buffer of kFrameHeaderSize to decode.
+ * @param header The header to populate.
+ * @return Returns false if the header is not a valid frame of this version.
+ */
+bool DecodeFrameHeader(const uint8_t *buffer, FrameHeader *header);
+
+/**
+ * Encodes a sample for transmission. The monotonic timestamp is converted to
+ * wall-clock time since monotonic clocks differ between hosts.
+ *
+ * @param sample The sample to encode.
+ * @param wall_clock_offset_us The offset from the monotonic clock of the
+ *        sample to wall-clock time.
+ * @param buffer The buffer of kEncodedSampleSize to encode into.
+ */
+void EncodeSample(const Sample& sample, int64_t wall_clock_offset_us,
+                  uint8_t *buffer);
+
+/**
+ * Decodes a sample encoded by EncodeSample().
+ *
+ * @param buffer The buffer of kEncodedSampleSize to decode.
+ * @param wall_clock_offset_us The offset from the local monotonic clock to
+ *        wall-clock time, used to convert the timestamp back.
+ * @param sample The sample to populate.
+ * @return Returns false if the sample is malformed.
+ */
+bool DecodeSample(const uint8_t *buffer, int64_t wall_clock_offset_us,
+                  Sample *sample);
+
+/**
+ * Encodes an entry of a result.
+ *
+ * @param entry The entry to encode.
+ * @param buffer The buffer of kResultEntrySize to encode into.
+ */
+void EncodeResultEntry(const TopEntry& entry, uint8_t *buffer);
+
+/**
+ * Decodes an entry of a result.
+ *
+ * @param buffer The buffer of kResultEntrySize to decode.
+ * @param entry The entry to populate.
+ */
+void DecodeResultEntry(const uint8_t *buffer, TopEntry *entry);
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_COLLECTOR_PROTOCOL_H_
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "collector_query.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "collector_protocol.h"
+#include "util/socket_address.h"
+
+namespace pwrusbctl {
+
+//! The maximum time to wait for each part of the reply.
+constexpr int kReplyTimeoutMs(5000);
+
+/**
+ * Receives exactly the requested number of bytes.
+ *
+ * @param socket The socket to receive from.
+ * @param buffer The buffer to receive into.
+ * @param length The number of bytes to receive.
+ * @return Returns false if the connection closed or timed out first.
+ */
+static bool ReceiveAll(int socket, uint8_t *buffer, size_t length) {
+  while (length > 0) {
+    pollfd poll_fd = { socket, POLLIN, 0 };
+    int result = poll(&poll_fd, 1, kReplyTimeoutMs);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    } else if (result <= 0) {
+      return false;
+    }
+
+    ssize_t received = recv(socket, buffer, length, 0);
+    if (received <= 0) {
+      return false;
+    }
+
+    buffer += received;
+    length -= received;
+  }
+
+  return true;
+}
+
+bool QueryTopConsumers(const std::string& address, TopWindow window,
+                       size_t count, const std::string& label,
+                       std::vector<TopEntry> *entries) {
+  SocketAddress collector_address;
+  if (label.size() > kMaxQueryLabelLength
+      || !ResolveSocketAddress(address, SOCK_STREAM, &collector_address)) {
+    return false;
+  }
+
+  int fd = socket(collector_address.storage.ss_family,
+                  SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+
+  uint8_t query[kFrameHeaderSize + kQueryHeaderSize + kMaxQueryLabelLength];
+  size_t query_size = kFrameHeaderSize + kQueryHeaderSize + label.size();
+  EncodeFrameHeader(FrameType::Query, kQueryHeaderSize + label.size(), query);
+  query[kFrameHeaderSize] = static_cast<uint8_t>(window);
+  WriteLittleEndian(std::min(count, kMaxResultEntries), 2,
+                    query + kFrameHeaderSize + 1);
+  query[kFrameHeaderSize + 3] = label.size();
+  memcpy(query + kFrameHeaderSize + kQueryHeaderSize, label.data(),
+         label.size());
+
+  uint8_t header_buffer[kFrameHeaderSize];
+  FrameHeader header;
+  std::vector<uint8_t> payload;
+  bool success = connect(fd, collector_address.get(),
+                         collector_address.length) == 0
+      && send(fd, query, query_size, MSG_NOSIGNAL)
+          == static_cast<ssize_t>(query_size)
+      && ReceiveAll(fd, header_buffer, sizeof(header_buffer))
+      && DecodeFrameHeader(header_buffer, &header)
+      && header.type == FrameType::Result && header.payload_size >= 2;
+  if (success) {
+    payload.resize(header.payload_size);
+    success = ReceiveAll(fd, payload.data(), payload.size());
+  }
+
+  close(fd);
+  if (!success) {
+    return false;
+  }
+
+  size_t entry_count = ReadLittleEndian(payload.data(), 2);
+  if (payload.size() != 2 + entry_count * kResultEntrySize) {
+    return false;
+  }
+
+  entries->resize(entry_count);
+  for (size_t i = 0; i < entry_count; i++) {
+    DecodeResultEntry(payload.data() + 2 + i * kResultEntrySize,
+                      &(*entries)[i]);
+  }
+
+  return true;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_COLLECTOR_QUERY_H_
+#define PWRUSBCTL_COLLECTOR_QUERY_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "top_index.h"
+
+namespace pwrusbctl {
+
+/**
+ * Asks a collector for the devices that draw the most power.
+ *
+ * @param address The address of the collector in the form "host:port".
+ * @param window The window to rank devices by.
+ * @param count The maximum number of devices to return.
+ * @param label Only devices carrying this label are ranked, or every device
+ *        if empty.
+ * @param entries The vector to populate in descending order of power.
+ * @return Returns false if the collector could not be reached or replied
+ *         with a malformed result.
+ */
+bool QueryTopConsumers(const std::string& address, TopWindow window,
+                       size_t count, const std::string& label,
+                       std::vector<TopEntry> *entries);
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_COLLECTOR_QUERY_H_
@@ -0,0 +1,548 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "collector_server.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include "util/socket_address.h"
+
+namespace pwrusbctl {
+
+//! The interval at which Run() checks whether to stop.
+constexpr int kStopPollIntervalMs(100);
+
+//! The interval at which paused connections are retried.
+constexpr int kPausePollIntervalMs(10);
+
+//! The largest number of unsent bytes queued for a connection before the
+//! agent is assumed to have stopped reading.
+constexpr size_t kMaxSendBufferSize(64 * 1024);
+
+//! The maximum number of events handled per wait.
+constexpr int kMaxEvents(256);
+
+//! The initial size of the receive buffer of a connection. Buffers grow up to
+//! the largest frame as needed.
+constexpr size_t kInitialBufferSize(16 * 1024);
+
+CollectorServer::CollectorServer(const std::string& address,
+                                 Pipeline *pipeline, TopIndex *index,
+                                 const Clock& clock)
+    : pipeline_(pipeline),
+      index_(index),
+      clock_(clock),
+      wall_clock_offset_us_(clock.GetWallClockOffsetUs()),
+      listen_socket_(-1),
+      epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      context_(ZSTD_createDCtx()),
+      samples_(kMaxBatchSamples * kEncodedSampleSize),
+      accepted_count_(0),
+      rejected_count_(0),
+      batch_count_(0),
+      query_count_(0) {
+  SocketAddress listen_address;
+  if (epoll_fd_ < 0 || context_ == nullptr
+      || !ResolveSocketAddress(address, SOCK_STREAM, &listen_address)) {
+    return;
+  }
+
+  int fd = socket(listen_address.storage.ss_family,
+                  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+
+  int enable = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (bind(fd, listen_address.get(), listen_address.length) != 0
+      || listen(fd, SOMAXCONN) != 0
+      || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    fprintf(stderr, "Error listening on %s: %s\n", address.c_str(),
+            strerror(errno));
+    close(fd);
+    return;
+  }
+
+  listen_socket_ = fd;
+}
+
+CollectorServer::~CollectorServer() {
+  while (!connections_.empty()) {
+    Close(connections_.begin()->first);
+  }
+
+  if (listen_socket_ >= 0) {
+    close(listen_socket_);
+  }
+
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+
+  ZSTD_freeDCtx(context_);
+}
+
+bool CollectorServer::IsInitialized() const {
+  return (listen_socket_ >= 0);
+}
+
+void CollectorServer::Run(const std::atomic<bool>& stop) {
+  epoll_event events[kMaxEvents];
+  bool paused = false;
+  while (!stop) {
+    int count = epoll_wait(epoll_fd_, events, kMaxEvents,
+        paused ? kPausePollIntervalMs : kStopPollIntervalMs);
+    for (int i = 0; i < count; i++) {
+      int fd = events[i].data.fd;
+      if (fd == listen_socket_) {
+        Accept();
+        continue;
+      }
+
+      // The connection may have been replaced earlier in this wait.
+      auto it = connections_.find(fd);
+      if (it == connections_.end()) {
+        continue;
+      }
+
+      // A paused connection is not registered for reading, so a hangup is
+      // handled here rather than by a failed read.
+      Connection *connection = it->second.get();
+      if ((events[i].events & (EPOLLHUP | EPOLLERR))
+          || ((events[i].events & EPOLLOUT)
+              && !FlushSendBuffer(connection))
+          || !Serve(connection)) {
+        Close(fd);
+      }
+    }
+
+    paused = ResumePaused();
+  }
+}
+
+void CollectorServer::PrintStats(FILE *file) const {
+  size_t paused_count = 0;
+  for (const auto& entry : connections_) {
+    paused_count += entry.second->paused ? 1 : 0;
+  }
+
+  uint64_t received_count = 0;
+  uint64_t duplicate_count = 0;
+  uint64_t lost_count = 0;
+  uint64_t handed_off_count = 0;
+  for (const auto& entry : streams_) {
+    received_count += entry.second.received_count;
+    duplicate_count += entry.second.duplicate_count;
+    lost_count += entry.second.lost_count;
+    handed_off_count += entry.second.handed_off_count;
+  }
+
+  fprintf(file, "Collector: %zu connections (accepted %" PRIu64
+          ", rejected %" PRIu64 ", %zu paused for full sinks), %zu streams, %"
+          PRIu64 " batches, %" PRIu64 " samples, %" PRIu64 " duplicates, %"
+          PRIu64 " lost, %" PRIu64 " received elsewhere, %" PRIu64
+          " queries\n",
+          connections_.size(), accepted_count_, rejected_count_,
+          paused_count, streams_.size(), batch_count_, received_count, duplicate_count,
+          lost_count, handed_off_count, query_count_);
+}
+
+void CollectorServer::Accept() {
+  while (true) {
+    int fd = accept4(listen_socket_, nullptr, nullptr,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "Error accepting agent: %s\n", strerror(errno));
+      }
+
+      return;
+    }
+
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      close(fd);
+      continue;
+    }
+
+    std::unique_ptr<Connection> connection(new Connection());
+    connection->socket = fd;
+    connection->stream = nullptr;
+    connection->buffer.resize(kInitialBufferSize);
+    connection->length = 0;
+    connection->ack_pending = false;
+    connection->paused = false;
+    connection->events = event.events;
+    connections_[fd] = std::move(connection);
+    accepted_count_++;
+  }
+}
+
+bool CollectorServer::Serve(Connection *connection) {
+  // Acknowledgements are coalesced so that one is sent per wakeup however
+  // many batches arrived.
+  if (!Receive(connection)
+      || (connection->ack_pending && !SendSequence(connection,
+          FrameType::Ack, connection->stream->next_sequence))) {
+    return false;
+  }
+
+  connection->ack_pending = false;
+  return UpdateEvents(connection);
+}
+
+bool CollectorServer::ResumePaused() {
+  std::vector<int> sockets;
+  for (const auto& entry : connections_) {
+    if (entry.second->paused) {
+      sockets.push_back(entry.first);
+    }
+  }
+
+  bool paused = false;
+  for (int socket : sockets) {
+    // The connection may have been replaced by one served earlier.
+    auto it = connections_.find(socket);
+    if (it == connections_.end()) {
+      continue;
+    }
+
+    Connection *connection = it->second.get();
+    connection->paused = false;
+    if (!Serve(connection)) {
+      Close(socket);
+    } else {
+      paused |= connection->paused;
+    }
+  }
+
+  return paused;
+}
+
+bool CollectorServer::Receive(Connection *connection) {
+  std::vector<uint8_t>& buffer = connection->buffer;
+  while (true) {
+    // Frames left in the buffer by a pause are processed before reading more.
+    if (!ProcessFrames(connection)) {
+      return false;
+    } else if (connection->paused) {
+      return true;
+    }
+
+    // A full buffer holds an incomplete frame larger than the buffer, since
+    // complete frames have been consumed.
+    if (connection->length == buffer.size()) {
+      buffer.resize(std::min(buffer.size() * 2,
+                             kFrameHeaderSize + kMaxFramePayloadSize));
+    }
+
+    ssize_t length = recv(connection->socket,
+                          buffer.data() + connection->length,
+                          buffer.size() - connection->length, 0);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    } else if (length < 0 && errno == EINTR) {
+      continue;
+    } else if (length <= 0) {
+      return false;
+    }
+
+    connection->length += length;
+  }
+}
+
+bool CollectorServer::ProcessFrames(Connection *connection) {
+  std::vector<uint8_t>& buffer = connection->buffer;
+  size_t offset = 0;
+  while (connection->length - offset >= kFrameHeaderSize) {
+    FrameHeader header;
+    if (!DecodeFrameHeader(buffer.data() + offset, &header)) {
+      rejected_count_++;
+      return false;
+    }
+
+    size_t frame_size = kFrameHeaderSize + header.payload_size;
+    if (connection->length - offset < frame_size) {
+      break;
+    }
+
+    if (!HandleFrame(connection, header,
+                     buffer.data() + offset + kFrameHeaderSize)) {
+      rejected_count_++;
+      return false;
+    }
+
+    // The batch that paused the connection stays in the buffer.
+    if (connection->paused) {
+      break;
+    }
+
+    offset += frame_size;
+  }
+
+  memmove(buffer.data(), buffer.data() + offset, connection->length - offset);
+  connection->length -= offset;
+  return true;
+}
+
+bool CollectorServer::HandleFrame(Connection *connection,
+                                  const FrameHeader& header,
+                                  const uint8_t *payload) {
+  switch (header.type) {
+    case FrameType::Hello:
+      return HandleHello(connection, payload, header.payload_size);
+    case FrameType::Batch:
+      return HandleBatch(connection, payload, header.payload_size);
+    case FrameType::Query:
+      return HandleQuery(connection, payload, header.payload_size);
+    default:
+      return false;
+  }
+}
+
+bool CollectorServer::HandleHello(Connection *connection,
+                                  const uint8_t *payload, size_t size) {
+  if (connection->stream != nullptr || size <= kHelloHeaderSize
+      || payload[8] != size - kHelloHeaderSize
+      || payload[8] > kMaxStreamIdLength) {
+    return false;
+  }
+
+  uint64_t resume_sequence = ReadLittleEndian(payload, 8);
+  std::string stream_id(
+      reinterpret_cast<const char *>(payload + kHelloHeaderSize), payload[8]);
+  auto result = streams_.emplace(stream_id, Stream());
+  Stream *stream = &result.first->second;
+  if (result.second) {
+    stream->socket = -1;
+  }
+
+  // An agent that reconnects before its old connection is noticed to have
+  // died replaces it.
+  if (stream->socket >= 0) {
+    Close(stream->socket);
+  }
+
+  // Samples that the agent has had acknowledged were received here or by
+  // another collector while the stream was sharded elsewhere.
+  if (resume_sequence > stream->next_sequence) {
+    stream->handed_off_count += resume_sequence - stream->next_sequence;
+    stream->next_sequence = resume_sequence;
+  }
+
+  stream->socket = connection->socket;
+  connection->stream = stream;
+  return SendSequence(connection, FrameType::Welcome, stream->next_sequence);
+}
+
+bool CollectorServer::HandleBatch(Connection *connection,
+                                  const uint8_t *payload, size_t size) {
+  if (connection->stream == nullptr || size < kBatchHeaderSize) {
+    return false;
+  }
+
+  uint64_t first_sequence = ReadLittleEndian(payload, 8);
+  size_t sample_count = ReadLittleEndian(payload + 8, 4);
+  if (sample_count == 0 || sample_count > kMaxBatchSamples) {
+    return false;
+  }
+
+  // Samples are acknowledged once pushed, so the batch waits until no sink
+  // would drop them.
+  if (!pipeline_->CanAccept(sample_count)) {
+    connection->paused = true;
+    return true;
+  }
+
+  size_t decompressed_size = ZSTD_decompressDCtx(context_, samples_.data(),
+      samples_.size(), payload + kBatchHeaderSize, size - kBatchHeaderSize);
+  if (ZSTD_isError(decompressed_size)
+      || decompressed_size != sample_count * kEncodedSampleSize) {
+    return false;
+  }
+
+  // Samples before the expected sequence number were received on an earlier
+  // connection and are only resent because their acknowledgement was lost.
+  Stream *stream = connection->stream;
+  if (first_sequence > stream->next_sequence) {
+    stream->lost_count += first_sequence - stream->next_sequence;
+  }
+
+  for (size_t i = 0; i < sample_count; i++) {
+    Sample sample;
+    if (first_sequence + i < stream->next_sequence) {
+      stream->duplicate_count++;
+    } else if (DecodeSample(&samples_[i * kEncodedSampleSize],
+                            wall_clock_offset_us_, &sample)) {
+      if (index_ != nullptr) {
+        index_->Update(sample);
+      }
+
+      pipeline_->Push(sample);
+      stream->received_count++;
+    }
+  }
+
+  stream->next_sequence = std::max(stream->next_sequence,
+                                   first_sequence + sample_count);
+  connection->ack_pending = true;
+  batch_count_++;
+  return true;
+}
+
+bool CollectorServer::HandleQuery(Connection *connection,
+                                  const uint8_t *payload, size_t size) {
+  if (size < kQueryHeaderSize || payload[3] != size - kQueryHeaderSize
+      || payload[3] > kMaxQueryLabelLength
+      || payload[0] > static_cast<uint8_t>(TopWindow::Hour)) {
+    return false;
+  }
+
+  std::vector<TopEntry> entries;
+  if (index_ != nullptr) {
+    size_t count = std::min<size_t>(ReadLittleEndian(payload + 1, 2),
+                                    kMaxResultEntries);
+    std::string label(
+        reinterpret_cast<const char *>(payload + kQueryHeaderSize),
+        payload[3]);
+    index_->Query(static_cast<TopWindow>(payload[0]), count, label,
+                  clock_.GetMonotonicTimeUs(), &entries);
+  }
+
+  std::vector<uint8_t> frame(kFrameHeaderSize + 2
+                             + entries.size() * kResultEntrySize);
+  EncodeFrameHeader(FrameType::Result, frame.size() - kFrameHeaderSize,
+                    frame.data());
+  WriteLittleEndian(entries.size(), 2, frame.data() + kFrameHeaderSize);
+  for (size_t i = 0; i < entries.size(); i++) {
+    EncodeResultEntry(entries[i], frame.data() + kFrameHeaderSize + 2
+                      + i * kResultEntrySize);
+  }
+
+  query_count_++;
+  return Send(connection, frame.data(), frame.size());
+}
+
+bool CollectorServer::SendSequence(Connection *connection, FrameType type,
+                                   uint64_t sequence) {
+  uint8_t frame[kFrameHeaderSize + 8];
+  EncodeFrameHeader(type, 8, frame);
+  WriteLittleEndian(sequence, 8, frame + kFrameHeaderSize);
+  return Send(connection, frame, sizeof(frame));
+}
+
+bool CollectorServer::Send(Connection *connection, const uint8_t *frame,
+                           size_t size) {
+  // Frames queue behind those already queued so that they never interleave.
+  size_t sent = 0;
+  if (connection->send_buffer.empty()) {
+    ssize_t length = send(connection->socket, frame, size,
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (length < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+        && errno != EINTR) {
+      return false;
+    }
+
+    sent = std::max<ssize_t>(length, 0);
+  }
+
+  if (connection->send_buffer.size() + size - sent > kMaxSendBufferSize) {
+    return false;
+  }
+
+  connection->send_buffer.insert(connection->send_buffer.end(),
+                                 frame + sent, frame + size);
+  return true;
+}
+
+bool CollectorServer::FlushSendBuffer(Connection *connection) {
+  std::vector<uint8_t>& buffer = connection->send_buffer;
+  while (!buffer.empty()) {
+    ssize_t length = send(connection->socket, buffer.data(), buffer.size(),
+                          MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return true;
+    } else if (length < 0 && errno == EINTR) {
+      continue;
+    } else if (length < 0) {
+      return false;
+    }
+
+    buffer.erase(buffer.begin(), buffer.begin() + length);
+  }
+
+  return true;
+}
+
+bool CollectorServer::UpdateEvents(Connection *connection) {
+  uint32_t events = 0;
+  if (!connection->paused) {
+    events |= EPOLLIN;
+  }
+
+  if (!connection->send_buffer.empty()) {
+    events |= EPOLLOUT;
+  }
+
+  if (events == connection->events) {
+    return true;
+  }
+
+  epoll_event event = {};
+  event.events = events;
+  event.data.fd = connection->socket;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, connection->socket, &event) != 0) {
+    return false;
+  }
+
+  connection->events = events;
+  return true;
+}
+
+void CollectorServer::Close(int socket) {
+  auto it = connections_.find(socket);
+  if (it == connections_.end()) {
+    return;
+  }
+
+  Stream *stream = it->second->stream;
+  if (stream != nullptr && stream->socket == socket) {
+    stream->socket = -1;
+  }
+
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, socket, nullptr);
+  close(socket);
+  connections_.erase(it);
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,325 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_COLLECTOR_SERVER_H_
+#define PWRUSBCTL_COLLECTOR_SERVER_H_
+
+#include <zstd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "collector_protocol.h"
+#include "pipeline.h"
+#include "top_index.h"
+#include "util/clock.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * Receives sample streams from agents and pushes them into a pipeline, giving
+ * a single view of many strips on many hosts.
+ *
+ * Every connection is served by one thread with epoll and non-blocking
+ * sockets, so thousands of agents cost a file descriptor and a receive
+ * buffer each rather than a thread. Batches are decompressed into a buffer
+ * shared by all connections. The sequence number expected next is kept for
+ * every stream for the lifetime of the collector, so an agent that
+ * reconnects resumes where it left off. Samples already received are
+ * discarded and gaps are counted as lost, except for those that the agent
+ * reports were acknowledged by another collector.
+ *
+ * A batch is only pushed and acknowledged once every sink queue has room for
+ * it. Until then the connection is paused: the batch is left in its buffer
+ * and nothing more is read, so a slow sink holds back its agents rather than
+ * losing acknowledged samples. Frames that do not fit in the socket buffer
+ * are queued and sent once the socket is writable.
+ *
+ * Received samples may also be added to a TopIndex, so that clients can ask
+ * which devices draw the most power on the same port.
+ */
+class CollectorServer : public NonCopyable {
+ public:
+  /**
+   * Constructs a CollectorServer listening on an address. The return value
+   * of IsInitialized() must be checked before running it.
+   *
+   * @param address The address to listen on in the form "host:port".
+   * @param pipeline The started pipeline that received samples are pushed
+   *        into. Only pushed to from the thread that invokes Run().
+   * @param index The index that received samples are added to and queries
+   *        are answered from, or nullptr to answer every query with nothing.
+   *        Only accessed from the thread that invokes Run().
+   * @param clock The clock whose wall-clock offset converts received
+   *        timestamps to the local monotonic clock.
+   */
+  CollectorServer(const std::string& address, Pipeline *pipeline,
+                  TopIndex *index = nullptr,
+                  const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Closes the listening socket and every connection.
+   */
+  ~CollectorServer();
+
+  /**
+   * @return Returns true if the server is listening.
+   */
+  bool IsInitialized() const;
+
+  /**
+   * Serves connections until stopped.
+   *
+   * @param stop Set to return from Run() within a poll interval.
+   */
+  void Run(const std::atomic<bool>& stop);
+
+  /**
+   * Prints the number of connections, streams and samples received.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  /**
+   * The state of a stream, which outlives the connections that carry it.
+   */
+  struct Stream {
+    //! The sequence number expected next.
+    uint64_t next_sequence;
+
+    //! The connection currently carrying the stream, -1 if none.
+    int socket;
+
+    //! The number of samples received, discarded as duplicates and skipped
+    //! over by gaps in the sequence.
+    uint64_t received_count;
+    uint64_t duplicate_count;
+    uint64_t lost_count;
+
+    //! The number of samples acknowledged by other collectors while the
+    //! stream was sharded elsewhere.
+    uint64_t handed_off_count;
+  };
+
+  /**
+   * The state of a connection from an agent.
+   */
+  struct Connection {
+    //! The socket of the connection.
+    int socket;
+
+    //! The stream identified by the hello, nullptr until it is received.
+    Stream *stream;
+
+    //! The bytes received that do not yet form a complete frame.
+    std::vector<uint8_t> buffer;
+    size_t length;
+
+    //! Whether or not an acknowledgement is owed for received batches.
+    bool ack_pending;
+
+    //! Whether or not reading is paused until the sinks have room for the
+    //! batch at the front of the buffer.
+    bool paused;
+
+    //! The bytes of frames that did not fit in the socket buffer.
+    std::vector<uint8_t> send_buffer;
+
+    //! The events that the socket is registered for.
+    uint32_t events;
+  };
+
+  //! The pipeline that received samples are pushed into.
+  Pipeline *pipeline_;
+
+  //! The index of the largest consumers, nullptr if none.
+  TopIndex *index_;
+
+  //! The clock that queries are answered at.
+  const Clock& clock_;
+
+  //! The offset subtracted from received wall-clock timestamps.
+  const int64_t wall_clock_offset_us_;
+
+  //! The listening socket, -1 if it could not be created.
+  int listen_socket_;
+
+  //! The epoll instance.
+  int epoll_fd_;
+
+  //! The decompression context and buffer shared by every connection.
+  ZSTD_DCtx *context_;
+  std::vector<uint8_t> samples_;
+
+  //! The connections keyed by socket.
+  std::map<int, std::unique_ptr<Connection>> connections_;
+
+  //! The streams keyed by identifier.
+  std::map<std::string, Stream> streams_;
+
+  //! The number of connections accepted and closed for protocol errors.
+  uint64_t accepted_count_;
+  uint64_t rejected_count_;
+
+  //! The number of batches and queries received.
+  uint64_t batch_count_;
+  uint64_t query_count_;
+
+  /**
+   * Accepts every pending connection.
+   */
+  void Accept();
+
+  /**
+   * Receives from a connection, acknowledges the batches received and
+   * updates the events that it is registered for.
+   *
+   * @param connection The connection to serve.
+   * @return Returns false if the connection should be closed.
+   */
+  bool Serve(Connection *connection);
+
+  /**
+   * Serves every paused connection again, resuming those whose batches the
+   * sinks now have room for.
+   *
+   * @return Returns true if any connection remains paused.
+   */
+  bool ResumePaused();
+
+  /**
+   * Processes the complete frames in the buffer of a connection and reads
+   * from it until the socket is drained or the connection is paused.
+   *
+   * @param connection The connection to receive from.
+   * @return Returns false if the connection should be closed.
+   */
+  bool Receive(Connection *connection);
+
+  /**
+   * Processes the complete frames in the buffer of a connection, stopping at
+   * a batch that pauses it.
+   *
+   * @param connection The connection whose buffer is processed.
+   * @return Returns false if a frame violates the protocol.
+   */
+  bool ProcessFrames(Connection *connection);
+
+  /**
+   * Processes a complete frame.
+   *
+   * @param connection The connection that the frame arrived on.
+   * @param header The header of the frame.
+   * @param payload The payload of the frame.
+   * @return Returns false if the frame violates the protocol.
+   */
+  bool HandleFrame(Connection *connection, const FrameHeader& header,
+                   const uint8_t *payload);
+
+  /**
+   * Handles a hello, binding the connection to its stream.
+   *
+   * @param connection The connection that the frame arrived on.
+   * @param payload The payload of the frame.
+   * @param size The size of the payload.
+   * @return Returns false if the frame violates the protocol.
+   */
+  bool HandleHello(Connection *connection, const uint8_t *payload,
+                   size_t size);
+
+  /**
+   * Handles a batch, pushing samples that have not been seen before.
+   *
+   * @param connection The connection that the frame arrived on.
+   * @param payload The payload of the frame.
+   * @param size The size of the payload.
+   * @return Returns false if the frame violates the protocol.
+   */
+  bool HandleBatch(Connection *connection, const uint8_t *payload,
+                   size_t size);
+
+  /**
+   * Handles a query, replying with the devices that draw the most power.
+   *
+   * @param connection The connection that the frame arrived on.
+   * @param payload The payload of the frame.
+   * @param size The size of the payload.
+   * @return Returns false if the frame violates the protocol or the
+   *         connection failed.
+   */
+  bool HandleQuery(Connection *connection, const uint8_t *payload,
+                   size_t size);
+
+  /**
+   * Sends a frame carrying a sequence number.
+   *
+   * @param connection The connection to send on.
+   * @param type The type of frame.
+   * @param sequence The sequence number.
+   * @return Returns false if the connection failed.
+   */
+  bool SendSequence(Connection *connection, FrameType type,
+                    uint64_t sequence);
+
+  /**
+   * Sends a frame, queueing whatever does not fit in the socket buffer
+   * behind any frames already queued.
+   *
+   * @param connection The connection to send on.
+   * @param frame The frame to send.
+   * @param size The size of the frame.
+   * @return Returns false if the connection failed or the agent has stopped
+   *         reading.
+   */
+  bool Send(Connection *connection, const uint8_t *frame, size_t size);
+
+  /**
+   * Sends as much of the queued frames of a connection as the socket buffer
+   * accepts.
+   *
+   * @param connection The writable connection.
+   * @return Returns false if the connection failed.
+   */
+  bool FlushSendBuffer(Connection *connection);
+
+  /**
+   * Registers a connection for reading unless it is paused and for writing
+   * if it has queued frames.
+   *
+   * @param connection The connection to register.
+   * @return Returns false if the registration failed.
+   */
+  bool UpdateEvents(Connection *connection);
+
+  /**
+   * Closes a connection, detaching it from its stream.
+   *
+   * @param socket The socket of the connection.
+   */
+  void Close(int socket);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_COLLECTOR_SERVER_H_
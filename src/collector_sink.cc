@@ -0,0 +1,407 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "collector_sink.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+
+#include "util/hash_ring.h"
+
+namespace pwrusbctl {
+
+//! The zstd compression level of batches. Low levels are cheap enough to run
+//! continuously on the sink thread.
+constexpr int kCompressionLevel(3);
+
+//! The maximum time to wait for a connection to a collector to be accepted.
+constexpr int kConnectTimeoutMs(2000);
+
+//! The maximum time to wait for the collector to reply to a hello.
+constexpr int kHandshakeTimeoutMs(5000);
+
+//! The maximum time to wait for room in the window before a batch is sent.
+constexpr int kAckTimeoutMs(1000);
+
+constexpr size_t CollectorSink::kDefaultMaxBatchSize;
+constexpr size_t CollectorSink::kDefaultWindowSize;
+constexpr uint64_t CollectorSink::kRebalanceIntervalUs;
+
+CollectorSink::CollectorSink(const std::vector<std::string>& addresses,
+                             const std::string& stream_id,
+                             const std::string& shard_key,
+                             size_t max_batch_size, size_t window_size,
+                             const Clock& clock)
+    : stream_id_(stream_id.substr(0, kMaxStreamIdLength)),
+      max_batch_size_(std::max<size_t>(1,
+          std::min(max_batch_size, kMaxBatchSamples))),
+      window_size_(std::max<size_t>(1, window_size)),
+      wall_clock_offset_us_(clock.GetWallClockOffsetUs()),
+      clock_(clock),
+      collectors_(),
+      addresses_resolved_(!addresses.empty()),
+      collector_index_(0),
+      rebalance_time_us_(0),
+      context_(ZSTD_createCCtx()),
+      socket_(-1),
+      batch_(max_batch_size_ * kEncodedSampleSize),
+      batch_size_(0),
+      next_sequence_(0),
+      receive_buffer_(),
+      receive_length_(0),
+      batch_count_(0),
+      resent_count_(0),
+      connect_count_(0),
+      handoff_count_(0),
+      bytes_in_(0),
+      bytes_out_(0) {
+  HashRing ring;
+  for (const auto& address : addresses) {
+    ring.AddNode(address);
+  }
+
+  for (const auto& name : ring.GetPreferenceList(shard_key)) {
+    Collector collector;
+    collector.name = name;
+    addresses_resolved_ &= ResolveSocketAddress(name, SOCK_STREAM,
+                                                &collector.address);
+    collectors_.push_back(collector);
+  }
+}
+
+CollectorSink::~CollectorSink() {
+  // Give the collector a chance to acknowledge the final batches so that a
+  // clean shutdown does not leave them unconfirmed.
+  if (socket_ >= 0 && batch_size_ > 0) {
+    SendBatch();
+  }
+
+  DrainAcks();
+  Disconnect();
+  ZSTD_freeCCtx(context_);
+}
+
+bool CollectorSink::IsInitialized() const {
+  return addresses_resolved_ && context_ != nullptr;
+}
+
+bool CollectorSink::Write(const Sample& sample) {
+  // Samples are only accepted while connected so that a failure is reported
+  // to the pipeline before the sample is taken into the batch.
+  if (!Connect()) {
+    return false;
+  }
+
+  if (batch_size_ >= max_batch_size_ && !SendBatchOrFailOver()) {
+    return false;
+  }
+
+  EncodeSample(sample, wall_clock_offset_us_,
+               &batch_[batch_size_ * kEncodedSampleSize]);
+  batch_size_++;
+  return true;
+}
+
+bool CollectorSink::Flush() {
+  if (!Connect()) {
+    return false;
+  }
+
+  if (batch_size_ > 0 && !SendBatchOrFailOver()) {
+    return false;
+  }
+
+  return ProcessAcks(0);
+}
+
+void CollectorSink::PrintStats(FILE *file) const {
+  fprintf(file, "collector: sent %" PRIu64 " batches, resent %" PRIu64
+          ", %zu in flight, %" PRIu64 " connections, %" PRIu64
+          " handoffs, compression %.2fx\n",
+          batch_count_, resent_count_, inflight_.size(), connect_count_,
+          handoff_count_, (bytes_out_ == 0) ? 0.0
+              : static_cast<double>(bytes_in_) / bytes_out_);
+  if (socket_ >= 0) {
+    fprintf(file, "collector: connected to %s, choice %zu of %zu\n",
+            collectors_[collector_index_].name.c_str(), collector_index_ + 1,
+            collectors_.size());
+  }
+}
+
+bool CollectorSink::Connect() {
+  if (socket_ >= 0 && (collector_index_ == 0
+      || clock_.GetMonotonicTimeUs() < rebalance_time_us_)) {
+    return true;
+  }
+
+  // While connected to a fallback, only a more preferred collector is tried.
+  // The batches in flight are drained first so that they are not also sent
+  // to the new collector.
+  rebalance_time_us_ = clock_.GetMonotonicTimeUs() + kRebalanceIntervalUs;
+  for (size_t i = 0; i < collectors_.size(); i++) {
+    if (socket_ >= 0 && i >= collector_index_) {
+      break;
+    }
+
+    int fd = Dial(i);
+    if (fd < 0) {
+      continue;
+    }
+
+    if (socket_ >= 0) {
+      DrainAcks();
+      Disconnect();
+      handoff_count_++;
+    }
+
+    if (Handshake(fd, i)) {
+      return true;
+    }
+  }
+
+  return socket_ >= 0;
+}
+
+int CollectorSink::Dial(size_t index) {
+  const SocketAddress& address = collectors_[index].address;
+  int fd = socket(address.storage.ss_family,
+                  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int error = 0;
+  socklen_t error_length = sizeof(error);
+  if (connect(fd, address.get(), address.length) != 0) {
+    pollfd poll_fd = { fd, POLLOUT, 0 };
+    if (errno != EINPROGRESS || poll(&poll_fd, 1, kConnectTimeoutMs) != 1
+        || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0
+        || error != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  // The connection is used with blocking sends once established.
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  int enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  return fd;
+}
+
+bool CollectorSink::Handshake(int socket, size_t index) {
+  socket_ = socket;
+  collector_index_ = index;
+  connect_count_++;
+
+  // The resume sequence tells the collector which samples have already been
+  // acknowledged, possibly by another collector.
+  uint64_t resume_sequence = inflight_.empty()
+      ? next_sequence_ : inflight_.front().first_sequence;
+  uint8_t hello[kFrameHeaderSize + kHelloHeaderSize + kMaxStreamIdLength];
+  EncodeFrameHeader(FrameType::Hello, kHelloHeaderSize + stream_id_.size(),
+                    hello);
+  WriteLittleEndian(resume_sequence, 8, hello + kFrameHeaderSize);
+  hello[kFrameHeaderSize + 8] = stream_id_.size();
+  memcpy(hello + kFrameHeaderSize + kHelloHeaderSize, stream_id_.data(),
+         stream_id_.size());
+  uint64_t expected_sequence;
+  if (!Send(hello, kFrameHeaderSize + kHelloHeaderSize + stream_id_.size())
+      || !ReceiveSequence(FrameType::Welcome, kHandshakeTimeoutMs,
+                          &expected_sequence)) {
+    Disconnect();
+    return false;
+  }
+
+  // Batches that the collector has seen are released. If nothing remains in
+  // flight, numbering continues from where the collector left off so that a
+  // restarted agent is not mistaken for duplicates.
+  Acknowledge(expected_sequence);
+  if (inflight_.empty()) {
+    next_sequence_ = std::max(next_sequence_, expected_sequence);
+  }
+
+  for (const auto& batch : inflight_) {
+    if (!Send(batch.frame.data(), batch.frame.size())) {
+      return false;
+    }
+
+    resent_count_++;
+  }
+
+  return true;
+}
+
+void CollectorSink::DrainAcks() {
+  uint64_t next_sequence;
+  while (socket_ >= 0 && !inflight_.empty()
+         && ReceiveSequence(FrameType::Ack, kAckTimeoutMs, &next_sequence)) {
+    Acknowledge(next_sequence);
+  }
+}
+
+void CollectorSink::Disconnect() {
+  if (socket_ >= 0) {
+    close(socket_);
+    socket_ = -1;
+  }
+
+  receive_length_ = 0;
+}
+
+bool CollectorSink::Send(const uint8_t *data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(socket_, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    } else if (sent <= 0) {
+      Disconnect();
+      return false;
+    }
+
+    data += sent;
+    length -= sent;
+  }
+
+  return true;
+}
+
+bool CollectorSink::ReceiveSequence(FrameType type, int timeout_ms,
+                                    uint64_t *sequence) {
+  // A partially received frame is kept across calls so that a timeout never
+  // loses bytes.
+  while (receive_length_ < sizeof(receive_buffer_)) {
+    pollfd poll_fd = { socket_, POLLIN, 0 };
+    int result = poll(&poll_fd, 1, timeout_ms);
+    if (result == 0) {
+      return false;
+    } else if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    ssize_t length = (result < 0) ? -1 : recv(socket_,
+        receive_buffer_ + receive_length_,
+        sizeof(receive_buffer_) - receive_length_, 0);
+    if (length <= 0) {
+      Disconnect();
+      return false;
+    }
+
+    receive_length_ += length;
+  }
+
+  receive_length_ = 0;
+  FrameHeader header;
+  if (!DecodeFrameHeader(receive_buffer_, &header) || header.type != type
+      || header.payload_size != sizeof(receive_buffer_) - kFrameHeaderSize) {
+    fprintf(stderr, "Unexpected frame from collector\n");
+    Disconnect();
+    return false;
+  }
+
+  *sequence = ReadLittleEndian(receive_buffer_ + kFrameHeaderSize, 8);
+  return true;
+}
+
+bool CollectorSink::ProcessAcks(int timeout_ms) {
+  auto deadline = std::chrono::steady_clock::now()
+      + std::chrono::milliseconds(timeout_ms);
+  while (true) {
+    // Acknowledgements that have already arrived are always drained, but the
+    // collector is only waited on while the window is full.
+    int wait_ms = 0;
+    if (inflight_.size() >= window_size_) {
+      wait_ms = std::max<int64_t>(0,
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              deadline - std::chrono::steady_clock::now()).count());
+    }
+
+    uint64_t next_sequence;
+    if (!ReceiveSequence(FrameType::Ack, wait_ms, &next_sequence)) {
+      return socket_ >= 0 && inflight_.size() < window_size_;
+    }
+
+    Acknowledge(next_sequence);
+  }
+}
+
+void CollectorSink::Acknowledge(uint64_t next_sequence) {
+  while (!inflight_.empty() && inflight_.front().first_sequence
+         + inflight_.front().sample_count <= next_sequence) {
+    inflight_.pop_front();
+  }
+}
+
+bool CollectorSink::SendBatch() {
+  if (!ProcessAcks(kAckTimeoutMs)) {
+    return false;
+  }
+
+  size_t input_size = batch_size_ * kEncodedSampleSize;
+  size_t prefix_size = kFrameHeaderSize + kBatchHeaderSize;
+  InflightBatch batch;
+  batch.first_sequence = next_sequence_;
+  batch.sample_count = batch_size_;
+  batch.frame.resize(prefix_size + ZSTD_compressBound(input_size));
+  size_t compressed_size = ZSTD_compressCCtx(context_,
+      batch.frame.data() + prefix_size, batch.frame.size() - prefix_size,
+      batch_.data(), input_size, kCompressionLevel);
+  if (ZSTD_isError(compressed_size)) {
+    fprintf(stderr, "Error compressing batch: %s\n",
+            ZSTD_getErrorName(compressed_size));
+    return false;
+  }
+
+  batch.frame.resize(prefix_size + compressed_size);
+  EncodeFrameHeader(FrameType::Batch, kBatchHeaderSize + compressed_size,
+                    batch.frame.data());
+  WriteLittleEndian(batch.first_sequence, 8,
+                    batch.frame.data() + kFrameHeaderSize);
+  WriteLittleEndian(batch.sample_count, 4,
+                    batch.frame.data() + kFrameHeaderSize + 8);
+
+  next_sequence_ += batch_size_;
+  batch_size_ = 0;
+  batch_count_++;
+  bytes_in_ += input_size;
+  bytes_out_ += batch.frame.size();
+  inflight_.push_back(std::move(batch));
+
+  // The batch is retained until acknowledged, so a failed send only delays
+  // it until the next connection.
+  const InflightBatch& sent = inflight_.back();
+  Send(sent.frame.data(), sent.frame.size());
+  return true;
+}
+
+bool CollectorSink::SendBatchOrFailOver() {
+  // A connection found to be lost while sending is replaced once, falling
+  // back to another collector if the owner has gone, so that a collector
+  // leaving moves the stream rather than failing the write.
+  return SendBatch() || (socket_ < 0 && Connect() && SendBatch());
+}
+
+}  // namespace pwrusbctl
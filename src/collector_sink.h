@@ -0,0 +1,278 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_COLLECTOR_SINK_H_
+#define PWRUSBCTL_COLLECTOR_SINK_H_
+
+#include <zstd.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "collector_protocol.h"
+#include "sink.h"
+#include "util/clock.h"
+#include "util/socket_address.h"
+
+namespace pwrusbctl {
+
+/**
+ * A sink that streams samples to a collector over a persistent TCP
+ * connection, which makes the running instance an agent of the collector.
+ *
+ * Samples are numbered, encoded in a portable binary form and batched. Each
+ * batch is compressed with zstd and sent as a single frame. Up to a window of
+ * batches may await acknowledgement, and those batches are retained so that
+ * they can be resent after a reconnect. On connecting, the collector reports
+ * the sequence number it expects next and only later batches are resent.
+ *
+ * Several collectors may share the load. The stream is assigned to one of
+ * them by consistent hashing of a shard key, normally the serial number of
+ * the strip, so that adding or removing a collector only moves the streams
+ * that it gains or loses. If the owner cannot be reached, the stream falls
+ * back to the next collector on the ring and periodically tries to return.
+ * Before a stream moves, the batches in flight are given a chance to be
+ * acknowledged, and any that are not are resent to the new collector, so
+ * moving never loses samples.
+ */
+class CollectorSink : public Sink {
+ public:
+  //! The default maximum number of samples per batch.
+  static constexpr size_t kDefaultMaxBatchSize = 500;
+
+  //! The default number of batches that may await acknowledgement.
+  static constexpr size_t kDefaultWindowSize = 8;
+
+  //! The interval at which a stream that has fallen back tries to return to
+  //! a collector earlier in its order of preference.
+  static constexpr uint64_t kRebalanceIntervalUs = 30000000;
+
+  /**
+   * Constructs a CollectorSink. The connection is established lazily when
+   * the first sample is written. The return value of IsInitialized() must be
+   * checked before writing.
+   *
+   * @param addresses The addresses of the collectors in the form
+   *        "host:port". Every agent must list the same collectors.
+   * @param stream_id The identifier of this stream, unique among the agents
+   *        of the collectors.
+   * @param shard_key The key that assigns the stream to a collector.
+   * @param max_batch_size The maximum number of samples per batch.
+   * @param window_size The maximum number of unacknowledged batches.
+   * @param clock The clock whose wall-clock offset timestamps are sent with.
+   */
+  CollectorSink(const std::vector<std::string>& addresses,
+                const std::string& stream_id, const std::string& shard_key,
+                size_t max_batch_size = kDefaultMaxBatchSize,
+                size_t window_size = kDefaultWindowSize,
+                const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Sends any batched samples, waits briefly for outstanding
+   * acknowledgements and closes the connection.
+   */
+  ~CollectorSink();
+
+  /**
+   * @return Returns true if every address was resolved and the compression
+   *         context was created.
+   */
+  bool IsInitialized() const;
+
+  bool Write(const Sample& sample) override;
+  bool Flush() override;
+  void PrintStats(FILE *file) const override;
+
+ private:
+  /**
+   * A collector that the stream may be sent to.
+   */
+  struct Collector {
+    //! The address as given, which names the collector on the hash ring.
+    std::string name;
+
+    //! The resolved address.
+    SocketAddress address;
+  };
+
+  /**
+   * A batch that has been sent and awaits acknowledgement.
+   */
+  struct InflightBatch {
+    //! The sequence number of the first sample in the batch.
+    uint64_t first_sequence;
+
+    //! The number of samples in the batch.
+    uint32_t sample_count;
+
+    //! The encoded frame, retained to be resent after a reconnect.
+    std::vector<uint8_t> frame;
+  };
+
+  //! The identifier of this stream.
+  const std::string stream_id_;
+
+  //! The maximum number of samples per batch.
+  const size_t max_batch_size_;
+
+  //! The maximum number of unacknowledged batches.
+  const size_t window_size_;
+
+  //! The offset added to monotonic timestamps to obtain wall-clock time.
+  const int64_t wall_clock_offset_us_;
+
+  //! The clock that schedules attempts to return to a preferred collector.
+  const Clock& clock_;
+
+  //! The collectors in the order of preference of the stream.
+  std::vector<Collector> collectors_;
+
+  //! Whether or not every address was resolved.
+  bool addresses_resolved_;
+
+  //! The index in collectors_ of the connected collector.
+  size_t collector_index_;
+
+  //! The time at which to next try a more preferred collector.
+  uint64_t rebalance_time_us_;
+
+  //! The compression context, reused for every batch.
+  ZSTD_CCtx *context_;
+
+  //! The connected socket, -1 if disconnected.
+  int socket_;
+
+  //! The encoded samples of the batch being accumulated.
+  std::vector<uint8_t> batch_;
+
+  //! The number of samples in batch_.
+  size_t batch_size_;
+
+  //! The sequence number assigned to the first sample of the next batch.
+  uint64_t next_sequence_;
+
+  //! The batches awaiting acknowledgement, oldest first.
+  std::deque<InflightBatch> inflight_;
+
+  //! The partially received frame from the collector.
+  uint8_t receive_buffer_[kFrameHeaderSize + 8];
+  size_t receive_length_;
+
+  //! The counters reported by PrintStats().
+  uint64_t batch_count_;
+  uint64_t resent_count_;
+  uint64_t connect_count_;
+  uint64_t handoff_count_;
+  uint64_t bytes_in_;
+  uint64_t bytes_out_;
+
+  /**
+   * Connects to the most preferred collector that is reachable if not
+   * already connected. While connected to a fallback, periodically moves the
+   * stream back to a more preferred collector that has become reachable.
+   *
+   * @return Returns false if no collector could be reached.
+   */
+  bool Connect();
+
+  /**
+   * Opens a TCP connection to a collector, bounded by a timeout so that an
+   * unreachable collector does not stall the sink.
+   *
+   * @param index The index of the collector in collectors_.
+   * @return Returns the connected socket, or -1 on failure.
+   */
+  int Dial(size_t index);
+
+  /**
+   * Adopts a connected socket, exchanges the hello and welcome frames and
+   * resends any batches the collector has not seen.
+   *
+   * @param socket The connected socket.
+   * @param index The index of the collector in collectors_.
+   * @return Returns false if the handshake failed.
+   */
+  bool Handshake(int socket, size_t index);
+
+  /**
+   * Waits briefly for the acknowledgement of every batch in flight.
+   */
+  void DrainAcks();
+
+  /**
+   * Closes the connection, retaining unacknowledged batches.
+   */
+  void Disconnect();
+
+  /**
+   * Sends bytes on the connection, disconnecting on error.
+   *
+   * @param data The bytes to send.
+   * @param length The number of bytes to send.
+   * @return Returns false if an error occurs.
+   */
+  bool Send(const uint8_t *data, size_t length);
+
+  /**
+   * Receives a single frame of a given type, blocking up to a timeout.
+   *
+   * @param type The expected type of frame.
+   * @param timeout_ms The maximum time to wait.
+   * @param sequence The sequence number carried by the frame to populate.
+   * @return Returns false if the frame was not received, in which case the
+   *         connection is closed unless the wait timed out.
+   */
+  bool ReceiveSequence(FrameType type, int timeout_ms, uint64_t *sequence);
+
+  /**
+   * Processes acknowledgements until the window has room or a timeout
+   * elapses.
+   *
+   * @param timeout_ms The maximum time to wait for room in the window.
+   * @return Returns false if the window is still full or the connection was
+   *         lost.
+   */
+  bool ProcessAcks(int timeout_ms);
+
+  /**
+   * Releases the batches acknowledged by a cumulative acknowledgement.
+   *
+   * @param next_sequence The sequence number that the collector expects
+   *        next.
+   */
+  void Acknowledge(uint64_t next_sequence);
+
+  /**
+   * Compresses the current batch into a frame, retains it and sends it.
+   *
+   * @return Returns false if the window stayed full. The batch is kept so
+   *         that it can be sent later.
+   */
+  bool SendBatch();
+
+  /**
+   * Sends the current batch, reconnecting once if the connection is lost.
+   *
+   * @return Returns false if the batch could not be sent.
+   */
+  bool SendBatchOrFailOver();
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_COLLECTOR_SINK_H_
@@ -0,0 +1,232 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "command_profiler.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "util/time.h"
+
+namespace pwrusbctl {
+
+//! The interval at which to check whether the first sample has been taken.
+constexpr useconds_t kFirstSamplePollIntervalUs(1000);
+
+constexpr uint64_t ProfileOptions::kDefaultBaselineUs;
+
+/**
+ * The power drawn at an instant.
+ */
+struct PowerSample {
+  uint64_t timestamp_us;
+  double power_w;
+};
+
+/**
+ * Integrates power over a window, interpolating linearly between samples and
+ * at the edges of the window.
+ *
+ * @param samples The samples in ascending order of timestamp.
+ * @param start_us The start of the window.
+ * @param end_us The end of the window.
+ * @param peak_w Updated with the highest power within the window.
+ * @return The energy drawn within the window in joules.
+ */
+static double IntegratePower(const std::vector<PowerSample>& samples,
+                             uint64_t start_us, uint64_t end_us,
+                             double *peak_w) {
+  double energy_j = 0.0;
+  for (size_t i = 1; i < samples.size(); i++) {
+    const PowerSample& a = samples[i - 1];
+    const PowerSample& b = samples[i];
+    uint64_t low_us = std::max(a.timestamp_us, start_us);
+    uint64_t high_us = std::min(b.timestamp_us, end_us);
+    if (high_us <= low_us) {
+      continue;
+    }
+
+    double slope = (b.power_w - a.power_w) / (b.timestamp_us - a.timestamp_us);
+    double low_w = a.power_w + slope * (low_us - a.timestamp_us);
+    double high_w = a.power_w + slope * (high_us - a.timestamp_us);
+    energy_j += (low_w + high_w) / 2.0 * (high_us - low_us) / 1e6;
+    *peak_w = std::max(*peak_w, std::max(low_w, high_w));
+  }
+
+  return energy_j;
+}
+
+/**
+ * Starts a command in a child process.
+ *
+ * @param argv The null-terminated arguments of the command.
+ * @param child_actions The signal actions to restore in the child for SIGINT
+ *        and SIGQUIT.
+ * @return The process ID of the command, or -1 if it could not be started.
+ */
+static pid_t StartCommand(char *const *argv,
+                          const struct sigaction *child_actions) {
+  // The child reports a failure to exec through a pipe that is closed by a
+  // successful exec.
+  int error_pipe[2];
+  if (pipe(error_pipe) != 0) {
+    return -1;
+  }
+
+  fcntl(error_pipe[1], F_SETFD, FD_CLOEXEC);
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(error_pipe[0]);
+    sigaction(SIGINT, &child_actions[0], nullptr);
+    sigaction(SIGQUIT, &child_actions[1], nullptr);
+    execvp(argv[0], argv);
+    int error = errno;
+    write(error_pipe[1], &error, sizeof(error));
+    _exit(127);
+  }
+
+  close(error_pipe[1]);
+  int error = 0;
+  if (pid > 0) {
+    ssize_t length;
+    do {
+      length = read(error_pipe[0], &error, sizeof(error));
+    } while (length < 0 && errno == EINTR);
+
+    if (length > 0) {
+      fprintf(stderr, "Error running %s: %s\n", argv[0], strerror(error));
+      waitpid(pid, nullptr, 0);
+      pid = -1;
+    }
+  }
+
+  close(error_pipe[0]);
+  return pid;
+}
+
+bool ProfileCommand(const PowerUsbDevice& device, char *const *argv,
+                    const ProfileOptions& options, EnergyProfile *profile) {
+  // Samples are taken on a separate thread from just before the command
+  // starts until the first sample after it exits.
+  std::vector<PowerSample> samples;
+  std::atomic<size_t> sample_count(0);
+  std::atomic<uint64_t> stop_us(std::numeric_limits<uint64_t>::max());
+  std::atomic<bool> sample_error(false);
+  std::thread sampler([&]() {
+    uint64_t scheduled_us = GetMonotonicTimeUs();
+    uint64_t timestamp_us;
+    do {
+      int16_t current;
+      uint64_t request_us = GetMonotonicTimeUs();
+      if (!device.GetInstantaneousCurrent(&current)) {
+        // Release the wait for the first sample.
+        sample_error = true;
+        sample_count = 1;
+        return;
+      }
+
+      // The reading is taken at some point during the transaction.
+      timestamp_us = request_us + (GetMonotonicTimeUs() - request_us) / 2;
+      samples.push_back({ timestamp_us,
+                          (current / 1000.0) * options.line_voltage });
+      sample_count++;
+      if (options.interval_us > 0) {
+        scheduled_us += options.interval_us;
+        uint64_t now_us = GetMonotonicTimeUs();
+        if (now_us < scheduled_us) {
+          usleep(scheduled_us - now_us);
+        }
+      }
+    } while (timestamp_us <= stop_us);
+  });
+
+  while (sample_count == 0) {
+    usleep(kFirstSamplePollIntervalUs);
+  }
+
+  uint64_t baseline_start_us = GetMonotonicTimeUs();
+  std::this_thread::sleep_for(std::chrono::microseconds(options.baseline_us));
+
+  struct sigaction ignore_action = {};
+  ignore_action.sa_handler = SIG_IGN;
+  struct sigaction saved_actions[2];
+  sigaction(SIGINT, &ignore_action, &saved_actions[0]);
+  sigaction(SIGQUIT, &ignore_action, &saved_actions[1]);
+
+  uint64_t start_us = GetMonotonicTimeUs();
+  pid_t pid = sample_error ? -1 : StartCommand(argv, saved_actions);
+  int status = 0;
+  if (pid > 0) {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  }
+
+  uint64_t end_us = GetMonotonicTimeUs();
+  sigaction(SIGINT, &saved_actions[0], nullptr);
+  sigaction(SIGQUIT, &saved_actions[1], nullptr);
+  stop_us = (pid > 0) ? end_us : 0;
+  sampler.join();
+  if (pid <= 0 || sample_error) {
+    return false;
+  }
+
+  double baseline_peak_w = 0.0;
+  double peak_w = 0.0;
+  profile->duration_us = end_us - start_us;
+  profile->sample_count = std::count_if(samples.begin(), samples.end(),
+      [start_us, end_us](const PowerSample& sample) {
+        return sample.timestamp_us >= start_us && sample.timestamp_us <= end_us;
+      });
+  profile->baseline_w = (options.baseline_us == 0) ? 0.0
+      : IntegratePower(samples, baseline_start_us, start_us, &baseline_peak_w)
+          * 1e6 / (start_us - baseline_start_us);
+  profile->energy_j = IntegratePower(samples, start_us, end_us, &peak_w);
+  profile->net_energy_j = profile->energy_j
+      - profile->baseline_w * profile->duration_us / 1e6;
+  profile->average_w = (profile->duration_us == 0) ? 0.0
+      : profile->energy_j * 1e6 / profile->duration_us;
+  profile->peak_w = peak_w;
+  profile->status = status;
+  return true;
+}
+
+void PrintEnergyProfile(FILE *file, const EnergyProfile& profile) {
+  fprintf(file, "Duration: %.3fs (%" PRIu64 " samples)\n",
+          profile.duration_us / 1e6, profile.sample_count);
+  fprintf(file, "Energy: %.3fJ\n", profile.energy_j);
+  if (profile.baseline_w != 0.0) {
+    fprintf(file, "Baseline power: %.3fW\n", profile.baseline_w);
+    fprintf(file, "Energy above baseline: %.3fJ\n", profile.net_energy_j);
+  }
+
+  fprintf(file, "Average power: %.3fW\n", profile.average_w);
+  fprintf(file, "Peak power: %.3fW\n", profile.peak_w);
+}
+
+}  // namespace pwrusbctl
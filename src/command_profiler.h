@@ -0,0 +1,105 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_COMMAND_PROFILER_H_
+#define PWRUSBCTL_COMMAND_PROFILER_H_
+
+#include <cstdint>
+#include <cstdio>
+
+#include "power_usb_device.h"
+
+namespace pwrusbctl {
+
+/**
+ * The options used when profiling a command.
+ */
+struct ProfileOptions {
+  //! The default time spent measuring the idle baseline.
+  static constexpr uint64_t kDefaultBaselineUs = 2000000;
+
+  //! The interval between samples, or zero to sample as fast as the device
+  //! allows.
+  uint64_t interval_us;
+
+  //! The time spent sampling before the command starts to measure the idle
+  //! power, or zero to report gross energy only.
+  uint64_t baseline_us;
+
+  //! The line voltage used to convert current to power.
+  float line_voltage;
+};
+
+/**
+ * The energy consumed by the whole strip while a command ran.
+ */
+struct EnergyProfile {
+  //! The time from starting the command until it exited.
+  uint64_t duration_us;
+
+  //! The number of samples taken while the command ran.
+  uint64_t sample_count;
+
+  //! The mean power drawn before the command started.
+  double baseline_w;
+
+  //! The energy drawn while the command ran.
+  double energy_j;
+
+  //! The energy drawn while the command ran above the baseline.
+  double net_energy_j;
+
+  //! The mean power drawn while the command ran.
+  double average_w;
+
+  //! The highest power sampled while the command ran.
+  double peak_w;
+
+  //! The status of the command as reported by waitpid.
+  int status;
+};
+
+/**
+ * Runs a command while sampling the current drawn through a device and
+ * integrates the power drawn from just before the command starts until just
+ * after it exits. If requested, the idle power is measured first and
+ * subtracted to obtain the energy attributable to the command.
+ *
+ * Interrupt and quit signals are ignored while the command runs so that they
+ * only reach the command.
+ *
+ * @param device The device to sample.
+ * @param argv The null-terminated arguments of the command, starting with
+ *        the program to run, which is looked up in PATH.
+ * @param options The options for profiling.
+ * @param profile The profile to populate.
+ * @return Returns false if the device fails to respond or the command could
+ *         not be started.
+ */
+bool ProfileCommand(const PowerUsbDevice& device, char *const *argv,
+                    const ProfileOptions& options, EnergyProfile *profile);
+
+/**
+ * Prints an energy profile in a human-readable form.
+ *
+ * @param file The file to print to.
+ * @param profile The profile to print.
+ */
+void PrintEnergyProfile(FILE *file, const EnergyProfile& profile);
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_COMMAND_PROFILER_H_
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cpu_attribution_transform.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The time constant over which old measurements are forgotten by the idle
+//! power fit.
+constexpr double kIdleFitTimeConstantUs(3600.0 * 1e6);
+
+//! The variance of utilization required before the fit is trusted. Below
+//! this the host has not varied its load enough to separate idle power from
+//! the power of the load.
+constexpr double kMinUtilizationVariance(1e-4);
+
+//! The prefix of the region names that attribution is reported under.
+constexpr char kAccountPrefix[] = "cpu.";
+
+constexpr uint64_t CpuAttributionTransform::kDefaultIntervalUs;
+
+/**
+ * Reads the start of a file from its beginning without reopening it. Files
+ * in /proc and cgroupfs regenerate their contents on each read from offset
+ * zero.
+ *
+ * @param fd The file to read.
+ * @param buffer The buffer to read into, null-terminated on success.
+ * @param size The size of the buffer.
+ * @return Returns false if an error occurs.
+ */
+static bool ReadFromStart(int fd, char *buffer, size_t size) {
+  ssize_t length = pread(fd, buffer, size - 1, 0);
+  if (length <= 0) {
+    return false;
+  }
+
+  buffer[length] = '\0';
+  return true;
+}
+
+/**
+ * Populates the name of an account, replacing characters that are not valid
+ * in a region name and truncating it to fit.
+ *
+ * @param name The name without the prefix.
+ * @param account_name The buffer of kMaxRegionNameLength to populate.
+ */
+static void SetAccountName(const std::string& name, char *account_name) {
+  std::string full_name = kAccountPrefix + name;
+  full_name.resize(std::min(full_name.size(), kMaxRegionNameLength - 1));
+  for (char& c : full_name) {
+    bool valid = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+    if (!valid) {
+      c = '_';
+    }
+  }
+
+  strncpy(account_name, full_name.c_str(), kMaxRegionNameLength - 1);
+  account_name[kMaxRegionNameLength - 1] = '\0';
+}
+
+CpuAttributionTransform::CpuAttributionTransform(
+    const std::vector<std::string>& targets, float idle_power_w,
+    uint64_t interval_us)
+    : idle_power_w_(idle_power_w),
+      interval_us_(std::max<uint64_t>(1, interval_us)),
+      tick_us_(1e6 / std::max(1L, sysconf(_SC_CLK_TCK))),
+      cpu_count_(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN))),
+      stat_fd_(open("/proc/stat", O_RDONLY | O_CLOEXEC)),
+      initialized_(stat_fd_ >= 0),
+      has_last_(false),
+      last_(),
+      busy_us_(0),
+      interval_start_us_(0),
+      interval_sample_count_(0),
+      fit_weight_(0.0),
+      fit_u_(0.0),
+      fit_p_(0.0),
+      fit_uu_(0.0),
+      fit_up_(0.0),
+      min_power_w_(0.0f) {
+  // Accounts are reserved up front so that none is reallocated while
+  // attributing.
+  accounts_.reserve(targets.size() + 2);
+  for (const auto& target : targets) {
+    Account account = {};
+    if (!OpenTarget(target, &account)) {
+      fprintf(stderr, "Error opening CPU accounting for %s\n",
+              target.c_str());
+      initialized_ = false;
+    }
+
+    accounts_.push_back(account);
+  }
+
+  for (const char *name : { "idle", "other" }) {
+    Account account = {};
+    SetAccountName(name, account.name);
+    account.fd = -1;
+    accounts_.push_back(account);
+  }
+}
+
+CpuAttributionTransform::~CpuAttributionTransform() {
+  if (stat_fd_ >= 0) {
+    close(stat_fd_);
+  }
+
+  for (const auto& account : accounts_) {
+    if (account.fd >= 0) {
+      close(account.fd);
+    }
+  }
+}
+
+bool CpuAttributionTransform::IsInitialized() const {
+  return initialized_;
+}
+
+void CpuAttributionTransform::Process(const Sample& sample,
+                                      SampleConsumer *output) {
+  output->Consume(sample);
+  if (sample.type != SampleType::Measurement || !sample.has_current
+      || (has_last_ && sample.timestamp_us <= last_.timestamp_us)) {
+    return;
+  }
+
+  uint64_t busy_us;
+  if (!ReadSystemCpu(&busy_us)) {
+    return;
+  }
+
+  size_t target_count = accounts_.size() - 2;
+  for (size_t i = 0; i < target_count; i++) {
+    Account& account = accounts_[i];
+    uint64_t cpu_us = account.cpu_us;
+    if (account.fd >= 0 && !ReadTargetCpu(account, &cpu_us)) {
+      // The process has exited, so it consumes no further CPU time.
+      close(account.fd);
+      account.fd = -1;
+    }
+
+    account.cpu_delta_us = (cpu_us > account.cpu_us)
+        ? cpu_us - account.cpu_us : 0;
+    account.cpu_us = cpu_us;
+  }
+
+  uint64_t busy_delta_us = (busy_us > busy_us_) ? busy_us - busy_us_ : 0;
+  busy_us_ = busy_us;
+  min_power_w_ = has_last_ ? std::min(min_power_w_, sample.power_w)
+      : sample.power_w;
+  if (!has_last_) {
+    // The first measurement establishes the CPU time that later measurements
+    // are compared against.
+    last_ = sample;
+    has_last_ = true;
+    interval_start_us_ = sample.timestamp_us;
+    return;
+  }
+
+  uint64_t duration_us = sample.timestamp_us - last_.timestamp_us;
+  double duration_s = duration_us / 1e6;
+  double power_w = (last_.power_w + sample.power_w) / 2.0;
+  double utilization = std::min(1.0,
+      static_cast<double>(busy_delta_us) / (duration_us * cpu_count_));
+  double idle_w = (idle_power_w_ >= 0.0f) ? idle_power_w_
+      : UpdateIdlePower(utilization, power_w,
+                        std::exp(-static_cast<double>(duration_us)
+                            / kIdleFitTimeConstantUs));
+  idle_w = std::max(0.0, std::min(idle_w, power_w));
+  double dynamic_w = power_w - idle_w;
+
+  double remaining_share = 1.0;
+  for (size_t i = 0; i < accounts_.size(); i++) {
+    Account& account = accounts_[i];
+    double account_w;
+    if (i < target_count) {
+      double share = (busy_delta_us == 0) ? 0.0 : std::min(1.0,
+          static_cast<double>(account.cpu_delta_us) / busy_delta_us);
+      remaining_share -= share;
+      account_w = dynamic_w * share;
+    } else if (i == target_count) {
+      account_w = idle_w;
+    } else {
+      account_w = dynamic_w * std::max(0.0, remaining_share);
+    }
+
+    account.interval_energy_j += account_w * duration_s;
+    account.total_energy_j += account_w * duration_s;
+    account.interval_peak_w = std::max(account.interval_peak_w,
+                                       static_cast<float>(account_w));
+  }
+
+  interval_sample_count_ += sample.sample_count;
+  last_ = sample;
+  if (sample.timestamp_us - interval_start_us_ >= interval_us_) {
+    EmitInterval(sample.timestamp_us, output);
+  }
+}
+
+void CpuAttributionTransform::Finish(SampleConsumer *output) {
+  if (has_last_ && last_.timestamp_us > interval_start_us_) {
+    EmitInterval(last_.timestamp_us, output);
+  }
+}
+
+void CpuAttributionTransform::PrintStats(FILE *file) const {
+  for (const auto& account : accounts_) {
+    fprintf(file, "Attributed to %s: %fJ\n", account.name,
+            account.total_energy_j);
+  }
+}
+
+bool CpuAttributionTransform::OpenTarget(const std::string& target,
+                                         Account *account) {
+  size_t separator = target.find('=');
+  std::string path = (separator == std::string::npos)
+      ? target : target.substr(separator + 1);
+  while (path.size() > 1 && path.back() == '/') {
+    path.pop_back();
+  }
+
+  bool is_pid = !path.empty()
+      && path.find_first_not_of("0123456789") == std::string::npos;
+  std::string name;
+  if (separator != std::string::npos) {
+    name = target.substr(0, separator);
+  } else if (is_pid) {
+    name = "pid." + path;
+  } else {
+    name = path.substr(path.find_last_of('/') + 1);
+  }
+
+  SetAccountName(name, account->name);
+  account->is_cgroup = !is_pid;
+  account->fd = open(is_pid ? ("/proc/" + path + "/stat").c_str()
+                     : (path + "/cpu.stat").c_str(), O_RDONLY | O_CLOEXEC);
+  return account->fd >= 0 && ReadTargetCpu(*account, &account->cpu_us);
+}
+
+bool CpuAttributionTransform::ReadSystemCpu(uint64_t *busy_us) const {
+  // Only the aggregate line at the start of the file is needed.
+  char buffer[256];
+  uint64_t user, nice, system, idle, iowait, irq, softirq, steal;
+  if (!ReadFromStart(stat_fd_, buffer, sizeof(buffer))
+      || sscanf(buffer, "cpu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+                " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64, &user, &nice,
+                &system, &idle, &iowait, &irq, &softirq, &steal) != 8) {
+    return false;
+  }
+
+  *busy_us = (user + nice + system + irq + softirq + steal) * tick_us_;
+  return true;
+}
+
+bool CpuAttributionTransform::ReadTargetCpu(const Account& account,
+                                            uint64_t *cpu_us) const {
+  char buffer[1024];
+  if (!ReadFromStart(account.fd, buffer, sizeof(buffer))) {
+    return false;
+  }
+
+  if (account.is_cgroup) {
+    return sscanf(buffer, "usage_usec %" SCNu64, cpu_us) == 1;
+  }
+
+  // The command name may contain spaces and parentheses, so fields are
+  // counted from the last parenthesis. The time of reaped children is
+  // included so that short-lived workers are attributed to their parent.
+  const char *fields = strrchr(buffer, ')');
+  uint64_t utime, stime;
+  int64_t cutime, cstime;
+  if (fields == nullptr
+      || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                "%" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64, &utime, &stime,
+                &cutime, &cstime) != 4) {
+    return false;
+  }
+
+  *cpu_us = (utime + stime + std::max<int64_t>(0, cutime + cstime))
+      * tick_us_;
+  return true;
+}
+
+float CpuAttributionTransform::UpdateIdlePower(double utilization,
+                                               double power_w, double weight) {
+  fit_weight_ = fit_weight_ * weight + 1.0;
+  fit_u_ = fit_u_ * weight + utilization;
+  fit_p_ = fit_p_ * weight + power_w;
+  fit_uu_ = fit_uu_ * weight + utilization * utilization;
+  fit_up_ = fit_up_ * weight + utilization * power_w;
+
+  double mean_u = fit_u_ / fit_weight_;
+  double mean_p = fit_p_ / fit_weight_;
+  double variance = fit_uu_ / fit_weight_ - mean_u * mean_u;
+  if (variance < kMinUtilizationVariance) {
+    return min_power_w_;
+  }
+
+  // Power falling with load is not physical and means that something other
+  // than the CPU dominates, so the fit is not used.
+  double slope = (fit_up_ / fit_weight_ - mean_u * mean_p) / variance;
+  if (slope < 0.0) {
+    return min_power_w_;
+  }
+
+  return mean_p - slope * mean_u;
+}
+
+void CpuAttributionTransform::EmitInterval(uint64_t end_us,
+                                           SampleConsumer *output) {
+  for (auto& account : accounts_) {
+    Sample summary = {};
+    memcpy(summary.device_id, last_.device_id, sizeof(summary.device_id));
+    memcpy(summary.region, account.name, sizeof(summary.region));
+    summary.type = SampleType::Region;
+    summary.timestamp_us = interval_start_us_;
+    summary.sample_count = interval_sample_count_;
+    summary.region_duration_us = end_us - interval_start_us_;
+    summary.region_energy_j = account.interval_energy_j;
+    summary.region_peak_w = account.interval_peak_w;
+    output->Consume(summary);
+
+    account.interval_energy_j = 0.0;
+    account.interval_peak_w = 0.0f;
+  }
+
+  interval_start_us_ = end_us;
+  interval_sample_count_ = 0;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_CPU_ATTRIBUTION_TRANSFORM_H_
+#define PWRUSBCTL_CPU_ATTRIBUTION_TRANSFORM_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "pipeline.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that apportions the power drawn by a host to processes and
+ * cgroups by the CPU time that each consumed. It is intended for a strip that
+ * powers a single host and must run on that host.
+ *
+ * On each measurement the CPU time of the system and of every target is read
+ * from /proc and cgroupfs, so the split follows the same ticks as the
+ * current. Power above the idle power is divided between the targets in
+ * proportion to their share of the busy CPU time, and the remainder is
+ * attributed to other. The idle power is either given or estimated from an
+ * exponentially weighted least-squares fit of power against CPU utilization
+ * that is updated on every measurement.
+ *
+ * Every interval a Region sample is emitted for each target, named with a
+ * "cpu." prefix, along with "cpu.idle" and "cpu.other". Overlapping targets,
+ * such as a cgroup and a process within it, are each attributed their full
+ * share. Measurements and other samples pass through unchanged.
+ */
+class CpuAttributionTransform : public Transform {
+ public:
+  //! The default interval between attribution summaries.
+  static constexpr uint64_t kDefaultIntervalUs = 60000000;
+
+  /**
+   * Constructs a CpuAttributionTransform. The return value of IsInitialized()
+   * must be checked before it is used.
+   *
+   * @param targets The processes and cgroups to attribute power to. Each is a
+   *        PID or the path of a cgroup v2 directory, optionally preceded by
+   *        "<name>=" to name it in the output.
+   * @param idle_power_w The idle power of the host, or a negative value to
+   *        estimate it.
+   * @param interval_us The interval between attribution summaries.
+   */
+  CpuAttributionTransform(const std::vector<std::string>& targets,
+                          float idle_power_w,
+                          uint64_t interval_us = kDefaultIntervalUs);
+
+  /**
+   * Closes the files that CPU time is read from.
+   */
+  ~CpuAttributionTransform();
+
+  /**
+   * @return Returns true if the system CPU time and every target could be
+   *         opened.
+   */
+  bool IsInitialized() const;
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+
+  /**
+   * Emits the summaries of the partial interval.
+   */
+  void Finish(SampleConsumer *output) override;
+
+  /**
+   * Prints the energy attributed to each target since the transform was
+   * created.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  /**
+   * A recipient of attributed energy, either a target or the idle and other
+   * remainders.
+   */
+  struct Account {
+    //! The region name used in summaries.
+    char name[kMaxRegionNameLength];
+
+    //! The file that CPU time is read from, -1 for the remainders or once a
+    //! process has exited.
+    int fd;
+
+    //! Whether the file is a cgroup cpu.stat rather than /proc/<pid>/stat.
+    bool is_cgroup;
+
+    //! The CPU time consumed as of the last measurement.
+    uint64_t cpu_us;
+
+    //! The CPU time consumed since the last measurement.
+    uint64_t cpu_delta_us;
+
+    //! The energy and peak power attributed over the current interval.
+    double interval_energy_j;
+    float interval_peak_w;
+
+    //! The energy attributed since the transform was created.
+    double total_energy_j;
+  };
+
+  //! The idle power of the host, negative if it is estimated.
+  const float idle_power_w_;
+
+  //! The interval between summaries.
+  const uint64_t interval_us_;
+
+  //! The number of microseconds in a clock tick of /proc.
+  const double tick_us_;
+
+  //! The number of online CPUs.
+  const unsigned int cpu_count_;
+
+  //! The file that system CPU time is read from.
+  int stat_fd_;
+
+  //! Whether or not every file could be opened.
+  bool initialized_;
+
+  //! The targets followed by the idle and other remainders.
+  std::vector<Account> accounts_;
+
+  //! Whether or not a measurement has been seen, and the last measurement.
+  bool has_last_;
+  Sample last_;
+
+  //! The busy CPU time of the system as of the last measurement.
+  uint64_t busy_us_;
+
+  //! The start of the current interval.
+  uint64_t interval_start_us_;
+
+  //! The number of measurements in the current interval.
+  uint32_t interval_sample_count_;
+
+  //! The weighted sums of the least-squares fit of power against
+  //! utilization.
+  double fit_weight_;
+  double fit_u_;
+  double fit_p_;
+  double fit_uu_;
+  double fit_up_;
+
+  //! The lowest power seen, used as the idle power until utilization has
+  //! varied enough to fit.
+  float min_power_w_;
+
+  /**
+   * Opens the file that a target's CPU time is read from.
+   *
+   * @param target The PID or cgroup path, optionally named.
+   * @param account The account to populate.
+   * @return Returns false if the target cannot be opened.
+   */
+  bool OpenTarget(const std::string& target, Account *account);
+
+  /**
+   * Reads the busy CPU time of the system.
+   *
+   * @param busy_us The busy time to populate.
+   * @return Returns false if an error occurs.
+   */
+  bool ReadSystemCpu(uint64_t *busy_us) const;
+
+  /**
+   * Reads the CPU time consumed by a target.
+   *
+   * @param account The target to read.
+   * @param cpu_us The CPU time to populate.
+   * @return Returns false if the target could not be read, such as when a
+   *         process has exited.
+   */
+  bool ReadTargetCpu(const Account& account, uint64_t *cpu_us) const;
+
+  /**
+   * Updates the idle power estimate with a measurement.
+   *
+   * @param utilization The CPU utilization between 0 and 1.
+   * @param power_w The average power over the measurement.
+   * @param weight The weight given to history relative to this measurement.
+   * @return The estimated idle power.
+   */
+  float UpdateIdlePower(double utilization, double power_w, double weight);
+
+  /**
+   * Emits a summary of every account for the current interval and starts the
+   * next.
+   *
+   * @param end_us The end of the interval.
+   * @param output The next stage of the pipeline.
+   */
+  void EmitInterval(uint64_t end_us, SampleConsumer *output);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_CPU_ATTRIBUTION_TRANSFORM_H_
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "decimating_transform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace pwrusbctl {
+
+DecimatingTransform::DecimatingTransform(uint64_t interval_us,
+                                         float cutoff_hz)
+    : interval_us_(std::max<uint64_t>(1, interval_us)),
+      cutoff_hz_(cutoff_hz),
+      has_aggregate_(false),
+      aggregate_(),
+      current_sum_ma_(0.0),
+      power_sum_w_(0.0),
+      current_count_(0),
+      filter_primed_(false),
+      filtered_current_ma_(0.0f),
+      filtered_power_w_(0.0f),
+      last_timestamp_us_(0) {}
+
+void DecimatingTransform::Process(const Sample& sample,
+                                  SampleConsumer *output) {
+  // Events are not aggregated.
+  if (sample.type != SampleType::Measurement) {
+    output->Consume(sample);
+    return;
+  }
+
+  uint64_t window_us = sample.timestamp_us - sample.timestamp_us % interval_us_;
+  if (has_aggregate_ && (window_us != aggregate_.timestamp_us
+      || strcmp(sample.device_id, aggregate_.device_id) != 0)) {
+    Emit(output);
+  }
+
+  if (!has_aggregate_) {
+    aggregate_ = Sample();
+    memcpy(aggregate_.device_id, sample.device_id, sizeof(sample.device_id));
+    aggregate_.timestamp_us = window_us;
+    aggregate_.lateness_us = sample.lateness_us;
+    current_sum_ma_ = 0.0;
+    power_sum_w_ = 0.0;
+    current_count_ = 0;
+    has_aggregate_ = true;
+  }
+
+  // The worst lateness in the interval is the most useful measure of jitter.
+  aggregate_.lateness_us = std::max(aggregate_.lateness_us,
+                                    sample.lateness_us);
+  aggregate_.sample_count += std::max<uint32_t>(1, sample.sample_count);
+
+  if (sample.has_energy) {
+    aggregate_.has_energy = true;
+    aggregate_.energy_kwh = sample.energy_kwh;
+  }
+
+  if (!sample.has_current) {
+    return;
+  }
+
+  float current_ma = sample.current_ma;
+  float power_w = sample.power_w;
+  if (cutoff_hz_ > 0.0f) {
+    if (!filter_primed_) {
+      filtered_current_ma_ = current_ma;
+      filtered_power_w_ = power_w;
+      filter_primed_ = true;
+    } else {
+      // The coefficient is derived from the actual spacing of samples so
+      // that jitter in the sampling loop does not shift the cutoff.
+      double dt_s = (sample.timestamp_us - last_timestamp_us_) / 1e6;
+      float alpha = static_cast<float>(1.0 - exp(-2.0 * M_PI * cutoff_hz_
+                                                 * dt_s));
+      filtered_current_ma_ += alpha * (current_ma - filtered_current_ma_);
+      filtered_power_w_ += alpha * (power_w - filtered_power_w_);
+    }
+
+    last_timestamp_us_ = sample.timestamp_us;
+    current_ma = filtered_current_ma_;
+    power_w = filtered_power_w_;
+  }
+
+  int32_t rounded_current_ma = static_cast<int32_t>(lroundf(current_ma));
+  if (!aggregate_.has_current) {
+    aggregate_.has_current = true;
+    aggregate_.current_min_ma = rounded_current_ma;
+    aggregate_.current_max_ma = rounded_current_ma;
+    aggregate_.power_min_w = power_w;
+    aggregate_.power_max_w = power_w;
+  } else {
+    aggregate_.current_min_ma = std::min(aggregate_.current_min_ma,
+                                         rounded_current_ma);
+    aggregate_.current_max_ma = std::max(aggregate_.current_max_ma,
+                                         rounded_current_ma);
+    aggregate_.power_min_w = std::min(aggregate_.power_min_w, power_w);
+    aggregate_.power_max_w = std::max(aggregate_.power_max_w, power_w);
+  }
+
+  current_sum_ma_ += current_ma;
+  power_sum_w_ += power_w;
+  current_count_++;
+}
+
+void DecimatingTransform::Finish(SampleConsumer *output) {
+  if (has_aggregate_) {
+    Emit(output);
+  }
+}
+
+void DecimatingTransform::Emit(SampleConsumer *output) {
+  if (current_count_ > 0) {
+    aggregate_.current_ma = static_cast<int32_t>(
+        lround(current_sum_ma_ / current_count_));
+    aggregate_.power_w = static_cast<float>(power_sum_w_ / current_count_);
+  }
+
+  output->Consume(aggregate_);
+  has_aggregate_ = false;
+}
+
+}  // namespace pwrusbctl
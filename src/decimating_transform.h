@@ -0,0 +1,93 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_DECIMATING_TRANSFORM_H_
+#define PWRUSBCTL_DECIMATING_TRANSFORM_H_
+
+#include <cstdint>
+
+#include "pipeline.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that reduces a high-rate stream of samples to one sample per
+ * output interval. Each output sample carries the average of current and
+ * power over its interval in current_ma and power_w along with their minimum
+ * and maximum, so short peaks remain visible at a fraction of the output
+ * volume. Intervals are aligned to multiples of the interval on the sample
+ * clock and are timestamped with their start.
+ *
+ * An optional first-order low-pass filter may be applied to the raw samples
+ * before they are aggregated. This suppresses content above the cutoff that
+ * would otherwise alias into the minimum and maximum.
+ */
+class DecimatingTransform : public Transform {
+ public:
+  /**
+   * Constructs a DecimatingTransform.
+   *
+   * @param interval_us The output interval in microseconds.
+   * @param cutoff_hz The cutoff frequency of the anti-aliasing filter, or
+   *        zero to aggregate raw samples unfiltered.
+   */
+  DecimatingTransform(uint64_t interval_us, float cutoff_hz);
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+  void Finish(SampleConsumer *output) override;
+
+ private:
+  //! The output interval in microseconds.
+  const uint64_t interval_us_;
+
+  //! The cutoff frequency of the anti-aliasing filter, zero if disabled.
+  const float cutoff_hz_;
+
+  //! Whether or not aggregate_ holds samples.
+  bool has_aggregate_;
+
+  //! The output sample being accumulated for the current interval.
+  Sample aggregate_;
+
+  //! The sum of current and power over the current interval.
+  double current_sum_ma_;
+  double power_sum_w_;
+
+  //! The number of samples with current in the current interval.
+  uint32_t current_count_;
+
+  //! Whether or not the filter state below has been initialized.
+  bool filter_primed_;
+
+  //! The filtered current and power as of the previous sample.
+  float filtered_current_ma_;
+  float filtered_power_w_;
+
+  //! The timestamp of the previous sample with current, used to compute the
+  //! filter coefficient.
+  uint64_t last_timestamp_us_;
+
+  /**
+   * Passes the aggregate for the current interval to output.
+   *
+   * @param output The next stage of the pipeline.
+   */
+  void Emit(SampleConsumer *output);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_DECIMATING_TRANSFORM_H_
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "device_bring_up.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <thread>
+
+namespace pwrusbctl {
+
+constexpr size_t DeviceBringUp::kDefaultParallelism;
+
+DeviceBringUp::DeviceBringUp(const std::vector<std::string>& paths,
+                             size_t parallelism, const Clock& clock)
+    : parallelism_(std::max<size_t>(parallelism, 1)),
+      clock_(clock),
+      start_us_(0),
+      records_(paths.size()),
+      devices_(paths.size()) {
+  for (size_t i = 0; i < paths.size(); i++) {
+    BringUpRecord& record = records_[i];
+    record.path = paths[i];
+    record.device_id[0] = '\0';
+    record.ready = false;
+    record.queued_us = 0;
+    record.open_us = 0;
+    record.probe_us = 0;
+    record.ready_us = 0;
+  }
+}
+
+void DeviceBringUp::Run(const Probe& probe, const ReadyCallback& ready) {
+  // Workers take the next device in order until none remain, so a slow
+  // device only delays the devices queued behind it on the same worker.
+  start_us_ = clock_.GetMonotonicTimeUs();
+  std::atomic<size_t> next_index(0);
+  auto worker = [&]() {
+    for (size_t index = next_index++; index < records_.size();
+         index = next_index++) {
+      BringUp(index, probe, ready);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  size_t thread_count = std::min(parallelism_, records_.size());
+  for (size_t i = 1; i < thread_count; i++) {
+    threads.emplace_back(worker);
+  }
+
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+const PowerUsbDevice *DeviceBringUp::FindDevice(
+    const std::string& device_id) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = ready_devices_.find(device_id);
+  return (it == ready_devices_.end()) ? nullptr : it->second;
+}
+
+const BringUpRecord& DeviceBringUp::GetRecord(size_t index) const {
+  assert(index < records_.size());
+  return records_[index];
+}
+
+size_t DeviceBringUp::GetDeviceCount() const {
+  return records_.size();
+}
+
+uint64_t DeviceBringUp::GetStartTimeUs() const {
+  return start_us_;
+}
+
+void DeviceBringUp::BringUp(size_t index, const Probe& probe,
+                            const ReadyCallback& ready) {
+  BringUpRecord& record = records_[index];
+  uint64_t open_start_us = clock_.GetMonotonicTimeUs();
+  record.queued_us = open_start_us - start_us_;
+
+  std::unique_ptr<PowerUsbDevice> device(new PowerUsbDevice(record.path));
+  uint64_t probe_start_us = clock_.GetMonotonicTimeUs();
+  record.open_us = probe_start_us - open_start_us;
+  if (!device->IsInitialized()) {
+    fprintf(stderr, "Error opening the Power USB device at %s\n",
+            record.path.c_str());
+    return;
+  }
+
+  if (!device->GetSerialNumber(record.device_id, sizeof(record.device_id))
+      || record.device_id[0] == '\0') {
+    fprintf(stderr, "Error reading the serial number of %s\n",
+            record.path.c_str());
+    return;
+  }
+
+  bool probed = probe(*device);
+  uint64_t ready_us = clock_.GetMonotonicTimeUs();
+  record.probe_us = ready_us - probe_start_us;
+  if (!probed) {
+    fprintf(stderr, "Error probing the Power USB device %s\n",
+            record.device_id);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!ready_devices_.emplace(record.device_id, device.get()).second) {
+    fprintf(stderr, "Error: more than one device has serial number %s\n",
+            record.device_id);
+    return;
+  }
+
+  record.ready = true;
+  record.ready_us = ready_us - start_us_;
+  devices_[index] = std::move(device);
+  ready(index, *devices_[index]);
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_DEVICE_BRING_UP_H_
+#define PWRUSBCTL_DEVICE_BRING_UP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "power_usb_device.h"
+#include "sample.h"
+#include "util/clock.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * The progress of bringing up one device.
+ */
+struct BringUpRecord {
+  //! The path that the device was opened from.
+  std::string path;
+
+  //! The identifier of the device, empty if it could not be opened.
+  char device_id[kMaxDeviceIdLength];
+
+  //! Whether or not the device was opened and probed successfully.
+  bool ready;
+
+  //! The time spent waiting for a worker, opening the device and probing it.
+  uint64_t queued_us;
+  uint64_t open_us;
+  uint64_t probe_us;
+
+  //! The time from the start of bring-up until the device was ready.
+  uint64_t ready_us;
+};
+
+/**
+ * Opens and probes a number of devices concurrently so that a host with many
+ * strips starts sampling each of them as soon as it is ready rather than
+ * after every strip ahead of it.
+ *
+ * Each device is opened by path and probed by a caller-supplied function,
+ * which typically reads the device type and applies any configuration. The
+ * number of devices brought up at once is bounded, since the USB host
+ * controller serializes transfers and too many concurrent opens only queue.
+ * Devices that fail are recorded and skipped. Devices remain open for the
+ * lifetime of this object.
+ */
+class DeviceBringUp : public NonCopyable {
+ public:
+  //! The default number of devices brought up at once.
+  static constexpr size_t kDefaultParallelism = 8;
+
+  /**
+   * Probes a newly opened device.
+   *
+   * @param device The device to probe.
+   * @return Returns false if the device is unusable.
+   */
+  typedef std::function<bool(const PowerUsbDevice& device)> Probe;
+
+  /**
+   * Receives a device once it is ready. Invoked on the worker thread that
+   * brought up the device, one device at a time.
+   *
+   * @param index The index of the device in the paths given.
+   * @param device The device, which remains valid for the lifetime of the
+   *        DeviceBringUp.
+   */
+  typedef std::function<void(size_t index, const PowerUsbDevice& device)>
+      ReadyCallback;
+
+  /**
+   * Constructs a DeviceBringUp.
+   *
+   * @param paths The paths of the devices to open.
+   * @param parallelism The maximum number of devices brought up at once.
+   * @param clock The clock used to time each device. Must outlive this
+   *        object.
+   */
+  DeviceBringUp(const std::vector<std::string>& paths,
+                size_t parallelism = kDefaultParallelism,
+                const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Brings up every device, returning once each is ready or has failed.
+   * Must be invoked at most once.
+   *
+   * @param probe The function that probes each device.
+   * @param ready The function invoked as each device becomes ready.
+   */
+  void Run(const Probe& probe, const ReadyCallback& ready);
+
+  /**
+   * Finds a ready device by identifier. May be invoked from any thread.
+   *
+   * @param device_id The identifier of the device.
+   * @return The device, or nullptr if no such device is ready.
+   */
+  const PowerUsbDevice *FindDevice(const std::string& device_id) const;
+
+  /**
+   * Obtains the progress of a device. Must not be invoked while Run() is
+   * bringing up devices.
+   *
+   * @param index The index of the device in the paths given.
+   * @return The progress of the device.
+   */
+  const BringUpRecord& GetRecord(size_t index) const;
+
+  /**
+   * @return Returns the number of devices being brought up.
+   */
+  size_t GetDeviceCount() const;
+
+  /**
+   * @return Returns the time at which Run() started bringing up devices.
+   */
+  uint64_t GetStartTimeUs() const;
+
+ private:
+  //! The maximum number of devices brought up at once.
+  const size_t parallelism_;
+
+  //! The clock used to time each device.
+  const Clock& clock_;
+
+  //! The time at which Run() started.
+  uint64_t start_us_;
+
+  //! The progress and the device for each path, each written only by the
+  //! worker that brings it up.
+  std::vector<BringUpRecord> records_;
+  std::vector<std::unique_ptr<PowerUsbDevice>> devices_;
+
+  //! Guards ready_devices_ and serializes the ready callback.
+  mutable std::mutex mutex_;
+
+  //! The devices that are ready keyed by identifier.
+  std::map<std::string, const PowerUsbDevice *> ready_devices_;
+
+  /**
+   * Opens and probes a single device.
+   *
+   * @param index The index of the device.
+   * @param probe The function that probes the device.
+   * @param ready The function invoked if the device becomes ready.
+   */
+  void BringUp(size_t index, const Probe& probe, const ReadyCallback& ready);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_DEVICE_BRING_UP_H_
@@ -0,0 +1,362 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hang_watchdog_transform.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+
+namespace pwrusbctl {
+
+//! The number of windows that must be learned before hangs are detected.
+constexpr uint64_t kMinBaselineCount(30);
+
+//! The number of windows that the baseline is averaged over once learned.
+constexpr double kBaselineWindowCount(360.0);
+
+//! The fraction of the learned standard deviation below which a window is a
+//! flatline or a high draw is considered stuck.
+constexpr double kFlatlineRatio(0.1);
+constexpr double kStuckRatio(0.5);
+
+//! The number of learned deviations above the learned mean at which a draw
+//! is considered high.
+constexpr double kStuckHighDeviations(4.0);
+
+//! The smallest learned standard deviation that a flatline can be detected
+//! against. Quieter hosts are indistinguishable from a flatline.
+constexpr double kMinBaselineStddevMa(2.0);
+
+//! The kinds of hang, as reported.
+constexpr char kFlatlineReason[] = "flatline";
+constexpr char kStuckHighReason[] = "stuck high";
+
+//! The time after a switch within which the change must be observed.
+constexpr uint64_t kVerifyTimeoutUs(5000000);
+
+//! The number of consecutive samples that must show a change to verify it,
+//! so that a single noisy sample does not.
+constexpr size_t kVerifySampleCount(3);
+
+constexpr uint64_t HangWatchdogTransform::kDefaultSustainUs;
+constexpr uint64_t HangWatchdogTransform::kDefaultOffTimeUs;
+constexpr float HangWatchdogTransform::kDefaultMinStepMa;
+constexpr uint64_t HangWatchdogTransform::kDefaultWindowUs;
+constexpr uint64_t HangWatchdogTransform::kDefaultHoldoffUs;
+
+HangWatchdogTransform::HangWatchdogTransform(const PowerUsbDevice& device,
+                                             size_t outlet,
+                                             uint64_t sustain_us,
+                                             uint64_t off_time_us,
+                                             float min_step_ma,
+                                             uint64_t window_us,
+                                             uint64_t holdoff_us)
+    : device_(device),
+      outlet_(outlet),
+      sustain_us_(sustain_us),
+      off_time_us_(off_time_us),
+      min_step_ma_(min_step_ma),
+      window_us_(std::max<uint64_t>(1, window_us)),
+      holdoff_us_(holdoff_us),
+      state_(State::Monitoring),
+      state_deadline_us_(0),
+      window_started_(false),
+      window_start_us_(0),
+      window_count_(0),
+      window_sum_ma_(0.0),
+      window_sum_squares_ma_(0.0),
+      baseline_count_(0),
+      baseline_mean_ma_(0.0),
+      baseline_mean_variance_(0.0),
+      baseline_stddev_ma_(0.0),
+      hang_start_us_(0),
+      hang_reason_(nullptr),
+      level_before_ma_(0.0f),
+      level_off_ma_(0.0f),
+      confirm_count_(0),
+      cycle_start_us_(0),
+      flatline_count_(0),
+      stuck_high_count_(0),
+      verified_count_(0),
+      failed_count_(0),
+      last_recovery_us_(0),
+      command_pending_(false),
+      command_state_(SocketState::On),
+      command_status_(CommandStatus::Succeeded),
+      stop_(false) {
+  worker_thread_ = std::thread(&HangWatchdogTransform::WorkerLoop, this);
+}
+
+HangWatchdogTransform::~HangWatchdogTransform() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+
+  condition_.notify_all();
+  worker_thread_.join();
+}
+
+void HangWatchdogTransform::Process(const Sample& sample,
+                                    SampleConsumer *output) {
+  output->Consume(sample);
+  if (sample.type != SampleType::Measurement || !sample.has_current) {
+    return;
+  }
+
+  if (state_ == State::Monitoring) {
+    Monitor(sample);
+  } else if (state_ == State::Holdoff) {
+    if (sample.timestamp_us >= state_deadline_us_) {
+      state_ = State::Monitoring;
+      window_started_ = false;
+    }
+  } else {
+    Recover(sample);
+  }
+}
+
+void HangWatchdogTransform::Finish(SampleConsumer *output) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [this]() { return !command_pending_; });
+  }
+
+  // The host must not be left without power when logging stops.
+  if (state_ == State::WaitingForOff || state_ == State::Off) {
+    fprintf(stderr, "Watchdog: switching outlet %zu back on before exit\n",
+            outlet_);
+    if (!device_.SetSocketState(outlet_, SocketState::On)) {
+      fprintf(stderr, "Watchdog: error switching outlet %zu on\n", outlet_);
+    }
+  }
+}
+
+void HangWatchdogTransform::PrintStats(FILE *file) const {
+  fprintf(file, "Watchdog: outlet %zu, baseline %.1fmA +/- %.1fmA over %"
+          PRIu64 " windows, %" PRIu64 " flatlines, %" PRIu64
+          " stuck high, %" PRIu64 " cycles verified, %" PRIu64 " failed",
+          outlet_, baseline_mean_ma_, baseline_stddev_ma_, baseline_count_,
+          flatline_count_, stuck_high_count_, verified_count_,
+          failed_count_);
+  if (verified_count_ > 0) {
+    fprintf(file, ", last recovery %.1fs",
+            static_cast<double>(last_recovery_us_) / 1000000.0);
+  }
+
+  fprintf(file, "\n");
+}
+
+void HangWatchdogTransform::Monitor(const Sample& sample) {
+  if (!window_started_) {
+    window_started_ = true;
+    window_start_us_ = sample.timestamp_us;
+    window_count_ = 0;
+    window_sum_ma_ = 0.0;
+    window_sum_squares_ma_ = 0.0;
+  } else if (sample.timestamp_us - window_start_us_ >= window_us_) {
+    EvaluateWindow(sample.timestamp_us);
+    if (state_ != State::Monitoring) {
+      return;
+    }
+
+    window_start_us_ = sample.timestamp_us;
+    window_count_ = 0;
+    window_sum_ma_ = 0.0;
+    window_sum_squares_ma_ = 0.0;
+  }
+
+  window_count_++;
+  window_sum_ma_ += sample.current_ma;
+  window_sum_squares_ma_ += static_cast<double>(sample.current_ma)
+      * sample.current_ma;
+}
+
+void HangWatchdogTransform::EvaluateWindow(uint64_t end_us) {
+  if (window_count_ < 2) {
+    return;
+  }
+
+  double mean_ma = window_sum_ma_ / window_count_;
+  double stddev_ma = std::sqrt(std::max(0.0,
+      window_sum_squares_ma_ / window_count_ - mean_ma * mean_ma));
+
+  // A host that looks hung is judged against what was learned before it
+  // hung, so those windows are not learned from.
+  const char *reason = nullptr;
+  if (baseline_count_ >= kMinBaselineCount) {
+    double spread_ma = std::max(std::sqrt(baseline_mean_variance_),
+                                baseline_stddev_ma_);
+    if (mean_ma > baseline_mean_ma_ + kStuckHighDeviations * spread_ma
+        && stddev_ma < kStuckRatio * baseline_stddev_ma_) {
+      reason = kStuckHighReason;
+    } else if (baseline_stddev_ma_ >= kMinBaselineStddevMa
+               && stddev_ma < kFlatlineRatio * baseline_stddev_ma_
+               && mean_ma >= min_step_ma_) {
+      reason = kFlatlineReason;
+    }
+  }
+
+  if (reason == nullptr) {
+    hang_reason_ = nullptr;
+    baseline_count_++;
+    double alpha = std::max(1.0 / baseline_count_,
+                            1.0 / kBaselineWindowCount);
+    double delta_ma = mean_ma - baseline_mean_ma_;
+    baseline_mean_ma_ += alpha * delta_ma;
+    baseline_mean_variance_ = (1.0 - alpha)
+        * (baseline_mean_variance_ + alpha * delta_ma * delta_ma);
+    baseline_stddev_ma_ += alpha * (stddev_ma - baseline_stddev_ma_);
+    return;
+  }
+
+  if (hang_reason_ != reason) {
+    hang_reason_ = reason;
+    hang_start_us_ = window_start_us_;
+  }
+
+  if (end_us - hang_start_us_ < sustain_us_) {
+    return;
+  }
+
+  if (reason == kFlatlineReason) {
+    flatline_count_++;
+  } else {
+    stuck_high_count_++;
+  }
+
+  fprintf(stderr, "Watchdog: %s at %.1fmA for %.0fs on outlet %zu, power "
+          "cycling\n", reason, mean_ma,
+          static_cast<double>(end_us - hang_start_us_) / 1000000.0, outlet_);
+  hang_reason_ = nullptr;
+  level_before_ma_ = mean_ma;
+  cycle_start_us_ = end_us;
+  confirm_count_ = 0;
+  state_ = State::WaitingForOff;
+  state_deadline_us_ = end_us + kVerifyTimeoutUs;
+  RequestSwitch(SocketState::Off);
+}
+
+void HangWatchdogTransform::Recover(const Sample& sample) {
+  uint64_t now_us = sample.timestamp_us;
+  CommandStatus status = command_status_;
+  if (status == CommandStatus::Failed) {
+    fprintf(stderr, "Watchdog: error switching outlet %zu\n", outlet_);
+    failed_count_++;
+    EnterHoldoff(now_us);
+    return;
+  }
+
+  // Samples taken before the command was written cannot verify it, and the
+  // deadline only runs once it has been.
+  if (status == CommandStatus::Pending) {
+    state_deadline_us_ = now_us + kVerifyTimeoutUs;
+    return;
+  }
+
+  switch (state_) {
+    case State::WaitingForOff:
+      if (Confirm(sample.current_ma <= level_before_ma_ - min_step_ma_)) {
+        state_ = State::Off;
+        state_deadline_us_ = now_us + off_time_us_;
+        level_off_ma_ = sample.current_ma;
+      } else if (now_us >= state_deadline_us_) {
+        // The outlet is switched on regardless so that the host is not left
+        // in an unknown state.
+        fprintf(stderr, "Watchdog: no drop in current after switching "
+                "outlet %zu off\n", outlet_);
+        failed_count_++;
+        RequestSwitch(SocketState::On);
+        EnterHoldoff(now_us);
+      }
+      break;
+    case State::Off:
+      level_off_ma_ = std::max(level_off_ma_,
+                               static_cast<float>(sample.current_ma));
+      if (now_us >= state_deadline_us_) {
+        confirm_count_ = 0;
+        state_ = State::WaitingForOn;
+        state_deadline_us_ = now_us + kVerifyTimeoutUs;
+        RequestSwitch(SocketState::On);
+      }
+      break;
+    case State::WaitingForOn:
+      if (Confirm(sample.current_ma >= level_off_ma_ + min_step_ma_)) {
+        last_recovery_us_ = now_us - cycle_start_us_;
+        verified_count_++;
+        fprintf(stderr, "Watchdog: power cycle of outlet %zu verified in "
+                "%.1fs\n", outlet_,
+                static_cast<double>(last_recovery_us_) / 1000000.0);
+        EnterHoldoff(now_us);
+      } else if (now_us >= state_deadline_us_) {
+        fprintf(stderr, "Watchdog: no rise in current after switching "
+                "outlet %zu on\n", outlet_);
+        failed_count_++;
+        EnterHoldoff(now_us);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+bool HangWatchdogTransform::Confirm(bool satisfied) {
+  confirm_count_ = satisfied ? confirm_count_ + 1 : 0;
+  return confirm_count_ >= kVerifySampleCount;
+}
+
+void HangWatchdogTransform::EnterHoldoff(uint64_t now_us) {
+  state_ = State::Holdoff;
+  state_deadline_us_ = now_us + holdoff_us_;
+  hang_reason_ = nullptr;
+}
+
+void HangWatchdogTransform::RequestSwitch(SocketState state) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    command_pending_ = true;
+    command_state_ = state;
+    command_status_ = CommandStatus::Pending;
+  }
+
+  condition_.notify_all();
+}
+
+void HangWatchdogTransform::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    condition_.wait(lock, [this]() { return stop_ || command_pending_; });
+    if (!command_pending_) {
+      return;
+    }
+
+    SocketState state = command_state_;
+    lock.unlock();
+    bool success = device_.SetSocketState(outlet_, state);
+    lock.lock();
+
+    // A newer command may have been requested while this one was written.
+    if (command_state_ == state) {
+      command_pending_ = false;
+      command_status_ = success
+          ? CommandStatus::Succeeded : CommandStatus::Failed;
+      condition_.notify_all();
+    }
+  }
+}
+
+}  // namespace pwrusbctl
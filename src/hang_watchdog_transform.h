@@ -0,0 +1,265 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_HANG_WATCHDOG_TRANSFORM_H_
+#define PWRUSBCTL_HANG_WATCHDOG_TRANSFORM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+#include "pipeline.h"
+#include "power_usb_device.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that detects a hung host from its current draw and recovers it
+ * by power cycling its outlet. A hung host tends to draw a flat current, or
+ * to sit at a high draw with little variation when spinning.
+ *
+ * Samples are summarized over fixed windows. The mean and standard deviation
+ * of normal windows are learned over roughly the last hour. A window is a
+ * flatline if its standard deviation collapses to a fraction of the learned
+ * one while the host still draws power, and stuck high if its mean is far
+ * above the learned mean while its standard deviation is suppressed. Windows
+ * that look hung are not learned from. Once every window has looked hung for
+ * the sustain time, the outlet is power cycled and each switch is verified
+ * against the samples that follow: switching off must drop the current by
+ * the minimum step and switching on must raise it again. Detection is then
+ * held off while the host boots.
+ *
+ * The PowerUSB measures the strip as a whole, so the watched host should be
+ * the dominant load on the strip. Switching commands are written on a
+ * separate thread so that the sampling schedule is not disturbed. Samples
+ * pass through unchanged.
+ */
+class HangWatchdogTransform : public Transform {
+ public:
+  //! The default time that a host must look hung before it is cycled.
+  static constexpr uint64_t kDefaultSustainUs = 300000000;
+
+  //! The default time that the outlet is held off during a cycle.
+  static constexpr uint64_t kDefaultOffTimeUs = 10000000;
+
+  //! The default smallest change in current that verifies a switch.
+  static constexpr float kDefaultMinStepMa = 50.0f;
+
+  //! The default duration of each summarized window.
+  static constexpr uint64_t kDefaultWindowUs = 10000000;
+
+  //! The default time after a cycle during which detection is suspended.
+  static constexpr uint64_t kDefaultHoldoffUs = 600000000;
+
+  /**
+   * Constructs a HangWatchdogTransform.
+   *
+   * @param device The device to switch. Must outlive this transform.
+   * @param outlet The index of the outlet that powers the watched host.
+   * @param sustain_us The time that every window must look hung.
+   * @param off_time_us The time that the outlet is held off.
+   * @param min_step_ma The smallest change in current that verifies a
+   *        switch, and the least current drawn by a host that can be
+   *        considered hung.
+   * @param window_us The duration of each summarized window.
+   * @param holdoff_us The time after a cycle during which detection is
+   *        suspended.
+   */
+  HangWatchdogTransform(const PowerUsbDevice& device, size_t outlet,
+                        uint64_t sustain_us = kDefaultSustainUs,
+                        uint64_t off_time_us = kDefaultOffTimeUs,
+                        float min_step_ma = kDefaultMinStepMa,
+                        uint64_t window_us = kDefaultWindowUs,
+                        uint64_t holdoff_us = kDefaultHoldoffUs);
+
+  /**
+   * Waits for any switching command being written to complete.
+   */
+  ~HangWatchdogTransform();
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+
+  /**
+   * Switches the outlet back on if logging stops partway through a cycle.
+   */
+  void Finish(SampleConsumer *output) override;
+
+  /**
+   * Prints the learned baseline and the number of hangs detected and cycles
+   * verified.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  /**
+   * The stages of detection and recovery.
+   */
+  enum class State {
+    //! Learning the baseline and looking for hangs.
+    Monitoring,
+
+    //! The outlet has been commanded off and the drop is awaited.
+    WaitingForOff,
+
+    //! The outlet is verified off and held off.
+    Off,
+
+    //! The outlet has been commanded on and the rise is awaited.
+    WaitingForOn,
+
+    //! Detection is suspended while the host boots.
+    Holdoff,
+  };
+
+  /**
+   * The progress of the switching command passed to the worker thread.
+   */
+  enum class CommandStatus {
+    Pending,
+    Succeeded,
+    Failed,
+  };
+
+  //! The device to switch.
+  const PowerUsbDevice& device_;
+
+  //! The index of the outlet that powers the watched host.
+  const size_t outlet_;
+
+  //! The configuration provided at construction.
+  const uint64_t sustain_us_;
+  const uint64_t off_time_us_;
+  const float min_step_ma_;
+  const uint64_t window_us_;
+  const uint64_t holdoff_us_;
+
+  //! The stage of detection and recovery.
+  State state_;
+
+  //! The time at which the current state times out or ends.
+  uint64_t state_deadline_us_;
+
+  //! The start and running sums of the window being summarized.
+  bool window_started_;
+  uint64_t window_start_us_;
+  uint64_t window_count_;
+  double window_sum_ma_;
+  double window_sum_squares_ma_;
+
+  //! The number of windows learned and the learned baseline.
+  uint64_t baseline_count_;
+  double baseline_mean_ma_;
+  double baseline_mean_variance_;
+  double baseline_stddev_ma_;
+
+  //! The time at which windows began to look hung and the kind of hang,
+  //! nullptr if the last window looked normal.
+  uint64_t hang_start_us_;
+  const char *hang_reason_;
+
+  //! The current before the cycle and while off, against which the switches
+  //! are verified.
+  float level_before_ma_;
+  float level_off_ma_;
+
+  //! The number of consecutive samples past the verification level.
+  size_t confirm_count_;
+
+  //! The time at which the current cycle began.
+  uint64_t cycle_start_us_;
+
+  //! The counters reported by PrintStats().
+  uint64_t flatline_count_;
+  uint64_t stuck_high_count_;
+  uint64_t verified_count_;
+  uint64_t failed_count_;
+  uint64_t last_recovery_us_;
+
+  //! Guards command_pending_, command_state_ and stop_.
+  std::mutex mutex_;
+  std::condition_variable condition_;
+
+  //! Whether or not a command awaits the worker thread, and its state.
+  bool command_pending_;
+  SocketState command_state_;
+
+  //! The progress of the most recent command.
+  std::atomic<CommandStatus> command_status_;
+
+  //! Whether or not the worker thread should exit.
+  bool stop_;
+
+  //! The thread that writes switching commands to the device.
+  std::thread worker_thread_;
+
+  /**
+   * Adds a sample to the current window, evaluating the window when it ends.
+   *
+   * @param sample The sample to add.
+   */
+  void Monitor(const Sample& sample);
+
+  /**
+   * Evaluates a completed window, learning from it if it looks normal and
+   * starting a cycle if the host has looked hung for long enough.
+   *
+   * @param end_us The time at which the window ended.
+   */
+  void EvaluateWindow(uint64_t end_us);
+
+  /**
+   * Advances a cycle in progress.
+   *
+   * @param sample The latest sample.
+   */
+  void Recover(const Sample& sample);
+
+  /**
+   * Counts consecutive samples that satisfy a verification condition.
+   *
+   * @param satisfied Whether or not the latest sample satisfies it.
+   * @return Returns true once enough consecutive samples satisfy it.
+   */
+  bool Confirm(bool satisfied);
+
+  /**
+   * Ends a cycle and suspends detection.
+   *
+   * @param now_us The current time.
+   */
+  void EnterHoldoff(uint64_t now_us);
+
+  /**
+   * Passes a switching command to the worker thread.
+   *
+   * @param state The state to switch the outlet to.
+   */
+  void RequestSwitch(SocketState state);
+
+  /**
+   * The entry point of the worker thread.
+   */
+  void WorkerLoop();
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_HANG_WATCHDOG_TRANSFORM_H_
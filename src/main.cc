@@ -14,12 +14,51 @@
  * limitations under the License.
  */
 
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
 #include <cstdio>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <tclap/CmdLine.h>
 
+#include "actuation_latency.h"
+#include "burst_capture_transform.h"
+#include "benchmark.h"
+#include "calibration.h"
+#include "collector_query.h"
+#include "collector_server.h"
+#include "collector_sink.h"
+#include "command_profiler.h"
+#include "cpu_attribution_transform.h"
+#include "decimating_transform.h"
+#include "device_bring_up.h"
+#include "hang_watchdog_transform.h"
+#include "marker_client.h"
+#include "marker_server.h"
+#include "mqtt_sink.h"
+#include "per_device_sink.h"
+#include "pipeline.h"
 #include "power_usb_device.h"
+#include "region_transform.h"
+#include "sqlite_sink.h"
+#include "statsd_sink.h"
+#include "step_detection_transform.h"
+#include "text_sink.h"
+#include "topology_transform.h"
+#include "util/clock.h"
+#include "util/histogram.h"
+#include "util/time.h"
+#include "voltage_feed.h"
+#include "voltage_join_transform.h"
+#include "zstd_output_stream.h"
 
 using namespace pwrusbctl;
 
@@ -27,6 +66,54 @@ using namespace pwrusbctl;
 constexpr char kToolDescription[] =
     "a tool for interacting with PowerUSB USB-controlled power strips";
 
+//! A description of the measure subcommand.
+constexpr char kMeasureDescription[] =
+    "runs a command and reports the energy drawn through the strip while it "
+    "runs. Usage: pwrusbctl measure [options] -- <command> [args...]";
+
+//! The name of the subcommand that profiles a command.
+constexpr char kMeasureCommand[] = "measure";
+
+//! A description of the benchmark subcommand.
+constexpr char kBenchmarkDescription[] =
+    "runs a command repeatedly and reports statistics of the energy drawn "
+    "per run. Usage: pwrusbctl benchmark [options] -- <command> [args...]";
+
+//! The name of the subcommand that benchmarks a command.
+constexpr char kBenchmarkCommand[] = "benchmark";
+
+//! The default number of runs of a benchmark.
+constexpr size_t kDefaultBenchmarkRuns(10);
+
+//! The default time to wait between runs of a benchmark.
+constexpr uint64_t kDefaultBenchmarkCooldownUs(5000000);
+
+//! The default increase in mean energy tolerated when comparing a benchmark
+//! against a baseline.
+constexpr double kDefaultMaxEnergyIncreasePercent(5.0);
+
+//! The name of the subcommand that sends a region marker.
+constexpr char kMarkCommand[] = "mark";
+
+//! A description of the collector subcommand.
+constexpr char kCollectorDescription[] =
+    "receives samples streamed by instances run with --collector and logs "
+    "them. Usage: pwrusbctl collector --listen <host:port> [options]";
+
+//! The name of the subcommand that runs a collector.
+constexpr char kCollectorCommand[] = "collector";
+
+//! A description of the top subcommand.
+constexpr char kTopDescription[] =
+    "lists the devices that draw the most power among those streaming to a "
+    "collector. Usage: pwrusbctl top --collector <host:port> [options]";
+
+//! The name of the subcommand that queries a collector for top consumers.
+constexpr char kTopCommand[] = "top";
+
+//! The default number of devices listed by the top subcommand.
+constexpr size_t kDefaultTopCount(10);
+
 //! The current version of this tool. Defined according to the rules of
 //! semantic versioning.
 constexpr char kVersionString[] = "0.1.0";
@@ -34,12 +121,32 @@ constexpr char kVersionString[] = "0.1.0";
 //! The default logging interval of 200ms.
 constexpr useconds_t kDefaultLoggingIntervalUs(200000);
 
+//! The upper bounds of the buckets used to record sampling lateness in
+//! microseconds.
+const std::vector<int64_t> kLatenessBucketsUs = {
+  10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000,
+  200000, 500000, 1000000,
+};
+
 //! The default line voltage when computing energy consumption.
 constexpr float kDefaultLineVoltage(115.0f);
 
 //! The default minimum power to disable idle ports.
 constexpr float kDefaultMinPower(10.0f);
 
+//! The interval at which to check whether a capture is armed before switching
+//! outlets.
+constexpr useconds_t kCaptureArmPollIntervalUs(1000);
+
+//! The device identifier used when the serial number cannot be read.
+constexpr char kDefaultDeviceId[] = "pwrusb";
+
+//! The default prefix for metrics sent to StatsD.
+constexpr char kDefaultStatsdPrefix[] = "pwrusb.";
+
+//! The default prefix for MQTT topics.
+constexpr char kDefaultMqttTopicPrefix[] = "pwrusb";
+
 /**
  * A configuration for how to log data from the PowerUsb device.
  */
@@ -65,6 +172,9 @@ struct LoggingConfig {
   //! The interval between logs (if logging more than once).
   int interval_us;
 
+  //! The time to log for. If non-zero, this overrides log_count.
+  uint64_t duration_us;
+
   /**
    * Determines whether or not any log statements will be printed given the
    * configuration.
@@ -158,46 +268,835 @@ void SetDefaultSocketState(const PowerUsbDevice& device, size_t outlet_index,
 }
 
 /**
- * Log information about the power strip based on configurable arguments.
+ * Measures the latency of switching an outlet and prints the results. Any
+ * errors are logged.
+ *
+ * @param device The PowerUsbDevice to manipulate.
+ * @param outlet_index The index of the outlet to switch.
+ * @param trial_count The number of on and off cycles to measure.
+ * @param min_step_ma The smallest change in current treated as the load
+ *        switching.
+ */
+void MeasureActuationLatency(const PowerUsbDevice& device,
+                             size_t outlet_index, size_t trial_count,
+                             float min_step_ma) {
+  if (outlet_index >= device.GetSocketCount()) {
+    fprintf(stderr, "Error: outlet %zu does not exist\n", outlet_index);
+    CleanupAndAbort();
+  }
+
+  ActuationLatencyMeter meter(device, outlet_index, min_step_ma);
+  if (!meter.Measure(trial_count)) {
+    fprintf(stderr, "Error measuring actuation latency\n");
+    CleanupAndAbort();
+  }
+
+  meter.PrintResults(stderr);
+}
+
+/**
+ * Switches outlets on and off, logging any errors.
+ *
+ * @param device The PowerUsbDevice to manipulate.
+ * @param enable_indices The indices of the outlets to switch on.
+ * @param disable_indices The indices of the outlets to switch off.
+ */
+void SwitchOutlets(const PowerUsbDevice& device,
+                   const std::vector<size_t>& enable_indices,
+                   const std::vector<size_t>& disable_indices) {
+  for (size_t outlet_index : enable_indices) {
+    SetSocketState(device, outlet_index, SocketState::On);
+  }
+
+  for (size_t outlet_index : disable_indices) {
+    SetSocketState(device, outlet_index, SocketState::Off);
+  }
+}
+
+/**
+ * Switches outlets once a capture has filled its pre-trigger buffer and then
+ * triggers the capture. Runs alongside the sampling loop and switches without
+ * waiting further if logging ends first.
+ *
+ * @param device The PowerUsbDevice to manipulate.
+ * @param enable_indices The indices of the outlets to switch on.
+ * @param disable_indices The indices of the outlets to switch off.
+ * @param capture The capture to trigger.
+ * @param logging_done Set once the sampling loop has finished.
+ */
+void SwitchOutletsForCapture(const PowerUsbDevice& device,
+                             std::vector<size_t> enable_indices,
+                             std::vector<size_t> disable_indices,
+                             BurstCaptureTransform *capture,
+                             const std::atomic<bool>& logging_done) {
+  if (enable_indices.empty() && disable_indices.empty()) {
+    return;
+  }
+
+  while (!capture->IsArmed() && !logging_done) {
+    usleep(kCaptureArmPollIntervalUs);
+  }
+
+  SwitchOutlets(device, enable_indices, disable_indices);
+  capture->Trigger();
+}
+
+/**
+ * Obtains the identifier used for samples from a device. This is the serial
+ * number of the device if it can be read.
+ *
+ * @param device The device to identify.
+ * @param device_id The buffer to populate with the identifier.
+ */
+void GetDeviceId(const PowerUsbDevice& device,
+                 char (&device_id)[kMaxDeviceIdLength]) {
+  if (!device.GetSerialNumber(device_id, kMaxDeviceIdLength)
+      || device_id[0] == '\0') {
+    snprintf(device_id, kMaxDeviceIdLength, "%s", kDefaultDeviceId);
+  }
+}
+
+/**
+ * Obtains the calibration of a device, loading it from the cache if possible
+ * and probing the device otherwise. The calibration is printed and any errors
+ * are logged.
+ *
+ * @param device The device to calibrate.
+ * @param use_cache Whether or not a cached calibration may be used.
+ * @return The calibration of the device.
+ */
+Calibration GetCalibration(const PowerUsbDevice& device, bool use_cache) {
+  // Calibrations are only cached for devices that report a serial number, as
+  // there is otherwise no way to tell devices apart.
+  char serial[kMaxDeviceIdLength];
+  std::string cache_path;
+  if (device.GetSerialNumber(serial, sizeof(serial)) && serial[0] != '\0') {
+    cache_path = GetCalibrationCachePath(serial);
+  }
+
+  Calibration calibration;
+  if (use_cache && !cache_path.empty()
+      && LoadCalibration(cache_path, &calibration)) {
+    fprintf(stderr, "Using cached calibration %s\n", cache_path.c_str());
+  } else {
+    fprintf(stderr, "Calibrating device\n");
+    if (!CalibrateDevice(device, &calibration)) {
+      fprintf(stderr, "Error calibrating device\n");
+      CleanupAndAbort();
+    }
+
+    if (!cache_path.empty() && !SaveCalibration(cache_path, calibration)) {
+      fprintf(stderr, "Error caching calibration %s\n", cache_path.c_str());
+    }
+  }
+
+  PrintCalibration(stderr, calibration);
+  return calibration;
+}
+
+/**
+ * Opens the sink that logged samples are printed to, logging any errors.
+ *
+ * @param config The configuration of the logs.
+ * @param format The name of the output format.
+ * @param path The path to write to, or empty for stdout.
+ * @param compression The name of the compression algorithm.
+ * @param compression_level The compression level to use.
+ * @param print_device Whether or not samples from several devices are
+ *        interleaved, so each line must name its device.
+ * @return The sink.
+ */
+std::unique_ptr<Sink> OpenTextSink(const LoggingConfig& config,
+                                   const std::string& format,
+                                   const std::string& path,
+                                   const std::string& compression,
+                                   int compression_level,
+                                   bool print_device) {
+  TextFormat text_format;
+  if (format == "text") {
+    text_format = TextFormat::Text;
+  } else if (format == "csv") {
+    text_format = TextFormat::Csv;
+  } else {
+    fprintf(stderr, "Invalid output format %s\n", format.c_str());
+    CleanupAndAbort();
+  }
+
+  std::unique_ptr<OutputStream> output;
+  if (path.empty()) {
+    output.reset(new FileOutputStream(stdout, false));
+  } else {
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+      fprintf(stderr, "Error opening output file %s\n", path.c_str());
+      CleanupAndAbort();
+    }
+
+    output.reset(new FileOutputStream(file, true));
+  }
+
+  if (compression == "zstd") {
+    ZstdOutputStream *zstd_output = new ZstdOutputStream(std::move(output),
+                                                         compression_level);
+    output.reset(zstd_output);
+    if (!zstd_output->IsInitialized()) {
+      fprintf(stderr, "Error creating zstd context\n");
+      CleanupAndAbort();
+    }
+  } else if (compression != "none") {
+    fprintf(stderr, "Invalid compression %s\n", compression.c_str());
+    CleanupAndAbort();
+  }
+
+  return std::unique_ptr<Sink>(new TextSink(std::move(output), text_format,
+      config.log_current, config.log_power, config.log_energy,
+      print_device));
+}
+
+/**
+ * Builds the options for a network sink, opening a spool for the sink if a
+ * spool directory was configured. Any errors are logged.
+ *
+ * @param base_options The options shared by all sinks.
+ * @param name The name of the sink, used as the spool subdirectory.
+ * @param spool_dir The directory that spools are created in, may be empty.
+ * @param spool_max_bytes The maximum size of the spool.
+ * @param spool_drain_rate The rate at which the spool is drained.
+ * @return The options for the sink.
+ */
+SinkOptions GetNetworkSinkOptions(const SinkOptions& base_options,
+                                  const std::string& name,
+                                  const std::string& spool_dir,
+                                  uint64_t spool_max_bytes,
+                                  double spool_drain_rate) {
+  SinkOptions options = base_options;
+  if (spool_dir.empty()) {
+    return options;
+  }
+
+  if (spool_drain_rate <= 0.0) {
+    fprintf(stderr, "Invalid spool drain rate %f\n", spool_drain_rate);
+    CleanupAndAbort();
+  }
+
+  mkdir(spool_dir.c_str(), 0755);
+  std::string path = spool_dir + "/" + name;
+  options.spool = std::make_shared<Spool>(path, spool_max_bytes);
+  options.spool_drain_rate = spool_drain_rate;
+  if (!options.spool->IsInitialized()) {
+    fprintf(stderr, "Error opening spool %s\n", path.c_str());
+    CleanupAndAbort();
+  }
+
+  return options;
+}
+
+/**
+ * Samples the power strip based on configurable arguments and pushes each
+ * sample into the output pipeline.
  *
- * @param device The device to print info about.
+ * Samples are scheduled at fixed multiples of the interval rather than an
+ * interval after the previous sample, so time spent sampling does not
+ * accumulate as drift. The lateness of each sample relative to its schedule is
+ * recorded in the sample and in a histogram.
+ *
+ * @param device The device to sample.
  * @param config The configuration of the logs.
+ * @param pipeline The pipeline that samples are pushed into.
+ * @param clock The clock that samples are timestamped and scheduled with.
+ * @param lateness_histogram The histogram to record sampling lateness in, or
+ *        null.
+ * @param marker_server The server to pop region markers from, or null.
+ * @param first_sample_us Populated with the time of the first sample if not
+ *        null.
+ * @return Returns false if the device could not be read.
  */
-void LogStats(const PowerUsbDevice& device, const LoggingConfig& config) {
-  for (size_t i = 0; config.log_indefinitely || i < config.log_count; i++) {
+bool LogStats(const PowerUsbDevice& device, const LoggingConfig& config,
+              Pipeline *pipeline, Clock *clock,
+              Histogram *lateness_histogram, MarkerServer *marker_server,
+              uint64_t *first_sample_us = nullptr) {
+  char device_id[kMaxDeviceIdLength];
+  GetDeviceId(device, device_id);
+
+  uint64_t start_us = clock->GetMonotonicTimeUs();
+  uint64_t scheduled_us = start_us;
+  for (size_t i = 0; config.log_indefinitely
+       || ((config.duration_us > 0)
+           ? clock->GetMonotonicTimeUs() < start_us + config.duration_us
+           : i < config.log_count); i++) {
+    Sample sample = {};
+    memcpy(sample.device_id, device_id, sizeof(sample.device_id));
+    sample.timestamp_us = clock->GetMonotonicTimeUs();
+    sample.sample_count = 1;
+    sample.lateness_us = static_cast<int64_t>(sample.timestamp_us)
+        - static_cast<int64_t>(scheduled_us);
+    if (lateness_histogram != nullptr) {
+      lateness_histogram->Record(sample.lateness_us);
+    }
+
     if (config.log_current || config.log_power) {
       int16_t current;
       if (device.GetInstantaneousCurrent(&current)) {
-        if (config.log_current) {
-          fprintf(stdout, "Current: %" PRId16 "mA\n", current);
-        }
-
-        if (config.log_power) {
-          float power = (current / 1000.0f) * config.line_voltage;
-          fprintf(stdout, "Power: %fW\n", power);
-        }
+        sample.has_current = true;
+        sample.current_ma = current;
+        sample.current_min_ma = current;
+        sample.current_max_ma = current;
+        sample.power_w = (current / 1000.0f) * config.line_voltage;
+        sample.power_min_w = sample.power_w;
+        sample.power_max_w = sample.power_w;
       } else {
         fprintf(stderr, "Error reading device current\n");
-        CleanupAndAbort();
+        return false;
       }
     }
 
     if (config.log_energy) {
       int32_t milliamp_minutes;
       if (device.GetAccumulatedCharge(&milliamp_minutes)) {
-        float energy = PowerUsbDevice::ConvertChargeToKilowattHours(
+        sample.has_energy = true;
+        sample.energy_kwh = PowerUsbDevice::ConvertChargeToKilowattHours(
             milliamp_minutes, config.line_voltage);
-        fprintf(stdout, "Energy: %fkWh\n", energy);
       } else {
-        CleanupAndAbort();
+        fprintf(stderr, "Error reading device charge\n");
+        return false;
+      }
+    }
+
+    // Markers are pushed ahead of the first sample taken after them so that
+    // regions are integrated in timestamp order.
+    Sample marker;
+    while (marker_server != nullptr
+           && marker_server->PopMarker(sample.timestamp_us, &marker)) {
+      pipeline->Push(marker);
+    }
+
+    pipeline->Push(sample);
+    if (i == 0 && first_sample_us != nullptr) {
+      *first_sample_us = sample.timestamp_us;
+    }
+
+    // Sleep until the next sample is due if logs will be printed more than
+    // once. If sampling has fallen more than an interval behind, the schedule
+    // restarts from now rather than sampling in a burst to catch up.
+    if (config.log_indefinitely || config.duration_us > 0
+        || config.log_count != 1) {
+      scheduled_us += config.interval_us;
+      uint64_t now_us = clock->GetMonotonicTimeUs();
+      if (now_us > scheduled_us + config.interval_us) {
+        scheduled_us = now_us;
+      } else {
+        clock->SleepUntilUs(scheduled_us);
+      }
+    }
+  }
+
+  // Markers received after the last sample close their regions at it.
+  Sample marker;
+  while (marker_server != nullptr
+         && marker_server->PopMarker(UINT64_MAX, &marker)) {
+    pipeline->Push(marker);
+  }
+
+  return true;
+}
+
+/**
+ * Brings up every device in parallel and logs each on its own thread from the
+ * moment it is ready, returning once every device has finished logging.
+ *
+ * @param bring_up The devices to bring up.
+ * @param probe The function that probes each device.
+ * @param config The configuration of the logs.
+ * @param pipeline The pipeline that samples are pushed into.
+ * @param clock The clock that samples are timestamped and scheduled with.
+ * @param print_stats Whether or not to print the time that each device took
+ *        to become ready and to produce its first sample.
+ */
+void LogAllDevices(DeviceBringUp *bring_up, const DeviceBringUp::Probe& probe,
+                   const LoggingConfig& config, Pipeline *pipeline,
+                   Clock *clock, bool print_stats) {
+  // The ready callback is serialized, so the threads need no lock. Each
+  // thread writes only its own first sample time.
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> first_sample_us(bring_up->GetDeviceCount(), 0);
+  bring_up->Run(probe, [&](size_t index, const PowerUsbDevice& device) {
+    if (!config.LogsEnabled()) {
+      return;
+    }
+
+    const PowerUsbDevice *ready_device = &device;
+    uint64_t *ready_first_sample_us = &first_sample_us[index];
+    threads.emplace_back([ready_device, ready_first_sample_us, &config,
+                          pipeline, clock]() {
+      if (!LogStats(*ready_device, config, pipeline, clock, nullptr, nullptr,
+                    ready_first_sample_us)) {
+        char device_id[kMaxDeviceIdLength];
+        GetDeviceId(*ready_device, device_id);
+        fprintf(stderr, "Stopped logging device %s\n", device_id);
       }
+    });
+  });
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (!print_stats) {
+    return;
+  }
+
+  size_t ready_count = 0;
+  for (size_t i = 0; i < bring_up->GetDeviceCount(); i++) {
+    if (bring_up->GetRecord(i).ready) {
+      ready_count++;
+    }
+  }
+
+  fprintf(stderr, "Bring-up: %zu devices, %zu ready\n",
+          bring_up->GetDeviceCount(), ready_count);
+  for (size_t i = 0; i < bring_up->GetDeviceCount(); i++) {
+    const BringUpRecord& record = bring_up->GetRecord(i);
+    if (!record.ready) {
+      fprintf(stderr, "  %s: failed\n", record.path.c_str());
+      continue;
     }
 
-    // Sleep if logs will be printed more than once.
-    if (config.log_indefinitely || config.log_count != 1) {
-      usleep(config.interval_us);
+    fprintf(stderr, "  %s: queued %.1fms, open %.1fms, probe %.1fms, "
+            "ready %.1fms", record.device_id, record.queued_us / 1000.0,
+            record.open_us / 1000.0, record.probe_us / 1000.0,
+            record.ready_us / 1000.0);
+    if (first_sample_us[i] != 0) {
+      fprintf(stderr, ", first sample %.1fms",
+              (first_sample_us[i] - bring_up->GetStartTimeUs()) / 1000.0);
     }
+
+    DeviceLockStats lock_stats;
+    bring_up->FindDevice(record.device_id)->GetLockStats(&lock_stats);
+    if (lock_stats.contended_count > 0) {
+      fprintf(stderr, ", %" PRIu64 " lock waits (max %.1fms)",
+              lock_stats.contended_count, lock_stats.max_wait_us / 1000.0);
+    }
+
+    fprintf(stderr, "\n");
+  }
+}
+
+/**
+ * Parses the options of a subcommand that runs a command. Options precede a
+ * "--" separator and the command follows it. Exits if no command is given.
+ *
+ * @param cmd The command line object defining the options.
+ * @param subcommand The name of the subcommand.
+ * @param argc The number of arguments following the subcommand name.
+ * @param argv The arguments following the subcommand name.
+ * @return The index of the separator in argv.
+ */
+int ParseCommandArgs(TCLAP::CmdLine *cmd, const char *subcommand, int argc,
+                     char **argv) {
+  int separator = 0;
+  while (separator < argc && strcmp(argv[separator], "--") != 0) {
+    separator++;
+  }
+
+  std::vector<std::string> args = {
+    std::string("pwrusbctl ") + subcommand,
+  };
+  args.insert(args.end(), argv, argv + separator);
+  cmd->parse(args);
+  if (separator + 1 >= argc) {
+    fprintf(stderr, "Error: no command given, use -- <command> [args...]\n");
+    CleanupAndAbort();
   }
+
+  return separator;
+}
+
+/**
+ * Runs the measure subcommand, which profiles the energy drawn while a
+ * command runs.
+ *
+ * @param argc The number of arguments following the subcommand name.
+ * @param argv The arguments following the subcommand name.
+ * @return The exit code of the command, or 128 plus the signal that
+ *         terminated it.
+ */
+int RunMeasureCommand(int argc, char **argv) {
+  using TCLAP::CmdLine;
+  using TCLAP::ValueArg;
+
+  CmdLine cmd(kMeasureDescription, ' ', kVersionString);
+  ValueArg<uint64_t> interval_arg("", "interval",
+      "The interval between samples, 0 to sample as fast as the device allows",
+      false, 0, "microseconds", cmd);
+  ValueArg<uint64_t> baseline_arg("", "baseline",
+      "The time spent measuring idle power before the command starts, which "
+      "is subtracted from the reported energy. 0 to disable",
+      false, ProfileOptions::kDefaultBaselineUs, "microseconds", cmd);
+  ValueArg<float> line_voltage_arg("", "line_voltage",
+      "Specify the line voltage used in power estimation",
+      false, kDefaultLineVoltage, "volts", cmd);
+
+  int separator = ParseCommandArgs(&cmd, kMeasureCommand, argc, argv);
+  PowerUsbDevice device;
+  if (!device.IsInitialized()) {
+    fprintf(stderr, "Error opening the Power USB device: not found\n");
+    CleanupAndAbort();
+  }
+
+  ProfileOptions options;
+  options.interval_us = interval_arg.getValue();
+  options.baseline_us = baseline_arg.getValue();
+  options.line_voltage = line_voltage_arg.getValue();
+
+  // The remaining arguments are already null-terminated by argv.
+  EnergyProfile profile;
+  if (!ProfileCommand(device, argv + separator + 1, options, &profile)) {
+    fprintf(stderr, "Error profiling command\n");
+    CleanupAndAbort();
+  }
+
+  PrintEnergyProfile(stderr, profile);
+  if (WIFSIGNALED(profile.status)) {
+    return 128 + WTERMSIG(profile.status);
+  }
+
+  return WEXITSTATUS(profile.status);
+}
+
+/**
+ * Runs the benchmark subcommand, which profiles repeated runs of a command
+ * and reports statistics of the energy per run.
+ *
+ * @param argc The number of arguments following the subcommand name.
+ * @param argv The arguments following the subcommand name.
+ * @return Returns zero on success, 1 if a run fails and 2 if the energy
+ *         regressed from the baseline result.
+ */
+int RunBenchmarkCommand(int argc, char **argv) {
+  using TCLAP::CmdLine;
+  using TCLAP::ValueArg;
+
+  CmdLine cmd(kBenchmarkDescription, ' ', kVersionString);
+  ValueArg<size_t> runs_arg("", "runs", "The number of times to run the "
+      "command", false, kDefaultBenchmarkRuns, "count", cmd);
+  ValueArg<uint64_t> cooldown_arg("", "cooldown",
+      "The time to wait after each run before measuring the baseline of the "
+      "next", false, kDefaultBenchmarkCooldownUs, "microseconds", cmd);
+  ValueArg<uint64_t> interval_arg("", "interval",
+      "The interval between samples, 0 to sample as fast as the device allows",
+      false, 0, "microseconds", cmd);
+  ValueArg<uint64_t> baseline_arg("", "baseline",
+      "The time spent measuring idle power before each run, which is "
+      "subtracted from the energy of the run. 0 to disable",
+      false, ProfileOptions::kDefaultBaselineUs, "microseconds", cmd);
+  ValueArg<float> line_voltage_arg("", "line_voltage",
+      "Specify the line voltage used in power estimation",
+      false, kDefaultLineVoltage, "volts", cmd);
+  ValueArg<std::string> save_arg("", "save",
+      "Save the results to this file for use with --compare",
+      false, "", "path", cmd);
+  ValueArg<std::string> compare_arg("", "compare",
+      "Compare the results against a file saved with --save and exit with "
+      "status 2 on a significant regression", false, "", "path", cmd);
+  ValueArg<double> max_increase_arg("", "max_increase",
+      "The increase in mean energy over the --compare baseline that is "
+      "tolerated", false, kDefaultMaxEnergyIncreasePercent, "percent", cmd);
+
+  int separator = ParseCommandArgs(&cmd, kBenchmarkCommand, argc, argv);
+  if (runs_arg.getValue() == 0) {
+    fprintf(stderr, "Error: --runs must be at least 1\n");
+    CleanupAndAbort();
+  }
+
+  // Check the baseline before spending time on the runs.
+  EnergyStats baseline_stats = {};
+  if (compare_arg.isSet()
+      && !LoadEnergyStats(compare_arg.getValue(), &baseline_stats)) {
+    fprintf(stderr, "Error loading benchmark results %s\n",
+            compare_arg.getValue().c_str());
+    CleanupAndAbort();
+  }
+
+  PowerUsbDevice device;
+  if (!device.IsInitialized()) {
+    fprintf(stderr, "Error opening the Power USB device: not found\n");
+    CleanupAndAbort();
+  }
+
+  ProfileOptions options;
+  options.interval_us = interval_arg.getValue();
+  options.baseline_us = baseline_arg.getValue();
+  options.line_voltage = line_voltage_arg.getValue();
+
+  // Runs are compared by the energy above the baseline when it is measured.
+  std::vector<double> energies_j;
+  for (size_t run = 1; run <= runs_arg.getValue(); run++) {
+    if (run > 1) {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(cooldown_arg.getValue()));
+    }
+
+    EnergyProfile profile;
+    if (!ProfileCommand(device, argv + separator + 1, options, &profile)) {
+      fprintf(stderr, "Error profiling command\n");
+      CleanupAndAbort();
+    }
+
+    if (!WIFEXITED(profile.status) || WEXITSTATUS(profile.status) != 0) {
+      fprintf(stderr, "Error: run %zu of the command failed\n", run);
+      return 1;
+    }
+
+    energies_j.push_back((options.baseline_us > 0)
+        ? profile.net_energy_j : profile.energy_j);
+    fprintf(stderr, "Run %zu: %.3fJ in %.3fs (average %.3fW, peak %.3fW)\n",
+            run, energies_j.back(), profile.duration_us / 1e6,
+            profile.average_w, profile.peak_w);
+  }
+
+  std::vector<bool> outliers = FindOutliers(energies_j);
+  for (size_t i = 0; i < outliers.size(); i++) {
+    if (outliers[i]) {
+      fprintf(stderr, "Run %zu is an outlier\n", i + 1);
+    }
+  }
+
+  EnergyStats stats = ComputeEnergyStats(energies_j);
+  PrintEnergyStats(stderr, stats);
+  if (save_arg.isSet() && !SaveEnergyStats(save_arg.getValue(), stats)) {
+    fprintf(stderr, "Error saving benchmark results %s\n",
+            save_arg.getValue().c_str());
+    return 1;
+  }
+
+  if (compare_arg.isSet()) {
+    EnergyComparison comparison = CompareEnergyStats(baseline_stats, stats,
+        max_increase_arg.getValue());
+    PrintEnergyComparison(stderr, comparison);
+    if (comparison.regression) {
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Runs the mark subcommand, which sends a region marker to a running
+ * instance so that scripts can mark regions without the client library.
+ *
+ * @param argc The number of arguments following the subcommand name.
+ * @param argv The arguments following the subcommand name.
+ * @return Returns zero if the marker was sent.
+ */
+int RunMarkCommand(int argc, char **argv) {
+  if (argc != 3 || (strcmp(argv[1], "begin") != 0
+                    && strcmp(argv[1], "end") != 0)) {
+    fprintf(stderr, "Usage: pwrusbctl %s <socket> begin|end <name>\n",
+            kMarkCommand);
+    return 1;
+  }
+
+  MarkerClient client(argv[0]);
+  bool sent = (strcmp(argv[1], "begin") == 0)
+      ? client.Begin(argv[2]) : client.End(argv[2]);
+  if (!sent) {
+    fprintf(stderr, "Error sending marker to %s\n", argv[0]);
+    return 1;
+  }
+
+  return 0;
+}
+
+//! Set by SIGINT or SIGTERM to stop the collector.
+std::atomic<bool> collector_stopping(false);
+
+/**
+ * Stops the collector on SIGINT or SIGTERM so that its outputs are flushed.
+ *
+ * @param signal_number The signal received.
+ */
+void HandleCollectorSignal(int signal_number) {
+  collector_stopping = true;
+}
+
+/**
+ * Runs the collector subcommand, which receives samples from agents and logs
+ * them until interrupted.
+ *
+ * @param argc The number of arguments following the subcommand name.
+ * @param argv The arguments following the subcommand name.
+ * @return Returns zero on a clean shutdown.
+ */
+int RunCollectorCommand(int argc, char **argv) {
+  using TCLAP::CmdLine;
+  using TCLAP::SwitchArg;
+  using TCLAP::ValueArg;
+
+  CmdLine cmd(kCollectorDescription, ' ', kVersionString);
+  ValueArg<std::string> listen_arg("", "listen",
+      "The address to accept agents on", true, "", "host:port", cmd);
+  ValueArg<std::string> format_arg("", "format",
+      "The format of logged samples: text or csv",
+      false, "csv", "format", cmd);
+  ValueArg<std::string> output_path_arg("", "output",
+      "Write logged samples to a file instead of stdout",
+      false, "", "path", cmd);
+  ValueArg<std::string> compress_arg("", "compress",
+      "Compress logged samples: none or zstd",
+      false, "none", "algorithm", cmd);
+  ValueArg<int> compress_level_arg("", "compress_level",
+      "The compression level used with --compress",
+      false, ZstdOutputStream::kDefaultCompressionLevel, "level", cmd);
+  ValueArg<std::string> sqlite_path_arg("", "sqlite",
+      "Store samples in a SQLite database", false, "", "path", cmd);
+  SwitchArg sqlite_rollups_arg("", "sqlite_rollups",
+      "Maintain per-minute rollups in the SQLite database", cmd, false);
+  ValueArg<std::string> labels_path_arg("", "labels",
+      "Label devices for top queries from a file of lines holding a device "
+      "identifier followed by its labels, such as rack=a1",
+      false, "", "path", cmd);
+  ValueArg<std::string> topology_path_arg("", "topology",
+      "Log power and energy totals for each level of a hierarchy read from a "
+      "file of lines holding a device identifier and its path, such as "
+      "room1/row2/rack3", false, "", "path", cmd);
+  ValueArg<uint64_t> topology_interval_arg("", "topology_interval",
+      "The interval between logged --topology totals", false,
+      TopologyTransform::kDefaultIntervalUs, "microseconds", cmd);
+  SwitchArg sink_stats_arg("", "sink_stats",
+      "Print the counters of the collector and each output on exit", cmd,
+      false);
+
+  std::vector<std::string> args = {
+    std::string("pwrusbctl ") + kCollectorCommand,
+  };
+  args.insert(args.end(), argv, argv + argc);
+  cmd.parse(args);
+
+  LoggingConfig config = {};
+  config.log_current = true;
+  config.log_power = true;
+  config.log_energy = true;
+
+  Pipeline pipeline;
+  TopologyTransform *topology_transform = nullptr;
+  if (topology_path_arg.isSet()) {
+    topology_transform = new TopologyTransform(topology_path_arg.getValue(),
+        topology_interval_arg.getValue());
+    pipeline.AddTransform(std::unique_ptr<Transform>(topology_transform));
+
+    // The transform reports why the topology could not be read.
+    if (!topology_transform->IsInitialized()) {
+      return 1;
+    }
+  }
+
+  pipeline.AddSink("text", OpenTextSink(config, format_arg.getValue(),
+      output_path_arg.getValue(), compress_arg.getValue(),
+      compress_level_arg.getValue(), true));
+  if (sqlite_path_arg.isSet()) {
+    std::unique_ptr<SqliteSink> sqlite_sink(new SqliteSink(
+        sqlite_path_arg.getValue(), sqlite_rollups_arg.getValue()));
+    if (!sqlite_sink->IsInitialized()) {
+      fprintf(stderr, "Error opening SQLite database %s\n",
+              sqlite_path_arg.getValue().c_str());
+      return 1;
+    }
+
+    pipeline.AddSink("sqlite", std::move(sqlite_sink));
+  }
+
+  TopIndex top_index;
+  if (labels_path_arg.isSet()
+      && !top_index.LoadLabels(labels_path_arg.getValue())) {
+    fprintf(stderr, "Error reading labels from %s\n",
+            labels_path_arg.getValue().c_str());
+    return 1;
+  }
+
+  CollectorServer server(listen_arg.getValue(), &pipeline, &top_index);
+  if (!server.IsInitialized()) {
+    fprintf(stderr, "Error listening on %s\n",
+            listen_arg.getValue().c_str());
+    return 1;
+  }
+
+  struct sigaction stop_action = {};
+  stop_action.sa_handler = HandleCollectorSignal;
+  sigaction(SIGINT, &stop_action, nullptr);
+  sigaction(SIGTERM, &stop_action, nullptr);
+
+  pipeline.Start();
+  server.Run(collector_stopping);
+  pipeline.Stop();
+  if (sink_stats_arg.getValue()) {
+    server.PrintStats(stderr);
+    if (topology_transform != nullptr) {
+      topology_transform->PrintStats(stderr);
+    }
+
+    pipeline.PrintStats(stderr);
+  }
+
+  return 0;
+}
+
+/**
+ * Runs the top subcommand, which asks a collector for the devices that draw
+ * the most power and prints them.
+ *
+ * @param argc The number of arguments following the subcommand name.
+ * @param argv The arguments following the subcommand name.
+ * @return Returns zero if the collector answered.
+ */
+int RunTopCommand(int argc, char **argv) {
+  using TCLAP::CmdLine;
+  using TCLAP::ValueArg;
+
+  CmdLine cmd(kTopDescription, ' ', kVersionString);
+  ValueArg<std::string> collector_arg("", "collector",
+      "The address of the collector", true, "", "host:port", cmd);
+  ValueArg<std::string> window_arg("", "window",
+      "Rank by the latest power or the average over the last hour: now or "
+      "hour", false, "now", "window", cmd);
+  ValueArg<size_t> count_arg("", "count",
+      "The number of devices to list", false, kDefaultTopCount, "count",
+      cmd);
+  ValueArg<std::string> label_arg("", "label",
+      "Only rank devices given this label with the collector's --labels",
+      false, "", "label", cmd);
+
+  std::vector<std::string> args = {
+    std::string("pwrusbctl ") + kTopCommand,
+  };
+  args.insert(args.end(), argv, argv + argc);
+  cmd.parse(args);
+
+  TopWindow window;
+  if (window_arg.getValue() == "now") {
+    window = TopWindow::Now;
+  } else if (window_arg.getValue() == "hour") {
+    window = TopWindow::Hour;
+  } else {
+    fprintf(stderr, "Unknown window %s\n", window_arg.getValue().c_str());
+    return 1;
+  }
+
+  std::vector<TopEntry> entries;
+  if (!QueryTopConsumers(collector_arg.getValue(), window,
+                         count_arg.getValue(), label_arg.getValue(),
+                         &entries)) {
+    fprintf(stderr, "Error querying collector %s\n",
+            collector_arg.getValue().c_str());
+    return 1;
+  }
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    printf("%3zu  %-32s %10.2fW\n", i + 1, entries[i].device_id.c_str(),
+           entries[i].power_w);
+  }
+
+  return 0;
 }
 
 int main(int argc, char **argv) {
@@ -207,12 +1106,51 @@ int main(int argc, char **argv) {
   using TCLAP::SwitchArg;
   using TCLAP::ValueArg;
 
+  // Subcommands take their own arguments.
+  if (argc > 1 && strcmp(argv[1], kMeasureCommand) == 0) {
+    int status = RunMeasureCommand(argc - 2, argv + 2);
+    hid_exit();
+    return status;
+  } else if (argc > 1 && strcmp(argv[1], kBenchmarkCommand) == 0) {
+    int status = RunBenchmarkCommand(argc - 2, argv + 2);
+    hid_exit();
+    return status;
+  } else if (argc > 1 && strcmp(argv[1], kMarkCommand) == 0) {
+    return RunMarkCommand(argc - 2, argv + 2);
+  } else if (argc > 1 && strcmp(argv[1], kCollectorCommand) == 0) {
+    return RunCollectorCommand(argc - 2, argv + 2);
+  } else if (argc > 1 && strcmp(argv[1], kTopCommand) == 0) {
+    return RunTopCommand(argc - 2, argv + 2);
+  }
+
   // Define the command line object with the description of this tool.
   CmdLine cmd(kToolDescription, ' ', kVersionString);
 
   // Logging args.
   SwitchArg print_device_info_arg("", "device_info",
       "Print device information", cmd, false);
+  SwitchArg all_devices_arg("", "all_devices",
+      "Log every attached device rather than the first, opening them in "
+      "parallel and sampling each as soon as it is ready", cmd, false);
+  ValueArg<size_t> bring_up_parallelism_arg("", "bring_up_parallelism",
+      "The number of devices opened and probed at once with --all_devices",
+      false, DeviceBringUp::kDefaultParallelism, "count", cmd);
+  SwitchArg calibrate_arg("", "calibrate",
+      "Measure device latency and the maximum sampling rate, clamping the "
+      "interval to what the device sustains. Results are cached per device",
+      cmd, false);
+  SwitchArg recalibrate_arg("", "recalibrate",
+      "Like --calibrate, but ignore any cached results", cmd, false);
+  ValueArg<size_t> measure_actuation_arg("", "measure_actuation",
+      "Repeatedly switch an outlet with a load attached and report the time "
+      "to write each command and to observe the change in current. The "
+      "outlet is left switched off", false, 0, "index", cmd);
+  ValueArg<size_t> actuation_trials_arg("", "actuation_trials",
+      "The number of on and off cycles for --measure_actuation", false,
+      ActuationLatencyMeter::kDefaultTrialCount, "count", cmd);
+  ValueArg<float> actuation_min_step_arg("", "actuation_min_step",
+      "The smallest change in current treated as the load switching",
+      false, ActuationLatencyMeter::kDefaultMinStepMa, "milliamps", cmd);
   SwitchArg reset_charge_accumulator_arg("", "reset_charge_accumulator",
       "Resets the charge accumulator", cmd, false);
   ValueArg<float> set_current_ratio_arg("", "set_current_ratio",
@@ -228,6 +1166,15 @@ int main(int argc, char **argv) {
   ValueArg<float> line_voltage_arg("", "line_voltage",
       "Specify the line voltage used in energy estimation",
       false, kDefaultLineVoltage, "volts", cmd);
+  ValueArg<std::string> voltage_feed_arg("", "voltage_feed",
+      "Compute power and energy from line voltage read from this file, FIFO "
+      "or TCP server rather than --line_voltage. Each line holds a wall-clock "
+      "timestamp in microseconds and a voltage, or just a voltage",
+      false, "", "path|host:port", cmd);
+  ValueArg<uint64_t> voltage_max_lag_arg("", "voltage_max_lag",
+      "The time that samples are held waiting for --voltage_feed to cover "
+      "them", false, VoltageJoinTransform::kDefaultMaxLagUs, "microseconds",
+      cmd);
   SwitchArg log_indefinitely_arg("l", "log_indefinitely",
       "Requests stats to be logged indefinitely", cmd, false);
   ValueArg<size_t> log_count_arg("c", "log_count",
@@ -236,6 +1183,154 @@ int main(int argc, char **argv) {
   ValueArg<useconds_t> interval_us_arg("", "interval",
       "The interval between logs, ignored for just one log",
       false, kDefaultLoggingIntervalUs, "microseconds", cmd);
+  ValueArg<useconds_t> oversample_arg("", "oversample",
+      "Sample at this interval and log the average, minimum and maximum of "
+      "each --interval", false, 0, "microseconds", cmd);
+  ValueArg<float> detect_steps_arg("", "detect_steps",
+      "Log step changes in current at least this large, such as appliances "
+      "switching on and off", false, 0.0f, "milliamps", cmd);
+  SwitchArg steps_only_arg("", "steps_only",
+      "Log only the steps found by --detect_steps, not every sample", cmd,
+      false);
+  ValueArg<std::string> marker_socket_arg("", "marker_socket",
+      "Receive region begin and end markers from applications on this Unix "
+      "socket and log the energy and peak power of each region",
+      false, "", "path", cmd);
+  MultiArg<std::string> attribute_arg("", "attribute",
+      "Attribute the power of this host to a process or cgroup by its CPU "
+      "time, given as a PID or cgroup v2 path, optionally as name=target",
+      false, "[name=]pid|cgroup", cmd);
+  ValueArg<float> attribution_idle_arg("", "attribution_idle",
+      "The idle power of the host used by --attribute. Estimated from the "
+      "measurements if not set", false, 0.0f, "watts", cmd);
+  ValueArg<uint64_t> attribution_interval_arg("", "attribution_interval",
+      "The interval between summaries of the energy attributed by "
+      "--attribute", false, CpuAttributionTransform::kDefaultIntervalUs,
+      "microseconds", cmd);
+  ValueArg<size_t> watchdog_outlet_arg("", "watchdog_outlet",
+      "Power cycle this outlet when its host looks hung, either drawing a "
+      "flat current or a stuck high one compared to what was learned while "
+      "logging. Each switch is verified by the change in current",
+      false, 0, "index", cmd);
+  ValueArg<uint64_t> watchdog_sustain_arg("", "watchdog_sustain",
+      "The time that the host must look hung before --watchdog_outlet is "
+      "power cycled", false, HangWatchdogTransform::kDefaultSustainUs,
+      "microseconds", cmd);
+  ValueArg<uint64_t> watchdog_off_time_arg("", "watchdog_off_time",
+      "The time that --watchdog_outlet is held off during a power cycle",
+      false, HangWatchdogTransform::kDefaultOffTimeUs, "microseconds", cmd);
+  ValueArg<float> watchdog_min_step_arg("", "watchdog_min_step",
+      "The smallest change in current that verifies a switch of "
+      "--watchdog_outlet", false, HangWatchdogTransform::kDefaultMinStepMa,
+      "milliamps", cmd);
+  ValueArg<std::string> capture_dir_arg("", "capture_dir",
+      "Write bursts of samples around each trigger to files in this "
+      "directory. Outlets switched by this invocation are switched once "
+      "logging starts and fire a trigger", false, "", "path", cmd);
+  ValueArg<size_t> capture_pre_arg("", "capture_pre",
+      "The number of samples captured before a trigger",
+      false, BurstCaptureTransform::kDefaultPreTriggerCount, "count", cmd);
+  ValueArg<size_t> capture_post_arg("", "capture_post",
+      "The number of samples captured after a trigger",
+      false, BurstCaptureTransform::kDefaultPostTriggerCount, "count", cmd);
+  ValueArg<float> capture_threshold_arg("", "capture_threshold",
+      "Trigger a capture when current crosses this level, 0 to disable",
+      false, 0.0f, "milliamps", cmd);
+  ValueArg<float> antialias_cutoff_arg("", "antialias_cutoff",
+      "The cutoff of a low-pass filter applied before oversampled samples "
+      "are aggregated, 0 to disable", false, 0.0f, "hertz", cmd);
+
+  // Text output args.
+  ValueArg<std::string> format_arg("", "format",
+      "The format of logged samples: text or csv",
+      false, "text", "format", cmd);
+  ValueArg<std::string> output_path_arg("", "output",
+      "Write logged samples to a file instead of stdout",
+      false, "", "path", cmd);
+  ValueArg<std::string> compress_arg("", "compress",
+      "Compress logged samples: none or zstd",
+      false, "none", "algorithm", cmd);
+  ValueArg<int> compress_level_arg("", "compress_level",
+      "The compression level used with --compress",
+      false, ZstdOutputStream::kDefaultCompressionLevel, "level", cmd);
+
+  // StatsD output args.
+  ValueArg<std::string> statsd_address_arg("", "statsd",
+      "Send current, power and energy gauges to a StatsD agent",
+      false, "", "host:port", cmd);
+  ValueArg<std::string> statsd_prefix_arg("", "statsd_prefix",
+      "The prefix prepended to StatsD metric names",
+      false, kDefaultStatsdPrefix, "prefix", cmd);
+  ValueArg<int> statsd_flush_interval_arg("", "statsd_flush_interval",
+      "The maximum time that StatsD metrics are buffered before being sent",
+      false, SinkOptions::kDefaultFlushIntervalMs, "milliseconds", cmd);
+  ValueArg<size_t> statsd_max_packet_size_arg("", "statsd_max_packet_size",
+      "The maximum size of each datagram sent to StatsD",
+      false, StatsdSink::kDefaultMaxPacketSize, "bytes", cmd);
+
+  // MQTT output args.
+  ValueArg<std::string> mqtt_address_arg("", "mqtt",
+      "Publish samples to and accept outlet commands from an MQTT broker",
+      false, "", "host:port", cmd);
+  ValueArg<std::string> mqtt_topic_prefix_arg("", "mqtt_topic_prefix",
+      "The prefix of MQTT topics", false, kDefaultMqttTopicPrefix, "prefix",
+      cmd);
+  ValueArg<std::string> mqtt_client_id_arg("", "mqtt_client_id",
+      "The MQTT client identifier, defaults to one derived from the device",
+      false, "", "id", cmd);
+  ValueArg<size_t> mqtt_max_inflight_arg("", "mqtt_max_inflight",
+      "The maximum number of unacknowledged MQTT publishes",
+      false, MqttSink::kDefaultMaxInflight, "count", cmd);
+  ValueArg<size_t> mqtt_batch_size_arg("", "mqtt_batch_size",
+      "The maximum number of samples in each MQTT publish",
+      false, MqttSink::kDefaultMaxBatchSize, "count", cmd);
+
+  // SQLite output args.
+  ValueArg<std::string> sqlite_path_arg("", "sqlite",
+      "Store samples in a SQLite database", false, "", "path", cmd);
+  SwitchArg sqlite_rollups_arg("", "sqlite_rollups",
+      "Maintain per-minute rollups in the SQLite database", cmd, false);
+  ValueArg<size_t> sqlite_batch_size_arg("", "sqlite_batch_size",
+      "The number of samples inserted per SQLite transaction",
+      false, SqliteSink::kDefaultBatchSize, "count", cmd);
+
+  // Collector output args.
+  MultiArg<std::string> collector_address_arg("", "collector",
+      "Stream samples to a collector started with pwrusbctl collector. When "
+      "repeated, the device is assigned to one collector by consistent "
+      "hashing of its serial number", false, "host:port", cmd);
+  ValueArg<std::string> collector_stream_arg("", "collector_stream",
+      "The identifier of this stream at the collectors, defaults to the host "
+      "name and device. With --all_devices, the device is appended to it",
+      false, "", "id", cmd);
+  ValueArg<size_t> collector_batch_size_arg("", "collector_batch_size",
+      "The maximum number of samples in each batch sent to the collector",
+      false, CollectorSink::kDefaultMaxBatchSize, "count", cmd);
+  ValueArg<size_t> collector_window_arg("", "collector_window",
+      "The maximum number of batches awaiting acknowledgement from the "
+      "collector", false, CollectorSink::kDefaultWindowSize, "count", cmd);
+
+  // Pipeline args.
+  ValueArg<size_t> sink_queue_capacity_arg("", "sink_queue_capacity",
+      "The number of samples queued for each output before samples are dropped",
+      false, SinkOptions::kDefaultQueueCapacity, "count", cmd);
+  SwitchArg sink_stats_arg("", "sink_stats",
+      "Print the lag and drop counters of each output on exit", cmd, false);
+  SwitchArg jitter_stats_arg("", "jitter_stats",
+      "Print a histogram of how late each sample was taken on exit", cmd,
+      false);
+  SwitchArg virtual_clock_arg("", "virtual_clock",
+      "Sample as fast as the device allows while timestamping samples as if "
+      "the interval had elapsed, for benchmarking outputs", cmd, false);
+  ValueArg<std::string> spool_dir_arg("", "spool_dir",
+      "Spool samples for network outputs to disk when they cannot keep up",
+      false, "", "path", cmd);
+  ValueArg<uint64_t> spool_max_bytes_arg("", "spool_max_bytes",
+      "The maximum size of each output spool, 0 for unbounded",
+      false, 0, "bytes", cmd);
+  ValueArg<double> spool_drain_rate_arg("", "spool_drain_rate",
+      "The maximum rate at which a spool backlog is sent after recovery",
+      false, SinkOptions::kDefaultSpoolDrainRate, "samples/second", cmd);
 
   // Default outlet state args.
   ValueArg<size_t> outlet_default_enable_arg("", "outlet_default_enable",
@@ -266,53 +1361,105 @@ int main(int argc, char **argv) {
     CleanupAndAbort();
   }
 
+  // Options that act on a single device, or that assume samples from only one
+  // device, are not available when logging every device.
+  bool all_devices = all_devices_arg.getValue();
+  if (all_devices && (calibrate_arg.getValue() || recalibrate_arg.getValue()
+      || measure_actuation_arg.isSet() || outlet_default_enable_arg.isSet()
+      || outlet_default_disable_arg.isSet() || outlet_enable_arg.isSet()
+      || outlet_disable_arg.isSet() || outlet_disable_if_idle_arg.isSet()
+      || oversample_arg.isSet() || detect_steps_arg.isSet()
+      || marker_socket_arg.isSet() || attribute_arg.isSet()
+      || watchdog_outlet_arg.isSet() || capture_dir_arg.isSet()
+      || voltage_feed_arg.isSet() || jitter_stats_arg.getValue())) {
+    fprintf(stderr, "Error: --all_devices only supports logging, outputs, "
+            "--device_info, --reset_charge_accumulator and "
+            "--set_current_ratio\n");
+    CleanupAndAbort();
+  }
+
+  float current_ratio = set_current_ratio_arg.getValue();
+  if (all_devices && (current_ratio < -1.0f || current_ratio > 1.0f)) {
+    fprintf(stderr, "Invalid current ratio %f\n", current_ratio);
+    CleanupAndAbort();
+  }
+
+  if (sink_queue_capacity_arg.getValue() < 1) {
+    fprintf(stderr, "Invalid sink queue capacity %zu\n",
+            sink_queue_capacity_arg.getValue());
+    CleanupAndAbort();
+  }
+
+  if (statsd_flush_interval_arg.getValue() < 1) {
+    fprintf(stderr, "Invalid StatsD flush interval %d\n",
+            statsd_flush_interval_arg.getValue());
+    CleanupAndAbort();
+  }
+
   {
-    PowerUsbDevice device;
-    if (!device.IsInitialized()) {
-      fprintf(stderr, "Error opening the Power USB device: not found\n");
-      CleanupAndAbort();
-    }
+    // With --all_devices, every attached device is brought up in parallel
+    // once the pipeline is running and device remains null.
+    std::unique_ptr<PowerUsbDevice> device;
+    bool calibrate = calibrate_arg.getValue() || recalibrate_arg.getValue();
+    Calibration calibration = {};
+    bool capture = capture_dir_arg.isSet();
+    if (!all_devices) {
+      device.reset(new PowerUsbDevice());
+      if (!device->IsInitialized()) {
+        fprintf(stderr, "Error opening the Power USB device: not found\n");
+        CleanupAndAbort();
+      }
 
-    if (print_device_info_arg.getValue()) {
-      PrintDeviceType(device);
-    }
+      if (print_device_info_arg.getValue()) {
+        PrintDeviceType(*device);
+      }
 
-    if (reset_charge_accumulator_arg.getValue()) {
-      ResetChargeAccumulator(device);
-    }
+      if (calibrate) {
+        calibration = GetCalibration(*device, !recalibrate_arg.getValue());
+      }
 
-    if (set_current_ratio_arg.isSet()) {
-      SetCurrentRatio(device, set_current_ratio_arg.getValue());
-    }
+      if (measure_actuation_arg.isSet()) {
+        MeasureActuationLatency(*device, measure_actuation_arg.getValue(),
+                                actuation_trials_arg.getValue(),
+                                actuation_min_step_arg.getValue());
+      }
 
-    if (outlet_default_enable_arg.isSet()) {
-      size_t outlet_index = outlet_default_enable_arg.getValue();
-      SetDefaultSocketState(device, outlet_index, SocketState::On);
-    }
+      if (reset_charge_accumulator_arg.getValue()) {
+        ResetChargeAccumulator(*device);
+      }
 
-    if (outlet_default_disable_arg.isSet()) {
-      size_t outlet_index = outlet_default_disable_arg.getValue();
-      SetDefaultSocketState(device, outlet_index, SocketState::Off);
-    }
+      if (set_current_ratio_arg.isSet()) {
+        SetCurrentRatio(*device, set_current_ratio_arg.getValue());
+      }
 
-    for (size_t outlet_index : outlet_enable_arg) {
-      SetSocketState(device, outlet_index, SocketState::On);
-    }
+      if (outlet_default_enable_arg.isSet()) {
+        size_t outlet_index = outlet_default_enable_arg.getValue();
+        SetDefaultSocketState(*device, outlet_index, SocketState::On);
+      }
 
-    for (size_t outlet_index : outlet_disable_arg) {
-      SetSocketState(device, outlet_index, SocketState::Off);
-    }
+      if (outlet_default_disable_arg.isSet()) {
+        size_t outlet_index = outlet_default_disable_arg.getValue();
+        SetDefaultSocketState(*device, outlet_index, SocketState::Off);
+      }
 
-    for (size_t outlet_index : outlet_disable_if_idle_arg) {
-      int16_t current;
-      if (!device.GetInstantaneousCurrent(&current)) {
-        fprintf(stderr, "Error reading device current\n");
-        CleanupAndAbort();
+      // With a capture, outlets are switched once logging has started so that
+      // the capture records the switch.
+      if (!capture) {
+        SwitchOutlets(*device, outlet_enable_arg.getValue(),
+                      outlet_disable_arg.getValue());
       }
 
-      float power = (current / 1000.0f) * line_voltage_arg.getValue();
-      if (power < kDefaultMinPower) {
-        SetSocketState(device, outlet_index, SocketState::Off);
+      for (size_t outlet_index : outlet_disable_if_idle_arg) {
+        int16_t current;
+        if (!device->GetInstantaneousCurrent(&current)) {
+          fprintf(stderr, "Error reading device current\n");
+          CleanupAndAbort();
+        }
+
+        float power = (current / 1000.0f) * line_voltage_arg.getValue();
+        if (power < kDefaultMinPower) {
+          SetSocketState(*device, outlet_index, SocketState::Off);
+        }
       }
     }
 
@@ -325,8 +1472,394 @@ int main(int argc, char **argv) {
     logging_config.log_indefinitely = log_indefinitely_arg.getValue();
     logging_config.log_count = log_count_arg.getValue();
     logging_config.interval_us = interval_us_arg.getValue();
-    if (logging_config.LogsEnabled()) {
-      LogStats(device, logging_config);
+    logging_config.duration_us = 0;
+
+    // When oversampling, the device is sampled at the oversampling interval
+    // for as long as the requested number of outputs would take, and the
+    // samples are decimated to one output per --interval.
+    uint64_t output_interval_us = interval_us_arg.getValue();
+    if (oversample_arg.isSet()) {
+      if (oversample_arg.getValue() == 0
+          || oversample_arg.getValue() > output_interval_us) {
+        fprintf(stderr, "Oversampling interval must be between 1us and the "
+                "interval\n");
+        CleanupAndAbort();
+      }
+
+      logging_config.interval_us = oversample_arg.getValue();
+      logging_config.duration_us = log_count_arg.getValue()
+          * output_interval_us;
+    }
+
+    // An interval below what the device sustains only measures USB latency.
+    if (calibrate && static_cast<uint64_t>(logging_config.interval_us)
+        < calibration.min_interval_us) {
+      fprintf(stderr, "Interval %dus is shorter than the device sustains, "
+              "using %" PRIu64 "us\n", logging_config.interval_us,
+              calibration.min_interval_us);
+      logging_config.interval_us = calibration.min_interval_us;
+    }
+
+    // The virtual clock starts at the current time so that timestamps remain
+    // plausible, but skips every sleep.
+    VirtualClock virtual_clock(GetMonotonicTimeUs(), GetWallClockOffsetUs());
+    Clock *clock = virtual_clock_arg.getValue()
+        ? static_cast<Clock *>(&virtual_clock) : SystemClock::GetInstance();
+
+    // Build the output pipeline. Text output is always enabled.
+    SinkOptions sink_options;
+    sink_options.queue_capacity = sink_queue_capacity_arg.getValue();
+    std::unique_ptr<DeviceBringUp> bring_up;
+    if (all_devices) {
+      std::vector<std::string> paths;
+      PowerUsbDevice::EnumerateDevicePaths(&paths);
+      if (paths.empty()) {
+        fprintf(stderr, "Error opening the Power USB device: not found\n");
+        CleanupAndAbort();
+      }
+
+      bring_up.reset(new DeviceBringUp(paths,
+          bring_up_parallelism_arg.getValue(), *clock));
+    }
+
+    Pipeline pipeline(*clock);
+
+    // CPU time is read as samples enter the pipeline so that it lines up with
+    // the current, which means that attribution uses the nominal voltage.
+    CpuAttributionTransform *attribution_transform = nullptr;
+    if (attribute_arg.isSet()) {
+      if (!(logging_config.log_current || logging_config.log_power)) {
+        fprintf(stderr, "--attribute requires --current or --power\n");
+        CleanupAndAbort();
+      }
+
+      attribution_transform = new CpuAttributionTransform(
+          attribute_arg.getValue(), attribution_idle_arg.isSet()
+              ? attribution_idle_arg.getValue() : -1.0f,
+          attribution_interval_arg.getValue());
+      pipeline.AddTransform(
+          std::unique_ptr<Transform>(attribution_transform));
+      if (!attribution_transform->IsInitialized()) {
+        CleanupAndAbort();
+      }
+    }
+
+    // Measured voltage is joined next so that every later stage sees the
+    // corrected power.
+    VoltageJoinTransform *voltage_transform = nullptr;
+    if (voltage_feed_arg.isSet()) {
+      std::unique_ptr<VoltageFeed> voltage_feed(new VoltageFeed(
+          voltage_feed_arg.getValue(), VoltageFeed::kDefaultCapacity, *clock));
+      if (!voltage_feed->IsInitialized()) {
+        fprintf(stderr, "Error opening voltage feed %s\n",
+                voltage_feed_arg.getValue().c_str());
+        CleanupAndAbort();
+      }
+
+      voltage_transform = new VoltageJoinTransform(std::move(voltage_feed),
+          logging_config.line_voltage, voltage_max_lag_arg.getValue());
+      pipeline.AddTransform(std::unique_ptr<Transform>(voltage_transform));
+    }
+
+    // The capture runs ahead of the decimating and step transforms so that it
+    // records the full sampling rate, and after the voltage join so that it
+    // records the corrected power.
+    BurstCaptureTransform *capture_transform = nullptr;
+    if (capture) {
+      if (!(logging_config.log_current || logging_config.log_power)) {
+        fprintf(stderr, "--capture_dir requires --current or --power\n");
+        CleanupAndAbort();
+      }
+
+      capture_transform = new BurstCaptureTransform(capture_dir_arg.getValue(),
+          capture_pre_arg.getValue(), capture_post_arg.getValue(),
+          capture_threshold_arg.getValue(), *clock);
+      pipeline.AddTransform(std::unique_ptr<Transform>(capture_transform));
+    }
+
+    // Regions are integrated before decimation so that they use every sample.
+    std::unique_ptr<MarkerServer> marker_server;
+    if (marker_socket_arg.isSet()) {
+      if (!(logging_config.log_current || logging_config.log_power)) {
+        fprintf(stderr, "--marker_socket requires --current or --power\n");
+        CleanupAndAbort();
+      }
+
+      char device_id[kMaxDeviceIdLength];
+      GetDeviceId(*device, device_id);
+      marker_server.reset(new MarkerServer(marker_socket_arg.getValue(),
+                                           device_id, *clock));
+      if (!marker_server->IsInitialized()) {
+        fprintf(stderr, "Error opening marker socket %s\n",
+                marker_socket_arg.getValue().c_str());
+        CleanupAndAbort();
+      }
+
+      pipeline.AddTransform(std::unique_ptr<Transform>(new RegionTransform()));
+    }
+
+    // The watchdog learns from every sample, ahead of decimation.
+    HangWatchdogTransform *watchdog_transform = nullptr;
+    if (watchdog_outlet_arg.isSet()) {
+      if (watchdog_outlet_arg.getValue() >= device->GetSocketCount()
+          || !(logging_config.log_current || logging_config.log_power)) {
+        fprintf(stderr, "--watchdog_outlet requires a valid outlet and "
+                "--current or --power\n");
+        CleanupAndAbort();
+      }
+
+      watchdog_transform = new HangWatchdogTransform(*device,
+          watchdog_outlet_arg.getValue(), watchdog_sustain_arg.getValue(),
+          watchdog_off_time_arg.getValue(),
+          watchdog_min_step_arg.getValue());
+      pipeline.AddTransform(std::unique_ptr<Transform>(watchdog_transform));
+    }
+
+    if (steps_only_arg.getValue() && !detect_steps_arg.isSet()) {
+      fprintf(stderr, "--steps_only requires --detect_steps\n");
+      CleanupAndAbort();
+    }
+
+    // Steps are detected before decimation so that they are located at the
+    // full sampling rate.
+    if (detect_steps_arg.isSet()) {
+      if (detect_steps_arg.getValue() <= 0.0f
+          || !(logging_config.log_current || logging_config.log_power)) {
+        fprintf(stderr, "--detect_steps requires a positive step and "
+                "--current or --power\n");
+        CleanupAndAbort();
+      }
+
+      pipeline.AddTransform(std::unique_ptr<Transform>(
+          new StepDetectionTransform(detect_steps_arg.getValue(),
+                                     !steps_only_arg.getValue())));
+    }
+
+    if (oversample_arg.isSet()) {
+      pipeline.AddTransform(std::unique_ptr<Transform>(new DecimatingTransform(
+          output_interval_us, antialias_cutoff_arg.getValue())));
+    }
+
+    pipeline.AddSink("text", OpenTextSink(logging_config,
+        format_arg.getValue(), output_path_arg.getValue(),
+        compress_arg.getValue(), compress_level_arg.getValue(), all_devices),
+        sink_options);
+
+    if (statsd_address_arg.isSet()) {
+      std::unique_ptr<StatsdSink> statsd_sink(new StatsdSink(
+          statsd_address_arg.getValue(), statsd_prefix_arg.getValue(),
+          statsd_max_packet_size_arg.getValue(), all_devices));
+      if (!statsd_sink->IsInitialized()) {
+        fprintf(stderr, "Error opening StatsD socket for %s\n",
+                statsd_address_arg.getValue().c_str());
+        CleanupAndAbort();
+      }
+
+      SinkOptions statsd_options = GetNetworkSinkOptions(sink_options,
+          "statsd", spool_dir_arg.getValue(), spool_max_bytes_arg.getValue(),
+          spool_drain_rate_arg.getValue());
+      statsd_options.flush_interval_ms = statsd_flush_interval_arg.getValue();
+      pipeline.AddSink("statsd", std::move(statsd_sink), statsd_options);
+    }
+
+    if (mqtt_address_arg.isSet()) {
+      // A client logging every device is named after the host.
+      char device_id[kMaxDeviceIdLength] = {};
+      if (device != nullptr) {
+        GetDeviceId(*device, device_id);
+      } else {
+        gethostname(device_id, sizeof(device_id) - 1);
+      }
+
+      std::string client_id = mqtt_client_id_arg.isSet()
+          ? mqtt_client_id_arg.getValue()
+          : std::string("pwrusbctl-") + device_id;
+
+      // Commands arrive on the MQTT reader thread. PowerUsbDevice serializes
+      // transactions, so they may interleave safely with sampling.
+      std::string local_device_id(device_id);
+      const PowerUsbDevice *local_device = device.get();
+      const DeviceBringUp *devices = bring_up.get();
+      auto command_handler = [local_device, local_device_id, devices,
+                              capture_transform](
+          const std::string& target_device_id, size_t outlet,
+          SocketState state) {
+        const PowerUsbDevice *target_device = nullptr;
+        if (devices != nullptr) {
+          target_device = devices->FindDevice(target_device_id);
+        } else if (target_device_id == local_device_id) {
+          target_device = local_device;
+        }
+
+        if (target_device == nullptr
+            || outlet >= target_device->GetSocketCount()
+            || !target_device->SetSocketState(outlet, state)) {
+          return false;
+        }
+
+        if (capture_transform != nullptr) {
+          capture_transform->Trigger();
+        }
+
+        return true;
+      };
+
+      pipeline.AddSink("mqtt", std::unique_ptr<Sink>(new MqttSink(
+          mqtt_address_arg.getValue(), mqtt_topic_prefix_arg.getValue(),
+          client_id, mqtt_max_inflight_arg.getValue(),
+          mqtt_batch_size_arg.getValue(), command_handler, *clock)),
+          GetNetworkSinkOptions(sink_options, "mqtt",
+              spool_dir_arg.getValue(), spool_max_bytes_arg.getValue(),
+              spool_drain_rate_arg.getValue()));
+    }
+
+    if (sqlite_path_arg.isSet()) {
+      std::unique_ptr<SqliteSink> sqlite_sink(new SqliteSink(
+          sqlite_path_arg.getValue(), sqlite_rollups_arg.getValue(),
+          sqlite_batch_size_arg.getValue(), *clock));
+      if (!sqlite_sink->IsInitialized()) {
+        fprintf(stderr, "Error opening SQLite database %s\n",
+                sqlite_path_arg.getValue().c_str());
+        CleanupAndAbort();
+      }
+
+      pipeline.AddSink("sqlite", std::move(sqlite_sink), sink_options);
+    }
+
+    if (collector_address_arg.isSet()) {
+      // Every device has a stream of its own that is sharded by its serial
+      // number. When logging every device, the streams are created as the
+      // devices produce their first samples.
+      char host_name[256] = {};
+      gethostname(host_name, sizeof(host_name) - 1);
+      auto create_collector_sink = [&](const std::string& device_id)
+          -> std::unique_ptr<Sink> {
+        std::string stream_id = collector_stream_arg.getValue();
+        if (stream_id.empty()) {
+          stream_id = std::string(host_name) + "/" + device_id;
+        } else if (all_devices) {
+          stream_id += "/" + device_id;
+        }
+
+        CollectorSink *collector_sink = new CollectorSink(
+            collector_address_arg.getValue(), stream_id, device_id,
+            collector_batch_size_arg.getValue(),
+            collector_window_arg.getValue(), *clock);
+        std::unique_ptr<Sink> sink(collector_sink);
+        if (!collector_sink->IsInitialized()) {
+          return nullptr;
+        }
+
+        return sink;
+      };
+
+      std::string device_id(host_name);
+      if (device != nullptr) {
+        char serial[kMaxDeviceIdLength];
+        GetDeviceId(*device, serial);
+        device_id = serial;
+      }
+
+      std::unique_ptr<Sink> collector_sink = create_collector_sink(device_id);
+      if (collector_sink == nullptr) {
+        fprintf(stderr, "Error resolving collector addresses\n");
+        CleanupAndAbort();
+      }
+
+      if (all_devices) {
+        collector_sink.reset(new PerDeviceSink(create_collector_sink));
+      }
+
+      pipeline.AddSink("collector", std::move(collector_sink),
+          GetNetworkSinkOptions(sink_options, "collector",
+              spool_dir_arg.getValue(), spool_max_bytes_arg.getValue(),
+              spool_drain_rate_arg.getValue()));
+    }
+
+    if (bring_up != nullptr) {
+      // Each device is probed and configured as it is opened, ahead of its
+      // first sample. Every device is probed for its type so that devices
+      // that do not respond are left out.
+      auto probe = [&](const PowerUsbDevice& device) {
+        const char *device_type = device.GetDeviceType();
+        if (device_type == nullptr) {
+          return false;
+        }
+
+        if (print_device_info_arg.getValue()) {
+          char device_id[kMaxDeviceIdLength];
+          GetDeviceId(device, device_id);
+          fprintf(stdout, "Found PowerUSB device type: %s (%s)\n",
+                  device_type, device_id);
+        }
+
+        return (!reset_charge_accumulator_arg.getValue()
+                || device.ResetChargeAccumulator())
+            && (!set_current_ratio_arg.isSet()
+                || device.SetCurrentRatio(current_ratio));
+      };
+
+      pipeline.Start();
+      LogAllDevices(bring_up.get(), probe, logging_config, &pipeline, clock,
+                    sink_stats_arg.getValue());
+      pipeline.Stop();
+      if (sink_stats_arg.getValue() && logging_config.LogsEnabled()) {
+        pipeline.PrintStats(stderr);
+        if (voltage_transform != nullptr) {
+          voltage_transform->PrintStats(stderr);
+        }
+      }
+    } else if (logging_config.LogsEnabled()) {
+      Histogram lateness_histogram(kLatenessBucketsUs);
+      pipeline.Start();
+      std::atomic<bool> logging_done(false);
+      std::thread switch_thread;
+      if (capture) {
+        switch_thread = std::thread(SwitchOutletsForCapture,
+            std::cref(*device), outlet_enable_arg.getValue(),
+            outlet_disable_arg.getValue(), capture_transform,
+            std::cref(logging_done));
+      }
+
+      bool logged = LogStats(*device, logging_config, &pipeline, clock,
+                             &lateness_histogram, marker_server.get());
+      logging_done = true;
+      if (switch_thread.joinable()) {
+        switch_thread.join();
+      }
+
+      pipeline.Stop();
+      if (!logged) {
+        CleanupAndAbort();
+      }
+
+      if (jitter_stats_arg.getValue()) {
+        lateness_histogram.Print(stderr, "Sampling lateness", "us");
+      }
+
+      if (sink_stats_arg.getValue()) {
+        device->PrintStats(stderr);
+        pipeline.PrintStats(stderr);
+        if (capture_transform != nullptr) {
+          capture_transform->PrintStats(stderr);
+        }
+
+        if (marker_server != nullptr) {
+          marker_server->PrintStats(stderr);
+        }
+
+        if (voltage_transform != nullptr) {
+          voltage_transform->PrintStats(stderr);
+        }
+
+        if (attribution_transform != nullptr) {
+          attribution_transform->PrintStats(stderr);
+        }
+
+        if (watchdog_transform != nullptr) {
+          watchdog_transform->PrintStats(stderr);
+        }
+      }
     }
   }
 
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "marker_client.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "util/time.h"
+
+namespace pwrusbctl {
+
+MarkerClient::MarkerClient(const std::string& path)
+    : path_(path),
+      socket_(socket(AF_UNIX, SOCK_DGRAM, 0)) {}
+
+MarkerClient::~MarkerClient() {
+  if (IsInitialized()) {
+    close(socket_);
+  }
+}
+
+bool MarkerClient::IsInitialized() const {
+  return (socket_ >= 0);
+}
+
+bool MarkerClient::Begin(const std::string& name) {
+  return Send("begin", name);
+}
+
+bool MarkerClient::End(const std::string& name) {
+  return Send("end", name);
+}
+
+bool MarkerClient::Send(const char *kind, const std::string& name) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (!IsInitialized() || path_.size() >= sizeof(address.sun_path)) {
+    return false;
+  }
+
+  strncpy(address.sun_path, path_.c_str(), sizeof(address.sun_path) - 1);
+  char message[128];
+  int length = snprintf(message, sizeof(message), "%s %s %" PRIu64, kind,
+                        name.c_str(), GetMonotonicTimeUs());
+  if (length < 0 || static_cast<size_t>(length) >= sizeof(message)) {
+    return false;
+  }
+
+  return sendto(socket_, message, length, MSG_DONTWAIT,
+                reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)) == length;
+}
+
+}  // namespace pwrusbctl
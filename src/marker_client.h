@@ -0,0 +1,91 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_MARKER_CLIENT_H_
+#define PWRUSBCTL_MARKER_CLIENT_H_
+
+#include <string>
+
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * Sends region markers to a pwrusbctl instance started with --marker_socket
+ * so that it reports the energy and peak power of each region. This only
+ * depends on the standard library so that applications can link it on its
+ * own, as libpwrusbmarker.a.
+ *
+ * Markers are timestamped when they are sent. Sending never blocks and
+ * delivery is best-effort: a marker sent while no sampler is listening is
+ * lost, so applications may ignore the result of sending.
+ */
+class MarkerClient : public NonCopyable {
+ public:
+  /**
+   * Constructs a MarkerClient that sends to a socket.
+   *
+   * @param path The path of the socket given to --marker_socket.
+   */
+  explicit MarkerClient(const std::string& path);
+
+  /**
+   * Closes the socket.
+   */
+  ~MarkerClient();
+
+  /**
+   * @return Returns true if the socket was created.
+   */
+  bool IsInitialized() const;
+
+  /**
+   * Marks the start of a region.
+   *
+   * @param name The name of the region. Limited to 31 letters, digits, '_',
+   *        '-' and '.'.
+   * @return Returns false if the marker could not be sent.
+   */
+  bool Begin(const std::string& name);
+
+  /**
+   * Marks the end of a region.
+   *
+   * @param name The name of the region.
+   * @return Returns false if the marker could not be sent.
+   */
+  bool End(const std::string& name);
+
+ private:
+  //! The path of the socket.
+  const std::string path_;
+
+  //! The socket used to send markers.
+  int socket_;
+
+  /**
+   * Sends a marker timestamped with the current time.
+   *
+   * @param kind The kind of marker, "begin" or "end".
+   * @param name The name of the region.
+   * @return Returns false if the marker could not be sent.
+   */
+  bool Send(const char *kind, const std::string& name);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_MARKER_CLIENT_H_
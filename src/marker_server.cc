@@ -0,0 +1,240 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "marker_server.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The maximum length of a marker datagram.
+constexpr size_t kMaxMarkerLength(128);
+
+//! The interval at which the receiver thread checks whether to stop.
+constexpr int kStopPollIntervalMs(100);
+
+constexpr size_t MarkerServer::kMaxPendingMarkers;
+
+/**
+ * Checks that a region name only contains characters that every output can
+ * carry unescaped.
+ *
+ * @param name The null-terminated name to check.
+ * @return Returns true if the name is valid.
+ */
+static bool IsValidRegionName(const char *name) {
+  if (name[0] == '\0') {
+    return false;
+  }
+
+  for (const char *c = name; *c != '\0'; c++) {
+    bool valid = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')
+        || (*c >= '0' && *c <= '9') || *c == '_' || *c == '-' || *c == '.';
+    if (!valid) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+MarkerServer::MarkerServer(const std::string& path, const char *device_id,
+                           const Clock& clock)
+    : path_(path),
+      device_id_(),
+      clock_(clock),
+      socket_(-1),
+      stopping_(false),
+      received_count_(0),
+      rejected_count_(0) {
+  strncpy(device_id_, device_id, sizeof(device_id_) - 1);
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Marker socket path too long: %s\n", path_.c_str());
+    return;
+  }
+
+  strncpy(address.sun_path, path_.c_str(), sizeof(address.sun_path) - 1);
+  socket_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (socket_ < 0) {
+    return;
+  }
+
+  // A socket left behind by a previous run would prevent binding. It is only
+  // removed if nothing is bound to it any more, so that a running instance
+  // keeps its socket. Anything else at the path is left alone and binding
+  // fails.
+  struct stat path_stat;
+  if (lstat(path_.c_str(), &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+    int probe = socket(AF_UNIX, SOCK_DGRAM, 0);
+    bool stale = (probe >= 0 && connect(probe,
+        reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+        && errno == ECONNREFUSED);
+    if (probe >= 0) {
+      close(probe);
+    }
+
+    if (!stale) {
+      fprintf(stderr, "Error binding marker socket %s: already in use\n",
+              path_.c_str());
+      close(socket_);
+      socket_ = -1;
+      return;
+    }
+
+    unlink(path_.c_str());
+  }
+
+  if (bind(socket_, reinterpret_cast<sockaddr *>(&address),
+           sizeof(address)) != 0) {
+    fprintf(stderr, "Error binding marker socket %s: %s\n", path_.c_str(),
+            strerror(errno));
+    close(socket_);
+    socket_ = -1;
+    return;
+  }
+
+  receiver_thread_ = std::thread(&MarkerServer::ReceiveLoop, this);
+}
+
+MarkerServer::~MarkerServer() {
+  if (IsInitialized()) {
+    stopping_ = true;
+    receiver_thread_.join();
+    close(socket_);
+    unlink(path_.c_str());
+  }
+}
+
+bool MarkerServer::IsInitialized() const {
+  return (socket_ >= 0);
+}
+
+bool MarkerServer::PopMarker(uint64_t before_us, Sample *marker) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pending_.empty() || pending_.front().timestamp_us >= before_us) {
+    return false;
+  }
+
+  *marker = pending_.front();
+  pending_.pop_front();
+  return true;
+}
+
+void MarkerServer::PrintStats(FILE *file) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  fprintf(file, "Markers: received %" PRIu64 ", rejected %" PRIu64 "\n",
+          received_count_, rejected_count_);
+}
+
+void MarkerServer::ReceiveLoop() {
+  char message[kMaxMarkerLength + 1];
+  while (!stopping_) {
+    pollfd poll_fd = { socket_, POLLIN, 0 };
+    if (poll(&poll_fd, 1, kStopPollIntervalMs) <= 0) {
+      continue;
+    }
+
+    ssize_t length = recv(socket_, message, kMaxMarkerLength, 0);
+    if (length < 0) {
+      continue;
+    }
+
+    message[length] = '\0';
+    Sample marker;
+    bool valid = ParseMarker(message, &marker);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!valid || pending_.size() >= kMaxPendingMarkers) {
+      rejected_count_++;
+      continue;
+    }
+
+    // Markers that carry their own timestamp may arrive slightly out of
+    // order, so insert from the back to keep the queue sorted.
+    auto it = pending_.end();
+    while (it != pending_.begin()
+           && (it - 1)->timestamp_us > marker.timestamp_us) {
+      --it;
+    }
+
+    pending_.insert(it, marker);
+    received_count_++;
+  }
+}
+
+bool MarkerServer::ParseMarker(const char *message, Sample *marker) const {
+  // The name buffer holds one more character than a valid name so that a
+  // name that is too long is detected rather than truncated.
+  char kind[8];
+  char name[kMaxRegionNameLength + 1];
+  int name_end = 0;
+  if (sscanf(message, "%7s %32s%n", kind, name, &name_end) != 2
+      || strlen(name) >= kMaxRegionNameLength || !IsValidRegionName(name)) {
+    return false;
+  }
+
+  // The name may be followed by a timestamp and nothing else.
+  const char *rest = message + name_end;
+  while (isspace(static_cast<unsigned char>(*rest))) {
+    rest++;
+  }
+
+  bool has_timestamp = (*rest != '\0');
+  uint64_t timestamp_us = 0;
+  if (has_timestamp) {
+    char *timestamp_end;
+    timestamp_us = strtoull(rest, &timestamp_end, 10);
+    bool has_digits = (timestamp_end != rest);
+    rest = timestamp_end;
+    while (isspace(static_cast<unsigned char>(*rest))) {
+      rest++;
+    }
+
+    if (!has_digits || *rest != '\0') {
+      return false;
+    }
+  }
+
+  *marker = Sample();
+  if (strcmp(kind, "begin") == 0) {
+    marker->type = SampleType::RegionBegin;
+  } else if (strcmp(kind, "end") == 0) {
+    marker->type = SampleType::RegionEnd;
+  } else {
+    return false;
+  }
+
+  memcpy(marker->device_id, device_id_, sizeof(marker->device_id));
+  strncpy(marker->region, name, sizeof(marker->region) - 1);
+  marker->timestamp_us = has_timestamp
+      ? timestamp_us : clock_.GetMonotonicTimeUs();
+  return true;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_MARKER_SERVER_H_
+#define PWRUSBCTL_MARKER_SERVER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "sample.h"
+#include "util/clock.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * Receives region markers from applications over a Unix datagram socket and
+ * queues them as RegionBegin and RegionEnd samples. Each datagram is a line
+ * of text of the form:
+ *
+ *   begin <name> [<timestamp_us>]
+ *   end <name> [<timestamp_us>]
+ *
+ * The timestamp is on the monotonic clock that samples are timestamped with.
+ * If it is omitted, the marker is timestamped when it is received. Names are
+ * limited to letters, digits, '_', '-' and '.' so that they can be used
+ * unescaped in every output.
+ *
+ * Markers are received on a separate thread. The sampling loop pops them so
+ * that they enter the pipeline in timestamp order with the samples.
+ */
+class MarkerServer : public NonCopyable {
+ public:
+  //! The maximum number of markers queued before further markers are
+  //! rejected.
+  static constexpr size_t kMaxPendingMarkers = 1024;
+
+  /**
+   * Constructs a MarkerServer listening on a socket, replacing any existing
+   * file at the path. The return value of IsInitialized() must be checked
+   * before popping markers.
+   *
+   * @param path The path of the socket.
+   * @param device_id The device identifier that markers are attributed to.
+   * @param clock The clock used to timestamp markers that lack a timestamp.
+   */
+  MarkerServer(const std::string& path, const char *device_id,
+               const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Stops receiving, closes the socket and removes it.
+   */
+  ~MarkerServer();
+
+  /**
+   * @return Returns true if the socket was created.
+   */
+  bool IsInitialized() const;
+
+  /**
+   * Pops the oldest queued marker if it is older than a timestamp.
+   *
+   * @param before_us The timestamp that the marker must be older than.
+   * @param marker The marker to populate.
+   * @return Returns false if no queued marker is older than before_us.
+   */
+  bool PopMarker(uint64_t before_us, Sample *marker);
+
+  /**
+   * Prints the number of markers received and rejected.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  //! The path of the socket.
+  const std::string path_;
+
+  //! The device identifier that markers are attributed to.
+  char device_id_[kMaxDeviceIdLength];
+
+  //! The clock used to timestamp markers that lack a timestamp.
+  const Clock& clock_;
+
+  //! The socket that markers are received on, -1 if it could not be created.
+  int socket_;
+
+  //! Set to stop the receiver thread.
+  std::atomic<bool> stopping_;
+
+  //! The thread that receives markers.
+  std::thread receiver_thread_;
+
+  //! Guards all members below.
+  mutable std::mutex mutex_;
+
+  //! The markers waiting to be popped in ascending order of timestamp.
+  std::deque<Sample> pending_;
+
+  //! The number of markers accepted.
+  uint64_t received_count_;
+
+  //! The number of datagrams that were malformed or did not fit the queue.
+  uint64_t rejected_count_;
+
+  /**
+   * The entry point of the receiver thread.
+   */
+  void ReceiveLoop();
+
+  /**
+   * Parses a marker datagram.
+   *
+   * @param message The null-terminated datagram.
+   * @param marker The marker to populate.
+   * @return Returns false if the datagram is malformed.
+   */
+  bool ParseMarker(const char *message, Sample *marker) const;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_MARKER_SERVER_H_
@@ -0,0 +1,455 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mqtt_client.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+namespace pwrusbctl {
+
+//! The packet types used by this client, pre-shifted into the upper nibble.
+constexpr uint8_t kConnectPacket(0x10);
+constexpr uint8_t kConnackPacket(0x20);
+constexpr uint8_t kPublishPacket(0x30);
+constexpr uint8_t kPubackPacket(0x40);
+constexpr uint8_t kSubscribePacket(0x82);
+constexpr uint8_t kSubackPacket(0x90);
+constexpr uint8_t kPingreqPacket(0xC0);
+constexpr uint8_t kPingrespPacket(0xD0);
+constexpr uint8_t kDisconnectPacket(0xE0);
+
+//! The flags of a PUBLISH packet.
+constexpr uint8_t kPublishDuplicateFlag(0x08);
+constexpr uint8_t kPublishQos1Flag(0x02);
+constexpr uint8_t kPublishQosMask(0x06);
+
+//! The CONNECT flag requesting a clean session.
+constexpr uint8_t kConnectCleanSessionFlag(0x02);
+
+//! The protocol level of MQTT 3.1.1.
+constexpr uint8_t kProtocolLevel(4);
+
+//! The maximum time to wait for the broker to accept a connection.
+constexpr int kConnackTimeoutMs(5000);
+
+//! The largest remaining length accepted from the broker.
+constexpr size_t kMaxPacketLength(256 * 1024);
+
+/**
+ * Appends a big-endian 16-bit integer to a buffer.
+ */
+static void AppendUint16(std::vector<uint8_t> *buffer, uint16_t value) {
+  buffer->push_back(value >> 8);
+  buffer->push_back(value & 0xFF);
+}
+
+/**
+ * Appends a length-prefixed UTF-8 string to a buffer.
+ */
+static void AppendString(std::vector<uint8_t> *buffer,
+                         const std::string& value) {
+  AppendUint16(buffer, value.size());
+  buffer->insert(buffer->end(), value.begin(), value.end());
+}
+
+/**
+ * Encodes a packet by prepending the fixed header to a body.
+ *
+ * @param header The first byte of the fixed header.
+ * @param body The variable header and payload of the packet.
+ * @return The encoded packet.
+ */
+static std::vector<uint8_t> EncodePacket(uint8_t header,
+                                         const std::vector<uint8_t>& body) {
+  std::vector<uint8_t> packet;
+  packet.reserve(body.size() + 5);
+  packet.push_back(header);
+
+  // The remaining length is encoded seven bits at a time.
+  size_t length = body.size();
+  do {
+    uint8_t byte = length % 128;
+    length /= 128;
+    if (length > 0) {
+      byte |= 0x80;
+    }
+
+    packet.push_back(byte);
+  } while (length > 0);
+
+  packet.insert(packet.end(), body.begin(), body.end());
+  return packet;
+}
+
+/**
+ * Receives exactly length bytes from a socket.
+ *
+ * @return Returns false if the connection closes or an error occurs.
+ */
+static bool ReceiveAll(int socket, uint8_t *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t received = recv(socket, buffer, length, 0);
+    if (received <= 0) {
+      return false;
+    }
+
+    buffer += received;
+    length -= received;
+  }
+
+  return true;
+}
+
+/**
+ * Reads a single packet from a socket.
+ *
+ * @param socket The socket to read from.
+ * @param header Populated with the first byte of the fixed header.
+ * @param body Populated with the remainder of the packet.
+ * @return Returns false if an error occurs or the packet is too large.
+ */
+static bool ReadPacket(int socket, uint8_t *header,
+                       std::vector<uint8_t> *body) {
+  if (!ReceiveAll(socket, header, 1)) {
+    return false;
+  }
+
+  size_t length = 0;
+  size_t multiplier = 1;
+  uint8_t byte;
+  do {
+    if (multiplier > 128 * 128 * 128 || !ReceiveAll(socket, &byte, 1)) {
+      return false;
+    }
+
+    length += (byte & 0x7F) * multiplier;
+    multiplier *= 128;
+  } while (byte & 0x80);
+
+  if (length > kMaxPacketLength) {
+    return false;
+  }
+
+  body->resize(length);
+  return (length == 0) || ReceiveAll(socket, body->data(), length);
+}
+
+MqttClient::MqttClient(const std::string& address,
+                       const std::string& client_id, int keepalive_s,
+                       size_t max_inflight, MessageHandler handler)
+    : address_(address),
+      client_id_(client_id),
+      keepalive_(keepalive_s),
+      max_inflight_(max_inflight),
+      handler_(handler),
+      socket_(-1),
+      next_packet_id_(1) {}
+
+MqttClient::~MqttClient() {
+  int socket = -1;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    socket = socket_;
+  }
+
+  if (socket >= 0) {
+    std::vector<uint8_t> empty;
+    SendPacket(socket, EncodePacket(kDisconnectPacket, empty));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CloseSocket();
+  }
+
+  if (reader_thread_.joinable()) {
+    reader_thread_.join();
+  }
+}
+
+bool MqttClient::Connect() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (socket_ >= 0) {
+      return true;
+    }
+  }
+
+  // The reader of a previous connection closes its socket before exiting.
+  if (reader_thread_.joinable()) {
+    reader_thread_.join();
+  }
+
+  SocketAddress address;
+  if (!ResolveSocketAddress(address_, SOCK_STREAM, &address)) {
+    return false;
+  }
+
+  int socket = ::socket(address.storage.ss_family, SOCK_STREAM, 0);
+  if (socket < 0) {
+    return false;
+  }
+
+  if (connect(socket, address.get(), address.length) != 0) {
+    close(socket);
+    return false;
+  }
+
+  std::vector<uint8_t> body;
+  AppendString(&body, "MQTT");
+  body.push_back(kProtocolLevel);
+  body.push_back(kConnectCleanSessionFlag);
+  AppendUint16(&body, keepalive_.count());
+  AppendString(&body, client_id_);
+
+  uint8_t header;
+  std::vector<uint8_t> response;
+  pollfd poll_fd = { socket, POLLIN, 0 };
+  if (!SendPacket(socket, EncodePacket(kConnectPacket, body))
+      || poll(&poll_fd, 1, kConnackTimeoutMs) != 1
+      || !ReadPacket(socket, &header, &response)
+      || header != kConnackPacket || response.size() != 2
+      || response[1] != 0) {
+    fprintf(stderr, "MQTT broker %s refused the connection\n",
+            address_.c_str());
+    close(socket);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool success = true;
+  for (const std::string& filter : subscriptions_) {
+    success &= SendSubscribe(socket, filter);
+  }
+
+  // A clean session discards unacknowledged messages on the broker side, so
+  // resend them to avoid losing data across the reconnect.
+  for (const auto& message : inflight_) {
+    success &= SendPublish(socket, message.first, message.second, true);
+  }
+
+  if (!success) {
+    close(socket);
+    return false;
+  }
+
+  socket_ = socket;
+  reader_thread_ = std::thread(&MqttClient::ReaderLoop, this, socket);
+  return true;
+}
+
+bool MqttClient::IsConnected() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return (socket_ >= 0);
+}
+
+bool MqttClient::Subscribe(const std::string& filter) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  subscriptions_.push_back(filter);
+  return (socket_ < 0) || SendSubscribe(socket_, filter);
+}
+
+bool MqttClient::Publish(const std::string& topic, const std::string& payload,
+                         std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!inflight_condition_.wait_for(lock, timeout, [this]() {
+        return socket_ < 0 || inflight_.size() < max_inflight_;
+      }) || socket_ < 0) {
+    return false;
+  }
+
+  uint16_t packet_id = AllocatePacketId();
+  InflightMessage& message = inflight_[packet_id];
+  message.topic = topic;
+  message.payload = payload;
+  int socket = socket_;
+
+  // Send without holding the lock so that the reader thread can continue to
+  // process acknowledgements if the send blocks.
+  lock.unlock();
+  InflightMessage copy = { topic, payload };
+  if (!SendPublish(socket, packet_id, copy, false)) {
+    // Once a message is in flight it is resent after a reconnect, so a send
+    // failure here is not reported to the caller.
+    lock.lock();
+    if (socket_ == socket) {
+      CloseSocket();
+    }
+  }
+
+  return true;
+}
+
+size_t MqttClient::GetInflightCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return inflight_.size();
+}
+
+uint16_t MqttClient::AllocatePacketId() {
+  while (next_packet_id_ == 0 || inflight_.count(next_packet_id_) > 0) {
+    next_packet_id_++;
+  }
+
+  return next_packet_id_++;
+}
+
+bool MqttClient::SendPacket(int socket, const std::vector<uint8_t>& packet) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  const uint8_t *data = packet.data();
+  size_t length = packet.size();
+  while (length > 0) {
+    ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+
+    data += sent;
+    length -= sent;
+  }
+
+  last_send_ = std::chrono::steady_clock::now();
+  return true;
+}
+
+bool MqttClient::SendPublish(int socket, uint16_t packet_id,
+                             const InflightMessage& message, bool duplicate) {
+  std::vector<uint8_t> body;
+  body.reserve(message.topic.size() + message.payload.size() + 4);
+  AppendString(&body, message.topic);
+  AppendUint16(&body, packet_id);
+  body.insert(body.end(), message.payload.begin(), message.payload.end());
+
+  uint8_t header = kPublishPacket | kPublishQos1Flag;
+  if (duplicate) {
+    header |= kPublishDuplicateFlag;
+  }
+
+  return SendPacket(socket, EncodePacket(header, body));
+}
+
+bool MqttClient::SendSubscribe(int socket, const std::string& filter) {
+  std::vector<uint8_t> body;
+  AppendUint16(&body, AllocatePacketId());
+  AppendString(&body, filter);
+  body.push_back(1);
+  return SendPacket(socket, EncodePacket(kSubscribePacket, body));
+}
+
+void MqttClient::CloseSocket() {
+  // The reader thread owns the descriptor and closes it once it observes the
+  // shutdown.
+  if (socket_ >= 0) {
+    shutdown(socket_, SHUT_RDWR);
+    socket_ = -1;
+    inflight_condition_.notify_all();
+  }
+}
+
+void MqttClient::ReaderLoop(int socket) {
+  auto ping_interval = std::chrono::duration_cast<std::chrono::milliseconds>(
+      keepalive_) / 2;
+  while (true) {
+    pollfd poll_fd = { socket, POLLIN, 0 };
+    int result = poll(&poll_fd, 1, ping_interval.count());
+    if (result < 0) {
+      break;
+    }
+
+    if (result == 0) {
+      // Ping when nothing has been sent recently to keep the session alive.
+      bool idle;
+      {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        idle = (std::chrono::steady_clock::now() - last_send_
+            >= ping_interval);
+      }
+
+      std::vector<uint8_t> empty;
+      if (idle && !SendPacket(socket, EncodePacket(kPingreqPacket, empty))) {
+        break;
+      }
+
+      continue;
+    }
+
+    uint8_t header;
+    std::vector<uint8_t> body;
+    if (!ReadPacket(socket, &header, &body)
+        || !HandlePacket(socket, header, body)) {
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (socket_ == socket) {
+      socket_ = -1;
+    }
+
+    inflight_condition_.notify_all();
+  }
+
+  close(socket);
+}
+
+bool MqttClient::HandlePacket(int socket, uint8_t header,
+                              const std::vector<uint8_t>& body) {
+  uint8_t type = header & 0xF0;
+  if (type == kPubackPacket) {
+    if (body.size() < 2) {
+      return false;
+    }
+
+    uint16_t packet_id = (body[0] << 8) | body[1];
+    std::lock_guard<std::mutex> lock(mutex_);
+    inflight_.erase(packet_id);
+    inflight_condition_.notify_all();
+  } else if (type == kPublishPacket) {
+    if (body.size() < 2) {
+      return false;
+    }
+
+    size_t topic_length = (body[0] << 8) | body[1];
+    size_t offset = 2 + topic_length;
+    bool qos1 = (header & kPublishQosMask) != 0;
+    if (offset + (qos1 ? 2 : 0) > body.size()) {
+      return false;
+    }
+
+    std::string topic(body.begin() + 2, body.begin() + offset);
+    if (qos1) {
+      std::vector<uint8_t> ack(body.begin() + offset,
+                               body.begin() + offset + 2);
+      offset += 2;
+      if (!SendPacket(socket, EncodePacket(kPubackPacket, ack))) {
+        return false;
+      }
+    }
+
+    std::string payload(body.begin() + offset, body.end());
+    handler_(topic, payload);
+  }
+
+  // SUBACK and PINGRESP require no action.
+  return (type == kPubackPacket || type == kPublishPacket
+      || type == kSubackPacket || type == kPingrespPacket);
+}
+
+}  // namespace pwrusbctl
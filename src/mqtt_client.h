@@ -0,0 +1,222 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_MQTT_CLIENT_H_
+#define PWRUSBCTL_MQTT_CLIENT_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/noncopyable.h"
+#include "util/socket_address.h"
+
+namespace pwrusbctl {
+
+/**
+ * A minimal MQTT 3.1.1 client over a single persistent TCP connection.
+ * Publishes use QoS 1 and the number of unacknowledged publishes is capped.
+ * Unacknowledged publishes are retained and sent again after a reconnect so
+ * that a dropped connection does not lose messages.
+ *
+ * A reader thread handles acknowledgements, keepalive pings and messages
+ * received on subscribed topics. All public methods are thread-safe.
+ */
+class MqttClient : public NonCopyable {
+ public:
+  //! Invoked on the reader thread for each message received on a subscribed
+  //! topic.
+  typedef std::function<void(const std::string& topic,
+                             const std::string& payload)> MessageHandler;
+
+  /**
+   * Constructs a client. No connection is made until Connect() is invoked.
+   *
+   * @param address The address of the broker in the form "host:port".
+   * @param client_id The client identifier presented to the broker.
+   * @param keepalive_s The keepalive interval in seconds.
+   * @param max_inflight The maximum number of unacknowledged publishes.
+   * @param handler The handler for messages on subscribed topics.
+   */
+  MqttClient(const std::string& address, const std::string& client_id,
+             int keepalive_s, size_t max_inflight, MessageHandler handler);
+
+  /**
+   * Disconnects from the broker and joins the reader thread.
+   */
+  ~MqttClient();
+
+  /**
+   * Connects to the broker if not already connected, re-subscribes to all
+   * topics and resends any unacknowledged publishes.
+   *
+   * @return Returns false if the connection could not be established.
+   */
+  bool Connect();
+
+  /**
+   * @return Returns true if the client is connected to the broker.
+   */
+  bool IsConnected() const;
+
+  /**
+   * Subscribes to a topic filter with QoS 1. The subscription is restored
+   * after a reconnect.
+   *
+   * @param filter The topic filter to subscribe to.
+   * @return Returns false if the subscription could not be sent.
+   */
+  bool Subscribe(const std::string& filter);
+
+  /**
+   * Publishes a message with QoS 1, waiting for an in-flight slot if the cap
+   * has been reached.
+   *
+   * @param topic The topic to publish to.
+   * @param payload The payload of the message.
+   * @param timeout The maximum time to wait for an in-flight slot.
+   * @return Returns false if the client is disconnected or no slot became
+   *         available before the timeout.
+   */
+  bool Publish(const std::string& topic, const std::string& payload,
+               std::chrono::milliseconds timeout);
+
+  /**
+   * @return Returns the number of publishes awaiting acknowledgement.
+   */
+  size_t GetInflightCount() const;
+
+ private:
+  /**
+   * A publish awaiting acknowledgement.
+   */
+  struct InflightMessage {
+    std::string topic;
+    std::string payload;
+  };
+
+  //! The address of the broker.
+  const std::string address_;
+
+  //! The client identifier presented to the broker.
+  const std::string client_id_;
+
+  //! The keepalive interval.
+  const std::chrono::seconds keepalive_;
+
+  //! The maximum number of unacknowledged publishes.
+  const size_t max_inflight_;
+
+  //! The handler for messages on subscribed topics.
+  const MessageHandler handler_;
+
+  //! Serializes writes to the socket.
+  std::mutex write_mutex_;
+
+  //! Guards all members below.
+  mutable std::mutex mutex_;
+
+  //! Signalled when a publish is acknowledged or the connection drops.
+  std::condition_variable inflight_condition_;
+
+  //! The connected socket, -1 if disconnected.
+  int socket_;
+
+  //! The reader thread for the current connection.
+  std::thread reader_thread_;
+
+  //! The topic filters subscribed to.
+  std::vector<std::string> subscriptions_;
+
+  //! Publishes awaiting acknowledgement keyed by packet identifier.
+  std::map<uint16_t, InflightMessage> inflight_;
+
+  //! The identifier assigned to the next packet.
+  uint16_t next_packet_id_;
+
+  //! The time at which a packet was last sent, used for keepalive.
+  std::chrono::steady_clock::time_point last_send_;
+
+  /**
+   * Allocates a packet identifier. The caller must hold mutex_.
+   *
+   * @return A non-zero packet identifier not currently in flight.
+   */
+  uint16_t AllocatePacketId();
+
+  /**
+   * Sends an encoded packet.
+   *
+   * @param socket The socket to send on.
+   * @param packet The packet to send.
+   * @return Returns false if an error occurs.
+   */
+  bool SendPacket(int socket, const std::vector<uint8_t>& packet);
+
+  /**
+   * Encodes and sends a PUBLISH packet.
+   *
+   * @param socket The socket to send on.
+   * @param packet_id The packet identifier.
+   * @param message The message to send.
+   * @param duplicate Whether or not this is a retransmission.
+   * @return Returns false if an error occurs.
+   */
+  bool SendPublish(int socket, uint16_t packet_id,
+                   const InflightMessage& message, bool duplicate);
+
+  /**
+   * Encodes and sends a SUBSCRIBE packet.
+   *
+   * @param socket The socket to send on.
+   * @param filter The topic filter to subscribe to.
+   * @return Returns false if an error occurs.
+   */
+  bool SendSubscribe(int socket, const std::string& filter);
+
+  /**
+   * Closes the connection. The caller must hold mutex_.
+   */
+  void CloseSocket();
+
+  /**
+   * The entry point of the reader thread.
+   *
+   * @param socket The socket to read from.
+   */
+  void ReaderLoop(int socket);
+
+  /**
+   * Handles a packet received from the broker.
+   *
+   * @param socket The socket the packet was received on.
+   * @param header The first byte of the fixed header.
+   * @param body The remainder of the packet after the fixed header.
+   * @return Returns false if the packet is malformed.
+   */
+  bool HandlePacket(int socket, uint8_t header,
+                    const std::vector<uint8_t>& body);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_MQTT_CLIENT_H_
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mqtt_sink.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+namespace pwrusbctl {
+
+//! The maximum time to wait for an in-flight slot when publishing samples.
+constexpr std::chrono::milliseconds kPublishTimeout(1000);
+
+//! The maximum length of a single formatted sample.
+constexpr size_t kMaxSampleJsonLength(320);
+
+constexpr size_t MqttSink::kDefaultMaxInflight;
+constexpr size_t MqttSink::kDefaultMaxBatchSize;
+constexpr int MqttSink::kDefaultKeepaliveS;
+
+MqttSink::MqttSink(const std::string& address,
+                   const std::string& topic_prefix,
+                   const std::string& client_id, size_t max_inflight,
+                   size_t max_batch_size, CommandHandler command_handler,
+                   const Clock& clock)
+    : topic_prefix_(topic_prefix),
+      max_batch_size_(max_batch_size),
+      command_handler_(command_handler),
+      wall_clock_offset_us_(clock.GetWallClockOffsetUs()),
+      client_(address, client_id, kDefaultKeepaliveS, max_inflight,
+              [this](const std::string& topic, const std::string& payload) {
+                HandleMessage(topic, payload);
+              }),
+      batch_size_(0),
+      publish_count_(0) {
+  batch_.reserve(max_batch_size_ * kMaxSampleJsonLength);
+  client_.Subscribe(topic_prefix_ + "/+/outlet/+/set");
+}
+
+bool MqttSink::Write(const Sample& sample) {
+  // Samples are only accepted while connected so that a failure is reported
+  // to the pipeline before the sample is taken into the batch.
+  if (!client_.Connect()) {
+    return false;
+  }
+
+  // Events are rare, so each is published on its own without batching.
+  if (sample.type != SampleType::Measurement) {
+    char json[kMaxSampleJsonLength];
+    int64_t timestamp_us = static_cast<int64_t>(sample.timestamp_us)
+        + wall_clock_offset_us_;
+    if (sample.type == SampleType::Step) {
+      snprintf(json, sizeof(json), "{\"type\":\"step\",\"timestamp_us\":%"
+               PRId64 ",\"level_before_ma\":%f,\"level_after_ma\":%f}",
+               timestamp_us, sample.level_before_ma, sample.level_after_ma);
+    } else if (sample.type == SampleType::Region) {
+      snprintf(json, sizeof(json), "{\"type\":\"region\",\"timestamp_us\":%"
+               PRId64 ",\"region\":\"%s\",\"duration_us\":%" PRIu64
+               ",\"energy_j\":%f,\"peak_w\":%f}", timestamp_us,
+               sample.region, sample.region_duration_us,
+               sample.region_energy_j, sample.region_peak_w);
+    } else {
+      snprintf(json, sizeof(json), "{\"type\":\"%s\",\"timestamp_us\":%"
+               PRId64 ",\"region\":\"%s\"}",
+               (sample.type == SampleType::RegionBegin) ? "begin" : "end",
+               timestamp_us, sample.region);
+    }
+
+    return client_.Publish(topic_prefix_ + "/" + sample.device_id + "/events",
+                           json, kPublishTimeout);
+  }
+
+  if (batch_size_ > 0 && (batch_size_ >= max_batch_size_
+                          || batch_device_id_ != sample.device_id)) {
+    if (!PublishBatch()) {
+      return false;
+    }
+  }
+
+  char json[kMaxSampleJsonLength];
+  int length = snprintf(json, sizeof(json), "%s{\"timestamp_us\":%" PRId64
+      ",\"lateness_us\":%" PRId64, (batch_size_ == 0) ? "[" : ",",
+      static_cast<int64_t>(sample.timestamp_us) + wall_clock_offset_us_,
+      sample.lateness_us);
+  if (sample.has_current) {
+    length += snprintf(json + length, sizeof(json) - length,
+                       ",\"current_ma\":%" PRId32 ",\"power_w\":%f",
+                       sample.current_ma, sample.power_w);
+    if (sample.sample_count > 1) {
+      length += snprintf(json + length, sizeof(json) - length,
+                         ",\"sample_count\":%" PRIu32 ",\"current_min_ma\":%"
+                         PRId32 ",\"current_max_ma\":%" PRId32
+                         ",\"power_min_w\":%f,\"power_max_w\":%f",
+                         sample.sample_count, sample.current_min_ma,
+                         sample.current_max_ma, sample.power_min_w,
+                         sample.power_max_w);
+    }
+  }
+
+  if (sample.has_energy) {
+    length += snprintf(json + length, sizeof(json) - length,
+                       ",\"energy_kwh\":%f", sample.energy_kwh);
+  }
+
+  snprintf(json + length, sizeof(json) - length, "}");
+  if (batch_size_ == 0) {
+    batch_device_id_ = sample.device_id;
+    batch_.clear();
+  }
+
+  batch_.append(json);
+  batch_size_++;
+  return true;
+}
+
+bool MqttSink::Flush() {
+  return (batch_size_ == 0) || (client_.Connect() && PublishBatch());
+}
+
+void MqttSink::PrintStats(FILE *file) const {
+  fprintf(file, "mqtt: published %" PRIu64 " batches, %zu in flight\n",
+          publish_count_, client_.GetInflightCount());
+}
+
+bool MqttSink::PublishBatch() {
+  std::string topic = topic_prefix_ + "/" + batch_device_id_ + "/samples";
+  if (!client_.Publish(topic, batch_ + "]", kPublishTimeout)) {
+    return false;
+  }
+
+  publish_count_++;
+  batch_size_ = 0;
+  return true;
+}
+
+void MqttSink::HandleMessage(const std::string& topic,
+                             const std::string& payload) {
+  // Topics have the form <prefix>/<device>/outlet/<index>/set.
+  if (topic.compare(0, topic_prefix_.size() + 1, topic_prefix_ + "/") != 0) {
+    return;
+  }
+
+  std::string rest = topic.substr(topic_prefix_.size() + 1);
+  size_t device_end = rest.find('/');
+  const std::string kOutletPart = "/outlet/";
+  const std::string kSetPart = "/set";
+  if (device_end == std::string::npos
+      || rest.compare(device_end, kOutletPart.size(), kOutletPart) != 0
+      || rest.size() < kSetPart.size()
+      || rest.compare(rest.size() - kSetPart.size(), kSetPart.size(),
+                      kSetPart) != 0) {
+    return;
+  }
+
+  std::string device_id = rest.substr(0, device_end);
+  size_t index_start = device_end + kOutletPart.size();
+  std::string index_string = rest.substr(index_start,
+      rest.size() - kSetPart.size() - index_start);
+  char *index_end;
+  unsigned long outlet = strtoul(index_string.c_str(), &index_end, 10);
+  if (index_string.empty() || *index_end != '\0') {
+    return;
+  }
+
+  SocketState state;
+  if (payload == "on") {
+    state = SocketState::On;
+  } else if (payload == "off") {
+    state = SocketState::Off;
+  } else {
+    return;
+  }
+
+  if (command_handler_(device_id, outlet, state)) {
+    // This runs on the reader thread, which is the only thread that can
+    // process acknowledgements, so never wait for an in-flight slot here.
+    std::string state_topic = topic.substr(0, topic.size() - kSetPart.size())
+        + "/state";
+    client_.Publish(state_topic, payload, std::chrono::milliseconds(0));
+  }
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_MQTT_SINK_H_
+#define PWRUSBCTL_MQTT_SINK_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "mqtt_client.h"
+#include "power_usb_device.h"
+#include "sink.h"
+#include "util/clock.h"
+
+namespace pwrusbctl {
+
+/**
+ * A sink that publishes samples to an MQTT broker and maps command messages
+ * onto outlet state changes.
+ *
+ * Samples are batched into a JSON array and published with QoS 1 to
+ * "<prefix>/<device>/samples" once the batch is full or the sink is flushed,
+ * so a high sampling rate does not mean one round trip per sample. The number
+ * of unacknowledged publishes is capped. Events such as steps and region
+ * markers are published individually to "<prefix>/<device>/events".
+ *
+ * Messages of "on" or "off" published to "<prefix>/<device>/outlet/<n>/set"
+ * invoke the command handler, and the resulting state is published to
+ * "<prefix>/<device>/outlet/<n>/state".
+ */
+class MqttSink : public Sink {
+ public:
+  //! Invoked on the MQTT reader thread for each outlet command. Returns false
+  //! if the command could not be applied.
+  typedef std::function<bool(const std::string& device_id, size_t outlet,
+                             SocketState state)> CommandHandler;
+
+  //! The default maximum number of unacknowledged publishes.
+  static constexpr size_t kDefaultMaxInflight = 16;
+
+  //! The default maximum number of samples in a published batch.
+  static constexpr size_t kDefaultMaxBatchSize = 100;
+
+  //! The default keepalive interval in seconds.
+  static constexpr int kDefaultKeepaliveS = 30;
+
+  /**
+   * Constructs an MqttSink and subscribes to command topics. The connection
+   * is established lazily when the first sample is written.
+   *
+   * @param address The address of the broker in the form "host:port".
+   * @param topic_prefix The prefix of every topic.
+   * @param client_id The client identifier presented to the broker.
+   * @param max_inflight The maximum number of unacknowledged publishes.
+   * @param max_batch_size The maximum number of samples per publish.
+   * @param command_handler The handler for outlet commands.
+   * @param clock The clock whose wall-clock offset timestamps are published
+   *        with.
+   */
+  MqttSink(const std::string& address, const std::string& topic_prefix,
+           const std::string& client_id, size_t max_inflight,
+           size_t max_batch_size, CommandHandler command_handler,
+           const Clock& clock = *SystemClock::GetInstance());
+
+  bool Write(const Sample& sample) override;
+  bool Flush() override;
+  void PrintStats(FILE *file) const override;
+
+ private:
+  //! The prefix of every topic.
+  const std::string topic_prefix_;
+
+  //! The maximum number of samples per publish.
+  const size_t max_batch_size_;
+
+  //! The handler for outlet commands.
+  const CommandHandler command_handler_;
+
+  //! The offset added to monotonic timestamps to obtain wall-clock time.
+  const int64_t wall_clock_offset_us_;
+
+  //! The connection to the broker.
+  MqttClient client_;
+
+  //! The device that the samples in batch_ belong to.
+  std::string batch_device_id_;
+
+  //! The JSON array of samples waiting to be published.
+  std::string batch_;
+
+  //! The number of samples in batch_.
+  size_t batch_size_;
+
+  //! The number of batches published.
+  uint64_t publish_count_;
+
+  /**
+   * Publishes the current batch, retaining it if it could not be sent.
+   *
+   * @return Returns false if the batch could not be published.
+   */
+  bool PublishBatch();
+
+  /**
+   * Handles a message received on a command topic.
+   *
+   * @param topic The topic of the message.
+   * @param payload The payload of the message.
+   */
+  void HandleMessage(const std::string& topic, const std::string& payload);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_MQTT_SINK_H_
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_OUTPUT_STREAM_H_
+#define PWRUSBCTL_OUTPUT_STREAM_H_
+
+#include <cstddef>
+#include <cstdio>
+
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * A destination for formatted output bytes.
+ */
+class OutputStream : public NonCopyable {
+ public:
+  virtual ~OutputStream() {}
+
+  /**
+   * Writes bytes to the stream. The stream may buffer them internally.
+   *
+   * @param data The bytes to write.
+   * @param length The number of bytes to write.
+   * @return Returns false if an error occurs.
+   */
+  virtual bool Write(const char *data, size_t length) = 0;
+
+  /**
+   * Pushes any buffered bytes to the underlying file such that everything
+   * written so far can be read back.
+   *
+   * @return Returns false if an error occurs.
+   */
+  virtual bool Flush() = 0;
+
+  /**
+   * Prints statistics about the stream. Only invoked while the stream is
+   * idle.
+   *
+   * @param file The file to print to.
+   */
+  virtual void PrintStats(FILE *file) const {}
+};
+
+/**
+ * An OutputStream that writes bytes unmodified to a stdio stream.
+ */
+class FileOutputStream : public OutputStream {
+ public:
+  /**
+   * @param file The stream to write to.
+   * @param owned Whether or not the stream is closed on destruction.
+   */
+  FileOutputStream(FILE *file, bool owned)
+      : file_(file), owned_(owned) {}
+
+  ~FileOutputStream() {
+    if (owned_) {
+      fclose(file_);
+    }
+  }
+
+  bool Write(const char *data, size_t length) override {
+    return (fwrite(data, 1, length, file_) == length);
+  }
+
+  bool Flush() override {
+    return (fflush(file_) == 0);
+  }
+
+ private:
+  //! The stream that bytes are written to.
+  FILE *file_;
+
+  //! Whether or not file_ is closed on destruction.
+  const bool owned_;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_OUTPUT_STREAM_H_
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "per_device_sink.h"
+
+namespace pwrusbctl {
+
+PerDeviceSink::PerDeviceSink(const SinkFactory& factory)
+    : factory_(factory) {}
+
+bool PerDeviceSink::Write(const Sample& sample) {
+  std::string device_id(sample.device_id);
+  auto it = sinks_.find(device_id);
+  if (it == sinks_.end()) {
+    // A device whose sink could not be created is tried again with its next
+    // sample.
+    std::unique_ptr<Sink> sink = factory_(device_id);
+    if (sink == nullptr) {
+      return false;
+    }
+
+    it = sinks_.emplace(device_id, std::move(sink)).first;
+  }
+
+  return it->second->Write(sample);
+}
+
+bool PerDeviceSink::Flush() {
+  bool success = true;
+  for (auto& entry : sinks_) {
+    success &= entry.second->Flush();
+  }
+
+  return success;
+}
+
+void PerDeviceSink::PrintStats(FILE *file) const {
+  for (const auto& entry : sinks_) {
+    fprintf(file, "Device %s:\n", entry.first.c_str());
+    entry.second->PrintStats(file);
+  }
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_PER_DEVICE_SINK_H_
+#define PWRUSBCTL_PER_DEVICE_SINK_H_
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "sink.h"
+
+namespace pwrusbctl {
+
+/**
+ * A sink that gives every device a sink of its own, created when its first
+ * sample arrives. This lets sinks that carry per-device state, such as the
+ * stream of a collector, be used when logging several devices at once. The
+ * sinks of every device are written from the one thread of this sink.
+ */
+class PerDeviceSink : public Sink {
+ public:
+  /**
+   * Creates the sink for a device.
+   *
+   * @param device_id The identifier of the device.
+   * @return The sink for the device, or nullptr if it could not be created.
+   */
+  using SinkFactory =
+      std::function<std::unique_ptr<Sink>(const std::string& device_id)>;
+
+  /**
+   * Constructs a PerDeviceSink.
+   *
+   * @param factory Creates the sink for each device.
+   */
+  explicit PerDeviceSink(const SinkFactory& factory);
+
+  bool Write(const Sample& sample) override;
+  bool Flush() override;
+  void PrintStats(FILE *file) const override;
+
+ private:
+  //! Creates the sink for each device.
+  const SinkFactory factory_;
+
+  //! The sinks keyed by device identifier.
+  std::map<std::string, std::unique_ptr<Sink>> sinks_;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_PER_DEVICE_SINK_H_
@@ -0,0 +1,284 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+
+namespace pwrusbctl {
+
+constexpr size_t SinkOptions::kDefaultQueueCapacity;
+constexpr int SinkOptions::kDefaultFlushIntervalMs;
+constexpr double SinkOptions::kDefaultSpoolDrainRate;
+constexpr int SinkOptions::kDefaultRetryIntervalMs;
+
+//! The longest burst of spooled samples drained at once, in seconds of the
+//! drain rate.
+constexpr double kSpoolDrainBurstSeconds(0.1);
+
+//! The fraction of the queue, as a divisor of its capacity, beyond which the
+//! sink thread moves samples to the spool rather than writing them.
+constexpr size_t kSpoolSpillFraction(2);
+
+Pipeline::SinkWorker::SinkWorker(const std::string& name,
+                                 std::unique_ptr<Sink> sink,
+                                 const SinkOptions& options)
+    : name(name),
+      sink(std::move(sink)),
+      queue(options.queue_capacity),
+      flush_interval_us(options.flush_interval_ms * 1000ull),
+      spool(options.spool),
+      spool_drain_rate(options.spool_drain_rate),
+      retry_interval_us(options.retry_interval_ms * 1000ull),
+      written_count(0),
+      dropped_count(0),
+      error_count(0),
+      lag_us(0),
+      max_lag_us(0),
+      spooled_count(0) {}
+
+Pipeline::Pipeline(const Clock& clock) : clock_(clock), running_(false) {}
+
+Pipeline::~Pipeline() {
+  Stop();
+}
+
+void Pipeline::AddTransform(std::unique_ptr<Transform> transform) {
+  assert(!running_);
+  transforms_.push_back(std::move(transform));
+  stage_outputs_.emplace_back(this, transforms_.size());
+}
+
+void Pipeline::AddSink(const std::string& name, std::unique_ptr<Sink> sink,
+                       const SinkOptions& options) {
+  assert(!running_);
+  workers_.emplace_back(new SinkWorker(name, std::move(sink), options));
+}
+
+void Pipeline::Start() {
+  assert(!running_);
+  running_ = true;
+  for (auto& worker : workers_) {
+    worker->thread = std::thread(&Pipeline::WorkerLoop, this, worker.get());
+  }
+}
+
+void Pipeline::Push(const Sample& sample) {
+  std::lock_guard<std::mutex> lock(push_mutex_);
+  ProcessFrom(sample, 0);
+}
+
+void Pipeline::Stop() {
+  if (!running_) {
+    return;
+  }
+
+  // Transforms are finished in order so that samples released by one are
+  // seen by the following transforms before they finish.
+  for (size_t i = 0; i < transforms_.size(); i++) {
+    transforms_[i]->Finish(&stage_outputs_[i]);
+  }
+
+  for (auto& worker : workers_) {
+    worker->queue.Close();
+  }
+
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+
+  running_ = false;
+}
+
+bool Pipeline::CanAccept(size_t count) const {
+  for (const auto& worker : workers_) {
+    if (worker->queue.Capacity() - worker->queue.Size() < count) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+size_t Pipeline::GetSinkCount() const {
+  return workers_.size();
+}
+
+void Pipeline::GetSinkStats(size_t index, SinkStats *stats) const {
+  assert(index < workers_.size() && stats);
+  const SinkWorker& worker = *workers_[index];
+  stats->written_count = worker.written_count;
+  stats->dropped_count = worker.dropped_count;
+  stats->error_count = worker.error_count;
+  stats->lag_us = worker.lag_us;
+  stats->max_lag_us = worker.max_lag_us;
+  stats->spooled_count = worker.spooled_count;
+  stats->spool_backlog = worker.spool ? worker.spool->GetSampleCount() : 0;
+}
+
+void Pipeline::PrintStats(FILE *file) const {
+  for (size_t i = 0; i < workers_.size(); i++) {
+    SinkStats stats;
+    GetSinkStats(i, &stats);
+    fprintf(file, "Sink %s: written %" PRIu64 ", dropped %" PRIu64
+            ", errors %" PRIu64 ", lag %" PRIu64 "us, max lag %" PRIu64
+            "us", workers_[i]->name.c_str(), stats.written_count,
+            stats.dropped_count, stats.error_count, stats.lag_us,
+            stats.max_lag_us);
+    if (workers_[i]->spool) {
+      fprintf(file, ", spooled %" PRIu64 ", spool backlog %" PRIu64,
+              stats.spooled_count, stats.spool_backlog);
+    }
+
+    fprintf(file, "\n");
+    workers_[i]->sink->PrintStats(file);
+  }
+}
+
+void Pipeline::ProcessFrom(const Sample& sample, size_t transform_index) {
+  if (transform_index == transforms_.size()) {
+    Distribute(sample);
+  } else {
+    transforms_[transform_index]->Process(sample,
+                                          &stage_outputs_[transform_index]);
+  }
+}
+
+void Pipeline::Distribute(const Sample& sample) {
+  // Only the sink thread writes to a spool, and it spools samples well before
+  // the queue fills, so a full queue means that the spool cannot keep up.
+  for (auto& worker : workers_) {
+    if (!worker->queue.TryPush(sample)) {
+      worker->dropped_count++;
+    }
+  }
+}
+
+bool Pipeline::WriteSample(SinkWorker *worker, const Sample& sample) {
+  if (!worker->sink->Write(sample)) {
+    worker->error_count++;
+    return false;
+  }
+
+  uint64_t lag_us = clock_.GetMonotonicTimeUs() - sample.timestamp_us;
+  worker->written_count++;
+  worker->lag_us = lag_us;
+  if (lag_us > worker->max_lag_us) {
+    worker->max_lag_us = lag_us;
+  }
+
+  return true;
+}
+
+void Pipeline::SpoolSample(SinkWorker *worker, const Sample& sample) {
+  if (worker->spool->Append(sample)) {
+    worker->spooled_count++;
+  } else {
+    worker->dropped_count++;
+  }
+}
+
+void Pipeline::WorkerLoop(SinkWorker *worker) {
+  const uint64_t drain_period_us = worker->spool
+      ? static_cast<uint64_t>(1e6 / worker->spool_drain_rate) : 0;
+  const double max_drain_tokens = std::max(1.0,
+      worker->spool_drain_rate * kSpoolDrainBurstSeconds);
+  const size_t spill_size = worker->queue.Capacity() / kSpoolSpillFraction;
+
+  uint64_t next_flush_us = clock_.GetMonotonicTimeUs()
+      + worker->flush_interval_us;
+  uint64_t retry_time_us = clock_.GetMonotonicTimeUs();
+  uint64_t last_drain_us = clock_.GetMonotonicTimeUs();
+  double drain_tokens = 0.0;
+  while (!worker->queue.IsClosedAndEmpty()) {
+    uint64_t now_us = clock_.GetMonotonicTimeUs();
+    bool sink_failing = worker->spool && now_us < retry_time_us;
+    bool can_drain = worker->spool && !sink_failing
+        && !worker->spool->IsEmpty();
+
+    // This thread is the only writer of the spool and takes samples from the
+    // queue in order, so the spool only ever holds samples older than those
+    // in the queue and is drained first. Draining yields once the queue backs
+    // up so that queued samples are moved to the spool before it fills.
+    if (can_drain) {
+      drain_tokens = std::min(max_drain_tokens, drain_tokens
+          + (now_us - last_drain_us) / 1e6 * worker->spool_drain_rate);
+      last_drain_us = now_us;
+      Sample sample;
+      while (drain_tokens >= 1.0 && worker->queue.Size() < spill_size
+             && worker->spool->Peek(&sample)) {
+        if (!WriteSample(worker, sample)) {
+          sink_failing = true;
+          retry_time_us = clock_.GetMonotonicTimeUs()
+              + worker->retry_interval_us;
+          break;
+        }
+
+        worker->spool->Consume();
+        drain_tokens -= 1.0;
+      }
+    } else {
+      last_drain_us = now_us;
+    }
+
+    // Wake for the next drain token while the spool has a backlog.
+    uint64_t wait_until_us = std::max(next_flush_us, now_us);
+    if (can_drain && !sink_failing) {
+      wait_until_us = std::min(wait_until_us, now_us + drain_period_us);
+    }
+
+    // Samples follow any backlog into the spool so that the sink receives
+    // them in order. They are also spooled while the sink is failing, and
+    // once the queue backs up, so that a slow sink does not fill the queue.
+    Sample sample;
+    if (worker->queue.Pop(&sample,
+        std::chrono::microseconds(wait_until_us - now_us))) {
+      if (worker->spool && (sink_failing || !worker->spool->IsEmpty()
+                            || worker->queue.Size() >= spill_size)) {
+        SpoolSample(worker, sample);
+      } else if (!WriteSample(worker, sample) && worker->spool) {
+        SpoolSample(worker, sample);
+        retry_time_us = clock_.GetMonotonicTimeUs()
+            + worker->retry_interval_us;
+      }
+    }
+
+    if (clock_.GetMonotonicTimeUs() >= next_flush_us) {
+      if (!worker->sink->Flush()) {
+        worker->error_count++;
+      }
+
+      if (worker->spool) {
+        worker->spool->Sync();
+      }
+
+      next_flush_us = clock_.GetMonotonicTimeUs()
+          + worker->flush_interval_us;
+    }
+  }
+
+  if (!worker->sink->Flush()) {
+    worker->error_count++;
+  }
+
+  if (worker->spool) {
+    worker->spool->Sync();
+  }
+}
+
+}  // namespace pwrusbctl
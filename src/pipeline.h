@@ -0,0 +1,366 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_PIPELINE_H_
+#define PWRUSBCTL_PIPELINE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sink.h"
+#include "spool.h"
+#include "util/bounded_queue.h"
+#include "util/clock.h"
+
+namespace pwrusbctl {
+
+/**
+ * Receives samples from a stage of the pipeline.
+ */
+class SampleConsumer {
+ public:
+  virtual ~SampleConsumer() {}
+
+  /**
+   * Consumes a sample.
+   *
+   * @param sample The sample to consume.
+   */
+  virtual void Consume(const Sample& sample) = 0;
+};
+
+/**
+ * A stage that sits between the source and the sinks of a pipeline. A
+ * transform may modify, drop, aggregate or add samples. Transforms run on the
+ * thread that pushes samples into the pipeline, so they must be cheap.
+ */
+class Transform : public NonCopyable {
+ public:
+  virtual ~Transform() {}
+
+  /**
+   * Processes a sample, passing any resulting samples to output.
+   *
+   * @param sample The sample to process.
+   * @param output The next stage of the pipeline.
+   */
+  virtual void Process(const Sample& sample, SampleConsumer *output) = 0;
+
+  /**
+   * Passes any samples still held by this transform to output. Invoked once
+   * when the pipeline stops.
+   *
+   * @param output The next stage of the pipeline.
+   */
+  virtual void Finish(SampleConsumer *output) {}
+};
+
+/**
+ * A snapshot of the counters maintained for each sink.
+ */
+struct SinkStats {
+  //! The number of samples written to the sink.
+  uint64_t written_count;
+
+  //! The number of samples dropped because the sink queue was full.
+  uint64_t dropped_count;
+
+  //! The number of writes or flushes that the sink reported as failed.
+  uint64_t error_count;
+
+  //! The time between a sample being taken and it being written to the sink
+  //! for the most recently written sample.
+  uint64_t lag_us;
+
+  //! The largest lag observed.
+  uint64_t max_lag_us;
+
+  //! The number of samples written to the spool.
+  uint64_t spooled_count;
+
+  //! The number of samples waiting in the spool.
+  uint64_t spool_backlog;
+};
+
+/**
+ * The configuration of a sink within a Pipeline.
+ */
+struct SinkOptions {
+  //! The default capacity of each sink queue.
+  static constexpr size_t kDefaultQueueCapacity = 4096;
+
+  //! The default interval between flushes of each sink.
+  static constexpr int kDefaultFlushIntervalMs = 1000;
+
+  //! The default rate at which a spool backlog is drained.
+  static constexpr double kDefaultSpoolDrainRate = 1000.0;
+
+  //! The default time to wait before retrying a sink that failed.
+  static constexpr int kDefaultRetryIntervalMs = 5000;
+
+  SinkOptions()
+      : queue_capacity(kDefaultQueueCapacity),
+        flush_interval_ms(kDefaultFlushIntervalMs),
+        spool_drain_rate(kDefaultSpoolDrainRate),
+        retry_interval_ms(kDefaultRetryIntervalMs) {}
+
+  //! The maximum number of samples queued in memory for the sink.
+  size_t queue_capacity;
+
+  //! The interval at which the sink is flushed.
+  int flush_interval_ms;
+
+  //! An optional spool that samples overflow into when the queue backs up or
+  //! the sink is failing. When nullptr, such samples are dropped.
+  std::shared_ptr<Spool> spool;
+
+  //! The maximum rate in samples per second at which the spool is drained.
+  double spool_drain_rate;
+
+  //! The time to wait after a failed write before writing to the sink again.
+  //! Only used when a spool is configured.
+  int retry_interval_ms;
+};
+
+/**
+ * Distributes samples from a single source to a number of sinks. Samples are
+ * passed through each transform in the order they were added and then queued
+ * for every sink. Each sink has its own bounded queue and thread so that a
+ * stalled sink drops its own samples without slowing the source or the other
+ * sinks.
+ *
+ * A sink may be given a Spool. Once its queue is half full or a write fails,
+ * the sink thread appends samples to the spool instead of writing them. Only
+ * the sink thread writes the spool, taking samples from the queue in order,
+ * so the spool always holds the oldest samples. While it holds samples, new
+ * samples follow them into it, and it is drained oldest first at a capped
+ * rate.
+ */
+class Pipeline : public NonCopyable {
+ public:
+  /**
+   * Constructs an empty pipeline.
+   *
+   * @param clock The clock used for flush and retry timers and to measure
+   *        lag. Must outlive the pipeline.
+   */
+  explicit Pipeline(const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Stops the pipeline if it is still running.
+   */
+  ~Pipeline();
+
+  /**
+   * Appends a transform stage. Must be invoked before Start().
+   *
+   * @param transform The transform to append.
+   */
+  void AddTransform(std::unique_ptr<Transform> transform);
+
+  /**
+   * Adds a sink. Must be invoked before Start().
+   *
+   * @param name The name used when reporting statistics for the sink.
+   * @param sink The sink to add.
+   * @param options The configuration of the sink.
+   */
+  void AddSink(const std::string& name, std::unique_ptr<Sink> sink,
+               const SinkOptions& options = SinkOptions());
+
+  /**
+   * Starts a thread for each sink.
+   */
+  void Start();
+
+  /**
+   * Passes a sample through the transforms and queues it for each sink. May
+   * be invoked from several threads, in which case samples pass through the
+   * transforms one at a time.
+   *
+   * @param sample The sample to push.
+   */
+  void Push(const Sample& sample);
+
+  /**
+   * Finishes each transform, drains each sink queue, flushes the sinks and
+   * joins their threads.
+   */
+  void Stop();
+
+  /**
+   * Checks whether samples can be pushed without any being dropped. Samples
+   * that transforms add are not accounted for.
+   *
+   * @param count The number of samples to be pushed.
+   * @return Returns true if every sink queue has room for the samples.
+   */
+  bool CanAccept(size_t count) const;
+
+  /**
+   * @return Returns the number of sinks in the pipeline.
+   */
+  size_t GetSinkCount() const;
+
+  /**
+   * Obtains the statistics of a sink.
+   *
+   * @param index The index of the sink in the order it was added.
+   * @param stats The stats to populate.
+   */
+  void GetSinkStats(size_t index, SinkStats *stats) const;
+
+  /**
+   * Prints the statistics of every sink, including any statistics specific to
+   * the sink. Must not be invoked while the pipeline is running.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  /**
+   * The state associated with a single sink.
+   */
+  struct SinkWorker {
+    SinkWorker(const std::string& name, std::unique_ptr<Sink> sink,
+               const SinkOptions& options);
+
+    //! The name used when reporting statistics.
+    const std::string name;
+
+    //! The sink that samples are written to.
+    std::unique_ptr<Sink> sink;
+
+    //! Samples waiting to be written to the sink.
+    BoundedQueue<Sample> queue;
+
+    //! The interval at which the sink is flushed in microseconds.
+    const uint64_t flush_interval_us;
+
+    //! The spool that overflowing samples are written to, may be nullptr.
+    const std::shared_ptr<Spool> spool;
+
+    //! The maximum rate at which the spool is drained in samples per second.
+    const double spool_drain_rate;
+
+    //! The time to wait after a failed write before retrying the sink in
+    //! microseconds.
+    const uint64_t retry_interval_us;
+
+    //! The thread that writes samples to the sink.
+    std::thread thread;
+
+    //! The counters reported in SinkStats.
+    std::atomic<uint64_t> written_count;
+    std::atomic<uint64_t> dropped_count;
+    std::atomic<uint64_t> error_count;
+    std::atomic<uint64_t> lag_us;
+    std::atomic<uint64_t> max_lag_us;
+    std::atomic<uint64_t> spooled_count;
+  };
+
+  /**
+   * The output of a transform, which feeds the following stage.
+   */
+  class StageOutput : public SampleConsumer {
+   public:
+    StageOutput(Pipeline *pipeline, size_t next_index)
+        : pipeline_(pipeline), next_index_(next_index) {}
+
+    void Consume(const Sample& sample) override {
+      pipeline_->ProcessFrom(sample, next_index_);
+    }
+
+   private:
+    //! The pipeline that owns this stage.
+    Pipeline *pipeline_;
+
+    //! The index of the transform that follows this stage.
+    size_t next_index_;
+  };
+
+  //! The clock used for timers and lag measurement.
+  const Clock& clock_;
+
+  //! The transforms applied to each sample in order.
+  std::vector<std::unique_ptr<Transform>> transforms_;
+
+  //! The output of each transform, indexed the same as transforms_.
+  std::vector<StageOutput> stage_outputs_;
+
+  //! The sinks that samples are distributed to.
+  std::vector<std::unique_ptr<SinkWorker>> workers_;
+
+  //! Whether or not the sink threads are running.
+  bool running_;
+
+  //! Serializes samples pushed from several threads through the transforms.
+  std::mutex push_mutex_;
+
+  /**
+   * Passes a sample through the transforms starting at an index.
+   *
+   * @param sample The sample to process.
+   * @param transform_index The index of the first transform to apply.
+   */
+  void ProcessFrom(const Sample& sample, size_t transform_index);
+
+  /**
+   * Queues a sample that has passed through all transforms for every sink.
+   *
+   * @param sample The sample to distribute.
+   */
+  void Distribute(const Sample& sample);
+
+  /**
+   * Writes a sample to a sink and updates its counters.
+   *
+   * @param worker The sink to write to.
+   * @param sample The sample to write.
+   * @return Returns false if the sink reported an error.
+   */
+  bool WriteSample(SinkWorker *worker, const Sample& sample);
+
+  /**
+   * Appends a sample to the spool of a sink, counting it as dropped if the
+   * append fails.
+   *
+   * @param worker The sink whose spool is appended to.
+   * @param sample The sample to append.
+   */
+  static void SpoolSample(SinkWorker *worker, const Sample& sample);
+
+  /**
+   * The entry point of each sink thread. Timers are measured on the pipeline
+   * clock, so with a VirtualClock a sink is flushed according to the time
+   * that samples were pushed rather than the time spent waiting for them.
+   *
+   * @param worker The sink serviced by the thread.
+   */
+  void WorkerLoop(SinkWorker *worker);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_PIPELINE_H_
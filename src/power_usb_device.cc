@@ -16,8 +16,19 @@
 
 #include "power_usb_device.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cinttypes>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include "util/time.h"
 
 namespace pwrusbctl {
 
@@ -30,6 +41,17 @@ constexpr uint16_t kProductId(0x003f);
 //! The number of sockets attached to the PowerUsb device.
 constexpr size_t kSocketCount(3);
 
+//! The maximum length of a serial number read from the USB descriptor.
+constexpr size_t kMaxSerialNumberLength(64);
+
+//! The directory holding the lock file of each device. It must be shared by
+//! every user and service that runs the tool, so the system lock directory is
+//! used rather than /tmp, which may be private to a service.
+constexpr char kDefaultLockDirectory[] = "/run/lock";
+
+//! The environment variable that overrides the lock directory.
+constexpr char kLockDirectoryVariable[] = "PWRUSBCTL_LOCK_DIR";
+
 //! The device types as described by the http://pwrusb.com/products.html
 //! webpage. Note that this does not include the full name of the device and
 //! only the variant string.
@@ -89,11 +111,35 @@ float PowerUsbDevice::ConvertChargeToKilowattHours(int32_t milliamp_minutes,
   return (amp_hours * line_voltage) / 1000.0f;
 }
 
-PowerUsbDevice::PowerUsbDevice() {
+void PowerUsbDevice::EnumerateDevicePaths(std::vector<std::string> *paths) {
+  assert(paths);
+  paths->clear();
+  hid_device_info *devices = hid_enumerate(kVendorId, kProductId);
+  for (hid_device_info *info = devices; info != nullptr; info = info->next) {
+    if (info->path != nullptr) {
+      paths->push_back(info->path);
+    }
+  }
+
+  hid_free_enumeration(devices);
+}
+
+PowerUsbDevice::PowerUsbDevice() : lock_fd_(-1), lock_stats_() {
   device_ = hid_open(kVendorId, kProductId, nullptr);
+  OpenLockFile();
+}
+
+PowerUsbDevice::PowerUsbDevice(const std::string& path)
+    : lock_fd_(-1), lock_stats_() {
+  device_ = hid_open_path(path.c_str());
+  OpenLockFile();
 }
 
 PowerUsbDevice::~PowerUsbDevice() {
+  if (lock_fd_ != -1) {
+    close(lock_fd_);
+  }
+
   if (IsInitialized()) {
     hid_close(device_);
   }
@@ -111,12 +157,8 @@ size_t PowerUsbDevice::GetSocketCount() const {
 
 const char *PowerUsbDevice::GetDeviceType() const {
   uint8_t get_device_type = kGetDeviceTypeCommand;
-  if (!DeviceWrite(&get_device_type, 1)) {
-    return nullptr;
-  }
-
   uint8_t device_type;
-  if (!DeviceRead(&device_type, 1)) {
+  if (!Transaction(&get_device_type, 1, &device_type, 1)) {
     return nullptr;
   }
 
@@ -128,6 +170,28 @@ const char *PowerUsbDevice::GetDeviceType() const {
   return kDeviceTypes[device_type];
 }
 
+bool PowerUsbDevice::GetSerialNumber(char *serial, size_t length) const {
+  assert(serial && length > 0);
+  if (serial == nullptr || length == 0) {
+    return false;
+  }
+
+  wchar_t wide_serial[kMaxSerialNumberLength];
+  if (hid_get_serial_number_string(device_, wide_serial,
+                                   kMaxSerialNumberLength) == -1) {
+    return false;
+  }
+
+  size_t i = 0;
+  for (; i + 1 < length && wide_serial[i] != L'\0'; i++) {
+    wchar_t c = wide_serial[i];
+    serial[i] = (c > 0 && c < 0x80) ? static_cast<char>(c) : '?';
+  }
+
+  serial[i] = '\0';
+  return true;
+}
+
 bool PowerUsbDevice::SetSocketState(size_t index, SocketState state) const {
   // The index supplied must be less than 3. If the strip is indexed out of
   // bounds no operation is performed.
@@ -147,7 +211,7 @@ bool PowerUsbDevice::SetSocketState(size_t index, SocketState state) const {
     assert(false);
   }
 
-  return DeviceWrite(&command_value, 1);
+  return Transaction(&command_value, 1, nullptr, 0);
 }
 
 bool PowerUsbDevice::SetDefaultSocketState(size_t index, SocketState state) const {
@@ -169,7 +233,7 @@ bool PowerUsbDevice::SetDefaultSocketState(size_t index, SocketState state) cons
     assert(false);
   }
 
-  return DeviceWrite(&command_value, 1);
+  return Transaction(&command_value, 1, nullptr, 0);
 }
 
 bool PowerUsbDevice::GetInstantaneousCurrent(int16_t *current) const {
@@ -179,12 +243,9 @@ bool PowerUsbDevice::GetInstantaneousCurrent(int16_t *current) const {
   }
 
   uint8_t get_instantaneous_current = kGetInstantaneousCurrentCommand;
-  if (!DeviceWrite(&get_instantaneous_current, 1)) {
-    return false;
-  }
-
   uint8_t current_buffer[2];
-  if (!DeviceRead(current_buffer, sizeof(current_buffer))) {
+  if (!Transaction(&get_instantaneous_current, 1,
+                   current_buffer, sizeof(current_buffer))) {
     return false;
   }
 
@@ -199,12 +260,9 @@ bool PowerUsbDevice::GetAccumulatedCharge(int32_t *accumulated_charge) const {
   }
 
   uint8_t get_accumulated_energy = kGetAccumulatedEnergyCommand;
-  if (!DeviceWrite(&get_accumulated_energy, 1)) {
-    return false;
-  }
-
   uint8_t energy_buffer[4];
-  if (!DeviceRead(energy_buffer, sizeof(energy_buffer))) {
+  if (!Transaction(&get_accumulated_energy, 1,
+                   energy_buffer, sizeof(energy_buffer))) {
     return false;
   }
 
@@ -217,14 +275,124 @@ bool PowerUsbDevice::GetAccumulatedCharge(int32_t *accumulated_charge) const {
 
 bool PowerUsbDevice::ResetChargeAccumulator() const {
   uint8_t reset_charge_accumulator = kResetChargeAccumulatorCommand;
-  return DeviceWrite(&reset_charge_accumulator, 1);
+  return Transaction(&reset_charge_accumulator, 1, nullptr, 0);
 }
 
 bool PowerUsbDevice::SetCurrentRatio(float ratio) const {
   uint8_t command_buffer[2];
   command_buffer[0] = kSetCurrentSenseRatioCommand;
   command_buffer[1] = ratio * INT8_MAX;
-  return DeviceWrite(command_buffer, sizeof(command_buffer));
+  return Transaction(command_buffer, sizeof(command_buffer), nullptr, 0);
+}
+
+void PowerUsbDevice::GetLockStats(DeviceLockStats *stats) const {
+  assert(stats);
+  std::lock_guard<std::mutex> lock(transaction_mutex_);
+  *stats = lock_stats_;
+}
+
+void PowerUsbDevice::PrintStats(FILE *file) const {
+  DeviceLockStats stats;
+  GetLockStats(&stats);
+  fprintf(file, "Device lock: %s, %" PRIu64 " transactions, %" PRIu64
+          " waited for another process", (lock_fd_ != -1) ? "held" : "unused",
+          stats.transaction_count, stats.contended_count);
+  if (stats.contended_count > 0) {
+    fprintf(file, " (mean %.1fms, max %.1fms)",
+            stats.total_wait_us / 1000.0 / stats.contended_count,
+            stats.max_wait_us / 1000.0);
+  }
+
+  fprintf(file, "\n");
+}
+
+void PowerUsbDevice::OpenLockFile() {
+  char serial[kMaxSerialNumberLength];
+  if (!IsInitialized() || !GetSerialNumber(serial, sizeof(serial))
+      || serial[0] == '\0') {
+    return;
+  }
+
+  // Serial numbers are reported by the device so keep them from escaping the
+  // lock directory. flock() does not need write access, so the file is opened
+  // read-only and may be locked by users other than the one that created it.
+  const char *directory = getenv(kLockDirectoryVariable);
+  if (directory == nullptr || directory[0] == '\0') {
+    directory = kDefaultLockDirectory;
+  }
+
+  std::string name(serial);
+  std::replace(name.begin(), name.end(), '/', '_');
+  std::string path = std::string(directory) + "/pwrusbctl-" + name + ".lock";
+
+  // An existing file is opened without O_CREAT, which fs.protected_regular
+  // refuses in a sticky directory when the file belongs to another user. A
+  // file created by another process between the two opens is opened again.
+  do {
+    lock_fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (lock_fd_ == -1 && errno == ENOENT) {
+      lock_fd_ = open(path.c_str(),
+                      O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW,
+                      0644);
+    }
+  } while (lock_fd_ == -1 && errno == EEXIST);
+
+  // The lock directory may not be writable by every user, in which case the
+  // device is still usable but not shared safely.
+  if (lock_fd_ == -1) {
+    fprintf(stderr, "Error opening device lock %s: %s, transactions are "
+            "not locked against other processes\n", path.c_str(),
+            strerror(errno));
+  }
+}
+
+bool PowerUsbDevice::LockDevice() const {
+  lock_stats_.transaction_count++;
+  if (lock_fd_ == -1) {
+    return true;
+  }
+
+  // The lock is usually free, and only a wait is timed.
+  if (flock(lock_fd_, LOCK_EX | LOCK_NB) == 0) {
+    return true;
+  } else if (errno != EWOULDBLOCK) {
+    return false;
+  }
+
+  uint64_t start_us = GetMonotonicTimeUs();
+  int result;
+  do {
+    result = flock(lock_fd_, LOCK_EX);
+  } while (result == -1 && errno == EINTR);
+
+  uint64_t wait_us = GetMonotonicTimeUs() - start_us;
+  lock_stats_.contended_count++;
+  lock_stats_.total_wait_us += wait_us;
+  lock_stats_.max_wait_us = std::max(lock_stats_.max_wait_us, wait_us);
+  return (result == 0);
+}
+
+void PowerUsbDevice::UnlockDevice() const {
+  if (lock_fd_ != -1) {
+    flock(lock_fd_, LOCK_UN);
+  }
+}
+
+bool PowerUsbDevice::Transaction(const uint8_t *command,
+                                 size_t command_length, uint8_t *response,
+                                 size_t response_length) const {
+  // Responses are not tagged with the command that produced them, so the
+  // write and the read must not interleave with another transaction, whether
+  // from another thread or another process.
+  std::lock_guard<std::mutex> lock(transaction_mutex_);
+  if (!LockDevice()) {
+    return false;
+  }
+
+  bool success = DeviceWrite(command, command_length)
+      && ((response == nullptr) || DeviceRead(response, response_length));
+  UnlockDevice();
+  return success;
 }
 
 bool PowerUsbDevice::DeviceWrite(const uint8_t *buffer, size_t length) const {
@@ -14,9 +14,16 @@
  * limitations under the License.
  */
 
+#ifndef PWRUSBCTL_POWER_USB_DEVICE_H_
+#define PWRUSBCTL_POWER_USB_DEVICE_H_
+
 #include <hidapi.h>
 
 #include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "util/noncopyable.h"
 
@@ -33,10 +40,33 @@ enum class SocketState {
   On,
 };
 
+/**
+ * The counters of the lock that a PowerUsbDevice holds for each transaction.
+ */
+struct DeviceLockStats {
+  //! The number of transactions performed.
+  uint64_t transaction_count;
+
+  //! The number of transactions that waited for another process to finish
+  //! its transaction with the device.
+  uint64_t contended_count;
+
+  //! The total and the longest time spent waiting in microseconds.
+  uint64_t total_wait_us;
+  uint64_t max_wait_us;
+};
+
 /**
  * A class to model and control the state of a PowerUSB-branded power bar. This
  * device is interfaced with via the USB HID protocol. The HIDAPI is used as
  * a platform abstraction over the HID implementation.
+ *
+ * Each transaction holds an advisory lock on a file named after the serial
+ * number of the device, so that processes sharing a device do not read each
+ * other's responses. The lock is held only for the write and read of a single
+ * transaction, so concurrent tools interleave their transactions rather than
+ * excluding each other for a whole session. Devices that do not report a
+ * serial number, or whose lock file cannot be opened, are not locked.
  */
 class PowerUsbDevice : public NonCopyable {
  public:
@@ -52,17 +82,34 @@ class PowerUsbDevice : public NonCopyable {
   static float ConvertChargeToKilowattHours(int32_t milliamp_minutes,
                                             float line_voltage);
 
+  /**
+   * Finds every PowerUSB device attached to the system. This also initializes
+   * the hidapi library, which must be done before devices are opened from
+   * several threads.
+   *
+   * @param paths The vector to populate with the path of each device, which
+   *        may be passed to the constructor.
+   */
+  static void EnumerateDevicePaths(std::vector<std::string> *paths);
+
   /**
    * Constructs a PowerUsbDevice by opening the first (or only) PowerUSB
-   * device attached to the system. This library currently only supports
-   * interfacing with one device at a time (and defaults to the first
-   * available).
+   * device attached to the system.
    *
    * The return value of IsInitialized() must be checked prior to invoking any
    * of the methods that read or write the state of the device.
    */
   PowerUsbDevice();
 
+  /**
+   * Constructs a PowerUsbDevice by opening the device at a path obtained from
+   * EnumerateDevicePaths(). The return value of IsInitialized() must be
+   * checked prior to use.
+   *
+   * @param path The path of the device to open.
+   */
+  explicit PowerUsbDevice(const std::string& path);
+
   /**
    * Release the PowerUsbDevice by closing the device.
    */
@@ -94,6 +141,16 @@ class PowerUsbDevice : public NonCopyable {
    */
   const char *GetDeviceType() const;
 
+  /**
+   * Obtains the serial number of the device as reported in its USB
+   * descriptor. Characters outside of the ASCII range are replaced with '?'.
+   *
+   * @param serial The buffer to populate with a null-terminated serial number.
+   * @param length The size of the buffer.
+   * @return Returns false if an error occurs.
+   */
+  bool GetSerialNumber(char *serial, size_t length) const;
+
   /**
    * Sets the state of a power outlet given an index. If the index is out of
    * range for the connected device no operation is performed. For debug builds
@@ -158,10 +215,71 @@ class PowerUsbDevice : public NonCopyable {
    */
   bool SetCurrentRatio(float ratio) const;
 
+  /**
+   * Obtains the counters of the lock held for each transaction.
+   *
+   * @param stats The counters to populate.
+   */
+  void GetLockStats(DeviceLockStats *stats) const;
+
+  /**
+   * Prints the number of transactions that waited for another process and
+   * the time spent waiting.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
  private:
   //! The underlying HID device used to communicate with the PowerUSB device.
   hid_device *device_;
 
+  //! Serializes transactions so that the device may be shared by threads.
+  mutable std::mutex transaction_mutex_;
+
+  //! The lock file shared with other processes using the device, or -1 if
+  //! transactions are not locked across processes.
+  int lock_fd_;
+
+  //! The counters of the lock, guarded by transaction_mutex_.
+  mutable DeviceLockStats lock_stats_;
+
+  /**
+   * Opens the lock file for the device once it has been opened. The lock
+   * directory is /run/lock unless overridden by PWRUSBCTL_LOCK_DIR. If the
+   * lock file cannot be opened, a warning is printed and transactions are
+   * not locked.
+   */
+  void OpenLockFile();
+
+  /**
+   * Takes the lock shared with other processes, waiting for any transaction
+   * in progress to finish. Must be invoked with transaction_mutex_ held.
+   *
+   * @return Returns false if an error occurs.
+   */
+  bool LockDevice() const;
+
+  /**
+   * Releases the lock shared with other processes.
+   */
+  void UnlockDevice() const;
+
+  /**
+   * Performs a transaction with the device: a command is written and, if a
+   * response buffer is supplied, the response is read. Transactions from
+   * different threads and processes are serialized.
+   *
+   * @param command The command to write.
+   * @param command_length The length of the command.
+   * @param response The buffer to read the response into, or nullptr if the
+   *                 command has no response.
+   * @param response_length The size of the response buffer.
+   * @return Returns false if an error occurs.
+   */
+  bool Transaction(const uint8_t *command, size_t command_length,
+                   uint8_t *response, size_t response_length) const;
+
   /**
    * Writes a buffer to the underlying device. If an error occurs, false is
    * returned.
@@ -184,3 +302,5 @@ class PowerUsbDevice : public NonCopyable {
 };
 
 }  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_POWER_USB_DEVICE_H_
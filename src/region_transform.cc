@@ -0,0 +1,149 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "region_transform.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace pwrusbctl {
+
+constexpr size_t RegionTransform::kMaxOpenRegions;
+
+RegionTransform::RegionTransform()
+    : has_last_(false),
+      last_() {}
+
+void RegionTransform::Process(const Sample& sample, SampleConsumer *output) {
+  output->Consume(sample);
+
+  // Markers older than the last measurement are moved up to it since the
+  // energy before it has already been integrated.
+  uint64_t marker_us = has_last_
+      ? std::max(sample.timestamp_us, last_.timestamp_us)
+      : sample.timestamp_us;
+  if (sample.type == SampleType::RegionBegin) {
+    if (regions_.size() >= kMaxOpenRegions
+        && regions_.find(sample.region) == regions_.end()) {
+      return;
+    }
+
+    OpenRegion& region = regions_[sample.region];
+    region.device_id = sample.device_id;
+    region.start_us = marker_us;
+    region.end_us = 0;
+    region.energy_j = 0.0;
+    region.peak_w = 0.0f;
+    region.sample_count = 0;
+    return;
+  }
+
+  if (sample.type == SampleType::RegionEnd) {
+    auto it = regions_.find(sample.region);
+    if (it == regions_.end() || it->second.end_us != 0) {
+      return;
+    }
+
+    it->second.end_us = std::max(marker_us, it->second.start_us);
+    if (has_last_ && it->second.end_us <= last_.timestamp_us) {
+      EmitRegion(it->first, it->second, it->second.end_us, output);
+      regions_.erase(it);
+    }
+
+    return;
+  }
+
+  if (sample.type != SampleType::Measurement || !sample.has_current) {
+    return;
+  }
+
+  bool same_device = has_last_
+      && strcmp(last_.device_id, sample.device_id) == 0;
+  for (auto it = regions_.begin(); it != regions_.end();) {
+    OpenRegion& region = it->second;
+    if (region.device_id != sample.device_id) {
+      ++it;
+      continue;
+    }
+
+    // Integrate the interval since the last measurement that lies within the
+    // region, interpolating power at its edges.
+    uint64_t end_us = (region.end_us == 0) ? sample.timestamp_us
+        : std::min(sample.timestamp_us, region.end_us);
+    if (same_device) {
+      uint64_t low_us = std::max(last_.timestamp_us, region.start_us);
+      uint64_t high_us = end_us;
+      if (high_us > low_us) {
+        double slope = (sample.power_w - last_.power_w)
+            / (sample.timestamp_us - last_.timestamp_us);
+        double low_w = last_.power_w + slope * (low_us - last_.timestamp_us);
+        double high_w = last_.power_w + slope * (high_us - last_.timestamp_us);
+        region.energy_j += (low_w + high_w) / 2.0 * (high_us - low_us) / 1e6;
+        region.peak_w = std::max(region.peak_w,
+                                 static_cast<float>(std::max(low_w, high_w)));
+      }
+    }
+
+    if (sample.timestamp_us >= region.start_us
+        && (region.end_us == 0 || sample.timestamp_us <= region.end_us)) {
+      region.peak_w = std::max(region.peak_w, sample.power_max_w);
+      region.sample_count += sample.sample_count;
+    }
+
+    if (region.end_us != 0 && sample.timestamp_us >= region.end_us) {
+      EmitRegion(it->first, region, region.end_us, output);
+      it = regions_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  last_ = sample;
+  has_last_ = true;
+}
+
+void RegionTransform::Finish(SampleConsumer *output) {
+  for (const auto& entry : regions_) {
+    const OpenRegion& region = entry.second;
+    uint64_t end_us = region.end_us;
+    if (end_us == 0) {
+      end_us = has_last_
+          ? std::max(last_.timestamp_us, region.start_us) : region.start_us;
+    }
+
+    EmitRegion(entry.first, region, end_us, output);
+  }
+
+  regions_.clear();
+}
+
+void RegionTransform::EmitRegion(const std::string& name,
+                                 const OpenRegion& region, uint64_t end_us,
+                                 SampleConsumer *output) {
+  Sample summary = {};
+  strncpy(summary.device_id, region.device_id.c_str(),
+          sizeof(summary.device_id) - 1);
+  strncpy(summary.region, name.c_str(), sizeof(summary.region) - 1);
+  summary.type = SampleType::Region;
+  summary.timestamp_us = region.start_us;
+  summary.sample_count = region.sample_count;
+  summary.region_duration_us = end_us - region.start_us;
+  summary.region_energy_j = static_cast<float>(region.energy_j);
+  summary.region_peak_w = region.peak_w;
+  output->Consume(summary);
+}
+
+}  // namespace pwrusbctl
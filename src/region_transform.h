@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_REGION_TRANSFORM_H_
+#define PWRUSBCTL_REGION_TRANSFORM_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "pipeline.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that computes the energy and peak power of regions delimited by
+ * RegionBegin and RegionEnd markers. Once a measurement beyond the end of a
+ * region is seen, a Region sample summarizing it is emitted. Markers and
+ * measurements are passed through unchanged.
+ *
+ * Energy is integrated from measurements with current, interpolating linearly
+ * at the edges of each region. Regions of different names may overlap, and a
+ * second begin marker for an open region restarts it. Markers must arrive in
+ * timestamp order with the measurements; a marker older than the last
+ * measurement is treated as if it occurred at that measurement.
+ */
+class RegionTransform : public Transform {
+ public:
+  //! The maximum number of regions open at once. Further begin markers are
+  //! ignored so that a misbehaving application cannot exhaust memory.
+  static constexpr size_t kMaxOpenRegions = 64;
+
+  RegionTransform();
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+
+  /**
+   * Emits a summary of each region that has not been summarized yet. Regions
+   * that were never ended are truncated at the last measurement.
+   */
+  void Finish(SampleConsumer *output) override;
+
+ private:
+  /**
+   * The accumulated state of an open region.
+   */
+  struct OpenRegion {
+    //! The device that the region applies to.
+    std::string device_id;
+
+    //! The time of the begin marker.
+    uint64_t start_us;
+
+    //! The time of the end marker, zero until it is received.
+    uint64_t end_us;
+
+    //! The energy drawn within the region so far.
+    double energy_j;
+
+    //! The highest power within the region so far.
+    float peak_w;
+
+    //! The number of measurements within the region so far.
+    uint32_t sample_count;
+  };
+
+  //! The open regions keyed by name.
+  std::map<std::string, OpenRegion> regions_;
+
+  //! Whether or not last_ has been populated.
+  bool has_last_;
+
+  //! The last measurement with current.
+  Sample last_;
+
+  /**
+   * Emits a summary of a region.
+   *
+   * @param name The name of the region.
+   * @param region The region to summarize.
+   * @param end_us The end of the region.
+   * @param output The next stage of the pipeline.
+   */
+  void EmitRegion(const std::string& name, const OpenRegion& region,
+                  uint64_t end_us, SampleConsumer *output);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_REGION_TRANSFORM_H_
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_SAMPLE_H_
+#define PWRUSBCTL_SAMPLE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pwrusbctl {
+
+//! The maximum length of a device identifier, including the null terminator.
+constexpr size_t kMaxDeviceIdLength(32);
+
+//! The maximum length of a region name, including the null terminator.
+constexpr size_t kMaxRegionNameLength(32);
+
+/**
+ * The kinds of record carried by a Sample.
+ */
+enum class SampleType : uint8_t {
+  //! A measurement taken from the device.
+  Measurement,
+
+  //! A step change in current detected in the measurements. Only the device,
+  //! timestamp and levels are populated.
+  Step,
+
+  //! A marker sent by an application at the start or end of a named region.
+  //! Only the device, timestamp and region name are populated.
+  RegionBegin,
+  RegionEnd,
+
+  //! A summary of the power drawn over a region, timestamped with the start
+  //! of the region. The device, region name and region statistics are
+  //! populated, and sample_count is the number of measurements in the region.
+  Region,
+};
+
+/**
+ * A single measurement taken from a PowerUSB device, or an event derived from
+ * measurements. This is a plain value type so that it can be copied between
+ * threads without allocation.
+ */
+struct Sample {
+  //! A null-terminated identifier for the device that produced the sample,
+  //! usually its serial number.
+  char device_id[kMaxDeviceIdLength];
+
+  //! The time at which the sample was taken in microseconds on a monotonic
+  //! clock.
+  uint64_t timestamp_us;
+
+  //! The time by which the sample was taken after it was scheduled in
+  //! microseconds. This measures the jitter of the sampling loop.
+  int64_t lateness_us;
+
+  //! The number of raw samples aggregated into this sample. For a raw sample
+  //! this is one and the ranges below equal the instantaneous values.
+  uint32_t sample_count;
+
+  //! Whether or not current_ma, power_w and their ranges are populated.
+  bool has_current;
+
+  //! The instantaneous current in milliamps, or the average current of an
+  //! aggregated sample. Wider than a device reports so that totals over many
+  //! devices fit.
+  int32_t current_ma;
+
+  //! The range of current over the aggregated samples in milliamps.
+  int32_t current_min_ma;
+  int32_t current_max_ma;
+
+  //! The instantaneous power in watts, derived from current and line voltage,
+  //! or the average power of an aggregated sample.
+  float power_w;
+
+  //! The range of power over the aggregated samples in watts.
+  float power_min_w;
+  float power_max_w;
+
+  //! Whether or not energy_kwh is populated.
+  bool has_energy;
+
+  //! The energy used since the last reset of the charge accumulator in kWh.
+  float energy_kwh;
+
+  //! The kind of record. Value-initialized samples are measurements.
+  SampleType type;
+
+  //! For a step, the average current before and after the step in milliamps.
+  float level_before_ma;
+  float level_after_ma;
+
+  //! For a marker or region, the null-terminated name of the region.
+  char region[kMaxRegionNameLength];
+
+  //! For a region, the time between its markers in microseconds.
+  uint64_t region_duration_us;
+
+  //! For a region, the energy drawn and the peak power sampled within it.
+  float region_energy_j;
+  float region_peak_w;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_SAMPLE_H_
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_SINK_H_
+#define PWRUSBCTL_SINK_H_
+
+#include <cstdio>
+
+#include "sample.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * An output for samples taken from a PowerUSB device. Implementations may
+ * buffer samples internally and emit them when Flush() is invoked.
+ */
+class Sink : public NonCopyable {
+ public:
+  virtual ~Sink() {}
+
+  /**
+   * Writes a sample to this sink.
+   *
+   * @param sample The sample to write.
+   * @return Returns false if an error occurs.
+   */
+  virtual bool Write(const Sample& sample) = 0;
+
+  /**
+   * Emits any samples that have been buffered by this sink.
+   *
+   * @return Returns false if an error occurs.
+   */
+  virtual bool Flush() {
+    return true;
+  }
+
+  /**
+   * Prints statistics specific to this sink. Only invoked while the sink is
+   * idle.
+   *
+   * @param file The file to print to.
+   */
+  virtual void PrintStats(FILE *file) const {}
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_SINK_H_
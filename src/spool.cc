@@ -0,0 +1,369 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "spool.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+
+namespace pwrusbctl {
+
+//! The magic number at the start of each segment file.
+constexpr uint32_t kSegmentMagic(0x50535750);
+
+//! The name of the file that persists the read position.
+constexpr char kCursorFileName[] = "cursor";
+
+/**
+ * The header at the start of each segment file. The record size guards
+ * against reading segments written by a build with a different Sample layout.
+ */
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t record_size;
+};
+
+constexpr size_t Spool::kDefaultSegmentSize;
+
+Spool::Spool(const std::string& directory, uint64_t max_bytes,
+             size_t segment_size)
+    : directory_(directory),
+      max_bytes_(max_bytes),
+      samples_per_segment_(std::max<size_t>(
+          1, (segment_size - sizeof(SegmentHeader)) / sizeof(Sample))),
+      initialized_(false),
+      write_file_(nullptr),
+      read_file_(nullptr),
+      read_index_(0),
+      has_peeked_sample_(false),
+      sample_count_(0),
+      discarded_count_(0),
+      data_dirty_(false),
+      cursor_dirty_(false) {
+  mkdir(directory_.c_str(), 0755);
+  DIR *dir = opendir(directory_.c_str());
+  if (dir != nullptr) {
+    closedir(dir);
+    initialized_ = true;
+    Recover();
+  }
+}
+
+Spool::~Spool() {
+  Sync();
+  if (read_file_ != nullptr) {
+    fclose(read_file_);
+  }
+
+  if (write_file_ != nullptr) {
+    fclose(write_file_);
+  }
+}
+
+bool Spool::IsInitialized() const {
+  return initialized_;
+}
+
+bool Spool::IsEmpty() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return (sample_count_ == 0);
+}
+
+uint64_t Spool::GetSampleCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sample_count_;
+}
+
+uint64_t Spool::GetDiscardedCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return discarded_count_;
+}
+
+bool Spool::Append(const Sample& sample) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (write_file_ == nullptr || segments_.empty()
+      || segments_.back().sample_count >= samples_per_segment_) {
+    // A full segment is synced before it is closed, so that Sync() only has
+    // to sync the segment being written.
+    if (write_file_ != nullptr) {
+      fflush(write_file_);
+      fsync(fileno(write_file_));
+      fclose(write_file_);
+      write_file_ = nullptr;
+    }
+
+    Segment segment;
+    segment.sequence = segments_.empty() ? 1 : segments_.back().sequence + 1;
+    segment.sample_count = 0;
+
+    write_file_ = fopen(GetSegmentPath(segment.sequence).c_str(), "wb");
+    if (write_file_ == nullptr) {
+      return false;
+    }
+
+    SegmentHeader header = { kSegmentMagic, sizeof(Sample) };
+    if (fwrite(&header, sizeof(header), 1, write_file_) != 1) {
+      return false;
+    }
+
+    // The directory entry of the new segment is synced with the cursor.
+    segments_.push_back(segment);
+    cursor_dirty_ = true;
+  }
+
+  if (fwrite(&sample, sizeof(sample), 1, write_file_) != 1) {
+    return false;
+  }
+
+  segments_.back().sample_count++;
+  sample_count_++;
+  data_dirty_ = true;
+
+  // Discard the oldest segment to stay within the size limit. The segment
+  // being written to is never discarded.
+  uint64_t segment_bytes = samples_per_segment_ * sizeof(Sample);
+  while (max_bytes_ != 0 && segments_.size() > 1
+         && segments_.size() * segment_bytes > max_bytes_) {
+    discarded_count_ += segments_.front().sample_count - read_index_;
+    RemoveOldestSegment();
+  }
+
+  return true;
+}
+
+bool Spool::Peek(Sample *sample) {
+  assert(sample);
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (sample_count_ == 0) {
+    return false;
+  }
+
+  if (!has_peeked_sample_) {
+    // Skip past a consumed segment that was still being appended to when its
+    // last sample was consumed.
+    while (segments_.size() > 1
+           && read_index_ >= segments_.front().sample_count) {
+      RemoveOldestSegment();
+    }
+
+    const Segment& oldest = segments_.front();
+    if (read_file_ == nullptr) {
+      read_file_ = fopen(GetSegmentPath(oldest.sequence).c_str(), "rb");
+      if (read_file_ == nullptr || fseek(read_file_, sizeof(SegmentHeader)
+          + read_index_ * sizeof(Sample), SEEK_SET) != 0) {
+        return false;
+      }
+    }
+
+    // The oldest segment may also be the one being appended to.
+    if (segments_.size() == 1 && write_file_ != nullptr) {
+      fflush(write_file_);
+    }
+
+    clearerr(read_file_);
+    if (fread(&peeked_sample_, sizeof(Sample), 1, read_file_) != 1) {
+      return false;
+    }
+
+    has_peeked_sample_ = true;
+  }
+
+  *sample = peeked_sample_;
+  return true;
+}
+
+void Spool::Consume() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!has_peeked_sample_) {
+    return;
+  }
+
+  has_peeked_sample_ = false;
+  read_index_++;
+  sample_count_--;
+  cursor_dirty_ = true;
+
+  // Remove the oldest segment once it has been consumed and is no longer
+  // being appended to.
+  if (read_index_ >= segments_.front().sample_count
+      && (segments_.size() > 1 || write_file_ == nullptr)) {
+    RemoveOldestSegment();
+  }
+}
+
+bool Spool::Sync() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  bool success = true;
+  if (data_dirty_ && write_file_ != nullptr) {
+    success &= (fflush(write_file_) == 0);
+    success &= (fsync(fileno(write_file_)) == 0);
+  }
+
+  data_dirty_ = !success;
+  if (cursor_dirty_) {
+    success &= WriteCursor();
+  }
+
+  return success;
+}
+
+void Spool::Recover() {
+  DIR *dir = opendir(directory_.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+
+  dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    uint64_t sequence;
+    char suffix;
+    if (sscanf(entry->d_name, "segment-%" SCNx64 ".spoo%c",
+               &sequence, &suffix) != 2 || suffix != 'l') {
+      continue;
+    }
+
+    std::string path = GetSegmentPath(sequence);
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+      continue;
+    }
+
+    SegmentHeader header;
+    struct stat file_stat;
+    bool valid = (fread(&header, sizeof(header), 1, file) == 1)
+        && header.magic == kSegmentMagic
+        && header.record_size == sizeof(Sample)
+        && fstat(fileno(file), &file_stat) == 0;
+    fclose(file);
+
+    if (!valid) {
+      fprintf(stderr, "Ignoring incompatible spool segment %s\n",
+              path.c_str());
+      continue;
+    }
+
+    Segment segment;
+    segment.sequence = sequence;
+    segment.sample_count = (file_stat.st_size - sizeof(SegmentHeader))
+        / sizeof(Sample);
+    segments_.push_back(segment);
+  }
+
+  closedir(dir);
+  std::sort(segments_.begin(), segments_.end(),
+            [](const Segment& a, const Segment& b) {
+              return a.sequence < b.sequence;
+            });
+
+  for (const Segment& segment : segments_) {
+    sample_count_ += segment.sample_count;
+  }
+
+  // Restore the read position within the oldest segment.
+  std::string cursor_path = directory_ + "/" + kCursorFileName;
+  FILE *cursor = fopen(cursor_path.c_str(), "r");
+  if (cursor != nullptr) {
+    uint64_t sequence;
+    uint64_t index;
+    if (fscanf(cursor, "%" SCNu64 " %" SCNu64, &sequence, &index) == 2
+        && !segments_.empty() && segments_.front().sequence == sequence
+        && index <= segments_.front().sample_count) {
+      read_index_ = index;
+      sample_count_ -= index;
+    }
+
+    fclose(cursor);
+  }
+
+  // Drop segments that were fully consumed before the last run exited. New
+  // samples are always appended to a fresh segment so that a record left
+  // partially written by a crash is never appended to.
+  while (!segments_.empty()
+         && read_index_ >= segments_.front().sample_count) {
+    RemoveOldestSegment();
+  }
+}
+
+std::string Spool::GetSegmentPath(uint64_t sequence) const {
+  char name[64];
+  snprintf(name, sizeof(name), "segment-%016" PRIx64 ".spool", sequence);
+  return directory_ + "/" + name;
+}
+
+void Spool::RemoveOldestSegment() {
+  assert(!segments_.empty());
+  if (read_file_ != nullptr) {
+    fclose(read_file_);
+    read_file_ = nullptr;
+  }
+
+  if (segments_.size() == 1 && write_file_ != nullptr) {
+    fclose(write_file_);
+    write_file_ = nullptr;
+  }
+
+  const Segment& oldest = segments_.front();
+  sample_count_ -= oldest.sample_count - read_index_;
+  unlink(GetSegmentPath(oldest.sequence).c_str());
+  segments_.pop_front();
+  read_index_ = 0;
+  has_peeked_sample_ = false;
+  WriteCursor();
+}
+
+bool Spool::WriteCursor() {
+  if (!initialized_) {
+    return false;
+  }
+
+  // Write to a temporary file and rename it so that the cursor is never
+  // observed partially written. The directory is synced after the rename so
+  // that the cursor and any new segments survive a power loss.
+  std::string cursor_path = directory_ + "/" + kCursorFileName;
+  std::string temp_path = cursor_path + ".tmp";
+  FILE *cursor = fopen(temp_path.c_str(), "w");
+  if (cursor == nullptr) {
+    return false;
+  }
+
+  uint64_t sequence = segments_.empty() ? 0 : segments_.front().sequence;
+  bool success = (fprintf(cursor, "%" PRIu64 " %" PRIu64 "\n",
+                          sequence, read_index_) > 0);
+  success &= (fflush(cursor) == 0);
+  success &= (fsync(fileno(cursor)) == 0);
+  success &= (fclose(cursor) == 0);
+  if (!success || rename(temp_path.c_str(), cursor_path.c_str()) != 0) {
+    return false;
+  }
+
+  int dir_fd = open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return false;
+  }
+
+  success = (fsync(dir_fd) == 0);
+  close(dir_fd);
+  cursor_dirty_ = !success;
+  return success;
+}
+
+}  // namespace pwrusbctl
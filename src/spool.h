@@ -0,0 +1,201 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_SPOOL_H_
+#define PWRUSBCTL_SPOOL_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+
+#include "sample.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * A durable first-in, first-out store of samples on local disk. Samples are
+ * appended to fixed-size segment files in a directory and read back oldest
+ * first. Segments are deleted once every sample in them has been consumed.
+ * The read position is persisted in a cursor file so that a backlog survives
+ * a restart.
+ *
+ * Appends are buffered by stdio so that the cost to the caller is usually a
+ * copy into memory. All methods are thread-safe.
+ */
+class Spool : public NonCopyable {
+ public:
+  //! The default maximum size of a segment file.
+  static constexpr size_t kDefaultSegmentSize = 4 * 1024 * 1024;
+
+  /**
+   * Opens or creates a spool in a directory, recovering any segments left by
+   * a previous run. The return value of IsInitialized() must be checked prior
+   * to use.
+   *
+   * @param directory The directory that holds the segment files.
+   * @param max_bytes The maximum size of the spool. The oldest segment is
+   *                  discarded when this is exceeded. Zero means unbounded.
+   * @param segment_size The maximum size of each segment file.
+   */
+  Spool(const std::string& directory, uint64_t max_bytes,
+        size_t segment_size = kDefaultSegmentSize);
+
+  /**
+   * Persists the read position and closes any open segments.
+   */
+  ~Spool();
+
+  /**
+   * @return Returns true if the spool directory could be opened.
+   */
+  bool IsInitialized() const;
+
+  /**
+   * @return Returns true if there are no unconsumed samples in the spool.
+   */
+  bool IsEmpty() const;
+
+  /**
+   * @return Returns the number of unconsumed samples in the spool.
+   */
+  uint64_t GetSampleCount() const;
+
+  /**
+   * @return Returns the number of samples discarded because the spool
+   *         exceeded its maximum size.
+   */
+  uint64_t GetDiscardedCount() const;
+
+  /**
+   * Appends a sample to the newest segment.
+   *
+   * @param sample The sample to append.
+   * @return Returns false if an error occurs.
+   */
+  bool Append(const Sample& sample);
+
+  /**
+   * Reads the oldest unconsumed sample without consuming it.
+   *
+   * @param sample The sample to populate.
+   * @return Returns false if the spool is empty or an error occurs.
+   */
+  bool Peek(Sample *sample);
+
+  /**
+   * Consumes the sample returned by the last call to Peek().
+   */
+  void Consume();
+
+  /**
+   * Writes buffered appends and the read position to disk and waits for
+   * them to reach stable storage. Does nothing if neither has changed since
+   * the last sync.
+   *
+   * @return Returns false if an error occurs.
+   */
+  bool Sync();
+
+ private:
+  /**
+   * Describes a segment file.
+   */
+  struct Segment {
+    //! The sequence number of the segment, which orders segments by age.
+    uint64_t sequence;
+
+    //! The number of samples in the segment.
+    uint64_t sample_count;
+  };
+
+  //! The directory that holds the segment files.
+  const std::string directory_;
+
+  //! The maximum total size of the spool in bytes, zero if unbounded.
+  const uint64_t max_bytes_;
+
+  //! The maximum number of samples in a segment.
+  const uint64_t samples_per_segment_;
+
+  //! Whether or not the directory could be opened.
+  bool initialized_;
+
+  //! Guards all members below.
+  mutable std::mutex mutex_;
+
+  //! The segments in the spool ordered oldest first.
+  std::deque<Segment> segments_;
+
+  //! The segment being appended to, nullptr if none is open.
+  FILE *write_file_;
+
+  //! The oldest segment, which is being read from. nullptr if none is open.
+  FILE *read_file_;
+
+  //! The index of the next sample to read within the oldest segment.
+  uint64_t read_index_;
+
+  //! Whether or not peeked_sample_ holds the sample at read_index_.
+  bool has_peeked_sample_;
+
+  //! The sample returned by the last call to Peek().
+  Sample peeked_sample_;
+
+  //! The total number of unconsumed samples.
+  uint64_t sample_count_;
+
+  //! The number of samples discarded to respect max_bytes_.
+  uint64_t discarded_count_;
+
+  //! Whether or not samples have been appended, and whether or not the read
+  //! position or the set of segments has changed, since they were last
+  //! synced, so that an idle spool is not synced.
+  bool data_dirty_;
+  bool cursor_dirty_;
+
+  /**
+   * Enumerates existing segments and restores the read position.
+   */
+  void Recover();
+
+  /**
+   * Obtains the path of a segment file.
+   *
+   * @param sequence The sequence number of the segment.
+   * @return The path of the segment.
+   */
+  std::string GetSegmentPath(uint64_t sequence) const;
+
+  /**
+   * Removes the oldest segment, closing it if open. The caller must hold
+   * mutex_.
+   */
+  void RemoveOldestSegment();
+
+  /**
+   * Persists the read position. The caller must hold mutex_.
+   *
+   * @return Returns false if an error occurs.
+   */
+  bool WriteCursor();
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_SPOOL_H_
@@ -0,0 +1,336 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sqlite_sink.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace pwrusbctl {
+
+//! The time that a statement waits for a lock held by another connection,
+//! such as a reader or a checkpoint, before failing with SQLITE_BUSY.
+constexpr int kBusyTimeoutMs(5000);
+
+//! The number of microseconds in a rollup bucket.
+constexpr int64_t kRollupIntervalUs(60 * 1000 * 1000);
+
+//! The statements used to create the schema.
+constexpr const char *kSchemaStatements[] = {
+  "PRAGMA journal_mode=WAL",
+  "PRAGMA synchronous=NORMAL",
+  "CREATE TABLE IF NOT EXISTS samples ("
+  "  device TEXT NOT NULL,"
+  "  timestamp_us INTEGER NOT NULL,"
+  "  lateness_us INTEGER,"
+  "  current_ma INTEGER,"
+  "  power_w REAL,"
+  "  energy_kwh REAL,"
+  "  sample_count INTEGER,"
+  "  current_min_ma INTEGER,"
+  "  current_max_ma INTEGER,"
+  "  power_min_w REAL,"
+  "  power_max_w REAL)",
+  "CREATE INDEX IF NOT EXISTS samples_device_time"
+  "  ON samples (device, timestamp_us)",
+  "CREATE TABLE IF NOT EXISTS events ("
+  "  device TEXT NOT NULL,"
+  "  timestamp_us INTEGER NOT NULL,"
+  "  type TEXT NOT NULL,"
+  "  level_before_ma REAL,"
+  "  level_after_ma REAL,"
+  "  region TEXT,"
+  "  duration_us INTEGER,"
+  "  energy_j REAL,"
+  "  peak_w REAL)",
+  "CREATE INDEX IF NOT EXISTS events_device_time"
+  "  ON events (device, timestamp_us)",
+};
+
+//! The statements used to add columns to a database created before they
+//! existed. Each fails harmlessly if its column is already present.
+constexpr const char *kMigrationStatements[] = {
+  "ALTER TABLE samples ADD COLUMN lateness_us INTEGER",
+  "ALTER TABLE samples ADD COLUMN sample_count INTEGER",
+  "ALTER TABLE samples ADD COLUMN current_min_ma INTEGER",
+  "ALTER TABLE samples ADD COLUMN current_max_ma INTEGER",
+  "ALTER TABLE samples ADD COLUMN power_min_w REAL",
+  "ALTER TABLE samples ADD COLUMN power_max_w REAL",
+  "ALTER TABLE events ADD COLUMN region TEXT",
+  "ALTER TABLE events ADD COLUMN duration_us INTEGER",
+  "ALTER TABLE events ADD COLUMN energy_j REAL",
+  "ALTER TABLE events ADD COLUMN peak_w REAL",
+};
+
+//! The statement used to create the rollup table.
+constexpr char kCreateRollupTable[] =
+    "CREATE TABLE IF NOT EXISTS samples_1m ("
+    "  device TEXT NOT NULL,"
+    "  minute_us INTEGER NOT NULL,"
+    "  count INTEGER NOT NULL,"
+    "  current_min_ma INTEGER NOT NULL,"
+    "  current_max_ma INTEGER NOT NULL,"
+    "  current_sum_ma INTEGER NOT NULL,"
+    "  power_sum_w REAL NOT NULL,"
+    "  energy_kwh REAL,"
+    "  PRIMARY KEY (device, minute_us))";
+
+//! The statement used to insert a sample.
+constexpr char kInsertSample[] =
+    "INSERT INTO samples (device, timestamp_us, current_ma, power_w,"
+    " energy_kwh, lateness_us, sample_count, current_min_ma, current_max_ma,"
+    " power_min_w, power_max_w)"
+    " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11)";
+
+//! The statement used to insert an event.
+constexpr char kInsertEvent[] =
+    "INSERT INTO events (device, timestamp_us, type, level_before_ma,"
+    " level_after_ma, region, duration_us, energy_j, peak_w)"
+    " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9)";
+
+//! The statement used to fold a sample into its rollup bucket.
+constexpr char kUpsertRollup[] =
+    "INSERT INTO samples_1m (device, minute_us, count, current_min_ma,"
+    " current_max_ma, current_sum_ma, power_sum_w, energy_kwh)"
+    " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8)"
+    " ON CONFLICT (device, minute_us) DO UPDATE SET"
+    "  count = count + excluded.count,"
+    "  current_min_ma = min(current_min_ma, excluded.current_min_ma),"
+    "  current_max_ma = max(current_max_ma, excluded.current_max_ma),"
+    "  current_sum_ma = current_sum_ma + excluded.current_sum_ma,"
+    "  power_sum_w = power_sum_w + excluded.power_sum_w,"
+    "  energy_kwh = coalesce(excluded.energy_kwh, energy_kwh)";
+
+constexpr size_t SqliteSink::kDefaultBatchSize;
+
+SqliteSink::SqliteSink(const std::string& path, bool enable_rollups,
+                       size_t batch_size, const Clock& clock)
+    : database_(nullptr),
+      insert_sample_(nullptr),
+      insert_event_(nullptr),
+      upsert_rollup_(nullptr),
+      batch_size_(batch_size),
+      wall_clock_offset_us_(clock.GetWallClockOffsetUs()) {
+  if (sqlite3_open(path.c_str(), &database_) != SQLITE_OK
+      || sqlite3_busy_timeout(database_, kBusyTimeoutMs) != SQLITE_OK
+      || !Prepare(enable_rollups)) {
+    if (database_ != nullptr) {
+      fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(database_));
+    }
+
+    sqlite3_finalize(insert_sample_);
+    sqlite3_finalize(insert_event_);
+    sqlite3_finalize(upsert_rollup_);
+    sqlite3_close(database_);
+    database_ = nullptr;
+    return;
+  }
+
+  pending_.reserve(batch_size_);
+}
+
+SqliteSink::~SqliteSink() {
+  if (IsInitialized()) {
+    Flush();
+    sqlite3_finalize(insert_sample_);
+    sqlite3_finalize(insert_event_);
+    sqlite3_finalize(upsert_rollup_);
+    sqlite3_close(database_);
+  }
+}
+
+bool SqliteSink::IsInitialized() const {
+  return (database_ != nullptr);
+}
+
+bool SqliteSink::Write(const Sample& sample) {
+  pending_.push_back(sample);
+  if (pending_.size() >= batch_size_) {
+    return Flush();
+  }
+
+  return true;
+}
+
+bool SqliteSink::Flush() {
+  if (pending_.empty()) {
+    return true;
+  }
+
+  // A batch that could not take the lock is kept and committed again by the
+  // next flush, rather than being lost.
+  int result = CommitBatch(pending_);
+  if ((result & 0xff) == SQLITE_BUSY || (result & 0xff) == SQLITE_LOCKED) {
+    return false;
+  }
+
+  pending_.clear();
+  return (result == SQLITE_OK);
+}
+
+bool SqliteSink::Prepare(bool enable_rollups) {
+  for (const char *statement : kSchemaStatements) {
+    if (!Execute(statement)) {
+      return false;
+    }
+  }
+
+  for (const char *statement : kMigrationStatements) {
+    Execute(statement);
+  }
+
+  if (sqlite3_prepare_v2(database_, kInsertSample, -1,
+                         &insert_sample_, nullptr) != SQLITE_OK
+      || sqlite3_prepare_v2(database_, kInsertEvent, -1,
+                            &insert_event_, nullptr) != SQLITE_OK) {
+    return false;
+  }
+
+  if (enable_rollups) {
+    if (!Execute(kCreateRollupTable)
+        || sqlite3_prepare_v2(database_, kUpsertRollup, -1,
+                              &upsert_rollup_, nullptr) != SQLITE_OK) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int SqliteSink::CommitBatch(const std::vector<Sample>& samples) {
+  int result = sqlite3_exec(database_, "BEGIN", nullptr, nullptr, nullptr);
+  if (result != SQLITE_OK) {
+    return result;
+  }
+
+  for (const Sample& sample : samples) {
+    if (result != SQLITE_OK) {
+      break;
+    }
+
+    int64_t timestamp_us = static_cast<int64_t>(sample.timestamp_us)
+        + wall_clock_offset_us_;
+    if (sample.type != SampleType::Measurement) {
+      sqlite3_bind_text(insert_event_, 1, sample.device_id, -1,
+                        SQLITE_STATIC);
+      sqlite3_bind_int64(insert_event_, 2, timestamp_us);
+      for (int index = 4; index <= 9; index++) {
+        sqlite3_bind_null(insert_event_, index);
+      }
+
+      if (sample.type == SampleType::Step) {
+        sqlite3_bind_text(insert_event_, 3, "step", -1, SQLITE_STATIC);
+        sqlite3_bind_double(insert_event_, 4, sample.level_before_ma);
+        sqlite3_bind_double(insert_event_, 5, sample.level_after_ma);
+      } else {
+        const char *type = "region";
+        if (sample.type == SampleType::RegionBegin) {
+          type = "begin";
+        } else if (sample.type == SampleType::RegionEnd) {
+          type = "end";
+        }
+
+        sqlite3_bind_text(insert_event_, 3, type, -1, SQLITE_STATIC);
+        sqlite3_bind_text(insert_event_, 6, sample.region, -1, SQLITE_STATIC);
+        if (sample.type == SampleType::Region) {
+          sqlite3_bind_int64(insert_event_, 7, sample.region_duration_us);
+          sqlite3_bind_double(insert_event_, 8, sample.region_energy_j);
+          sqlite3_bind_double(insert_event_, 9, sample.region_peak_w);
+        }
+      }
+
+      result = Step(insert_event_);
+      continue;
+    }
+
+    sqlite3_bind_text(insert_sample_, 1, sample.device_id, -1,
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(insert_sample_, 2, timestamp_us);
+    if (sample.has_current) {
+      sqlite3_bind_int(insert_sample_, 3, sample.current_ma);
+      sqlite3_bind_double(insert_sample_, 4, sample.power_w);
+      sqlite3_bind_int(insert_sample_, 8, sample.current_min_ma);
+      sqlite3_bind_int(insert_sample_, 9, sample.current_max_ma);
+      sqlite3_bind_double(insert_sample_, 10, sample.power_min_w);
+      sqlite3_bind_double(insert_sample_, 11, sample.power_max_w);
+    } else {
+      for (int index : { 3, 4, 8, 9, 10, 11 }) {
+        sqlite3_bind_null(insert_sample_, index);
+      }
+    }
+
+    if (sample.has_energy) {
+      sqlite3_bind_double(insert_sample_, 5, sample.energy_kwh);
+    } else {
+      sqlite3_bind_null(insert_sample_, 5);
+    }
+
+    sqlite3_bind_int64(insert_sample_, 6, sample.lateness_us);
+    sqlite3_bind_int64(insert_sample_, 7, sample.sample_count);
+
+    result = Step(insert_sample_);
+    if (result == SQLITE_OK && upsert_rollup_ != nullptr
+        && sample.has_current) {
+      int64_t minute_us = timestamp_us - (timestamp_us % kRollupIntervalUs);
+      sqlite3_bind_text(upsert_rollup_, 1, sample.device_id, -1,
+                        SQLITE_STATIC);
+      sqlite3_bind_int64(upsert_rollup_, 2, minute_us);
+
+      // An aggregated sample contributes its average once per raw sample so
+      // that rollup averages weight every raw sample equally.
+      uint32_t count = std::max<uint32_t>(1, sample.sample_count);
+      sqlite3_bind_int64(upsert_rollup_, 3, count);
+      sqlite3_bind_int(upsert_rollup_, 4, sample.current_min_ma);
+      sqlite3_bind_int(upsert_rollup_, 5, sample.current_max_ma);
+      sqlite3_bind_int64(upsert_rollup_, 6,
+                         static_cast<int64_t>(sample.current_ma) * count);
+      sqlite3_bind_double(upsert_rollup_, 7, sample.power_w * count);
+      if (sample.has_energy) {
+        sqlite3_bind_double(upsert_rollup_, 8, sample.energy_kwh);
+      } else {
+        sqlite3_bind_null(upsert_rollup_, 8);
+      }
+
+      result = Step(upsert_rollup_);
+    }
+  }
+
+  if (result == SQLITE_OK) {
+    result = sqlite3_exec(database_, "COMMIT", nullptr, nullptr, nullptr);
+  }
+
+  // A failed insert or commit leaves the transaction open, which would fail
+  // every later BEGIN, so it is rolled back.
+  if (result != SQLITE_OK) {
+    fprintf(stderr, "SQLite error: %s\n", sqlite3_errmsg(database_));
+    Execute("ROLLBACK");
+  }
+
+  return result;
+}
+
+int SqliteSink::Step(sqlite3_stmt *statement) {
+  int result = sqlite3_step(statement);
+  sqlite3_reset(statement);
+  return (result == SQLITE_DONE) ? SQLITE_OK : result;
+}
+
+bool SqliteSink::Execute(const char *sql) {
+  return (sqlite3_exec(database_, sql, nullptr, nullptr, nullptr)
+      == SQLITE_OK);
+}
+
+}  // namespace pwrusbctl
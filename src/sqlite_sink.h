@@ -0,0 +1,135 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_SQLITE_SINK_H_
+#define PWRUSBCTL_SQLITE_SINK_H_
+
+#include <sqlite3.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sink.h"
+#include "util/clock.h"
+
+namespace pwrusbctl {
+
+/**
+ * A sink that stores samples in a SQLite database. The database is opened in
+ * WAL mode and samples are buffered and inserted in batched transactions using
+ * prepared statements that are reused for the lifetime of the sink. Samples
+ * are stored with wall-clock timestamps in microseconds since the Unix epoch
+ * and are indexed by (device, timestamp_us). Events such as steps, region
+ * markers and region summaries are stored in the events table.
+ *
+ * A transaction is committed once batch_size samples are buffered or when
+ * Flush() is invoked. When used in a Pipeline, commits run on the sink thread.
+ *
+ * When rollups are enabled, per-minute min/max/average aggregates are
+ * maintained in the samples_1m table within the same transaction as the raw
+ * inserts.
+ */
+class SqliteSink : public Sink {
+ public:
+  //! The default number of samples to insert per transaction.
+  static constexpr size_t kDefaultBatchSize = 512;
+
+  /**
+   * Opens or creates the database at the supplied path. The return value of
+   * IsInitialized() must be checked prior to writing samples.
+   *
+   * @param path The path of the database file.
+   * @param enable_rollups Whether or not to maintain per-minute rollups.
+   * @param batch_size The number of samples that triggers a commit.
+   * @param clock The clock whose wall-clock offset timestamps are stored with.
+   */
+  SqliteSink(const std::string& path, bool enable_rollups,
+             size_t batch_size = kDefaultBatchSize,
+             const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Commits any buffered samples and closes the database.
+   */
+  ~SqliteSink();
+
+  /**
+   * @return Returns true if the database was opened and the schema created.
+   */
+  bool IsInitialized() const;
+
+  bool Write(const Sample& sample) override;
+  bool Flush() override;
+
+ private:
+  //! The underlying database connection.
+  sqlite3 *database_;
+
+  //! The prepared statement used to insert raw samples.
+  sqlite3_stmt *insert_sample_;
+
+  //! The prepared statement used to insert events.
+  sqlite3_stmt *insert_event_;
+
+  //! The prepared statement used to update rollups, nullptr if disabled.
+  sqlite3_stmt *upsert_rollup_;
+
+  //! The number of buffered samples that triggers a commit.
+  const size_t batch_size_;
+
+  //! The offset added to monotonic timestamps to obtain wall-clock time.
+  int64_t wall_clock_offset_us_;
+
+  //! Samples waiting to be committed.
+  std::vector<Sample> pending_;
+
+  /**
+   * Creates the schema and prepares statements.
+   *
+   * @param enable_rollups Whether or not to create the rollup table.
+   * @return Returns false if an error occurs.
+   */
+  bool Prepare(bool enable_rollups);
+
+  /**
+   * Inserts a batch of samples in a single transaction, rolling it back if
+   * any statement fails.
+   *
+   * @param samples The samples to insert.
+   * @return The SQLite result code, SQLITE_OK if the batch was committed.
+   */
+  int CommitBatch(const std::vector<Sample>& samples);
+
+  /**
+   * Executes a prepared statement that produces no rows and resets it.
+   *
+   * @param statement The statement to execute.
+   * @return The SQLite result code, SQLITE_OK if the statement completed.
+   */
+  static int Step(sqlite3_stmt *statement);
+
+  /**
+   * Executes a SQL statement that produces no rows.
+   *
+   * @param sql The statement to execute.
+   * @return Returns false if an error occurs.
+   */
+  bool Execute(const char *sql);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_SQLITE_SINK_H_
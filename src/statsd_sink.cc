@@ -0,0 +1,153 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "statsd_sink.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The maximum length of a single formatted metric line.
+constexpr size_t kMaxMetricLineLength(128);
+
+constexpr size_t StatsdSink::kDefaultMaxPacketSize;
+
+StatsdSink::StatsdSink(const std::string& address, const std::string& prefix,
+                       size_t max_packet_size, bool per_device)
+    : socket_(-1),
+      prefix_(prefix),
+      per_device_(per_device),
+      packet_(max_packet_size),
+      packet_length_(0) {
+  if (ResolveSocketAddress(address, SOCK_DGRAM, &address_)) {
+    socket_ = socket(address_.storage.ss_family, SOCK_DGRAM, 0);
+  }
+}
+
+StatsdSink::~StatsdSink() {
+  if (IsInitialized()) {
+    Flush();
+    close(socket_);
+  }
+}
+
+bool StatsdSink::IsInitialized() const {
+  return (socket_ >= 0);
+}
+
+bool StatsdSink::Write(const Sample& sample) {
+  // Characters that delimit StatsD names and values cannot appear in a name.
+  if (per_device_) {
+    device_ = sample.device_id;
+    for (char& c : device_) {
+      if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+        c = '_';
+      }
+    }
+
+    device_ += ".";
+  }
+
+  if (sample.type == SampleType::Step) {
+    return AppendMetric("steps", 1.0f, "c")
+        && AppendMetric("step_ma",
+                        sample.level_after_ma - sample.level_before_ma, "g");
+  } else if (sample.type == SampleType::Region) {
+    // Each region is reported under its own name, such as
+    // "region.warmup.energy_j".
+    char energy_name[kMaxMetricLineLength];
+    char peak_name[kMaxMetricLineLength];
+    char duration_name[kMaxMetricLineLength];
+    snprintf(energy_name, sizeof(energy_name), "region.%s.energy_j",
+             sample.region);
+    snprintf(peak_name, sizeof(peak_name), "region.%s.peak_w",
+             sample.region);
+    snprintf(duration_name, sizeof(duration_name), "region.%s.duration",
+             sample.region);
+    return AppendMetric(energy_name, sample.region_energy_j, "g")
+        && AppendMetric(peak_name, sample.region_peak_w, "g")
+        && AppendMetric(duration_name, sample.region_duration_us / 1000.0f,
+                        "ms");
+  } else if (sample.type != SampleType::Measurement) {
+    return true;
+  }
+
+  bool success = true;
+  if (sample.has_current) {
+    success &= AppendMetric("current_ma", sample.current_ma, "g");
+    success &= AppendMetric("power_w", sample.power_w, "g");
+    if (sample.sample_count > 1) {
+      success &= AppendMetric("current_min_ma", sample.current_min_ma, "g");
+      success &= AppendMetric("current_max_ma", sample.current_max_ma, "g");
+      success &= AppendMetric("power_min_w", sample.power_min_w, "g");
+      success &= AppendMetric("power_max_w", sample.power_max_w, "g");
+    }
+  }
+
+  if (sample.has_energy) {
+    success &= AppendMetric("energy_kwh", sample.energy_kwh, "g");
+  }
+
+  // Lateness is sent as a timer so that StatsD aggregates its distribution.
+  success &= AppendMetric("lateness", sample.lateness_us / 1000.0f, "ms");
+
+  return success;
+}
+
+bool StatsdSink::Flush() {
+  if (packet_length_ == 0) {
+    return true;
+  }
+
+  ssize_t sent = sendto(socket_, packet_.data(), packet_length_, 0,
+                        address_.get(), address_.length);
+  packet_length_ = 0;
+  return (sent >= 0);
+}
+
+bool StatsdSink::AppendMetric(const char *name, float value,
+                              const char *type) {
+  char line[kMaxMetricLineLength];
+  int length = snprintf(line, sizeof(line), "%s%s%s:%f|%s",
+                        prefix_.c_str(), device_.c_str(), name, value, type);
+  if (length < 0 || static_cast<size_t>(length) >= sizeof(line)
+      || static_cast<size_t>(length) > packet_.size()) {
+    return false;
+  }
+
+  // Metrics within a datagram are separated by newlines.
+  size_t required = static_cast<size_t>(length)
+      + ((packet_length_ > 0) ? 1 : 0);
+  bool success = true;
+  if (packet_length_ + required > packet_.size()) {
+    success = Flush();
+  }
+
+  if (packet_length_ > 0) {
+    packet_[packet_length_++] = '\n';
+  }
+
+  memcpy(&packet_[packet_length_], line, length);
+  packet_length_ += length;
+  return success;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_STATSD_SINK_H_
+#define PWRUSBCTL_STATSD_SINK_H_
+
+#include <string>
+#include <vector>
+
+#include "sink.h"
+#include "util/socket_address.h"
+
+namespace pwrusbctl {
+
+/**
+ * A sink that emits samples as StatsD metrics over UDP. Metrics are packed
+ * into a datagram until it would exceed the configured maximum packet size, at
+ * which point the datagram is sent. Partially-filled datagrams are sent when
+ * Flush() is invoked, which a Pipeline does on a timer, so that a sampler
+ * emits a handful of packets per second rather than one per metric.
+ */
+class StatsdSink : public Sink {
+ public:
+  //! The default maximum datagram payload. This fits within a 1500 byte
+  //! Ethernet MTU with room for IP and UDP headers.
+  static constexpr size_t kDefaultMaxPacketSize = 1432;
+
+  /**
+   * Constructs a StatsdSink that sends to the supplied address. The return
+   * value of IsInitialized() must be checked prior to writing samples.
+   *
+   * @param address The address of the StatsD agent in the form "host:port".
+   * @param prefix The prefix prepended to each metric name, e.g. "pwrusb.".
+   * @param max_packet_size The maximum size of each datagram payload.
+   * @param per_device Whether or not to name metrics after the device that
+   *        they came from, such as "pwrusb.ABC123.power_w", so that several
+   *        devices do not report to the same metric.
+   */
+  StatsdSink(const std::string& address, const std::string& prefix,
+             size_t max_packet_size = kDefaultMaxPacketSize,
+             bool per_device = false);
+
+  /**
+   * Flushes any buffered metrics and closes the socket.
+   */
+  ~StatsdSink();
+
+  /**
+   * @return Returns true if the address was resolved and the socket opened.
+   */
+  bool IsInitialized() const;
+
+  bool Write(const Sample& sample) override;
+  bool Flush() override;
+
+ private:
+  //! The socket used to send datagrams.
+  int socket_;
+
+  //! The resolved address of the StatsD agent.
+  SocketAddress address_;
+
+  //! The prefix prepended to each metric name.
+  const std::string prefix_;
+
+  //! Whether or not the device identifier follows the prefix.
+  const bool per_device_;
+
+  //! The device identifier of the sample being written, sanitized for use in
+  //! a metric name.
+  std::string device_;
+
+  //! The datagram currently being assembled. Sized once at construction.
+  std::vector<char> packet_;
+
+  //! The number of bytes of packet_ currently in use.
+  size_t packet_length_;
+
+  /**
+   * Appends a metric to the current datagram, sending the datagram first if
+   * the metric would not fit.
+   *
+   * @param name The name of the metric, not including the prefix.
+   * @param value The value of the metric.
+   * @param type The StatsD metric type, such as "g" for a gauge.
+   * @return Returns false if an error occurs sending a datagram.
+   */
+  bool AppendMetric(const char *name, float value, const char *type);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_STATSD_SINK_H_
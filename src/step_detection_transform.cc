@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "step_detection_transform.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The largest number of samples averaged into the level. Beyond this the
+//! level becomes an exponential average that tracks slow drift.
+constexpr uint32_t kMaxLevelCount(64);
+
+constexpr float StepDetectionTransform::kDefaultDecisionFactor;
+
+StepDetectionTransform::StepDetectionTransform(float min_step_ma,
+                                               bool pass_measurements,
+                                               float decision_factor)
+    : allowance_ma_(min_step_ma / 2.0f),
+      decision_ma_(min_step_ma * decision_factor),
+      pass_measurements_(pass_measurements),
+      has_level_(false),
+      level_ma_(0.0f),
+      level_count_(0),
+      up_(),
+      down_() {}
+
+void StepDetectionTransform::Process(const Sample& sample,
+                                     SampleConsumer *output) {
+  if (pass_measurements_ || sample.type != SampleType::Measurement) {
+    output->Consume(sample);
+  }
+
+  if (sample.type != SampleType::Measurement || !sample.has_current) {
+    return;
+  }
+
+  float current_ma = sample.current_ma;
+  if (!has_level_) {
+    level_ma_ = current_ma;
+    level_count_ = 1;
+    has_level_ = true;
+    return;
+  }
+
+  float deviation_ma = current_ma - level_ma_;
+  if (Accumulate(&up_, deviation_ma - allowance_ma_, sample)) {
+    EmitStep(up_, sample, output);
+  } else if (Accumulate(&down_, -deviation_ma - allowance_ma_, sample)) {
+    EmitStep(down_, sample, output);
+  } else if (up_.sum == 0.0f && down_.sum == 0.0f) {
+    // Only samples that are not part of a potential step refine the level.
+    level_count_ = std::min(level_count_ + 1, kMaxLevelCount);
+    level_ma_ += deviation_ma / level_count_;
+  }
+}
+
+bool StepDetectionTransform::Accumulate(Cusum *cusum, float deviation,
+                                        const Sample& sample) {
+  if (cusum->sum == 0.0f) {
+    cusum->start_us = sample.timestamp_us;
+    cusum->run_sum_ma = 0.0;
+    cusum->run_count = 0;
+  }
+
+  cusum->sum = std::max(0.0f, cusum->sum + deviation);
+  if (cusum->sum == 0.0f) {
+    return false;
+  }
+
+  cusum->run_sum_ma += sample.current_ma;
+  cusum->run_count++;
+  return cusum->sum > decision_ma_;
+}
+
+void StepDetectionTransform::EmitStep(const Cusum& cusum,
+                                      const Sample& sample,
+                                      SampleConsumer *output) {
+  Sample step = {};
+  memcpy(step.device_id, sample.device_id, sizeof(step.device_id));
+  step.type = SampleType::Step;
+  step.timestamp_us = cusum.start_us;
+  step.level_before_ma = level_ma_;
+  step.level_after_ma = static_cast<float>(cusum.run_sum_ma / cusum.run_count);
+  output->Consume(step);
+
+  // Restart from the new level, seeded with the samples of the step.
+  level_ma_ = step.level_after_ma;
+  level_count_ = std::min(cusum.run_count, kMaxLevelCount);
+  up_ = Cusum();
+  down_ = Cusum();
+}
+
+}  // namespace pwrusbctl
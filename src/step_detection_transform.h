@@ -0,0 +1,122 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_STEP_DETECTION_TRANSFORM_H_
+#define PWRUSBCTL_STEP_DETECTION_TRANSFORM_H_
+
+#include <cstdint>
+
+#include "pipeline.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that detects step changes in current, such as an appliance
+ * switching on or off, using a two-sided CUSUM. Each detected step is emitted
+ * as a Step sample carrying the current level before and after the step and
+ * timestamped with the estimated start of the change. Every measurement costs
+ * constant time and memory.
+ *
+ * Deviations from the current level smaller than half of the minimum step are
+ * treated as noise. A step is reported once the accumulated deviation exceeds
+ * the decision threshold, so a full-size step is reported after a few
+ * samples while a sustained smaller shift takes longer.
+ */
+class StepDetectionTransform : public Transform {
+ public:
+  //! The default decision threshold as a multiple of the minimum step.
+  static constexpr float kDefaultDecisionFactor = 2.0f;
+
+  /**
+   * Constructs a StepDetectionTransform.
+   *
+   * @param min_step_ma The smallest change in current to detect in
+   *        milliamps.
+   * @param pass_measurements Whether or not measurements are passed on
+   *        alongside steps. If false, only steps are emitted.
+   * @param decision_factor The decision threshold as a multiple of
+   *        min_step_ma.
+   */
+  StepDetectionTransform(float min_step_ma, bool pass_measurements,
+                         float decision_factor = kDefaultDecisionFactor);
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+
+ private:
+  /**
+   * The state of one side of the CUSUM.
+   */
+  struct Cusum {
+    //! The accumulated deviation beyond the noise allowance.
+    float sum;
+
+    //! The timestamp of the first sample of the current run.
+    uint64_t start_us;
+
+    //! The sum and number of samples since the run started, used to estimate
+    //! the new level.
+    double run_sum_ma;
+    uint32_t run_count;
+  };
+
+  //! The deviation from the level that is tolerated as noise.
+  const float allowance_ma_;
+
+  //! The accumulated deviation that signals a step.
+  const float decision_ma_;
+
+  //! Whether or not measurements are passed on.
+  const bool pass_measurements_;
+
+  //! Whether or not level_ma_ has been initialized.
+  bool has_level_;
+
+  //! The estimated current level since the last step.
+  float level_ma_;
+
+  //! The number of samples contributing to level_ma_, capped so that the
+  //! level follows slow drift.
+  uint32_t level_count_;
+
+  //! The CUSUM for upward and downward steps.
+  Cusum up_;
+  Cusum down_;
+
+  /**
+   * Accumulates a deviation into one side of the CUSUM.
+   *
+   * @param cusum The side to update.
+   * @param deviation The deviation from the level in the direction of the
+   *        side, less the allowance.
+   * @param sample The sample being processed.
+   * @return Returns true if the decision threshold was exceeded.
+   */
+  bool Accumulate(Cusum *cusum, float deviation, const Sample& sample);
+
+  /**
+   * Emits a step and resets the detector to the new level.
+   *
+   * @param cusum The side that signalled the step.
+   * @param sample The sample that completed the step.
+   * @param output The next stage of the pipeline.
+   */
+  void EmitStep(const Cusum& cusum, const Sample& sample,
+                SampleConsumer *output);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_STEP_DETECTION_TRANSFORM_H_
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "text_sink.h"
+
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+
+namespace pwrusbctl {
+
+//! The maximum length of the formatted output for a single sample.
+constexpr size_t kMaxFormattedSampleLength(256);
+
+/**
+ * Appends formatted text to a buffer, clamping at the end of the buffer.
+ *
+ * @param buffer The buffer to append to.
+ * @param size The size of the buffer.
+ * @param offset The number of bytes already in use, updated on return.
+ * @param format The printf-style format string.
+ */
+static void Append(char *buffer, size_t size, size_t *offset,
+                   const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void Append(char *buffer, size_t size, size_t *offset,
+                   const char *format, ...) {
+  if (*offset >= size) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer + *offset, size - *offset, format, args);
+  va_end(args);
+  if (length > 0) {
+    *offset += static_cast<size_t>(length);
+    if (*offset >= size) {
+      *offset = size - 1;
+    }
+  }
+}
+
+TextSink::TextSink(std::unique_ptr<OutputStream> output, TextFormat format,
+                   bool print_current, bool print_power, bool print_energy,
+                   bool print_device)
+    : output_(std::move(output)),
+      format_(format),
+      print_current_(print_current),
+      print_power_(print_power),
+      print_energy_(print_energy),
+      print_device_(print_device),
+      header_written_(false) {}
+
+bool TextSink::Write(const Sample& sample) {
+  char buffer[kMaxFormattedSampleLength];
+  size_t length = (format_ == TextFormat::Csv)
+      ? FormatCsv(sample, buffer, sizeof(buffer))
+      : FormatText(sample, buffer, sizeof(buffer));
+  if (length == 0 || format_ == TextFormat::Csv || !print_device_) {
+    return (length == 0) || output_->Write(buffer, length);
+  }
+
+  // Every line is prefixed so that the lines of a sample can be told apart
+  // from those of other devices.
+  char prefixed[kMaxFormattedSampleLength * 2];
+  size_t prefixed_length = 0;
+  size_t line_start = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (buffer[i] == '\n') {
+      Append(prefixed, sizeof(prefixed), &prefixed_length, "%s %.*s",
+             sample.device_id, static_cast<int>(i + 1 - line_start),
+             buffer + line_start);
+      line_start = i + 1;
+    }
+  }
+
+  return output_->Write(prefixed, prefixed_length);
+}
+
+bool TextSink::Flush() {
+  return output_->Flush();
+}
+
+void TextSink::PrintStats(FILE *file) const {
+  output_->PrintStats(file);
+}
+
+size_t TextSink::FormatText(const Sample& sample, char *buffer,
+                            size_t size) const {
+  size_t offset = 0;
+  if (sample.type == SampleType::Step) {
+    Append(buffer, size, &offset, "Step: %+.1fmA (%.1fmA to %.1fmA)\n",
+           sample.level_after_ma - sample.level_before_ma,
+           sample.level_before_ma, sample.level_after_ma);
+    return offset;
+  } else if (sample.type == SampleType::RegionBegin
+             || sample.type == SampleType::RegionEnd) {
+    Append(buffer, size, &offset, "Region %s: %s\n",
+           (sample.type == SampleType::RegionBegin) ? "begin" : "end",
+           sample.region);
+    return offset;
+  } else if (sample.type == SampleType::Region) {
+    double duration_s = sample.region_duration_us / 1e6;
+    Append(buffer, size, &offset, "Region %s: %fJ over %.3fs (average %fW, "
+           "peak %fW)\n", sample.region, sample.region_energy_j, duration_s,
+           (duration_s > 0.0) ? sample.region_energy_j / duration_s : 0.0,
+           sample.region_peak_w);
+    return offset;
+  }
+
+  if (sample.has_current) {
+    // Aggregated samples also show the range of their interval.
+    bool aggregated = (sample.sample_count > 1);
+    if (print_current_ && aggregated) {
+      Append(buffer, size, &offset, "Current: %" PRId32 "mA (min %" PRId32
+             "mA, max %" PRId32 "mA)\n", sample.current_ma,
+             sample.current_min_ma, sample.current_max_ma);
+    } else if (print_current_) {
+      Append(buffer, size, &offset, "Current: %" PRId32 "mA\n",
+             sample.current_ma);
+    }
+
+    if (print_power_ && aggregated) {
+      Append(buffer, size, &offset, "Power: %fW (min %fW, max %fW)\n",
+             sample.power_w, sample.power_min_w, sample.power_max_w);
+    } else if (print_power_) {
+      Append(buffer, size, &offset, "Power: %fW\n", sample.power_w);
+    }
+  }
+
+  if (sample.has_energy && print_energy_) {
+    Append(buffer, size, &offset, "Energy: %fkWh\n", sample.energy_kwh);
+  }
+
+  return offset;
+}
+
+size_t TextSink::FormatCsv(const Sample& sample, char *buffer,
+                           size_t size) {
+  size_t offset = 0;
+  if (!header_written_) {
+    Append(buffer, size, &offset,
+           "device,timestamp_us,lateness_us,sample_count%s%s%s"
+           ",type,level_before_ma,level_after_ma,region,region_duration_us"
+           ",region_energy_j,region_peak_w\n",
+           print_current_ ? ",current_ma,current_min_ma,current_max_ma" : "",
+           print_power_ ? ",power_w,power_min_w,power_max_w" : "",
+           print_energy_ ? ",energy_kwh" : "");
+    header_written_ = true;
+  }
+
+  Append(buffer, size, &offset, "%s,%" PRIu64 ",%" PRId64 ",%" PRIu32,
+         sample.device_id, sample.timestamp_us, sample.lateness_us,
+         sample.sample_count);
+  if (print_current_) {
+    if (sample.has_current) {
+      Append(buffer, size, &offset, ",%" PRId32 ",%" PRId32 ",%" PRId32,
+             sample.current_ma, sample.current_min_ma, sample.current_max_ma);
+    } else {
+      Append(buffer, size, &offset, ",,,");
+    }
+  }
+
+  if (print_power_) {
+    if (sample.has_current) {
+      Append(buffer, size, &offset, ",%f,%f,%f", sample.power_w,
+             sample.power_min_w, sample.power_max_w);
+    } else {
+      Append(buffer, size, &offset, ",,,");
+    }
+  }
+
+  if (print_energy_) {
+    if (sample.has_energy) {
+      Append(buffer, size, &offset, ",%f", sample.energy_kwh);
+    } else {
+      Append(buffer, size, &offset, ",");
+    }
+  }
+
+  switch (sample.type) {
+    case SampleType::Measurement:
+      Append(buffer, size, &offset, ",measurement,,,,,,\n");
+      break;
+    case SampleType::Step:
+      Append(buffer, size, &offset, ",step,%f,%f,,,,\n",
+             sample.level_before_ma, sample.level_after_ma);
+      break;
+    case SampleType::RegionBegin:
+      Append(buffer, size, &offset, ",begin,,,%s,,,\n", sample.region);
+      break;
+    case SampleType::RegionEnd:
+      Append(buffer, size, &offset, ",end,,,%s,,,\n", sample.region);
+      break;
+    case SampleType::Region:
+      Append(buffer, size, &offset, ",region,,,%s,%" PRIu64 ",%f,%f\n",
+             sample.region, sample.region_duration_us,
+             sample.region_energy_j, sample.region_peak_w);
+      break;
+  }
+
+  return offset;
+}
+
+}  // namespace pwrusbctl
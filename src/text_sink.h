@@ -0,0 +1,109 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_TEXT_SINK_H_
+#define PWRUSBCTL_TEXT_SINK_H_
+
+#include <memory>
+
+#include "output_stream.h"
+#include "sink.h"
+
+namespace pwrusbctl {
+
+/**
+ * The formats supported by TextSink.
+ */
+enum class TextFormat {
+  //! Human-readable lines of the form "Current: 100mA".
+  Text,
+
+  //! Comma-separated values with a header row.
+  Csv,
+};
+
+/**
+ * A sink that formats samples as text and writes them to an OutputStream.
+ */
+class TextSink : public Sink {
+ public:
+  /**
+   * Constructs a TextSink that prints the selected fields of each sample.
+   *
+   * @param output The stream to write to.
+   * @param format The format of each sample.
+   * @param print_current Whether or not to print current.
+   * @param print_power Whether or not to print power.
+   * @param print_energy Whether or not to print energy.
+   * @param print_device Whether or not to start each line of the
+   *        human-readable format with the device identifier, for output that
+   *        interleaves several devices. CSV rows always include it.
+   */
+  TextSink(std::unique_ptr<OutputStream> output, TextFormat format,
+           bool print_current, bool print_power, bool print_energy,
+           bool print_device = false);
+
+  bool Write(const Sample& sample) override;
+  bool Flush() override;
+  void PrintStats(FILE *file) const override;
+
+ private:
+  //! The stream that formatted samples are written to.
+  std::unique_ptr<OutputStream> output_;
+
+  //! The format of each sample.
+  const TextFormat format_;
+
+  //! Whether or not current is printed.
+  const bool print_current_;
+
+  //! Whether or not power is printed.
+  const bool print_power_;
+
+  //! Whether or not energy is printed.
+  const bool print_energy_;
+
+  //! Whether or not human-readable lines start with the device identifier.
+  const bool print_device_;
+
+  //! Whether or not the CSV header has been written.
+  bool header_written_;
+
+  /**
+   * Formats a sample in the human-readable format.
+   *
+   * @param sample The sample to format.
+   * @param buffer The buffer to format into.
+   * @param size The size of the buffer.
+   * @return The number of bytes formatted.
+   */
+  size_t FormatText(const Sample& sample, char *buffer, size_t size) const;
+
+  /**
+   * Formats a sample as a CSV row, preceded by the header row if it has not
+   * been written yet.
+   *
+   * @param sample The sample to format.
+   * @param buffer The buffer to format into.
+   * @param size The size of the buffer.
+   * @return The number of bytes formatted.
+   */
+  size_t FormatCsv(const Sample& sample, char *buffer, size_t size);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_TEXT_SINK_H_
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "top_index.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The duration of each bucket of the hourly average.
+constexpr uint64_t kBucketUs(60000000);
+
+//! The number of buckets in an hour.
+constexpr size_t kBucketCount(60);
+
+//! The longest gap between samples that is treated as covered by the later
+//! sample. Longer gaps are assumed to be outages.
+constexpr uint64_t kMaxGapUs(10000000);
+
+//! The maximum length of a line of the labels file.
+constexpr size_t kMaxLabelLineLength(1024);
+
+constexpr uint64_t TopIndex::kStaleUs;
+
+void TopIndex::SetLabels(const std::string& device_id,
+                         const std::vector<std::string>& labels) {
+  Device *device = GetDevice(device_id);
+  bool ranked = !device->rankings.empty();
+  if (ranked) {
+    Unrank(device);
+  }
+
+  device->labels = labels;
+  if (ranked) {
+    Rank(device);
+  }
+}
+
+bool TopIndex::LoadLabels(const std::string& path) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr) {
+    return false;
+  }
+
+  char line[kMaxLabelLineLength];
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    char *comment = strchr(line, '#');
+    if (comment != nullptr) {
+      *comment = '\0';
+    }
+
+    std::vector<std::string> fields;
+    char *save = nullptr;
+    for (char *field = strtok_r(line, " \t\r\n", &save); field != nullptr;
+         field = strtok_r(nullptr, " \t\r\n", &save)) {
+      fields.push_back(field);
+    }
+
+    if (!fields.empty()) {
+      SetLabels(fields[0], std::vector<std::string>(fields.begin() + 1,
+                                                    fields.end()));
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+void TopIndex::Update(const Sample& sample) {
+  if (sample.type != SampleType::Measurement || !sample.has_current) {
+    return;
+  }
+
+  Device *device = GetDevice(sample.device_id);
+  bool first = device->rankings.empty();
+  uint64_t minute = sample.timestamp_us / kBucketUs;
+  uint64_t duration_us = 0;
+  if (first) {
+    device->minute = minute;
+    device->last_us = sample.timestamp_us;
+  } else {
+    // Samples that arrive out of order are counted in the latest bucket but
+    // cover no time.
+    if (sample.timestamp_us > device->last_us) {
+      duration_us = std::min(sample.timestamp_us - device->last_us,
+                             kMaxGapUs);
+      device->last_us = sample.timestamp_us;
+    }
+
+    AdvanceBuckets(device, minute);
+  }
+
+  double energy_ws = static_cast<double>(sample.power_w) * duration_us
+      / 1000000.0;
+  Bucket& bucket = device->buckets[device->minute % kBucketCount];
+  bucket.energy_ws += energy_ws;
+  bucket.duration_us += duration_us;
+  device->hour_energy_ws += energy_ws;
+  device->hour_duration_us += duration_us;
+
+  float now_w = sample.power_w;
+  float hour_w = (device->hour_duration_us == 0) ? now_w
+      : static_cast<float>(device->hour_energy_ws * 1000000.0
+                           / device->hour_duration_us);
+  if (first) {
+    device->now_w = now_w;
+    device->hour_w = hour_w;
+    Rank(device);
+    return;
+  }
+
+  // Only the entries whose key changed are moved.
+  for (Rankings *rankings : device->rankings) {
+    if (now_w != device->now_w) {
+      rankings->now.erase(std::make_pair(device->now_w, device));
+      rankings->now.emplace(now_w, device);
+    }
+
+    if (hour_w != device->hour_w) {
+      rankings->hour.erase(std::make_pair(device->hour_w, device));
+      rankings->hour.emplace(hour_w, device);
+    }
+  }
+
+  device->now_w = now_w;
+  device->hour_w = hour_w;
+}
+
+void TopIndex::Query(TopWindow window, size_t count, const std::string& label,
+                     uint64_t now_us, std::vector<TopEntry> *entries) const {
+  entries->clear();
+  const Rankings *rankings = &all_;
+  if (!label.empty()) {
+    auto it = labeled_.find(label);
+    if (it == labeled_.end()) {
+      return;
+    }
+
+    rankings = &it->second;
+  }
+
+  // Devices that have stopped reporting sink out of view as their window
+  // passes, but keep their place until they report again.
+  const Ranking& ranking = (window == TopWindow::Now)
+      ? rankings->now : rankings->hour;
+  uint64_t stale_us = (window == TopWindow::Now)
+      ? kStaleUs : kBucketUs * kBucketCount;
+  for (auto it = ranking.rbegin();
+       it != ranking.rend() && entries->size() < count; ++it) {
+    const Device *device = it->second;
+    if (now_us <= device->last_us + stale_us) {
+      entries->push_back({ device->id, it->first });
+    }
+  }
+}
+
+size_t TopIndex::GetDeviceCount() const {
+  return devices_.size();
+}
+
+TopIndex::Device *TopIndex::GetDevice(const std::string& device_id) {
+  std::unique_ptr<Device>& device = devices_[device_id];
+  if (device == nullptr) {
+    device.reset(new Device());
+    device->id = device_id;
+    device->last_us = 0;
+    device->now_w = 0.0f;
+    device->hour_w = 0.0f;
+    device->minute = 0;
+    device->buckets.resize(kBucketCount, Bucket());
+    device->hour_energy_ws = 0.0;
+    device->hour_duration_us = 0;
+  }
+
+  return device.get();
+}
+
+void TopIndex::Unrank(const Device *device) {
+  for (Rankings *rankings : device->rankings) {
+    rankings->now.erase(std::make_pair(device->now_w, device));
+    rankings->hour.erase(std::make_pair(device->hour_w, device));
+  }
+}
+
+void TopIndex::Rank(Device *device) {
+  device->rankings.clear();
+  device->rankings.push_back(&all_);
+  for (const auto& label : device->labels) {
+    Rankings *rankings = &labeled_[label];
+    if (std::find(device->rankings.begin(), device->rankings.end(), rankings)
+        == device->rankings.end()) {
+      device->rankings.push_back(rankings);
+    }
+  }
+
+  for (Rankings *rankings : device->rankings) {
+    rankings->now.emplace(device->now_w, device);
+    rankings->hour.emplace(device->hour_w, device);
+  }
+}
+
+void TopIndex::AdvanceBuckets(Device *device, uint64_t minute) {
+  if (minute <= device->minute) {
+    return;
+  }
+
+  // Every bucket between the previous minute and this one has aged out of
+  // the hour. Skipping more than an hour retires every bucket once.
+  uint64_t first = device->minute + 1;
+  if (minute >= kBucketCount) {
+    first = std::max(first, minute - kBucketCount + 1);
+  }
+
+  for (uint64_t m = first; m <= minute; m++) {
+    Bucket& bucket = device->buckets[m % kBucketCount];
+    device->hour_energy_ws -= bucket.energy_ws;
+    device->hour_duration_us -= bucket.duration_us;
+    bucket.energy_ws = 0.0;
+    bucket.duration_us = 0;
+  }
+
+  // Subtraction leaves rounding error behind once everything has retired.
+  if (device->hour_duration_us == 0) {
+    device->hour_energy_ws = 0.0;
+  }
+
+  device->minute = minute;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_TOP_INDEX_H_
+#define PWRUSBCTL_TOP_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "sample.h"
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * The windows over which devices may be ranked.
+ */
+enum class TopWindow : uint8_t {
+  //! The power of the latest sample.
+  Now = 0,
+
+  //! The average power over the last hour.
+  Hour = 1,
+};
+
+/**
+ * A device and its power in a ranking.
+ */
+struct TopEntry {
+  //! The identifier of the device.
+  std::string device_id;
+
+  //! The power of the device over the window in watts.
+  float power_w;
+};
+
+/**
+ * Ranks devices by the power they draw, maintained incrementally as samples
+ * arrive so that the largest consumers are found without scanning every
+ * device.
+ *
+ * Every device is held in an ordered ranking for each window, and in a
+ * further ranking per label that it carries. Each sample moves its device
+ * within its rankings in logarithmic time, and a query walks a single
+ * ranking from the top, so finding the top N of D devices costs
+ * O(N log D) however many devices there are. The hourly average is kept in
+ * per-minute buckets that are retired as they age out of the hour. This class
+ * is not thread-safe.
+ */
+class TopIndex : public NonCopyable {
+ public:
+  //! The age of the latest sample beyond which a device is left out of the
+  //! Now ranking. Devices are left out of the Hour ranking after an hour.
+  static constexpr uint64_t kStaleUs = 60000000;
+
+  /**
+   * Assigns labels to a device, replacing any it had. Labels may be assigned
+   * before or after samples arrive from the device.
+   *
+   * @param device_id The identifier of the device.
+   * @param labels The labels of the device, conventionally "key=value".
+   */
+  void SetLabels(const std::string& device_id,
+                 const std::vector<std::string>& labels);
+
+  /**
+   * Reads labels from a file of lines holding a device identifier followed
+   * by its labels, separated by whitespace. Text after a '#' is ignored.
+   *
+   * @param path The path of the file.
+   * @return Returns false if the file could not be read.
+   */
+  bool LoadLabels(const std::string& path);
+
+  /**
+   * Updates the rankings with a sample. Only measurements are used.
+   *
+   * @param sample The sample to add.
+   */
+  void Update(const Sample& sample);
+
+  /**
+   * Finds the devices that draw the most power.
+   *
+   * @param window The window to rank by.
+   * @param count The maximum number of devices to return.
+   * @param label Only devices carrying this label are ranked, or every device
+   *        if empty.
+   * @param now_us The current time, used to leave out devices that have
+   *        not reported within the window.
+   * @param entries The vector to populate in descending order of power.
+   */
+  void Query(TopWindow window, size_t count, const std::string& label,
+             uint64_t now_us, std::vector<TopEntry> *entries) const;
+
+  /**
+   * @return Returns the number of devices indexed.
+   */
+  size_t GetDeviceCount() const;
+
+ private:
+  struct Device;
+
+  //! Devices ordered by ascending power, with ties broken by device.
+  typedef std::set<std::pair<float, const Device *>> Ranking;
+
+  /**
+   * The rankings of a set of devices.
+   */
+  struct Rankings {
+    Ranking now;
+    Ranking hour;
+  };
+
+  /**
+   * The energy drawn within one minute.
+   */
+  struct Bucket {
+    //! The energy drawn and the time covered by samples.
+    double energy_ws;
+    uint64_t duration_us;
+  };
+
+  /**
+   * The state of a device.
+   */
+  struct Device {
+    //! The identifier of the device.
+    std::string id;
+
+    //! The labels of the device.
+    std::vector<std::string> labels;
+
+    //! The rankings that the device is held in, the first ranking every
+    //! device. Empty until the first sample arrives.
+    std::vector<Rankings *> rankings;
+
+    //! The time of the latest sample.
+    uint64_t last_us;
+
+    //! The keys of the device in the Now and Hour rankings.
+    float now_w;
+    float hour_w;
+
+    //! The minute since the start of the clock of the latest bucket.
+    uint64_t minute;
+
+    //! The buckets of the last hour, indexed by minute modulo their number,
+    //! and their running totals.
+    std::vector<Bucket> buckets;
+    double hour_energy_ws;
+    uint64_t hour_duration_us;
+  };
+
+  //! The devices keyed by identifier.
+  std::unordered_map<std::string, std::unique_ptr<Device>> devices_;
+
+  //! The rankings of every device.
+  Rankings all_;
+
+  //! The rankings of the devices carrying each label.
+  std::map<std::string, Rankings> labeled_;
+
+  /**
+   * Finds or creates a device.
+   *
+   * @param device_id The identifier of the device.
+   * @return The device.
+   */
+  Device *GetDevice(const std::string& device_id);
+
+  /**
+   * Removes a device from its rankings.
+   *
+   * @param device The device to remove.
+   */
+  void Unrank(const Device *device);
+
+  /**
+   * Adds a device to the rankings for its labels.
+   *
+   * @param device The device to add.
+   */
+  void Rank(Device *device);
+
+  /**
+   * Advances the hourly buckets of a device to a minute, retiring buckets
+   * that have aged out of the hour.
+   *
+   * @param device The device to advance.
+   * @param minute The minute of the latest sample.
+   */
+  static void AdvanceBuckets(Device *device, uint64_t minute);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_TOP_INDEX_H_
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "topology_transform.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The longest gap between measurements of a strip that is treated as
+//! covered by the later measurement. Longer gaps are assumed to be outages.
+constexpr uint64_t kMaxGapUs(10000000);
+
+//! The maximum length of a line of the topology file.
+constexpr size_t kMaxTopologyLineLength(1024);
+
+constexpr uint64_t TopologyTransform::kDefaultIntervalUs;
+constexpr uint64_t TopologyTransform::kStaleUs;
+
+TopologyTransform::TopologyTransform(const std::string& path,
+                                     uint64_t interval_us)
+    : interval_us_(std::max<uint64_t>(interval_us, 1)),
+      initialized_(false),
+      interval_end_us_(0),
+      unplaced_count_(0),
+      emitted_count_(0) {
+  initialized_ = Load(path);
+}
+
+bool TopologyTransform::IsInitialized() const {
+  return initialized_;
+}
+
+void TopologyTransform::Process(const Sample& sample,
+                                SampleConsumer *output) {
+  output->Consume(sample);
+  if (sample.type != SampleType::Measurement || !sample.has_current) {
+    return;
+  }
+
+  // Totals are emitted for every interval that ends before this measurement.
+  // After a pause, only the latest of the missed intervals is emitted.
+  if (interval_end_us_ == 0) {
+    interval_end_us_ = (sample.timestamp_us / interval_us_ + 1) * interval_us_;
+  } else if (sample.timestamp_us >= interval_end_us_) {
+    Emit((sample.timestamp_us / interval_us_) * interval_us_, output);
+    interval_end_us_ = (sample.timestamp_us / interval_us_ + 1) * interval_us_;
+  }
+
+  auto it = strips_.find(sample.device_id);
+  if (it == strips_.end()) {
+    unplaced_count_++;
+    return;
+  }
+
+  Strip& strip = it->second;
+  if (!strip.reporting) {
+    strip.reporting = true;
+    strip.last_us = sample.timestamp_us;
+    strip.power_w = sample.power_w;
+    strip.current_ma = sample.current_ma;
+    Propagate(strip.node, sample.power_w, sample.current_ma, 0.0, 1);
+    return;
+  }
+
+  // Measurements that arrive out of order update the totals but cover no
+  // time.
+  uint64_t duration_us = 0;
+  if (sample.timestamp_us > strip.last_us) {
+    duration_us = std::min(sample.timestamp_us - strip.last_us, kMaxGapUs);
+    strip.last_us = sample.timestamp_us;
+  }
+
+  double energy_ws = static_cast<double>(sample.power_w) * duration_us
+      / 1000000.0;
+  Propagate(strip.node, sample.power_w - strip.power_w,
+            static_cast<double>(sample.current_ma) - strip.current_ma,
+            energy_ws, 0);
+  strip.power_w = sample.power_w;
+  strip.current_ma = sample.current_ma;
+}
+
+void TopologyTransform::PrintStats(FILE *file) const {
+  size_t reporting_count = 0;
+  for (const auto& strip : strips_) {
+    if (strip.second.reporting) {
+      reporting_count++;
+    }
+  }
+
+  fprintf(file, "Topology: %zu nodes, %zu strips (%zu reporting), %" PRIu64
+          " samples from unplaced devices, %" PRIu64 " totals emitted\n",
+          nodes_.size(), strips_.size(), reporting_count, unplaced_count_,
+          emitted_count_);
+}
+
+bool TopologyTransform::Load(const std::string& path) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == nullptr) {
+    fprintf(stderr, "Error opening topology %s\n", path.c_str());
+    return false;
+  }
+
+  bool success = true;
+  char line[kMaxTopologyLineLength];
+  size_t line_number = 0;
+  while (success && fgets(line, sizeof(line), file) != nullptr) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != nullptr) {
+      *comment = '\0';
+    }
+
+    char *save = nullptr;
+    const char *device_id = strtok_r(line, " \t\r\n", &save);
+    if (device_id == nullptr) {
+      continue;
+    }
+
+    const char *node_path = strtok_r(nullptr, " \t\r\n", &save);
+    if (node_path == nullptr || strtok_r(nullptr, " \t\r\n", &save) != nullptr
+        || node_path[0] == '/' || strstr(node_path, "//") != nullptr
+        || node_path[strlen(node_path) - 1] == '/') {
+      fprintf(stderr, "%s:%zu: expected a device and a path\n",
+              path.c_str(), line_number);
+      success = false;
+    } else if (strlen(node_path) >= kMaxDeviceIdLength) {
+      // The path is carried in the device identifier of emitted totals.
+      fprintf(stderr, "%s:%zu: path '%s' is longer than %zu characters\n",
+              path.c_str(), line_number, node_path, kMaxDeviceIdLength - 1);
+      success = false;
+    } else if (strips_.count(device_id) != 0) {
+      fprintf(stderr, "%s:%zu: device '%s' is placed twice\n",
+              path.c_str(), line_number, device_id);
+      success = false;
+    } else {
+      Strip& strip = strips_[device_id];
+      strip.node = GetNode(node_path);
+      strip.reporting = false;
+      strip.last_us = 0;
+      strip.power_w = 0.0f;
+      strip.current_ma = 0.0f;
+    }
+  }
+
+  fclose(file);
+  return success;
+}
+
+TopologyTransform::Node *TopologyTransform::GetNode(const std::string& path) {
+  for (const auto& node : nodes_) {
+    if (node->path == path) {
+      return node.get();
+    }
+  }
+
+  // The parent is created first so that it precedes this node.
+  Node *parent = nullptr;
+  size_t separator = path.rfind('/');
+  if (separator != std::string::npos) {
+    parent = GetNode(path.substr(0, separator));
+  }
+
+  std::unique_ptr<Node> node(new Node());
+  node->path = path;
+  node->parent = parent;
+  node->power_w = 0.0;
+  node->current_ma = 0.0;
+  node->energy_ws = 0.0;
+  node->power_min_w = 0.0;
+  node->power_max_w = 0.0;
+  node->strip_count = 0;
+  nodes_.push_back(std::move(node));
+  return nodes_.back().get();
+}
+
+void TopologyTransform::Propagate(Node *node, double power_w,
+                                  double current_ma, double energy_ws,
+                                  int strip_count) {
+  for (; node != nullptr; node = node->parent) {
+    node->power_w += power_w;
+    node->current_ma += current_ma;
+    node->energy_ws += energy_ws;
+    node->strip_count += strip_count;
+    node->power_min_w = std::min(node->power_min_w, node->power_w);
+    node->power_max_w = std::max(node->power_max_w, node->power_w);
+  }
+}
+
+void TopologyTransform::Emit(uint64_t timestamp_us, SampleConsumer *output) {
+  for (auto& entry : strips_) {
+    Strip& strip = entry.second;
+    if (strip.reporting && timestamp_us > strip.last_us + kStaleUs) {
+      strip.reporting = false;
+      Propagate(strip.node, -strip.power_w, -strip.current_ma, 0.0, -1);
+    }
+  }
+
+  for (const auto& node : nodes_) {
+    // Subtraction leaves rounding error behind once every strip has left.
+    if (node->strip_count == 0) {
+      node->power_w = 0.0;
+      node->current_ma = 0.0;
+    }
+
+    Sample sample = {};
+    strncpy(sample.device_id, node->path.c_str(),
+            sizeof(sample.device_id) - 1);
+    sample.timestamp_us = timestamp_us;
+    sample.sample_count = node->strip_count;
+    sample.has_current = true;
+    sample.current_ma = static_cast<int32_t>(std::max(node->current_ma, 0.0));
+    sample.current_min_ma = sample.current_ma;
+    sample.current_max_ma = sample.current_ma;
+    sample.power_w = static_cast<float>(node->power_w);
+    sample.power_min_w = static_cast<float>(
+        std::min(node->power_min_w, node->power_w));
+    sample.power_max_w = static_cast<float>(
+        std::max(node->power_max_w, node->power_w));
+    sample.has_energy = true;
+    sample.energy_kwh = static_cast<float>(node->energy_ws / 3600000.0);
+    output->Consume(sample);
+    emitted_count_++;
+
+    node->power_min_w = node->power_w;
+    node->power_max_w = node->power_w;
+  }
+}
+
+}  // namespace pwrusbctl
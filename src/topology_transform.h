@@ -0,0 +1,189 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_TOPOLOGY_TRANSFORM_H_
+#define PWRUSBCTL_TOPOLOGY_TRANSFORM_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pipeline.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that totals power and energy over a physical hierarchy of
+ * strips, such as room, row and rack.
+ *
+ * The hierarchy is read from a file of lines holding a device identifier and
+ * the slash-separated path of the node that the strip belongs to:
+ *
+ *   ABC123 room1/row2/rack3
+ *
+ * Every node keeps the sum of the latest power and current of the strips
+ * beneath it, the energy they have drawn and the range of its total since it
+ * was last emitted. A measurement from a strip applies the change in its
+ * power to its ancestors only, so the totals stay current at the full
+ * sampling rate however large the tree. The totals are time-aligned by
+ * holding each strip at its latest measurement, and a strip that stops
+ * reporting is removed from the totals.
+ *
+ * At the end of each interval, aligned to multiples of the interval, a
+ * measurement is emitted for every node with the node path as its device
+ * identifier. Its power range covers the interval, its energy is cumulative
+ * and its sample count is the number of strips reporting. Samples pass
+ * through unchanged.
+ */
+class TopologyTransform : public Transform {
+ public:
+  //! The default interval between emitted totals.
+  static constexpr uint64_t kDefaultIntervalUs = 1000000;
+
+  //! The time without a measurement after which a strip is removed from the
+  //! totals.
+  static constexpr uint64_t kStaleUs = 10000000;
+
+  /**
+   * Constructs a TopologyTransform. The return value of IsInitialized() must
+   * be checked before use.
+   *
+   * @param path The path of the file describing the hierarchy.
+   * @param interval_us The interval between emitted totals.
+   */
+  TopologyTransform(const std::string& path,
+                    uint64_t interval_us = kDefaultIntervalUs);
+
+  /**
+   * @return Returns true if the hierarchy was read and is valid.
+   */
+  bool IsInitialized() const;
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+
+  /**
+   * Prints the size of the hierarchy and the number of totals emitted.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  /**
+   * A node of the hierarchy.
+   */
+  struct Node {
+    //! The path of the node, used as the device identifier of its totals.
+    std::string path;
+
+    //! The parent of the node, nullptr for a top-level node.
+    Node *parent;
+
+    //! The total power and current of the strips reporting beneath the node.
+    double power_w;
+    double current_ma;
+
+    //! The energy drawn beneath the node in watt-seconds.
+    double energy_ws;
+
+    //! The range of the total power since it was last emitted.
+    double power_min_w;
+    double power_max_w;
+
+    //! The number of strips reporting beneath the node.
+    uint32_t strip_count;
+  };
+
+  /**
+   * A strip placed in the hierarchy.
+   */
+  struct Strip {
+    //! The node that the strip belongs to.
+    Node *node;
+
+    //! Whether or not the strip is counted in the totals.
+    bool reporting;
+
+    //! The latest measurement of the strip.
+    uint64_t last_us;
+    float power_w;
+    float current_ma;
+  };
+
+  //! The interval between emitted totals.
+  const uint64_t interval_us_;
+
+  //! Whether or not the hierarchy was read and is valid.
+  bool initialized_;
+
+  //! The nodes, each after its parent.
+  std::vector<std::unique_ptr<Node>> nodes_;
+
+  //! The strips keyed by device identifier.
+  std::unordered_map<std::string, Strip> strips_;
+
+  //! The end of the current interval, zero before the first measurement.
+  uint64_t interval_end_us_;
+
+  //! The number of measurements from strips not in the hierarchy and the
+  //! number of totals emitted.
+  uint64_t unplaced_count_;
+  uint64_t emitted_count_;
+
+  /**
+   * Reads the hierarchy from a file.
+   *
+   * @param path The path of the file.
+   * @return Returns false if the file could not be read or is invalid.
+   */
+  bool Load(const std::string& path);
+
+  /**
+   * Finds or creates a node and its ancestors.
+   *
+   * @param path The path of the node.
+   * @return The node.
+   */
+  Node *GetNode(const std::string& path);
+
+  /**
+   * Applies a change to the totals of a node and its ancestors.
+   *
+   * @param node The node that the change applies to.
+   * @param power_w The change in power.
+   * @param current_ma The change in current.
+   * @param energy_ws The energy drawn.
+   * @param strip_count The change in the number of strips reporting.
+   */
+  static void Propagate(Node *node, double power_w, double current_ma,
+                        double energy_ws, int strip_count);
+
+  /**
+   * Removes strips that have stopped reporting and emits the totals of
+   * every node.
+   *
+   * @param timestamp_us The end of the interval being emitted.
+   * @param output The next stage of the pipeline.
+   */
+  void Emit(uint64_t timestamp_us, SampleConsumer *output);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_TOPOLOGY_TRANSFORM_H_
@@ -0,0 +1,149 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_UTIL_BOUNDED_QUEUE_H_
+#define PWRUSBCTL_UTIL_BOUNDED_QUEUE_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "util/noncopyable.h"
+
+namespace pwrusbctl {
+
+/**
+ * A fixed-capacity multi-producer, multi-consumer queue. Storage is allocated
+ * once at construction. Producers never block: pushing to a full queue fails
+ * so that a slow consumer cannot stall a producer.
+ */
+template<typename T>
+class BoundedQueue : public NonCopyable {
+ public:
+  /**
+   * Constructs a queue that holds at most capacity elements.
+   *
+   * @param capacity The maximum number of elements held by the queue.
+   */
+  explicit BoundedQueue(size_t capacity)
+      : elements_(capacity), head_(0), size_(0), closed_(false) {}
+
+  /**
+   * Pushes an element onto the back of the queue if there is space.
+   *
+   * @param element The element to push.
+   * @return Returns false if the queue is full or closed.
+   */
+  bool TryPush(const T& element) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_ || size_ == elements_.size()) {
+        return false;
+      }
+
+      elements_[(head_ + size_) % elements_.size()] = element;
+      size_++;
+    }
+
+    condition_.notify_one();
+    return true;
+  }
+
+  /**
+   * Pops an element from the front of the queue, waiting up to timeout for one
+   * to become available.
+   *
+   * @param element The element to populate.
+   * @param timeout The maximum time to wait.
+   * @return Returns false if no element was available before the timeout or
+   *         the queue is closed and empty.
+   */
+  template<typename Rep, typename Period>
+  bool Pop(T *element, const std::chrono::duration<Rep, Period>& timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!condition_.wait_for(lock, timeout,
+                             [this]() { return closed_ || size_ > 0; })
+        || size_ == 0) {
+      return false;
+    }
+
+    *element = elements_[head_];
+    head_ = (head_ + 1) % elements_.size();
+    size_--;
+    return true;
+  }
+
+  /**
+   * Closes the queue. Subsequent pushes fail and consumers are woken once the
+   * remaining elements have been drained.
+   */
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+
+    condition_.notify_all();
+  }
+
+  /**
+   * @return Returns true if the queue has been closed and is empty.
+   */
+  bool IsClosedAndEmpty() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ && size_ == 0;
+  }
+
+  /**
+   * @return Returns the number of elements currently in the queue.
+   */
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+  }
+
+  /**
+   * @return Returns the maximum number of elements held by the queue.
+   */
+  size_t Capacity() const {
+    return elements_.size();
+  }
+
+ private:
+  //! Guards all members below.
+  mutable std::mutex mutex_;
+
+  //! Signalled when an element is pushed or the queue is closed.
+  std::condition_variable condition_;
+
+  //! The storage for queued elements.
+  std::vector<T> elements_;
+
+  //! The index of the element at the front of the queue.
+  size_t head_;
+
+  //! The number of elements in the queue.
+  size_t size_;
+
+  //! Whether or not the queue has been closed.
+  bool closed_;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_BOUNDED_QUEUE_H_
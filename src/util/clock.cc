@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/clock.h"
+
+#include <unistd.h>
+
+#include "util/time.h"
+
+namespace pwrusbctl {
+
+SystemClock *SystemClock::GetInstance() {
+  static SystemClock instance;
+  return &instance;
+}
+
+uint64_t SystemClock::GetMonotonicTimeUs() const {
+  return pwrusbctl::GetMonotonicTimeUs();
+}
+
+int64_t SystemClock::GetWallClockOffsetUs() const {
+  return pwrusbctl::GetWallClockOffsetUs();
+}
+
+void SystemClock::SleepUntilUs(uint64_t deadline_us) {
+  uint64_t now_us = GetMonotonicTimeUs();
+  if (now_us < deadline_us) {
+    usleep(deadline_us - now_us);
+  }
+}
+
+VirtualClock::VirtualClock(uint64_t start_us, int64_t wall_clock_offset_us)
+    : time_us_(start_us), wall_clock_offset_us_(wall_clock_offset_us) {}
+
+uint64_t VirtualClock::GetMonotonicTimeUs() const {
+  return time_us_;
+}
+
+int64_t VirtualClock::GetWallClockOffsetUs() const {
+  return wall_clock_offset_us_;
+}
+
+void VirtualClock::SleepUntilUs(uint64_t deadline_us) {
+  // Another thread may already have moved the clock past the deadline.
+  uint64_t time_us = time_us_;
+  while (time_us < deadline_us
+         && !time_us_.compare_exchange_weak(time_us, deadline_us)) {}
+}
+
+void VirtualClock::Advance(uint64_t duration_us) {
+  time_us_ += duration_us;
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_UTIL_CLOCK_H_
+#define PWRUSBCTL_UTIL_CLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace pwrusbctl {
+
+/**
+ * A source of time. Code that takes timestamps, sleeps or runs timers does so
+ * through a Clock so that a VirtualClock can be substituted to run long
+ * schedules without waiting for them.
+ */
+class Clock {
+ public:
+  virtual ~Clock() {}
+
+  /**
+   * @return Returns the current time in microseconds on a monotonic clock.
+   */
+  virtual uint64_t GetMonotonicTimeUs() const = 0;
+
+  /**
+   * @return Returns the offset that converts a monotonic timestamp from this
+   *         clock into wall-clock time in microseconds since the Unix epoch.
+   */
+  virtual int64_t GetWallClockOffsetUs() const = 0;
+
+  /**
+   * Blocks until the monotonic time reaches a deadline. Returns immediately
+   * if the deadline has passed.
+   *
+   * @param deadline_us The monotonic time to sleep until in microseconds.
+   */
+  virtual void SleepUntilUs(uint64_t deadline_us) = 0;
+};
+
+/**
+ * A clock backed by the system steady and wall clocks.
+ */
+class SystemClock : public Clock {
+ public:
+  /**
+   * @return Returns the shared instance of the system clock.
+   */
+  static SystemClock *GetInstance();
+
+  uint64_t GetMonotonicTimeUs() const override;
+  int64_t GetWallClockOffsetUs() const override;
+  void SleepUntilUs(uint64_t deadline_us) override;
+};
+
+/**
+ * A clock that only advances when it is slept on or advanced explicitly.
+ * Sleeping jumps the clock straight to the deadline, so a schedule of any
+ * length runs as fast as the work between sleeps allows. This class is
+ * thread-safe and time never moves backwards.
+ */
+class VirtualClock : public Clock {
+ public:
+  /**
+   * Constructs a virtual clock.
+   *
+   * @param start_us The initial monotonic time in microseconds.
+   * @param wall_clock_offset_us The offset reported as the wall-clock offset.
+   */
+  explicit VirtualClock(uint64_t start_us = 0,
+                        int64_t wall_clock_offset_us = 0);
+
+  uint64_t GetMonotonicTimeUs() const override;
+  int64_t GetWallClockOffsetUs() const override;
+  void SleepUntilUs(uint64_t deadline_us) override;
+
+  /**
+   * Advances the clock.
+   *
+   * @param duration_us The number of microseconds to advance by.
+   */
+  void Advance(uint64_t duration_us);
+
+ private:
+  //! The current monotonic time in microseconds.
+  std::atomic<uint64_t> time_us_;
+
+  //! The offset reported as the wall-clock offset.
+  const int64_t wall_clock_offset_us_;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_CLOCK_H_
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/hash_ring.h"
+
+namespace pwrusbctl {
+
+constexpr size_t HashRing::kDefaultVirtualNodeCount;
+
+HashRing::HashRing(size_t virtual_node_count)
+    : virtual_node_count_(virtual_node_count == 0 ? 1 : virtual_node_count),
+      ring_(),
+      nodes_() {}
+
+void HashRing::AddNode(const std::string& node) {
+  if (!nodes_.insert(node).second) {
+    return;
+  }
+
+  // Colliding points keep their first owner, which every host agrees on as
+  // long as nodes are added in the same order.
+  for (size_t i = 0; i < virtual_node_count_; i++) {
+    ring_.emplace(GetPointHash(node, i), node);
+  }
+}
+
+void HashRing::RemoveNode(const std::string& node) {
+  if (nodes_.erase(node) == 0) {
+    return;
+  }
+
+  for (size_t i = 0; i < virtual_node_count_; i++) {
+    auto it = ring_.find(GetPointHash(node, i));
+    if (it != ring_.end() && it->second == node) {
+      ring_.erase(it);
+    }
+  }
+}
+
+std::string HashRing::GetNode(const std::string& key) const {
+  if (ring_.empty()) {
+    return std::string();
+  }
+
+  auto it = ring_.lower_bound(Hash(key));
+  return (it == ring_.end()) ? ring_.begin()->second : it->second;
+}
+
+std::vector<std::string> HashRing::GetPreferenceList(
+    const std::string& key) const {
+  std::vector<std::string> nodes;
+  if (ring_.empty()) {
+    return nodes;
+  }
+
+  // Walk clockwise from the key, wrapping once, until every node is found.
+  std::set<std::string> seen;
+  auto start = ring_.lower_bound(Hash(key));
+  auto it = start;
+  do {
+    if (it == ring_.end()) {
+      it = ring_.begin();
+    }
+
+    if (seen.insert(it->second).second) {
+      nodes.push_back(it->second);
+    }
+
+    ++it;
+  } while (nodes.size() < nodes_.size() && it != start);
+
+  return nodes;
+}
+
+uint64_t HashRing::Hash(const std::string& value) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (unsigned char c : value) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+uint64_t HashRing::GetPointHash(const std::string& node, size_t index) {
+  return Hash(node + "#" + std::to_string(index));
+}
+
+}  // namespace pwrusbctl
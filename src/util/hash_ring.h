@@ -0,0 +1,110 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_UTIL_HASH_RING_H_
+#define PWRUSBCTL_UTIL_HASH_RING_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace pwrusbctl {
+
+/**
+ * A consistent hash ring that assigns keys to nodes. Each node is placed on
+ * the ring at many points so that keys are spread evenly, and a key belongs to
+ * the node at the first point after its hash. Adding or removing a node only
+ * moves the keys that it gains or loses.
+ *
+ * The hash is fixed rather than std::hash so that every host assigns a key to
+ * the same node. This class is not thread-safe.
+ */
+class HashRing {
+ public:
+  //! The default number of points per node.
+  static constexpr size_t kDefaultVirtualNodeCount = 128;
+
+  /**
+   * Constructs an empty ring.
+   *
+   * @param virtual_node_count The number of points per node.
+   */
+  explicit HashRing(size_t virtual_node_count = kDefaultVirtualNodeCount);
+
+  /**
+   * Adds a node to the ring. Adding a node that is present has no effect.
+   *
+   * @param node The name of the node.
+   */
+  void AddNode(const std::string& node);
+
+  /**
+   * Removes a node from the ring.
+   *
+   * @param node The name of the node.
+   */
+  void RemoveNode(const std::string& node);
+
+  /**
+   * @param key The key to assign.
+   * @return Returns the node that owns a key, or an empty string if the ring
+   *         is empty.
+   */
+  std::string GetNode(const std::string& key) const;
+
+  /**
+   * Lists every node in the order that a key falls back to them, starting
+   * with its owner. Removing the owner makes the next node the owner, so this
+   * is the order in which to try nodes when some are unavailable.
+   *
+   * @param key The key to assign.
+   * @return Returns the distinct nodes in order of preference.
+   */
+  std::vector<std::string> GetPreferenceList(const std::string& key) const;
+
+  /**
+   * Hashes a string with 64-bit FNV-1a followed by a finalizer that spreads
+   * similar strings across the ring.
+   *
+   * @param value The string to hash.
+   * @return The hash of the string.
+   */
+  static uint64_t Hash(const std::string& value);
+
+ private:
+  //! The number of points per node.
+  const size_t virtual_node_count_;
+
+  //! The nodes keyed by the position of each of their points.
+  std::map<uint64_t, std::string> ring_;
+
+  //! The nodes on the ring.
+  std::set<std::string> nodes_;
+
+  /**
+   * @param node The name of the node.
+   * @param index The index of the point.
+   * @return Returns the position of a point of a node.
+   */
+  static uint64_t GetPointHash(const std::string& node, size_t index);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_HASH_RING_H_
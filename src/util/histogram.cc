@@ -0,0 +1,91 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/histogram.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace pwrusbctl {
+
+Histogram::Histogram(const std::vector<int64_t>& upper_bounds)
+    : upper_bounds_(upper_bounds),
+      counts_(upper_bounds.size() + 1),
+      count_(0),
+      sum_(0),
+      max_(0) {}
+
+void Histogram::Record(int64_t value) {
+  size_t bucket = std::lower_bound(upper_bounds_.begin(), upper_bounds_.end(),
+                                   value) - upper_bounds_.begin();
+  counts_[bucket]++;
+  max_ = (count_ == 0) ? value : std::max(max_, value);
+  sum_ += value;
+  count_++;
+}
+
+uint64_t Histogram::GetCount() const {
+  return count_;
+}
+
+int64_t Histogram::GetMax() const {
+  return max_;
+}
+
+double Histogram::GetMean() const {
+  return (count_ == 0) ? 0.0 : static_cast<double>(sum_) / count_;
+}
+
+int64_t Histogram::GetPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+
+  // The rank of the value at the percentile, counting from one.
+  uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(
+      percentile / 100.0 * count_ + 0.5));
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < upper_bounds_.size(); i++) {
+    cumulative += counts_[i];
+    if (cumulative >= rank) {
+      return std::min(upper_bounds_[i], max_);
+    }
+  }
+
+  return max_;
+}
+
+void Histogram::Print(FILE *file, const char *name, const char *unit) const {
+  fprintf(file, "%s: count %" PRIu64 ", mean %.1f%s, p50 %" PRId64 "%s"
+          ", p99 %" PRId64 "%s, max %" PRId64 "%s\n", name, count_,
+          GetMean(), unit, GetPercentile(50.0), unit, GetPercentile(99.0),
+          unit, max_, unit);
+  for (size_t i = 0; i < counts_.size(); i++) {
+    if (counts_[i] == 0) {
+      continue;
+    }
+
+    if (i < upper_bounds_.size()) {
+      fprintf(file, "  <= %8" PRId64 "%s: %" PRIu64 "\n", upper_bounds_[i],
+              unit, counts_[i]);
+    } else {
+      fprintf(file, "   > %8" PRId64 "%s: %" PRIu64 "\n",
+              upper_bounds_.back(), unit, counts_[i]);
+    }
+  }
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_UTIL_HISTOGRAM_H_
+#define PWRUSBCTL_UTIL_HISTOGRAM_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace pwrusbctl {
+
+/**
+ * A histogram with fixed bucket boundaries. Recording a value is constant time
+ * in the number of buckets and never allocates. This class is not thread-safe.
+ */
+class Histogram {
+ public:
+  /**
+   * Constructs a histogram. Each bucket counts the values no greater than its
+   * upper bound and greater than the bound of the previous bucket. A final
+   * bucket counts the values greater than the last bound.
+   *
+   * @param upper_bounds The inclusive upper bound of each bucket in
+   *        ascending order. Must not be empty.
+   */
+  explicit Histogram(const std::vector<int64_t>& upper_bounds);
+
+  /**
+   * Records a value.
+   *
+   * @param value The value to record.
+   */
+  void Record(int64_t value);
+
+  /**
+   * @return Returns the number of values recorded.
+   */
+  uint64_t GetCount() const;
+
+  /**
+   * @return Returns the largest value recorded, or zero if none.
+   */
+  int64_t GetMax() const;
+
+  /**
+   * @return Returns the mean of the values recorded, or zero if none.
+   */
+  double GetMean() const;
+
+  /**
+   * Estimates a percentile as the upper bound of the bucket that contains it.
+   * Values in the overflow bucket are reported as the maximum recorded value.
+   *
+   * @param percentile The percentile to estimate, between 0 and 100.
+   * @return Returns the estimated percentile, or zero if no values have been
+   *         recorded.
+   */
+  int64_t GetPercentile(double percentile) const;
+
+  /**
+   * Prints a summary and the non-empty buckets of the histogram.
+   *
+   * @param file The file to print to.
+   * @param name The name of the histogram.
+   * @param unit The unit of recorded values, appended to each value printed.
+   */
+  void Print(FILE *file, const char *name, const char *unit) const;
+
+ private:
+  //! The inclusive upper bound of each bucket except the overflow bucket.
+  const std::vector<int64_t> upper_bounds_;
+
+  //! The number of values in each bucket, including the overflow bucket.
+  std::vector<uint64_t> counts_;
+
+  //! The number of values recorded.
+  uint64_t count_;
+
+  //! The sum of values recorded.
+  int64_t sum_;
+
+  //! The largest value recorded.
+  int64_t max_;
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_HISTOGRAM_H_
@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#ifndef PWRUSBCTL_UTIL_NONCOPYABLE_H_
+#define PWRUSBCTL_UTIL_NONCOPYABLE_H_
+
 namespace pwrusbctl {
 
 /**
@@ -27,3 +30,5 @@ class NonCopyable {
 };
 
 }  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_NONCOPYABLE_H_
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/socket_address.h"
+
+#include <netdb.h>
+
+#include <cassert>
+#include <cstring>
+
+namespace pwrusbctl {
+
+bool ResolveSocketAddress(const std::string& address, int socket_type,
+                          SocketAddress *result) {
+  assert(result);
+  if (result == nullptr) {
+    return false;
+  }
+
+  // The port follows the last colon so that IPv6 literals may be supplied in
+  // brackets.
+  size_t separator = address.rfind(':');
+  if (separator == std::string::npos || separator + 1 == address.size()) {
+    return false;
+  }
+
+  std::string host = address.substr(0, separator);
+  std::string port = address.substr(separator + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = socket_type;
+
+  addrinfo *addresses = nullptr;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                  &hints, &addresses) != 0 || addresses == nullptr) {
+    return false;
+  }
+
+  memset(&result->storage, 0, sizeof(result->storage));
+  memcpy(&result->storage, addresses->ai_addr, addresses->ai_addrlen);
+  result->length = addresses->ai_addrlen;
+  result->socket_type = socket_type;
+  freeaddrinfo(addresses);
+  return true;
+}
+
+}  // namespace pwrusbctl
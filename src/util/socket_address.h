@@ -0,0 +1,62 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_UTIL_SOCKET_ADDRESS_H_
+#define PWRUSBCTL_UTIL_SOCKET_ADDRESS_H_
+
+#include <sys/socket.h>
+
+#include <string>
+
+namespace pwrusbctl {
+
+/**
+ * A resolved network address that can be passed directly to the BSD socket
+ * APIs.
+ */
+struct SocketAddress {
+  //! The storage for the resolved address.
+  sockaddr_storage storage;
+
+  //! The length of the address held in storage.
+  socklen_t length;
+
+  //! The socket type that the address was resolved for.
+  int socket_type;
+
+  /**
+   * @return Returns the address in a form suitable for the socket APIs.
+   */
+  const sockaddr *get() const {
+    return reinterpret_cast<const sockaddr *>(&storage);
+  }
+};
+
+/**
+ * Resolves an address of the form "host:port" (or "[host]:port" for IPv6
+ * literals). Only the first result returned by the resolver is used.
+ *
+ * @param address The address to resolve.
+ * @param socket_type The socket type to resolve for (SOCK_DGRAM, SOCK_STREAM).
+ * @param result The resolved address to populate.
+ * @return Returns false if the address is malformed or cannot be resolved.
+ */
+bool ResolveSocketAddress(const std::string& address, int socket_type,
+                          SocketAddress *result);
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_SOCKET_ADDRESS_H_
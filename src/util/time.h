@@ -0,0 +1,50 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_UTIL_TIME_H_
+#define PWRUSBCTL_UTIL_TIME_H_
+
+#include <chrono>
+#include <cstdint>
+
+namespace pwrusbctl {
+
+/**
+ * Returns the current time in microseconds on a monotonic clock. This is the
+ * clock used for sample timestamps.
+ */
+inline uint64_t GetMonotonicTimeUs() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+/**
+ * Returns the offset that converts a monotonic timestamp into wall-clock time
+ * in microseconds since the Unix epoch. The offset is only valid until the
+ * wall clock is next adjusted.
+ */
+inline int64_t GetWallClockOffsetUs() {
+  auto steady_now = std::chrono::steady_clock::now().time_since_epoch();
+  auto wall_now = std::chrono::system_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      wall_now).count()
+      - std::chrono::duration_cast<std::chrono::microseconds>(
+          steady_now).count();
+}
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_UTIL_TIME_H_
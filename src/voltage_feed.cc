@@ -0,0 +1,247 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "voltage_feed.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace pwrusbctl {
+
+//! The maximum length of a line of the feed. Longer lines are discarded.
+constexpr size_t kMaxLineLength(128);
+
+//! The interval at which the reader thread checks whether to stop.
+constexpr int kStopPollIntervalMs(100);
+
+//! The number of stop polls to wait before reconnecting to a TCP server.
+constexpr int kReconnectPollCount(10);
+
+constexpr size_t VoltageFeed::kDefaultCapacity;
+
+VoltageFeed::VoltageFeed(const std::string& source, size_t capacity,
+                         const Clock& clock)
+    : source_(source),
+      clock_(clock),
+      wall_clock_offset_us_(clock.GetWallClockOffsetUs()),
+      is_path_(false),
+      address_(),
+      initialized_(false),
+      stopping_(false),
+      points_(capacity),
+      head_(0),
+      count_(0),
+      overwritten_count_(0) {
+  if (capacity == 0) {
+    return;
+  }
+
+  struct stat source_stat;
+  is_path_ = (stat(source_.c_str(), &source_stat) == 0);
+  if (is_path_) {
+    initialized_ = (access(source_.c_str(), R_OK) == 0);
+  } else {
+    initialized_ = ResolveSocketAddress(source_, SOCK_STREAM, &address_);
+  }
+
+  if (!initialized_) {
+    fprintf(stderr, "Voltage feed is not a readable path or address: %s\n",
+            source_.c_str());
+    return;
+  }
+
+  reader_thread_ = std::thread(&VoltageFeed::ReadLoop, this);
+}
+
+VoltageFeed::~VoltageFeed() {
+  if (IsInitialized()) {
+    stopping_ = true;
+    reader_thread_.join();
+  }
+}
+
+bool VoltageFeed::IsInitialized() const {
+  return initialized_;
+}
+
+bool VoltageFeed::Pop(VoltagePoint *point) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (count_ == 0) {
+    return false;
+  }
+
+  *point = points_[head_];
+  head_ = (head_ + 1) % points_.size();
+  count_--;
+  return true;
+}
+
+uint64_t VoltageFeed::GetOverwrittenCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return overwritten_count_;
+}
+
+int VoltageFeed::Open() const {
+  if (is_path_) {
+    // Opening a FIFO without O_NONBLOCK would block until a writer appears,
+    // preventing the reader thread from stopping.
+    return open(source_.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  }
+
+  int fd = socket(address_.storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, address_.get(), address_.length) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void VoltageFeed::ReadLoop() {
+  char line[kMaxLineLength + 1];
+  size_t line_length = 0;
+  bool discarding = false;
+  bool is_regular_file = false;
+  int fd = -1;
+  int reconnect_polls = 0;
+  while (!stopping_) {
+    if (fd < 0) {
+      if (reconnect_polls > 0) {
+        reconnect_polls--;
+        poll(nullptr, 0, kStopPollIntervalMs);
+        continue;
+      }
+
+      fd = Open();
+      if (fd < 0) {
+        fprintf(stderr, "Error opening voltage feed %s: %s\n",
+                source_.c_str(), strerror(errno));
+        reconnect_polls = kReconnectPollCount;
+        continue;
+      }
+
+      struct stat fd_stat;
+      is_regular_file = (fstat(fd, &fd_stat) == 0 && S_ISREG(fd_stat.st_mode));
+      line_length = 0;
+      discarding = false;
+    }
+
+    pollfd poll_fd = { fd, POLLIN, 0 };
+    if (poll(&poll_fd, 1, kStopPollIntervalMs) <= 0) {
+      continue;
+    }
+
+    char buffer[512];
+    ssize_t length = read(fd, buffer, sizeof(buffer));
+    if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+      continue;
+    } else if (length <= 0) {
+      // A regular file has been read in full. A FIFO writer or TCP server
+      // has gone away, so wait for the next one.
+      close(fd);
+      fd = -1;
+      if (is_regular_file) {
+        break;
+      }
+
+      reconnect_polls = is_path_ ? 0 : kReconnectPollCount;
+      continue;
+    }
+
+    for (ssize_t i = 0; i < length; i++) {
+      if (buffer[i] == '\n') {
+        line[line_length] = '\0';
+        if (!discarding) {
+          HandleLine(line);
+        }
+
+        line_length = 0;
+        discarding = false;
+      } else if (line_length < kMaxLineLength) {
+        line[line_length++] = buffer[i];
+      } else {
+        discarding = true;
+      }
+    }
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+void VoltageFeed::HandleLine(const char *line) {
+  char *end;
+  double first = strtod(line, &end);
+  if (end == line) {
+    return;
+  }
+
+  const char *rest = end;
+  while (isspace(static_cast<unsigned char>(*rest))) {
+    rest++;
+  }
+
+  VoltagePoint point;
+  if (*rest == '\0') {
+    point.timestamp_us = clock_.GetMonotonicTimeUs();
+    point.voltage_v = first;
+  } else {
+    uint64_t wall_clock_us = strtoull(line, &end, 10);
+    double voltage_v = strtod(rest, &end);
+    while (isspace(static_cast<unsigned char>(*end))) {
+      end++;
+    }
+
+    if (end == rest || *end != '\0'
+        || static_cast<int64_t>(wall_clock_us) < wall_clock_offset_us_) {
+      return;
+    }
+
+    point.timestamp_us = wall_clock_us - wall_clock_offset_us_;
+    point.voltage_v = voltage_v;
+  }
+
+  if (!std::isfinite(point.voltage_v) || point.voltage_v <= 0.0f) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (count_ == points_.size()) {
+    head_ = (head_ + 1) % points_.size();
+    count_--;
+    overwritten_count_++;
+  }
+
+  points_[(head_ + count_) % points_.size()] = point;
+  count_++;
+}
+
+}  // namespace pwrusbctl
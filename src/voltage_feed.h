@@ -0,0 +1,159 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_VOLTAGE_FEED_H_
+#define PWRUSBCTL_VOLTAGE_FEED_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/clock.h"
+#include "util/noncopyable.h"
+#include "util/socket_address.h"
+
+namespace pwrusbctl {
+
+/**
+ * A line voltage measured at an instant.
+ */
+struct VoltagePoint {
+  //! The time of the measurement in microseconds on the monotonic sample
+  //! clock.
+  uint64_t timestamp_us;
+
+  //! The line voltage in volts.
+  float voltage_v;
+};
+
+/**
+ * Reads a time series of line voltage from a file, a FIFO or a TCP server.
+ * Each line holds a wall-clock timestamp in microseconds since the Unix epoch
+ * followed by the voltage, or just the voltage, in which case it is
+ * timestamped when read. Malformed lines are skipped.
+ *
+ * Points are read on a separate thread into a ring buffer that is allocated
+ * up front. If points are not popped quickly enough the oldest are
+ * overwritten. A FIFO is reopened when its writer closes it and a TCP
+ * connection is re-established when it drops. A regular file is read once.
+ */
+class VoltageFeed : public NonCopyable {
+ public:
+  //! The default number of points buffered.
+  static constexpr size_t kDefaultCapacity = 4096;
+
+  /**
+   * Constructs a VoltageFeed and starts reading. The return value of
+   * IsInitialized() must be checked before popping points.
+   *
+   * @param source The path of a file or FIFO, or the address of a TCP server
+   *        in the form "host:port" if no such path exists.
+   * @param capacity The number of points buffered.
+   * @param clock The clock whose wall-clock offset converts timestamps, and
+   *        which timestamps points that lack one.
+   */
+  VoltageFeed(const std::string& source, size_t capacity = kDefaultCapacity,
+              const Clock& clock = *SystemClock::GetInstance());
+
+  /**
+   * Stops reading and joins the reader thread.
+   */
+  ~VoltageFeed();
+
+  /**
+   * @return Returns true if the source is a readable path or a resolvable
+   *         address.
+   */
+  bool IsInitialized() const;
+
+  /**
+   * Pops the oldest buffered point.
+   *
+   * @param point The point to populate.
+   * @return Returns false if no point is buffered.
+   */
+  bool Pop(VoltagePoint *point);
+
+  /**
+   * @return Returns the number of points overwritten before being popped.
+   */
+  uint64_t GetOverwrittenCount() const;
+
+ private:
+  //! The path or address of the source.
+  const std::string source_;
+
+  //! The clock that timestamps points lacking a timestamp.
+  const Clock& clock_;
+
+  //! The offset subtracted from wall-clock timestamps to obtain monotonic
+  //! timestamps.
+  const int64_t wall_clock_offset_us_;
+
+  //! Whether the source is a path rather than a TCP address.
+  bool is_path_;
+
+  //! The resolved address of the TCP server if the source is not a path.
+  SocketAddress address_;
+
+  //! Whether or not the source could be opened or resolved.
+  bool initialized_;
+
+  //! Set to stop the reader thread.
+  std::atomic<bool> stopping_;
+
+  //! The thread that reads points.
+  std::thread reader_thread_;
+
+  //! Guards all members below.
+  mutable std::mutex mutex_;
+
+  //! The ring buffer of points.
+  std::vector<VoltagePoint> points_;
+
+  //! The index of the oldest point and the number of points buffered.
+  size_t head_;
+  size_t count_;
+
+  //! The number of points overwritten before being popped.
+  uint64_t overwritten_count_;
+
+  /**
+   * Opens the source.
+   *
+   * @return The file descriptor of the source, or -1 on error.
+   */
+  int Open() const;
+
+  /**
+   * The entry point of the reader thread.
+   */
+  void ReadLoop();
+
+  /**
+   * Parses a line and buffers the point it holds.
+   *
+   * @param line The null-terminated line.
+   */
+  void HandleLine(const char *line);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_VOLTAGE_FEED_H_
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "voltage_join_transform.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+namespace pwrusbctl {
+
+constexpr size_t VoltageJoinTransform::kMaxPendingSamples;
+constexpr uint64_t VoltageJoinTransform::kDefaultMaxLagUs;
+
+/**
+ * @param sample The sample to check.
+ * @return Returns true if the power or energy of a sample depend on voltage.
+ */
+static bool NeedsVoltage(const Sample& sample) {
+  return sample.type == SampleType::Measurement
+      && (sample.has_current || sample.has_energy);
+}
+
+VoltageJoinTransform::VoltageJoinTransform(std::unique_ptr<VoltageFeed> feed,
+                                           float nominal_voltage,
+                                           uint64_t max_lag_us)
+    : feed_(std::move(feed)),
+      nominal_voltage_(nominal_voltage),
+      max_lag_us_(max_lag_us),
+      pending_(kMaxPendingSamples),
+      head_(0),
+      count_(0),
+      newest_us_(0),
+      has_before_(false),
+      before_(),
+      has_after_(false),
+      after_(),
+      has_energy_(false),
+      last_device_energy_kwh_(0.0f),
+      energy_kwh_(0.0),
+      joined_count_(0),
+      held_count_(0),
+      nominal_count_(0) {}
+
+void VoltageJoinTransform::Process(const Sample& sample,
+                                   SampleConsumer *output) {
+  // The oldest sample is released early rather than dropped if the feed has
+  // fallen so far behind that the buffer is full.
+  if (count_ == pending_.size()) {
+    Join(&pending_[head_], output);
+    head_ = (head_ + 1) % pending_.size();
+    count_--;
+  }
+
+  pending_[(head_ + count_) % pending_.size()] = sample;
+  count_++;
+  newest_us_ = std::max(newest_us_, sample.timestamp_us);
+  Release(false, output);
+}
+
+void VoltageJoinTransform::Finish(SampleConsumer *output) {
+  Release(true, output);
+}
+
+void VoltageJoinTransform::PrintStats(FILE *file) const {
+  fprintf(file, "Voltage feed: joined %" PRIu64 ", held %" PRIu64
+          ", nominal %" PRIu64 ", overwritten %" PRIu64 "\n", joined_count_,
+          held_count_, nominal_count_, feed_->GetOverwrittenCount());
+}
+
+void VoltageJoinTransform::AdvanceFeed(uint64_t timestamp_us) {
+  if (!has_after_) {
+    has_after_ = feed_->Pop(&after_);
+  }
+
+  while (has_after_ && after_.timestamp_us <= timestamp_us) {
+    // A point older than the one already held is out of order and skipped.
+    if (!has_before_ || after_.timestamp_us >= before_.timestamp_us) {
+      before_ = after_;
+      has_before_ = true;
+    }
+
+    has_after_ = feed_->Pop(&after_);
+  }
+}
+
+void VoltageJoinTransform::Release(bool force, SampleConsumer *output) {
+  while (count_ > 0) {
+    Sample *sample = &pending_[head_];
+    if (!force && NeedsVoltage(*sample)) {
+      AdvanceFeed(sample->timestamp_us);
+      bool covered = has_after_ || (has_before_
+          && before_.timestamp_us == sample->timestamp_us);
+      if (!covered && newest_us_ < sample->timestamp_us + max_lag_us_) {
+        break;
+      }
+    }
+
+    Join(sample, output);
+    head_ = (head_ + 1) % pending_.size();
+    count_--;
+  }
+}
+
+void VoltageJoinTransform::Join(Sample *sample, SampleConsumer *output) {
+  if (!NeedsVoltage(*sample)) {
+    output->Consume(*sample);
+    return;
+  }
+
+  AdvanceFeed(sample->timestamp_us);
+  float voltage_v = nominal_voltage_;
+  if (has_before_ && before_.timestamp_us == sample->timestamp_us) {
+    voltage_v = before_.voltage_v;
+    joined_count_++;
+  } else if (has_before_ && has_after_) {
+    float fraction = static_cast<float>(
+        sample->timestamp_us - before_.timestamp_us)
+        / (after_.timestamp_us - before_.timestamp_us);
+    voltage_v = before_.voltage_v
+        + fraction * (after_.voltage_v - before_.voltage_v);
+    joined_count_++;
+  } else if (has_before_ || has_after_) {
+    voltage_v = has_before_ ? before_.voltage_v : after_.voltage_v;
+    held_count_++;
+  } else {
+    nominal_count_++;
+  }
+
+  // Power is proportional to voltage at a given current, so rescaling is
+  // equivalent to recomputing it from current.
+  float scale = voltage_v / nominal_voltage_;
+  if (sample->has_current) {
+    sample->power_w *= scale;
+    sample->power_min_w *= scale;
+    sample->power_max_w *= scale;
+  }
+
+  if (sample->has_energy) {
+    // The device counter restarting from zero leaves nothing to rescale
+    // against, so the rescaled energy restarts with it.
+    float increment_kwh = sample->energy_kwh - last_device_energy_kwh_;
+    if (!has_energy_ || increment_kwh < 0.0f) {
+      energy_kwh_ = sample->energy_kwh;
+    } else {
+      energy_kwh_ += increment_kwh * scale;
+    }
+
+    has_energy_ = true;
+    last_device_energy_kwh_ = sample->energy_kwh;
+    sample->energy_kwh = static_cast<float>(energy_kwh_);
+  }
+
+  output->Consume(*sample);
+}
+
+}  // namespace pwrusbctl
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_VOLTAGE_JOIN_TRANSFORM_H_
+#define PWRUSBCTL_VOLTAGE_JOIN_TRANSFORM_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "pipeline.h"
+#include "voltage_feed.h"
+
+namespace pwrusbctl {
+
+/**
+ * A transform that recomputes power and energy from a measured line voltage
+ * rather than the nominal voltage that samples were computed with. The
+ * voltage at each measurement is interpolated linearly between the feed
+ * points on either side of it.
+ *
+ * Samples are held until the feed has a point at or beyond them, up to a
+ * maximum lag behind the newest sample. A sample released before the feed
+ * catches up uses the nearest known voltage, or the nominal voltage if the
+ * feed has produced nothing. Samples are held in a buffer allocated up front
+ * and leave in the order they arrived, so markers and other events keep their
+ * place among the measurements.
+ *
+ * Energy is the device's accumulated charge converted at the nominal voltage.
+ * Each increment is rescaled by the voltage of the sample that observed it,
+ * starting from the first reading unchanged. Samples are expected to come
+ * from a single device.
+ */
+class VoltageJoinTransform : public Transform {
+ public:
+  //! The maximum number of samples held waiting for the feed.
+  static constexpr size_t kMaxPendingSamples = 1024;
+
+  //! The default time that a sample is held waiting for the feed.
+  static constexpr uint64_t kDefaultMaxLagUs = 1000000;
+
+  /**
+   * Constructs a VoltageJoinTransform.
+   *
+   * @param feed The initialized feed to take voltage from.
+   * @param nominal_voltage The voltage that incoming power and energy were
+   *        computed with.
+   * @param max_lag_us The time that a sample is held behind the newest
+   *        sample waiting for the feed.
+   */
+  VoltageJoinTransform(std::unique_ptr<VoltageFeed> feed,
+                       float nominal_voltage,
+                       uint64_t max_lag_us = kDefaultMaxLagUs);
+
+  void Process(const Sample& sample, SampleConsumer *output) override;
+
+  /**
+   * Releases every held sample using the voltage known so far.
+   */
+  void Finish(SampleConsumer *output) override;
+
+  /**
+   * Prints the number of samples joined against the feed and the number that
+   * fell back to a held or nominal voltage.
+   *
+   * @param file The file to print to.
+   */
+  void PrintStats(FILE *file) const;
+
+ private:
+  //! The source of voltage points.
+  const std::unique_ptr<VoltageFeed> feed_;
+
+  //! The voltage that incoming power and energy were computed with.
+  const float nominal_voltage_;
+
+  //! The time that a sample is held behind the newest sample.
+  const uint64_t max_lag_us_;
+
+  //! The ring buffer of held samples.
+  std::vector<Sample> pending_;
+
+  //! The index of the oldest held sample and the number held.
+  size_t head_;
+  size_t count_;
+
+  //! The timestamp of the newest sample received.
+  uint64_t newest_us_;
+
+  //! The latest feed point at or before the oldest held sample and the
+  //! earliest feed point after it, with whether each is populated.
+  bool has_before_;
+  VoltagePoint before_;
+  bool has_after_;
+  VoltagePoint after_;
+
+  //! The accumulated energy reported by the device as of the last sample with
+  //! energy, and the same energy rescaled by the measured voltage.
+  bool has_energy_;
+  float last_device_energy_kwh_;
+  double energy_kwh_;
+
+  //! The number of samples interpolated between feed points, given the
+  //! nearest known voltage, or given the nominal voltage.
+  uint64_t joined_count_;
+  uint64_t held_count_;
+  uint64_t nominal_count_;
+
+  /**
+   * Advances the feed points to bracket a timestamp as closely as the feed
+   * allows.
+   *
+   * @param timestamp_us The timestamp to bracket.
+   */
+  void AdvanceFeed(uint64_t timestamp_us);
+
+  /**
+   * Releases held samples from the front of the buffer.
+   *
+   * @param force Whether to release every held sample regardless of the feed.
+   * @param output The next stage of the pipeline.
+   */
+  void Release(bool force, SampleConsumer *output);
+
+  /**
+   * Recomputes the power and energy of a sample with the voltage at its
+   * timestamp and passes it to output.
+   *
+   * @param sample The sample to join, modified in place.
+   * @param output The next stage of the pipeline.
+   */
+  void Join(Sample *sample, SampleConsumer *output);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_VOLTAGE_JOIN_TRANSFORM_H_
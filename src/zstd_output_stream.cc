@@ -0,0 +1,141 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zstd_output_stream.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+namespace pwrusbctl {
+
+constexpr int ZstdOutputStream::kDefaultCompressionLevel;
+
+/**
+ * Returns the CPU time consumed by the calling thread in nanoseconds.
+ */
+static uint64_t GetThreadCpuTimeNs() {
+  timespec now;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+ZstdOutputStream::ZstdOutputStream(std::unique_ptr<OutputStream> output,
+                                   int compression_level)
+    : output_(std::move(output)),
+      context_(ZSTD_createCCtx()),
+      input_(ZSTD_CStreamInSize()),
+      input_length_(0),
+      buffer_(ZSTD_CStreamOutSize()),
+      frame_open_(false),
+      bytes_in_(0),
+      bytes_out_(0),
+      compress_time_ns_(0) {
+  if (context_ != nullptr
+      && ZSTD_isError(ZSTD_CCtx_setParameter(context_,
+          ZSTD_c_compressionLevel, compression_level))) {
+    ZSTD_freeCCtx(context_);
+    context_ = nullptr;
+  }
+}
+
+ZstdOutputStream::~ZstdOutputStream() {
+  if (IsInitialized()) {
+    Flush();
+    ZSTD_freeCCtx(context_);
+  }
+}
+
+bool ZstdOutputStream::IsInitialized() const {
+  return (context_ != nullptr);
+}
+
+bool ZstdOutputStream::Write(const char *data, size_t length) {
+  bytes_in_ += length;
+  frame_open_ = true;
+  while (length > 0) {
+    size_t count = std::min(length, input_.size() - input_length_);
+    memcpy(input_.data() + input_length_, data, count);
+    input_length_ += count;
+    data += count;
+    length -= count;
+
+    if (input_length_ == input_.size() && !Compress(ZSTD_e_continue)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool ZstdOutputStream::Flush() {
+  // Avoid emitting empty frames when nothing was written since the last
+  // flush.
+  if (frame_open_) {
+    frame_open_ = false;
+    if (!Compress(ZSTD_e_end)) {
+      return false;
+    }
+  }
+
+  return output_->Flush();
+}
+
+void ZstdOutputStream::PrintStats(FILE *file) const {
+  double megabytes = bytes_in_ / (1024.0 * 1024.0);
+  double cpu_ms_per_megabyte = (megabytes > 0.0)
+      ? (compress_time_ns_ / 1e6) / megabytes : 0.0;
+  double ratio = (bytes_out_ > 0)
+      ? static_cast<double>(bytes_in_) / bytes_out_ : 0.0;
+  fprintf(file, "zstd: in %" PRIu64 " bytes, out %" PRIu64 " bytes, "
+          "ratio %.2f, cpu %.3fms/MiB\n", bytes_in_, bytes_out_, ratio,
+          cpu_ms_per_megabyte);
+}
+
+bool ZstdOutputStream::Compress(ZSTD_EndDirective directive) {
+  ZSTD_inBuffer input = { input_.data(), input_length_, 0 };
+  input_length_ = 0;
+  bool finished = false;
+  while (!finished) {
+    ZSTD_outBuffer output = { buffer_.data(), buffer_.size(), 0 };
+
+    uint64_t start_ns = GetThreadCpuTimeNs();
+    size_t remaining = ZSTD_compressStream2(context_, &output, &input,
+                                            directive);
+    compress_time_ns_ += GetThreadCpuTimeNs() - start_ns;
+    if (ZSTD_isError(remaining)) {
+      return false;
+    }
+
+    if (output.pos > 0) {
+      bytes_out_ += output.pos;
+      if (!output_->Write(buffer_.data(), output.pos)) {
+        return false;
+      }
+    }
+
+    // When continuing, all input must be consumed. When ending a frame, zstd
+    // reports zero once the frame epilogue has been fully written.
+    finished = (directive == ZSTD_e_continue)
+        ? (input.pos == input.size) : (remaining == 0);
+  }
+
+  return true;
+}
+
+}  // namespace pwrusbctl
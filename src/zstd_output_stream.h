@@ -0,0 +1,112 @@
+/*
+ * Copyright 2017 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PWRUSBCTL_ZSTD_OUTPUT_STREAM_H_
+#define PWRUSBCTL_ZSTD_OUTPUT_STREAM_H_
+
+#include <zstd.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "output_stream.h"
+
+namespace pwrusbctl {
+
+/**
+ * An OutputStream that compresses bytes with zstd before passing them to
+ * another stream. The compression context is reused for the lifetime of the
+ * stream. Each Flush() ends the current zstd frame, so a file that is cut off
+ * after a flush still decompresses cleanly up to that point.
+ *
+ * Writes are staged into a block sized for zstd and compressed one block at a
+ * time. The CPU time spent compressing each block is measured so that the
+ * cost per megabyte can be reported by PrintStats(). Timing per block rather
+ * than per Write() keeps the thread CPU clock, which is a real system call,
+ * out of the per-sample path.
+ */
+class ZstdOutputStream : public OutputStream {
+ public:
+  //! The default zstd compression level. Low levels are cheap enough to run
+  //! continuously on the sink thread.
+  static constexpr int kDefaultCompressionLevel = 3;
+
+  /**
+   * Constructs a stream that compresses into another stream. The return
+   * value of IsInitialized() must be checked prior to writing.
+   *
+   * @param output The stream that compressed bytes are written to.
+   * @param compression_level The zstd compression level.
+   */
+  ZstdOutputStream(std::unique_ptr<OutputStream> output,
+                   int compression_level = kDefaultCompressionLevel);
+
+  /**
+   * Ends the current frame and releases the compression context.
+   */
+  ~ZstdOutputStream();
+
+  /**
+   * @return Returns true if the compression context was created.
+   */
+  bool IsInitialized() const;
+
+  bool Write(const char *data, size_t length) override;
+  bool Flush() override;
+  void PrintStats(FILE *file) const override;
+
+ private:
+  //! The stream that compressed bytes are written to.
+  std::unique_ptr<OutputStream> output_;
+
+  //! The compression context.
+  ZSTD_CCtx *context_;
+
+  //! The staging buffer for uncompressed input.
+  std::vector<char> input_;
+
+  //! The number of bytes staged in the input buffer.
+  size_t input_length_;
+
+  //! The staging buffer for compressed output.
+  std::vector<char> buffer_;
+
+  //! Whether or not bytes have been written since the last frame ended.
+  bool frame_open_;
+
+  //! The number of uncompressed bytes written.
+  uint64_t bytes_in_;
+
+  //! The number of compressed bytes produced.
+  uint64_t bytes_out_;
+
+  //! The CPU time spent in zstd in nanoseconds.
+  uint64_t compress_time_ns_;
+
+  /**
+   * Feeds the staged input through the compression context and writes any
+   * output. The input buffer is empty on return.
+   *
+   * @param directive Whether to continue or end the current frame.
+   * @return Returns false if an error occurs.
+   */
+  bool Compress(ZSTD_EndDirective directive);
+};
+
+}  // namespace pwrusbctl
+
+#endif  // PWRUSBCTL_ZSTD_OUTPUT_STREAM_H_